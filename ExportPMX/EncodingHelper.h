@@ -1,26 +1,45 @@
 #pragma once
 
-#include <locale.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <wchar.h>
+#include "EncodingTable.h"
+#ifdef _WIN32
 #include <Windows.h>
-#include <memory>
-#include <vector>
+#endif
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define ENCODING_SSE2
+#include <emmintrin.h>
+#endif
 
 namespace oguna
 {
-	/// CP932,UTF8,UTF16໥Q
+	/// CP936,CP932,UTF8,UTF16໥Q
+	/// CP936,CP932,CP1252ϽMzߤαǉQΤǡƥΥ`ɥک`椷ʤ
+	/// (MultiByteToWideCharͬYˤʤ롣淽mޥåԥ󥰤Фʤ)
 	class EncodingConverter
 	{
-	protected:
-		std::vector<char> buffer;
-
 	public:
-		/// ָΥХåե֤äЩ`ڻ(ڂ:MAX_PATH)
-		EncodingConverter(int initial_buffer_size = MAX_PATH)
+		/// ǰʤɤΥޥХФΥ`ɥک`
+		/// MString::toAnsiStringMQǰϥƥΥ`ɥک`(GetACP)Фˤʤ
+		unsigned int ansi_codepage;
+
+		EncodingConverter(unsigned int ansi_codepage = 936) : ansi_codepage(ansi_codepage)
+		{
+		}
+
+		/// ansi_codepageUTF16(std::wstring)؉Q
+		int AnsiToUtf16(const char* src, int length, std::wstring* out)
 		{
-			buffer.resize(initial_buffer_size);
+			return MultiByteToUtf16(ansi_codepage, src, length, out);
+		}
+
+		/// ansi_codepageUTF8(std::string)؉Q
+		int AnsiToUtf8(const char* src, int length, std::string* out)
+		{
+			return MultiByteToUtf8(ansi_codepage, src, length, out);
 		}
 
 		/// UTF8CP932(std::string)؉Q
@@ -28,70 +47,386 @@ namespace oguna
 		{
 			std::wstring unicode;
 			Utf8ToUtf16(src, size, &unicode);
-			return Utf16ToCp932(unicode.data(), unicode.length(), out);
+			return Utf16ToCp932(unicode.data(), static_cast<int>(unicode.length()), out);
 		}
 
 		/// CP932UTF8(std::string)؉Q
 		int Cp932ToUtf8(const char* src, int length, std::string* out)
 		{
-			std::wstring unicode;
-			Cp932ToUtf16(src, length, &unicode);
-			return Utf16ToUtf8(unicode.c_str(), unicode.length(), out);
+			return MultiByteToUtf8(932, src, length, out);
 		}
 
 		/// CP932UTF16(std::wstring)؉Q
 		int Cp932ToUtf16(const char* src, int length, std::wstring* out)
 		{
-			int size;
-			size = MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, src, length, nullptr, NULL);
-			buffer.resize(size * sizeof(wchar_t) * 2);
-			MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, src, length, (LPWSTR)buffer.data(), buffer.size() * 2);
-			out->assign((wchar_t*)buffer.data(), size);
-			return size;
+			return MultiByteToUtf16(932, src, length, out);
 		}
 
-		/// CP932UTF16(std::wstring)؉Q
+		/// CP936UTF16(std::wstring)؉Q
 		int Cp936ToUtf16(const char* src, int length, std::wstring* out)
 		{
-			int size;
-			size = MultiByteToWideChar(936, MB_PRECOMPOSED, src, length, nullptr, NULL);
-			buffer.resize(size * sizeof(wchar_t) * 2);
-			MultiByteToWideChar(936, MB_PRECOMPOSED, src, length, (LPWSTR)buffer.data(), buffer.size() * 2);
-			out->assign((wchar_t*)buffer.data(), size);
-			return size;
+			return MultiByteToUtf16(936, src, length, out);
+		}
+
+		/// CP936UTF8(std::string)؉Q
+		int Cp936ToUtf8(const char* src, int length, std::string* out)
+		{
+			return MultiByteToUtf8(936, src, length, out);
 		}
 
 		/// UTF16CP932(std::string)؉Q
 		int Utf16ToCp932(const wchar_t* src, int length, std::string* out)
 		{
-			int size;
-			size = WideCharToMultiByte(CP_ACP, NULL, src, length, nullptr, NULL, nullptr, nullptr);
-			buffer.resize(size);
-			WideCharToMultiByte(CP_ACP, NULL, src, length, (LPSTR)buffer.data(), buffer.size(), nullptr, nullptr);
-			out->assign(buffer.data(), size);
-			return size;
+			return Utf16ToMultiByte(932, src, length, out);
+		}
+
+		/// ޥХФUTF16(std::wstring)؉Q
+		/// lengthؓΈϤϽKˤ0ޤ(0򺬤)
+		int MultiByteToUtf16(unsigned int codepage, const char* src, int length, std::wstring* out)
+		{
+			size_t len = getLength(src, length);
+			const CodePageTable* table = GetCodePageTable(codepage);
+			if (table == nullptr)
+				return systemToUtf16(codepage, src, len, out);
+
+			// 1ХȤ2Ϥˤʤ뤳ȤϤʤ
+			out->resize(len);
+			const unsigned char* s = reinterpret_cast<const unsigned char*>(src);
+			wchar_t* dst = len > 0 ? &(*out)[0] : nullptr;
+			size_t n = 0;
+			size_t i = 0;
+			while (i < len)
+			{
+				if (s[i] < 0x80)
+				{
+					size_t ascii = copyAscii(s + i, len - i, dst + n);
+					i += ascii;
+					n += ascii;
+					continue;
+				}
+				dst[n++] = readChar(table, s, len, i);
+			}
+			out->resize(n);
+			return static_cast<int>(n);
+		}
+
+		/// ޥХФUTF8(std::string)؉Q
+		int MultiByteToUtf8(unsigned int codepage, const char* src, int length, std::string* out)
+		{
+			size_t len = getLength(src, length);
+			const CodePageTable* table = GetCodePageTable(codepage);
+			if (table == nullptr)
+			{
+				std::wstring unicode;
+				systemToUtf16(codepage, src, len, &unicode);
+				return Utf16ToUtf8(unicode.c_str(), static_cast<int>(unicode.length()), out);
+			}
+
+			// BMP֤3Х¤ʤΤǡ1ХȤ3ХȤ
+			out->resize(len * 3);
+			const unsigned char* s = reinterpret_cast<const unsigned char*>(src);
+			char* dst = len > 0 ? &(*out)[0] : nullptr;
+			size_t n = 0;
+			size_t i = 0;
+			while (i < len)
+			{
+				if (s[i] < 0x80)
+				{
+					size_t ascii = findNonAscii(s + i, len - i);
+					memcpy(dst + n, s + i, ascii);
+					i += ascii;
+					n += ascii;
+					continue;
+				}
+				n += putUtf8(readChar(table, s, len, i), dst + n);
+			}
+			out->resize(n);
+			return static_cast<int>(n);
+		}
+
+		/// UTF16ޥХ(std::string)؉Q
+		/// ˤʤ֤'?'ˤʤ
+		int Utf16ToMultiByte(unsigned int codepage, const wchar_t* src, int length, std::string* out)
+		{
+			size_t len = (length < 0) ? wcslen(src) + 1 : static_cast<size_t>(length);
+			const unsigned short* rev = GetCodePageReverseTable(GetCodePageTable(codepage));
+			if (rev == nullptr)
+				return systemFromUtf16(codepage, src, len, out);
+
+			out->resize(len * 2);
+			char* dst = len > 0 ? &(*out)[0] : nullptr;
+			size_t n = 0;
+			for (size_t i = 0; i < len; i++)
+			{
+				unsigned int u = static_cast<unsigned int>(src[i]);
+				if (u < 0x80)
+				{
+					dst[n++] = static_cast<char>(u);
+					continue;
+				}
+				unsigned short c = (u < 0x10000) ? rev[u] : 0;
+				if (sizeof(wchar_t) == 2 && u >= 0xD800 && u <= 0xDBFF && i + 1 < len && src[i + 1] >= 0xDC00 && src[i + 1] <= 0xDFFF)
+				{
+					i++; // `ȥڥ1
+				}
+				if (c == 0)
+				{
+					dst[n++] = '?';
+				}
+				else if (c >= 0x100)
+				{
+					dst[n++] = static_cast<char>(c >> 8);
+					dst[n++] = static_cast<char>(c & 0xFF);
+				}
+				else
+				{
+					dst[n++] = static_cast<char>(c);
+				}
+			}
+			out->resize(n);
+			return static_cast<int>(n);
 		}
 
 		/// UTF8UTF16(std::wstring)؉Q
+		/// ʥХȤU+FFFDˤʤ
 		int Utf8ToUtf16(const char* src, int length, std::wstring* out)
 		{
-			int size;
-			size = MultiByteToWideChar(CP_UTF8, 0, src, length, nullptr, NULL);
-			buffer.resize(size * sizeof(wchar_t));
-			MultiByteToWideChar(CP_UTF8, 0, src, length, (LPWSTR)buffer.data(), buffer.size());
-			out->swap(std::wstring((wchar_t*)buffer.data(), size));
-			return size;
+			size_t len = getLength(src, length);
+			out->resize(len);
+			const unsigned char* s = reinterpret_cast<const unsigned char*>(src);
+			wchar_t* dst = len > 0 ? &(*out)[0] : nullptr;
+			size_t n = 0;
+			size_t i = 0;
+			while (i < len)
+			{
+				if (s[i] < 0x80)
+				{
+					size_t ascii = copyAscii(s + i, len - i, dst + n);
+					i += ascii;
+					n += ascii;
+					continue;
+				}
+				unsigned int u = readUtf8(s, len, i);
+				if (u >= 0x10000 && sizeof(wchar_t) == 2)
+				{
+					u -= 0x10000;
+					dst[n++] = static_cast<wchar_t>(0xD800 + (u >> 10));
+					dst[n++] = static_cast<wchar_t>(0xDC00 + (u & 0x3FF));
+				}
+				else
+				{
+					dst[n++] = static_cast<wchar_t>(u);
+				}
+			}
+			out->resize(n);
+			return static_cast<int>(n);
 		}
 
 		/// UTF16UTF8(std::string)؉Q
+		/// ˤʤäƤʤ`ȤU+FFFDˤʤ
 		int Utf16ToUtf8(const wchar_t* src, int length, std::string* out)
 		{
-			int size;
-			size = WideCharToMultiByte(CP_UTF8, NULL, src, length, nullptr, NULL, nullptr, nullptr);
-			buffer.resize(size);
-			WideCharToMultiByte(CP_UTF8, NULL, src, length, (LPSTR)buffer.data(), buffer.size(), nullptr, nullptr);
-			out->assign(buffer.data(), size);
+			size_t len = (length < 0) ? wcslen(src) + 1 : static_cast<size_t>(length);
+			out->resize(len * 3);
+			char* dst = len > 0 ? &(*out)[0] : nullptr;
+			size_t n = 0;
+			for (size_t i = 0; i < len; i++)
+			{
+				unsigned int u = static_cast<unsigned int>(src[i]);
+				if (u < 0x80)
+				{
+					dst[n++] = static_cast<char>(u);
+					continue;
+				}
+				if (u >= 0xD800 && u <= 0xDFFF)
+				{
+					if (u <= 0xDBFF && i + 1 < len && src[i + 1] >= 0xDC00 && src[i + 1] <= 0xDFFF)
+					{
+						u = 0x10000 + ((u - 0xD800) << 10) + (static_cast<unsigned int>(src[++i]) - 0xDC00);
+					}
+					else
+					{
+						u = 0xFFFD;
+					}
+				}
+				n += putUtf8(u, dst + n);
+			}
+			out->resize(n);
+			return static_cast<int>(n);
+		}
+
+		/// ^AASCII֤lengthͬʤASCII
+		static size_t GetAsciiLength(const char* src, size_t length)
+		{
+			return findNonAscii(reinterpret_cast<const unsigned char*>(src), length);
+		}
+
+	private:
+		static size_t getLength(const char* src, int length)
+		{
+			return (length < 0) ? strlen(src) + 1 : static_cast<size_t>(length);
+		}
+
+		/// ^AASCII֤
+		static size_t findNonAscii(const unsigned char* s, size_t len)
+		{
+			size_t i = 0;
+#ifdef ENCODING_SSE2
+			for (; i + 16 <= len; i += 16)
+			{
+				if (_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i))) != 0)
+					break;
+			}
+#endif
+			while (i < len && s[i] < 0x80)
+			{
+				i++;
+			}
+			return i;
+		}
+
+		/// ^AASCII֤򤽤Τޤд򷵤
+		static size_t copyAscii(const unsigned char* s, size_t len, wchar_t* dst)
+		{
+			size_t i = 0;
+#ifdef ENCODING_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			for (; i + 16 <= len; i += 16)
+			{
+				__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+				if (_mm_movemask_epi8(v) != 0)
+					break;
+				__m128i lo = _mm_unpacklo_epi8(v, zero);
+				__m128i hi = _mm_unpackhi_epi8(v, zero);
+				__m128i* d = reinterpret_cast<__m128i*>(dst + i);
+				if (sizeof(wchar_t) == 2)
+				{
+					_mm_storeu_si128(d, lo);
+					_mm_storeu_si128(d + 1, hi);
+				}
+				else
+				{
+					_mm_storeu_si128(d, _mm_unpacklo_epi16(lo, zero));
+					_mm_storeu_si128(d + 1, _mm_unpackhi_epi16(lo, zero));
+					_mm_storeu_si128(d + 2, _mm_unpacklo_epi16(hi, zero));
+					_mm_storeu_si128(d + 3, _mm_unpackhi_epi16(hi, zero));
+				}
+			}
+#endif
+			for (; i < len && s[i] < 0x80; i++)
+			{
+				dst[i] = static_cast<wchar_t>(s[i]);
+			}
+			return i;
+		}
+
+		/// s[i]1֤iiM
+		/// AХȤХХȤϡǼȶ֤ˤʤ
+		static wchar_t readChar(const CodePageTable* table, const unsigned char* s, size_t len, size_t& i)
+		{
+			unsigned char c = s[i++];
+			if (!table->IsLeadByte(c))
+				return static_cast<wchar_t>(table->single[c]);
+			if (i >= len || !table->IsTrailByte(s[i]))
+				return static_cast<wchar_t>(table->default_char);
+
+			unsigned short u = table->GetDoubleByteChar(c, s[i++]);
+			return static_cast<wchar_t>(u != 0 ? u : table->default_char);
+		}
+
+		/// s[i]UTF81֤iiM
+		static unsigned int readUtf8(const unsigned char* s, size_t len, size_t& i)
+		{
+			unsigned int c = s[i++];
+			int follow;
+			unsigned int u;
+			unsigned int min;
+			if (c >= 0xC2 && c <= 0xDF) { follow = 1; u = c & 0x1F; min = 0x80; }
+			else if (c >= 0xE0 && c <= 0xEF) { follow = 2; u = c & 0x0F; min = 0x800; }
+			else if (c >= 0xF0 && c <= 0xF4) { follow = 3; u = c & 0x07; min = 0x10000; }
+			else return 0xFFFD;
+
+			for (int k = 0; k < follow; k++)
+			{
+				if (i >= len || (s[i] & 0xC0) != 0x80)
+					return 0xFFFD;
+				u = (u << 6) | (s[i++] & 0x3F);
+			}
+			if (u < min || u > 0x10FFFF || (u >= 0xD800 && u <= 0xDFFF))
+				return 0xFFFD;
+			return u;
+		}
+
+		static size_t putUtf8(unsigned int u, char* dst)
+		{
+			if (u < 0x80)
+			{
+				dst[0] = static_cast<char>(u);
+				return 1;
+			}
+			if (u < 0x800)
+			{
+				dst[0] = static_cast<char>(0xC0 | (u >> 6));
+				dst[1] = static_cast<char>(0x80 | (u & 0x3F));
+				return 2;
+			}
+			if (u < 0x10000)
+			{
+				dst[0] = static_cast<char>(0xE0 | (u >> 12));
+				dst[1] = static_cast<char>(0x80 | ((u >> 6) & 0x3F));
+				dst[2] = static_cast<char>(0x80 | (u & 0x3F));
+				return 3;
+			}
+			dst[0] = static_cast<char>(0xF0 | (u >> 18));
+			dst[1] = static_cast<char>(0x80 | ((u >> 12) & 0x3F));
+			dst[2] = static_cast<char>(0x80 | ((u >> 6) & 0x3F));
+			dst[3] = static_cast<char>(0x80 | (u & 0x3F));
+			return 4;
+		}
+
+		/// Τʤ`ɥک`ϥƥǉQ
+		static int systemToUtf16(unsigned int codepage, const char* src, size_t len, std::wstring* out)
+		{
+#ifdef _WIN32
+			int size = MultiByteToWideChar(codepage, MB_PRECOMPOSED, src, static_cast<int>(len), nullptr, 0);
+			out->resize(size);
+			if (size > 0)
+			{
+				MultiByteToWideChar(codepage, MB_PRECOMPOSED, src, static_cast<int>(len), &(*out)[0], size);
+			}
+			return size;
+#else
+			// ASCIIωQǤʤ
+			(void)codepage;
+			out->resize(len);
+			for (size_t i = 0; i < len; i++)
+			{
+				unsigned char c = static_cast<unsigned char>(src[i]);
+				(*out)[i] = static_cast<wchar_t>(c < 0x80 ? c : 0xFFFD);
+			}
+			return static_cast<int>(len);
+#endif
+		}
+
+		static int systemFromUtf16(unsigned int codepage, const wchar_t* src, size_t len, std::string* out)
+		{
+#ifdef _WIN32
+			int size = WideCharToMultiByte(codepage, 0, src, static_cast<int>(len), nullptr, 0, nullptr, nullptr);
+			out->resize(size);
+			if (size > 0)
+			{
+				WideCharToMultiByte(codepage, 0, src, static_cast<int>(len), &(*out)[0], size, nullptr, nullptr);
+			}
 			return size;
+#else
+			(void)codepage;
+			out->resize(len);
+			for (size_t i = 0; i < len; i++)
+			{
+				(*out)[i] = (src[i] < 0x80) ? static_cast<char>(src[i]) : '?';
+			}
+			return static_cast<int>(len);
+#endif
 		}
 	};
 }
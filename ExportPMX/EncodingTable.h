@@ -0,0 +1,33 @@
+﻿#pragma once
+
+namespace oguna
+{
+	/// Windowsのコードページの変換表
+	/// MultiByteToWideCharと同じ文字を返す(ユーザー定義の領域は私用領域へ)
+	struct CodePageTable
+	{
+		unsigned int codepage;
+		/// 1バイトの文字
+		unsigned short single[256];
+		/// 先行バイトの2バイト文字の行。1バイト文字は-1
+		short row[256];
+		/// 1行192文字(後続バイト0x40-0xFF)。未定義のコードは0
+		const unsigned short* dbcs;
+		/// 後続バイトの最大値(0x7Fは含まない)
+		unsigned char trail_max;
+		/// 表にない2バイト文字の代わりの文字
+		unsigned short default_char;
+
+		bool IsLeadByte(unsigned char c) const { return row[c] >= 0; }
+		bool IsTrailByte(unsigned char c) const { return c >= 0x40 && c <= trail_max && c != 0x7F; }
+		unsigned short GetDoubleByteChar(unsigned char lead, unsigned char trail) const { return dbcs[row[lead] * 192 + (trail - 0x40)]; }
+	};
+
+	/// 組み込みの表(936,932,1252)。ない場合はnullptr
+	const CodePageTable* GetCodePageTable(unsigned int codepage);
+
+	/// UTF-16の文字からコードページの文字への表(65536文字)。
+	/// 1バイト文字は上位バイトが0。変換できない文字は0(U+0000を除く)
+	/// 同じ文字に複数のコードがある場合はWideCharToMultiByteと同じコードを選ぶ
+	const unsigned short* GetCodePageReverseTable(const CodePageTable* table);
+}
@@ -11,12 +11,30 @@
 #include "MQSetting.h"
 #include "MQBoneManager.h"
 #include "EncodingHelper.h"
+#include "PMXMorph.h"
+#include "PMXMaterial.h"
+#include "PMXTextureDeploy.h"
+#include "PMXTextureAtlas.h"
+#include "PMXExportStats.h"
+#include "PMXHostProfiler.h"
+#include "PMXArena.h"
+#include "PMXStringPool.h"
+#include "PMXExportProgress.h"
+#include "PMXLayoutFingerprint.h"
+#include "PMXObjectSnapshot.h"
+#include "PMXLod.h"
+#include "PMXReader.h"
 //#include "Edition.h"
 #include <vector>
 #include <map>
 #include <list>
+#include <unordered_map>
+#include <iterator>
+#include <type_traits>
 #include <algorithm>
+#include <functional>
 #include <assert.h>
+#include <float.h>
 #include <MFileUtil.h>
 #include <tinyxml2.h>
 
@@ -24,12 +42,6 @@ HINSTANCE s_hInstance;
 wchar_t s_DllPath[MAX_PATH];
 
 #define LOG(str)	OutputDebugString(std::wstring(std::wstring(str) + L"\n").c_str())
-#define EPS	0.00001
-
-static bool MQPointFuzzyEqual(MQPoint A, MQPoint B)
-{
-	return ((fabs(A.x - B.x) < EPS) && (fabs(A.y - B.y) < EPS) && (fabs(A.z - B.z) < EPS));
-}
 
 static MAnsiString getMultiBytesSubstring(const MAnsiString& str, size_t maxlen)
 {
@@ -50,6 +62,26 @@ static MAnsiString getMultiBytesSubstring(const MAnsiString& str, size_t maxlen)
 	return MAnsiString();
 }
 
+// Same as getMultiBytesSubstring for a wide string: keeps whole characters that fit in maxlen
+// bytes of a double-byte code page (ASCII is one byte, the others two) without splitting a
+// surrogate pair.
+static MString getWideSubstring(const MString& str, size_t maxlen)
+{
+	const wchar_t* ptr = str.c_str();
+	size_t p = 0;
+	size_t bytes = 0;
+	while (p < str.length())
+	{
+		bytes += (ptr[p] < 0x80) ? 1 : 2;
+		if (bytes >= maxlen)
+		{
+			break;
+		}
+		p = str.next(p);
+	}
+	return str.substring(0, p);
+}
+
 BOOL APIENTRY DllMain(HMODULE hModule,
                       DWORD ul_reason_for_call,
                       LPVOID lpReserved
@@ -119,6 +151,7 @@ private:
 	std::vector<BoneNameSetting> m_BoneNameSetting;
 	std::vector<BoneIKNameSetting> m_BoneIKNameSetting;
 	std::vector<BoneGroupSetting> m_BoneGroupSetting;
+	PMXTextureDeployer m_TextureDeployer;
 	bool LoadBoneSettingFile();
 };
 
@@ -160,18 +193,41 @@ const char* ExportPMXPlugin::EnumFileExt(int index)
 	return nullptr;
 }
 
+struct CreateDialogOptionParam;
+
 class PMXOptionDialog : public MQDialog
 {
 public:
 	MQCheckBox* check_visible;
+	MQCheckBox* check_deploy_texture;
+	MQCheckBox* check_merge_material;
+	MQCheckBox* check_cleanup_mesh;
+	MQCheckBox* check_text_utf8;
+	MQCheckBox* check_texture_atlas;
+	MQSpinBox* spin_atlas_max_texture_size;
+	MQCheckBox* check_stream_export;
+	MQCheckBox* check_update_morphs;
+	MQCheckBox* check_lod;
+	MQEdit* edit_lod_levels;
+	MQCheckBox* check_export_stats;
+	MQCheckBox* check_profile_host;
 	MQComboBox* combo_bone;
 	MQComboBox* combo_ikend;
 	MQComboBox* combo_facial;
+	MQDoubleSpinBox* spin_morph_tolerance;
+	MQComboBox* combo_morph_tolerance;
+	MQComboBox* combo_morph_match;
+	MQDoubleSpinBox* spin_morph_match_radius;
 	MQEdit* edit_modelname;
 	MQMemo* memo_comment;
+	MQButton* button_analyze;
+	MQMemo* memo_analysis;
+
+	CreateDialogOptionParam* option;
 
 	PMXOptionDialog(int id, int parent_frame_id, ExportPMXPlugin* plugin);
 	BOOL ComboBoneChanged(MQWidgetBase* sender, MQDocument doc) const;
+	BOOL ButtonAnalyzeClicked(MQWidgetBase* sender, MQDocument doc);
 };
 
 PMXOptionDialog::PMXOptionDialog(int id, int parent_frame_id, ExportPMXPlugin* plugin) : MQDialog(id)
@@ -181,8 +237,41 @@ PMXOptionDialog::PMXOptionDialog(int id, int parent_frame_id, ExportPMXPlugin* p
 	MQGroupBox* group = CreateGroupBox(&parent, L"PMX选项");
 
 	check_visible = CreateCheckBox(group, L"仅可见对象");
-
+	check_deploy_texture = CreateCheckBox(group, L"复制纹理到输出文件夹");
+	check_merge_material = CreateCheckBox(group, L"合并相同材质");
+	// 頂点が重なるか面積がほぼ0の三角形と、どの面にも使われない頂点を書き出さない
+	check_cleanup_mesh = CreateCheckBox(group, L"清理退化面和未使用顶点");
+	// 名前をUTF-16ではなくUTF-8で書き出す。英数字の名前は半分の大きさになる
+	check_text_utf8 = CreateCheckBox(group, L"文本使用UTF-8编码");
+
+	// このサイズ以下のテクスチャをアトラスにまとめる
 	MQFrame* hframe = CreateHorizontalFrame(group);
+	check_texture_atlas = CreateCheckBox(hframe, L"合并小纹理为图集");
+	spin_atlas_max_texture_size = CreateSpinBox(hframe);
+	spin_atlas_max_texture_size->SetMin(16);
+	spin_atlas_max_texture_size->SetMax(1024);
+	spin_atlas_max_texture_size->SetIncrement(16);
+	spin_atlas_max_texture_size->SetHintSizeRateX(8);
+	spin_atlas_max_texture_size->SetFillBeforeRate(1);
+
+	// オブジェクトごとに書き出して解放し、メモリを最大のオブジェクト程度に抑える
+	check_stream_export = CreateCheckBox(group, L"低内存模式（逐对象导出）");
+
+	// 既存のPMXの頂点と面が変わっていなければ、モーフ以降だけを書き直す
+	check_update_morphs = CreateCheckBox(group, L"仅更新表情（顶点未变时）");
+
+	// 面の数を減らしたPMXを「名前_lod50.pmx」のように隣に書き出す
+	hframe = CreateHorizontalFrame(group);
+	check_lod = CreateCheckBox(hframe, L"导出LOD（面数%）");
+	edit_lod_levels = CreateEdit(hframe);
+	edit_lod_levels->SetHorzLayout(LAYOUT_FILL);
+
+	// 各処理の時間をPMXの隣にJSONで出力する
+	check_export_stats = CreateCheckBox(group, L"输出导出统计");
+	// 宿主の関数呼び出しの回数と時間をランキングで出力する
+	check_profile_host = CreateCheckBox(group, L"分析宿主调用");
+
+	hframe = CreateHorizontalFrame(group);
 	CreateLabel(hframe, L"导出骨骼");
 	combo_bone = CreateComboBox(hframe);
 	combo_bone->AddItem(L"否");
@@ -207,6 +296,37 @@ PMXOptionDialog::PMXOptionDialog(int id, int parent_frame_id, ExportPMXPlugin* p
 	combo_facial->SetHintSizeRateX(8);
 	combo_facial->SetFillBeforeRate(1);
 
+	// 変化量がこれ未満の頂点はモーフに含めない
+	hframe = CreateHorizontalFrame(group);
+	CreateLabel(hframe, L"表情容差");
+	spin_morph_tolerance = CreateDoubleSpinBox(hframe);
+	spin_morph_tolerance->SetMin(0.0);
+	spin_morph_tolerance->SetMax(1.0);
+	spin_morph_tolerance->SetDecimalDigit(6);
+	spin_morph_tolerance->SetIncrement(0.00001);
+	spin_morph_tolerance->SetHintSizeRateX(8);
+	spin_morph_tolerance->SetFillBeforeRate(1);
+	combo_morph_tolerance = CreateComboBox(hframe);
+	combo_morph_tolerance->AddItem(L"绝对");
+	combo_morph_tolerance->AddItem(L"相对模型尺寸");
+	combo_morph_tolerance->SetHintSizeRateX(8);
+
+	// 頂点数や順序がベースと異なるターゲットは最近傍の頂点で対応付ける
+	hframe = CreateHorizontalFrame(group);
+	CreateLabel(hframe, L"表情顶点对应");
+	combo_morph_match = CreateComboBox(hframe);
+	combo_morph_match->AddItem(L"索引");
+	combo_morph_match->AddItem(L"自动");
+	combo_morph_match->AddItem(L"最近顶点");
+	combo_morph_match->SetHintSizeRateX(8);
+	combo_morph_match->SetFillBeforeRate(1);
+	spin_morph_match_radius = CreateDoubleSpinBox(hframe);
+	spin_morph_match_radius->SetMin(0.0);
+	spin_morph_match_radius->SetMax(1000.0);
+	spin_morph_match_radius->SetDecimalDigit(4);
+	spin_morph_match_radius->SetIncrement(0.001);
+	spin_morph_match_radius->SetHintSizeRateX(8);
+
 	hframe = CreateHorizontalFrame(group);
 	CreateLabel(hframe, L"模型名");
 	edit_modelname = CreateEdit(hframe);
@@ -216,6 +336,15 @@ PMXOptionDialog::PMXOptionDialog(int id, int parent_frame_id, ExportPMXPlugin* p
 	CreateLabel(group, L"注释");
 	memo_comment = CreateMemo(group);
 	//memo_comment->SetMaxLength(256);
+
+	// 書き出さずに数だけを数えて、結果とファイルサイズを見積もる
+	group = CreateGroupBox(&parent, L"导出预估");
+	button_analyze = CreateButton(group, L"分析");
+	button_analyze->AddClickEvent(this, &PMXOptionDialog::ButtonAnalyzeClicked);
+	memo_analysis = CreateMemo(group);
+	memo_analysis->SetReadOnly(true);
+
+	option = nullptr;
 }
 
 BOOL PMXOptionDialog::ComboBoneChanged(MQWidgetBase* sender, MQDocument doc) const
@@ -224,21 +353,72 @@ BOOL PMXOptionDialog::ComboBoneChanged(MQWidgetBase* sender, MQDocument doc) con
 	return FALSE;
 }
 
+struct PMXBoneParam;
+
 struct CreateDialogOptionParam
 {
 	ExportPMXPlugin* plugin;
 	PMXOptionDialog* dialog;
 
+	// 分析に使う
+	MQDocument doc;
+	MQBoneManager* bone_manager;
+	const std::vector<PMXBoneParam>* bone_param;
+	const PMXStringPool* bone_names;
+	const PMXMorphTopology* morph_topology;
+
 	bool visible_only;
+	bool deploy_texture;
+	bool merge_material;
+	bool cleanup_mesh;
+	bool text_utf8;
+	bool texture_atlas;
+	int atlas_max_texture_size;
+	bool stream_export;
+	bool update_morphs_only;
+	bool export_lod;
+	std::wstring lod_levels; // 面の割合（%）をカンマで区切る
+	bool export_stats;
+	bool profile_host;
 	bool bone_exists;
 	bool facial_exists;
 	bool output_bone;
 	bool output_ik_end;
 	bool output_facial;
+	PMXMorphTolerance morph_tolerance;
+	int morph_match;
+	float morph_match_radius; // 単位は morph_tolerance と同じ
 	MAnsiString modelname;
 	MAnsiString comment;
 };
 
+// Read the options from the dialog
+static void ReadDialogOption(PMXOptionDialog* dialog, CreateDialogOptionParam* option)
+{
+	option->visible_only = dialog->check_visible->GetChecked();
+	option->deploy_texture = dialog->check_deploy_texture->GetChecked();
+	option->merge_material = dialog->check_merge_material->GetChecked();
+	option->cleanup_mesh = dialog->check_cleanup_mesh->GetChecked();
+	option->text_utf8 = dialog->check_text_utf8->GetChecked();
+	option->texture_atlas = dialog->check_texture_atlas->GetChecked();
+	option->atlas_max_texture_size = dialog->spin_atlas_max_texture_size->GetPosition();
+	option->stream_export = dialog->check_stream_export->GetChecked();
+	option->update_morphs_only = dialog->check_update_morphs->GetChecked();
+	option->export_lod = dialog->check_lod->GetChecked();
+	option->lod_levels = dialog->edit_lod_levels->GetText();
+	option->export_stats = dialog->check_export_stats->GetChecked();
+	option->profile_host = dialog->check_profile_host->GetChecked();
+	option->output_bone = dialog->combo_bone->GetCurrentIndex() == 1;
+	option->output_ik_end = dialog->combo_ikend->GetCurrentIndex() == 1;
+	option->output_facial = dialog->combo_facial->GetCurrentIndex() == 1;
+	option->morph_tolerance.value = static_cast<float>(dialog->spin_morph_tolerance->GetPosition());
+	option->morph_tolerance.relative = dialog->combo_morph_tolerance->GetCurrentIndex() == 1;
+	option->morph_match = dialog->combo_morph_match->GetCurrentIndex();
+	option->morph_match_radius = static_cast<float>(dialog->spin_morph_match_radius->GetPosition());
+	option->modelname = getMultiBytesSubstring(MString(dialog->edit_modelname->GetText()).toAnsiString(), 20);
+	option->comment = getMultiBytesSubstring(MString(dialog->memo_comment->GetText()).toAnsiString(), 256);
+}
+
 static void CreateDialogOption(bool init, MQFileDialogCallbackParam* param, void* ptr)
 {
 	CreateDialogOptionParam* option = static_cast<CreateDialogOptionParam*>(ptr);
@@ -247,24 +427,41 @@ static void CreateDialogOption(bool init, MQFileDialogCallbackParam* param, void
 	{
 		PMXOptionDialog* dialog = new PMXOptionDialog(param->dialog_id, param->parent_frame_id, option->plugin);
 		option->dialog = dialog;
+		dialog->option = option;
 
 		dialog->check_visible->SetChecked(option->visible_only);
+		dialog->check_deploy_texture->SetChecked(option->deploy_texture);
+		dialog->check_merge_material->SetChecked(option->merge_material);
+		dialog->check_cleanup_mesh->SetChecked(option->cleanup_mesh);
+		dialog->check_text_utf8->SetChecked(option->text_utf8);
+		dialog->check_texture_atlas->SetChecked(option->texture_atlas);
+		dialog->spin_atlas_max_texture_size->SetPosition(option->atlas_max_texture_size);
+		dialog->check_stream_export->SetChecked(option->stream_export);
+		dialog->check_update_morphs->SetEnabled(option->facial_exists);
+		dialog->check_update_morphs->SetChecked(option->update_morphs_only);
+		dialog->check_lod->SetChecked(option->export_lod);
+		dialog->edit_lod_levels->SetText(option->lod_levels);
+		dialog->check_export_stats->SetChecked(option->export_stats);
+		dialog->check_profile_host->SetChecked(option->profile_host);
 		dialog->combo_bone->SetEnabled(option->bone_exists);
 		dialog->combo_bone->SetCurrentIndex(option->output_bone ? 1 : 0);
 		dialog->combo_ikend->SetEnabled(option->bone_exists && option->output_bone);
 		dialog->combo_ikend->SetCurrentIndex(option->output_ik_end ? 1 : 0);
 		dialog->combo_facial->SetEnabled(option->facial_exists);
 		dialog->combo_facial->SetCurrentIndex(option->output_facial ? 1 : 0);
+		dialog->spin_morph_tolerance->SetEnabled(option->facial_exists);
+		dialog->spin_morph_tolerance->SetPosition(option->morph_tolerance.value);
+		dialog->combo_morph_tolerance->SetEnabled(option->facial_exists);
+		dialog->combo_morph_tolerance->SetCurrentIndex(option->morph_tolerance.relative ? 1 : 0);
+		dialog->combo_morph_match->SetEnabled(option->facial_exists);
+		dialog->combo_morph_match->SetCurrentIndex(option->morph_match);
+		dialog->spin_morph_match_radius->SetEnabled(option->facial_exists);
+		dialog->spin_morph_match_radius->SetPosition(option->morph_match_radius);
 		dialog->edit_modelname->SetText(MString::fromAnsiString(option->modelname).c_str());
 	}
 	else
 	{
-		option->visible_only = option->dialog->check_visible->GetChecked();
-		option->output_bone = option->dialog->combo_bone->GetCurrentIndex() == 1;
-		option->output_ik_end = option->dialog->combo_ikend->GetCurrentIndex() == 1;
-		option->output_facial = option->dialog->combo_facial->GetCurrentIndex() == 1;
-		option->modelname = getMultiBytesSubstring(MString(option->dialog->edit_modelname->GetText()).toAnsiString(), 20);
-		option->comment = getMultiBytesSubstring(MString(option->dialog->memo_comment->GetText()).toAnsiString(), 256);
+		ReadDialogOption(option->dialog, option);
 		delete option->dialog;
 	}
 }
@@ -289,6 +486,8 @@ struct PMXFileVertexList
 };
 #pragma pack(pop)
 
+// Names are handles into the PMXStringPool of the export, so a bone is copied
+// and moved without touching any string.
 struct PMXBoneParam
 {
 	UINT id;
@@ -299,7 +498,7 @@ struct PMXBoneParam
 	MQPoint org_root, org_tip;
 	MQPoint def_root, def_tip;
 	//MQPoint scale;
-	MString name;
+	PMXStringPool::Handle name;
 	int ikchain;
 	UINT ikparent;
 	bool ikparent_isik;
@@ -318,8 +517,8 @@ struct PMXBoneParam
 	std::vector<int> PMX_ik_chain;
 	bool PMX_ik_root_tip;
 
-	MString name_jp;
-	MString name_en;
+	PMXStringPool::Handle name_jp;
+	PMXStringPool::Handle name_en;
 	int root_group;
 	int group;
 	int ik_group;
@@ -330,16 +529,16 @@ struct PMXBoneParam
 	bool movable;
 	UINT group_id;
 	UINT tip_id;
-	MString tip_name;
-	MString ik_name;
-	MString ik_tip_name;
+	PMXStringPool::Handle tip_name;
+	PMXStringPool::Handle ik_name;
+	PMXStringPool::Handle ik_tip_name;
 
-	MString tip_name_jp;
-	MString tip_name_en;
-	MString ik_name_jp;
-	MString ik_tip_name_jp;
-	MString ik_name_en;
-	MString ik_tip_name_en;
+	PMXStringPool::Handle tip_name_jp;
+	PMXStringPool::Handle tip_name_en;
+	PMXStringPool::Handle ik_name_jp;
+	PMXStringPool::Handle ik_tip_name_jp;
+	PMXStringPool::Handle ik_name_en;
+	PMXStringPool::Handle ik_tip_name_en;
 
 	PMXBoneParam(): id(0)
 	{
@@ -368,302 +567,28 @@ struct PMXBoneParam
 		movable = false;
 		group_id = 0;
 		tip_id = 0;
-	}
-};
-
-//Facial
-enum MorphType
-{
-	MORPH_BASE = 0,
-	MORPH_BROW,
-	MORPH_EYE,
-	MORPH_LIP,
-	MORPH_OTHER,
-};
-
-struct PMXMorphInputParam
-{
-	MQObject base;
-	std::vector<std::pair<MQObject, MorphType>> target;
-};
 
-struct PMXMorphParam
-{
-	char skin_name[20]; //　表情名
-	DWORD vertNum; // 表情用の頂点数
-	MorphType type;
-
-	std::vector<std::pair<DWORD, MQPoint>> vertex;
-};
-
-static bool containsTargetObject(std::vector<PMXMorphInputParam>& list, MQObject obj)
-{
-	assert(obj != nullptr);
-
-	auto end = list.end();
-	for (auto ite = list.begin(); ite != end; ++ite)
-	{
-		for (auto tIte = ite->target.begin(); tIte != ite->target.end(); ++tIte)
-			if (tIte->first == obj)
-				return true;
+		name = 0;
+		name_jp = 0;
+		name_en = 0;
+		tip_name = 0;
+		ik_name = 0;
+		ik_tip_name = 0;
+		tip_name_jp = 0;
+		tip_name_en = 0;
+		ik_name_jp = 0;
+		ik_tip_name_jp = 0;
+		ik_name_en = 0;
+		ik_tip_name_en = 0;
 	}
+};
+static_assert(std::is_nothrow_move_constructible<PMXBoneParam>::value, "PMXBoneParam is moved while sorting the bones");
 
-	return false;
-}
-
-BOOL ExportPMXPlugin::ExportFile(int index, const char* filename, MQDocument doc)
+// Sort the bones by hierarchy and assign the PMX bone indices.
+// Returns the number of PMX bones, including the generated IK and IK end bones.
+static int AssignPMXBoneIndices(std::vector<PMXBoneParam>& bone_param, std::map<UINT, int>& bone_id_index, bool output_ik_end, std::vector<int>& ik_chain_end_list)
 {
-	if (GetACP() != 936)
-	{
-		MQWindow mainwin = MQWindow::GetMainWindow();
-		MQDialog::MessageWarningBox(mainwin, L"请在中文环境下使用该插件", L"导出错误");
-		return false;
-	}
-	LoadBoneSettingFile();
-	MQBoneManager bone_manager(this, doc);
-
-	// Query a number of bones
-	int bone_num = bone_manager.GetBoneNum();
-	// Enum bones
-	std::vector<UINT> bone_id;
-	std::vector<PMXBoneParam> bone_param;
-	if (bone_num > 0)
-	{
-		bone_id.resize(bone_num);
-		bone_manager.EnumBoneID(bone_id);
-
-		bone_param.resize(bone_num);
-		for (int i = 0; i < bone_num; i++)
-		{
-			bone_param[i].id = bone_id[i];
-
-			std::wstring name;
-			bone_manager.GetParent(bone_id[i], bone_param[i].parent);
-			bone_manager.GetChildNum(bone_id[i], bone_param[i].child_num);
-			bone_manager.GetBaseRootPos(bone_id[i], bone_param[i].org_root);
-			bone_manager.GetBaseTipPos(bone_id[i], bone_param[i].org_tip);
-			bone_manager.GetDeformRootPos(bone_id[i], bone_param[i].def_root);
-			bone_manager.GetDeformTipPos(bone_id[i], bone_param[i].def_tip);
-			bone_manager.GetDeformMatrix(bone_id[i], bone_param[i].mtx);
-			bone_manager.GetBaseMatrix(bone_id[i], bone_param[i].base_mtx);
-			//bone_manager.GetDeformScale(bone_id[i], bone_param[i].scale);
-			bone_manager.GetName(bone_id[i], name);
-			bone_manager.GetIKChain(bone_id[i], bone_param[i].ikchain);
-			bone_manager.GetDummy(bone_id[i], bone_param[i].dummy);
-			bone_manager.GetEndPoint(bone_id[i], bone_param[i].end_point);
-
-			bone_param[i].name = MString(name);
-			{
-				MQAngle angle_min, angle_max;
-				bone_manager.GetAngleMin(bone_id[i], angle_min);
-				bone_manager.GetAngleMax(bone_id[i], angle_max);
-				bone_param[i].twist = (angle_max.bank == 0 && angle_min.bank == 0 && angle_max.pitch == 0 && angle_min.pitch == 0);
-			}
-			{
-				MQBoneManager::LINK_PARAM param;
-				bone_manager.GetLink(bone_id[i], param);
-				bone_param[i].link_id = param.link_bone_id;
-				bone_param[i].link_rate = int(param.rotate);
-			}
-			{
-				bone_manager.GetMovable(bone_id[i], bone_param[i].movable);
-			}
-			{
-				bone_manager.GetTipBone(bone_id[i], bone_param[i].tip_id);
-			}
-			if (bone_param[i].tip_id == 0)
-			{
-				bone_manager.GetTipName(bone_id[i], name);
-				bone_param[i].tip_name = name;
-			}
-			if (bone_param[i].ikchain != -1)
-			{
-				std::wstring tip_name;
-				bone_manager.GetIKName(bone_id[i], name, tip_name);
-				bone_param[i].ik_name = name;
-				bone_param[i].ik_tip_name = tip_name;
-			}
-			if (bone_param[i].ikchain != -1)
-			{
-				bone_manager.GetIKParent(bone_id[i], bone_param[i].ikparent, bone_param[i].ikparent_isik);
-			}
-		}
-	}
-
-	const DWORD morph_plugin_product = 0x56A31D20;
-	const DWORD morph_plugin_id = 0xC452C6DB;
-
-	// モーフプラグインから必要な情報を取得
-	int morph_target_size = 0;
-	std::vector<PMXMorphInputParam> morph_intput_list;
-	std::vector<std::vector<MQObject>> morph_target_list;
-	std::vector<std::vector<int>> morph_target_index_list;
-
-	int morph_num = this->SendUserMessage(doc, morph_plugin_product, morph_plugin_id, "getMorphObjectSize", nullptr);
-	morph_intput_list.resize(morph_num);
-	morph_target_list.resize(morph_num);
-	morph_target_index_list.resize(morph_num);
-
-	{
-		// モーフのベースオブジェクトを取得
-		std::vector<MQObject> baseObj;
-		baseObj.resize(morph_num);
-#ifdef _DEBUG
-		assert(this->SendUserMessage(doc, morph_plugin_product, morph_plugin_id, "getBaseObjectList", baseObj.data()) == morph_num);
-#else
-		this->SendUserMessage(doc, morph_plugin_product, morph_plugin_id, "getBaseObjectList", baseObj.data());
-#endif
-
-		for (int i = 0; i < morph_num; ++i)
-			morph_intput_list.at(i).base = baseObj.at(i);
-	}
-
-	if (morph_num > 0)
-	{
-		// モーフターゲット情報を取得
-		std::vector<std::pair<MQObject, MorphType>> target;
-		auto targets = &morph_target_list.front();
-		auto targetIndexes = &morph_target_index_list.front();
-		int targetIndex = 1;
-		for (int i = 0; i < morph_num; ++i)
-		{
-			targets = &morph_target_list.at(i);
-			targetIndexes = &morph_target_index_list.at(i);
-
-			PMXMorphInputParam* iParam = &morph_intput_list.at(i);
-			int target_size = this->SendUserMessage(doc, morph_plugin_product, morph_plugin_id, "getTargetSize", iParam->base);
-
-			target.resize(target_size + 1);
-			target.at(0) = std::make_pair(iParam->base, MORPH_BASE);
-#ifdef _DEBUG
-			assert(this->SendUserMessage(doc, morph_plugin_product, morph_plugin_id, "getTargetList", target.data()) == target_size);
-#else
-			this->SendUserMessage(doc, morph_plugin_product, morph_plugin_id, "getTargetList", target.data());
-#endif
-
-			auto end = target.end();
-			for (auto ite = target.begin() + 1; ite != end; ++ite)
-			{
-				iParam->target.push_back(*ite);
-				targets->push_back(ite->first);
-				targetIndexes->push_back(targetIndex++);
-			}
-
-			morph_target_size += target_size;
-		}
-	}
-
-	// Show a dialog for converting axes
-	// 座標軸変換用ダイアログの表示
-	float scaling = 1;
-	CreateDialogOptionParam option;
-	option.plugin = this;
-	option.visible_only = false;
-	option.bone_exists = (bone_num > 0);
-	option.facial_exists = (morph_num > 0);
-	option.output_bone = true;
-	option.output_ik_end = true;
-	option.output_facial = true;
-	option.modelname = getMultiBytesSubstring(MFileUtil::extractFileNameOnly(MString::fromAnsiString(filename)).toAnsiString(), 20);
-	option.comment = MAnsiString();
-	// Load a setting.
-	MQSetting* setting = OpenSetting();
-	if (setting != nullptr)
-	{//设置页面显示的
-		setting->Load("VisibleOnly", option.visible_only, option.visible_only);
-		setting->Load("Bone", option.output_bone, option.output_bone);
-		setting->Load("IKEnd", option.output_ik_end, option.output_ik_end);
-		setting->Load("Facial", option.output_facial, option.output_facial);
-	}
-	MQFileDialogInfo dlginfo;
-	memset(&dlginfo, 0, sizeof(dlginfo));
-	dlginfo.dwSize = sizeof(dlginfo);
-	dlginfo.scale = scaling;
-	dlginfo.hidden_flag = MQFileDialogInfo::HIDDEN_AXIS | MQFileDialogInfo::HIDDEN_INVERT_FACE;
-	dlginfo.axis_x = MQFILE_TYPE_RIGHT;
-	dlginfo.axis_y = MQFILE_TYPE_UP;
-	dlginfo.axis_z = MQFILE_TYPE_FRONT;
-	dlginfo.softname = "";
-	dlginfo.dialog_callback = CreateDialogOption;
-	dlginfo.dialog_callback_ptr = &option;
-	MQ_ShowFileDialog("PMX Export", &dlginfo);
-
-	// Save a setting.
-	scaling = dlginfo.scale;
-	if (setting != nullptr)
-	{
-		setting->Save("VisibleOnly", option.visible_only);
-		setting->Save("Bone", option.output_bone);
-		setting->Save("IKEnd", option.output_ik_end);
-		setting->Save("Facial", option.output_facial);
-		CloseSetting(setting);
-	}
-
-	if (!option.output_bone)
-	{
-		bone_num = 0;
-		bone_id.clear();
-		bone_param.clear();
-	}
-
-	bool isOutputFacial = option.output_facial;
-	if (!isOutputFacial)
-	{
-		morph_num = 0;
-		morph_target_size = 0;
-		morph_intput_list.clear();
-	}
-
-	int numObj = doc->GetObjectCount();
-	int numMat = doc->GetMaterialCount();
-
-	// 頂点をひとまとめにする（単一オブジェクトしか扱えないので）
-	std::vector<MQExportObject*> expobjs(numObj, nullptr);
-	std::vector<std::vector<int>> orgvert_vert(numObj);
-	std::vector<int> vert_orgobj;
-	std::vector<int> vert_expvert;
-	std::vector<MQPoint> vert_normal;
-	std::vector<MQCoordinate> vert_coord;
-	int total_vert_num = 0;
-
-	for (int oi = 0; oi < numObj; oi++)
-	{
-		MQObject org_obj = doc->GetObject(oi);
-		if (org_obj == nullptr)
-			continue;
-
-		if (option.visible_only && org_obj->GetVisible() == 0)
-			continue;
-
-		MQExportObject::MSeparateParam separate;
-		separate.SeparateNormal = true;
-		separate.SeparateUV = true;
-		separate.SeparateVertexColor = false;
-		MQExportObject* eobj = new MQExportObject(org_obj, separate);
-		expobjs[oi] = eobj;
-
-		// ターゲットオブジェクトは飛ばす
-		if (isOutputFacial && containsTargetObject(morph_intput_list, org_obj))
-			continue;
-
-		int vert_num = eobj->GetVertexCount();
-		orgvert_vert[oi].resize(vert_num, -1);
-		for (int evi = 0; evi < vert_num; evi++)
-		{
-			orgvert_vert[oi][evi] = total_vert_num;
-
-			vert_orgobj.push_back(oi);
-			vert_expvert.push_back(evi);
-
-			MQPoint nrm = eobj->GetVertexNormal(evi);
-			MQCoordinate uv = eobj->GetVertexCoordinate(evi);
-
-			vert_normal.push_back(nrm);
-			vert_coord.push_back(uv);
-			total_vert_num++;
-		}
-	}
-	std::map<UINT, int> bone_id_index;
+	int bone_num = static_cast<int>(bone_param.size());
 	// Initialize bones.
 	if (bone_num > 0)
 	{
@@ -687,7 +612,7 @@ BOOL ExportPMXPlugin::ExportFile(int index, const char* filename, MQDocument doc
 
 		// Sort by hierarchy
 		{
-			std::list<PMXBoneParam> bone_param_temp(bone_param.begin(), bone_param.end());
+			std::list<PMXBoneParam> bone_param_temp(std::make_move_iterator(bone_param.begin()), std::make_move_iterator(bone_param.end()));
 			bone_param.clear();
 			bone_id_index.clear();
 			while (!bone_param_temp.empty())
@@ -702,14 +627,14 @@ BOOL ExportPMXPlugin::ExportFile(int index, const char* filename, MQDocument doc
 							if (bone_param[bone_id_index[(*it).parent]].tip_id == 0 || bone_id_index[(*it).parent] != bone_param.size() - 1)
 							{
 								bone_id_index[(*it).id] = int(bone_param.size());
-								bone_param.push_back(*it);
+								bone_param.push_back(std::move(*it));
 								it = bone_param_temp.erase(it);
 								done = true;
 							}
 							else if (bone_param[bone_id_index[(*it).parent]].tip_id == (*it).id)
 							{
 								bone_id_index[(*it).id] = int(bone_param.size());
-								bone_param.push_back(*it);
+								bone_param.push_back(std::move(*it));
 								it = bone_param_temp.erase(it);
 								done = true;
 							}
@@ -726,7 +651,7 @@ BOOL ExportPMXPlugin::ExportFile(int index, const char* filename, MQDocument doc
 					else
 					{
 						bone_id_index[(*it).id] = int(bone_param.size());
-						bone_param.push_back(*it);
+						bone_param.push_back(std::move(*it));
 						it = bone_param_temp.erase(it);
 						done = true;
 					}
@@ -739,7 +664,7 @@ BOOL ExportPMXPlugin::ExportFile(int index, const char* filename, MQDocument doc
 					{
 						bone_id_index[(*it).id] = int(bone_param.size());
 						(*it).parent = 0;
-						bone_param.push_back(*it);
+						bone_param.push_back(std::move(*it));
 					}
 					break;
 				}
@@ -769,7 +694,6 @@ BOOL ExportPMXPlugin::ExportFile(int index, const char* filename, MQDocument doc
 		}
 	}
 	int PMXbone_num = 0;
-	std::vector<int> ik_chain_end_list;
 
 	std::vector<std::pair<int, MQPoint>> root_bones;
 	for (int i = 0; i < bone_num; i++)
@@ -844,7 +768,7 @@ BOOL ExportPMXPlugin::ExportFile(int index, const char* filename, MQDocument doc
 		if (bone_param[i].PMX_ik_chain.size() > 0)
 		{
 			bone_param[i].PMX_ik_index = PMXbone_num++;
-			if (option.output_ik_end)
+			if (output_ik_end)
 			{
 				bone_param[i].PMX_ik_end_index = PMXbone_num++;
 			}
@@ -871,1200 +795,2528 @@ BOOL ExportPMXPlugin::ExportFile(int index, const char* filename, MQDocument doc
 			}
 		}
 	}
-	for (int i = 0; i < bone_num; i++)
+	return PMXbone_num;
+}
+
+// Count the triangles of the exported objects per material.
+// Faces without a valid material are counted in the last entry.
+// Returns the number of triangle vertices.
+static DWORD CountMaterialTriangles(MQDocument doc, bool visible_only, const PMXMorphTopology* skip_targets, std::vector<int>& material_used)
+{
+	int numObj = doc->GetObjectCount();
+	int numMat = doc->GetMaterialCount();
+	DWORD face_vert_count = 0;
+	material_used.assign(numMat + 1, 0);
+	for (int i = 0; i < numObj; i++)
 	{
-		bool name_found = false;
-		for (auto it = m_BoneNameSetting.begin(); it != m_BoneNameSetting.end(); ++it)
+		MQObject obj = doc->GetObject(i);
+		if (obj == nullptr)
+			continue;
+
+		if (visible_only && obj->GetVisible() == 0)
+			continue;
+
+		// ターゲットオブジェクトは飛ばす
+		if (skip_targets != nullptr && skip_targets->IsTarget(i))
+			continue;
+
+		int num_face = obj->GetFaceCount();
+		for (int fi = 0; fi < num_face; fi++)
 		{
-			if ((*it).jp == bone_param[i].name || (*it).en == bone_param[i].name)
+			int n = obj->GetFacePointCount(fi);
+			if (n >= 3)
 			{
-				bone_param[i].name_jp = (*it).jp;
-				bone_param[i].name_en = (*it).en;
-				name_found = true;
-				break;
-			}
-		}
-		if (!name_found)
+				face_vert_count += (n - 2) * 3;
+
+				int mi = obj->GetFaceMaterial(fi);
+				if (mi < 0 || mi >= numMat) mi = numMat;
+				material_used[mi] += (n - 2);
+			}
+		}
+	}
+	return face_vert_count;
+}
+
+// Triangulate a polygon by ear clipping on the plane of its Newell normal.
+// This replaces MQDocument::Triangulate so that the faces can be triangulated in
+// the export thread. Writes (n - 2) triangles of indices into 'p' to 'tri'.
+// Clipping starts at the second point, so a convex polygon becomes the same fan
+// from the first point as the host makes. Points left without an ear (e.g. a
+// degenerate polygon) are closed with a fan.
+static void TriangulatePolygon(const MQPoint* p, int n, int* tri, std::vector<int>& work)
+{
+	MQPoint nrm(0, 0, 0);
+	for (int i = 0; i < n; i++)
+	{
+		const MQPoint& a = p[i];
+		const MQPoint& b = p[(i + 1) % n];
+		nrm.x += (a.y - b.y) * (a.z + b.z);
+		nrm.y += (a.z - b.z) * (a.x + b.x);
+		nrm.z += (a.x - b.x) * (a.y + b.y);
+	}
+	// Drop the dominant axis of the normal. (u, v) keeps the winding of the polygon
+	// counterclockwise when 'sign' is positive.
+	int axis = (fabs(nrm.x) >= fabs(nrm.y) && fabs(nrm.x) >= fabs(nrm.z)) ? 0 : (fabs(nrm.y) >= fabs(nrm.z)) ? 1 : 2;
+	float sign = (axis == 0) ? nrm.x : (axis == 1) ? nrm.y : nrm.z;
+	auto cross = [&](int a, int b, int c) -> float
+	{
+		float au = (axis == 0) ? p[a].y : (axis == 1) ? p[a].z : p[a].x;
+		float av = (axis == 0) ? p[a].z : (axis == 1) ? p[a].x : p[a].y;
+		float bu = (axis == 0) ? p[b].y : (axis == 1) ? p[b].z : p[b].x;
+		float bv = (axis == 0) ? p[b].z : (axis == 1) ? p[b].x : p[b].y;
+		float cu = (axis == 0) ? p[c].y : (axis == 1) ? p[c].z : p[c].x;
+		float cv = (axis == 0) ? p[c].z : (axis == 1) ? p[c].x : p[c].y;
+		return ((bu - au) * (cv - av) - (bv - av) * (cu - au)) * sign;
+	};
+
+	work.resize(n);
+	for (int i = 0; i < n; i++)
+	{
+		work[i] = i;
+	}
+	int out = 0;
+	int m = n;
+	int k = 1;
+	int tried = 0;
+	while (m > 3 && tried < m)
+	{
+		int a = work[(k + m - 1) % m];
+		int b = work[k];
+		int c = work[(k + 1) % m];
+		bool ear = cross(a, b, c) > 0;
+		for (int j = 0; ear && j < m; j++)
+		{
+			int q = work[j];
+			if (q != a && q != b && q != c && cross(a, b, q) > 0 && cross(b, c, q) > 0 && cross(c, a, q) > 0)
+				ear = false;
+		}
+		if (!ear)
+		{
+			k = (k + 1) % m;
+			tried++;
+			continue;
+		}
+		tri[out++] = a;
+		tri[out++] = b;
+		tri[out++] = c;
+		work.erase(work.begin() + k);
+		m--;
+		if (k >= m) k = 0;
+		tried = 0;
+	}
+	for (int j = 1; j < m - 1; j++)
+	{
+		tri[out++] = work[0];
+		tri[out++] = work[j];
+		tri[out++] = work[j + 1];
+	}
+}
+
+// Triangulate the faces of the exported object from its snapshot.
+// func(material, tvi) is called for each triangle with the material index
+// ('numMat' for faces without a valid material) and the split vertex indices.
+// With 'cleanup', triangles with a repeated vertex or almost no area are skipped.
+// Returns the number of skipped triangles.
+template <typename Func>
+static int TriangulateObjectFaces(const PMXObjectSnapshot& snapshot, const MQExportObject* eobj, int numMat, bool cleanup, Func func)
+{
+	int skipped = 0;
+	std::vector<int> vi;
+	std::vector<MQPoint> p;
+	std::vector<int> tri;
+	std::vector<int> work;
+	int num_face = eobj->GetFaceCount();
+	for (int fi = 0; fi < num_face; fi++)
+	{
+		int n = eobj->GetFacePointCount(fi);
+		if (n < 3)
+			continue;
+
+		int mi = snapshot.face_material[fi];
+		if (mi < 0 || mi >= numMat) mi = numMat;
+
+		vi.resize(n);
+		p.resize(n);
+		eobj->GetFacePointArray(fi, vi.data());
+		for (int j = 0; j < n; j++)
+		{
+			p[j] = snapshot.positions[eobj->GetOriginalVertex(vi[j])];
+		}
+		tri.resize((n - 2) * 3);
+		TriangulatePolygon(p.data(), n, tri.data(), work);
+		for (int j = 0; j < n - 2; j++)
+		{
+			const int* t = &tri[j * 3];
+			int tvi[3] = { vi[t[0]], vi[t[1]], vi[t[2]] };
+			if (cleanup)
+			{
+				if (tvi[0] == tvi[1] || tvi[1] == tvi[2] || tvi[2] == tvi[0])
+				{
+					skipped++;
+					continue;
+				}
+				// 面積が最長辺の長さに比べてほぼ0の面
+				MQPoint e1 = p[t[1]] - p[t[0]];
+				MQPoint e2 = p[t[2]] - p[t[0]];
+				MQPoint e3 = p[t[2]] - p[t[1]];
+				float limit = 1e-6f * std::max(std::max(GetNorm(e1), GetNorm(e2)), GetNorm(e3));
+				if (GetNorm(GetCrossProduct(e1, e2)) <= limit * limit)
+				{
+					skipped++;
+					continue;
+				}
+			}
+			func(mi, tvi);
+		}
+	}
+	return skipped;
+}
+
+// Number the used vertices in order. Unused vertices get -1.
+// Returns the number of used vertices.
+static int CompactVertices(const std::vector<BYTE>& used, std::vector<int>& remap)
+{
+	remap.resize(used.size());
+	int count = 0;
+	for (size_t i = 0; i < used.size(); i++)
+	{
+		remap[i] = used[i] ? count++ : -1;
+	}
+	return count;
+}
+
+// Extend the bounds by the vertices of the object
+static void AddObjectBounds(const std::vector<MQPoint>& pts, MQPoint& bounds_min, MQPoint& bounds_max)
+{
+	for (auto it = pts.begin(); it != pts.end(); ++it)
+	{
+		bounds_min.x = std::min(bounds_min.x, it->x);
+		bounds_min.y = std::min(bounds_min.y, it->y);
+		bounds_min.z = std::min(bounds_min.z, it->z);
+		bounds_max.x = std::max(bounds_max.x, it->x);
+		bounds_max.y = std::max(bounds_max.y, it->y);
+		bounds_max.z = std::max(bounds_max.z, it->z);
+	}
+}
+
+// グループモーフのモーフ番号は符号付きなので、数に応じてサイズを決める
+static byte GetMorphIndexSize(size_t morph_num)
+{
+	return (morph_num <= 127) ? 1 : (morph_num <= 32767) ? 2 : 4;
+}
+
+// ボーン番号も符号付きで、-1 は親や接続先がないことを表す
+static byte GetBoneIndexSize(size_t bone_num)
+{
+	return (bone_num <= 127) ? 1 : (bone_num <= 32767) ? 2 : 4;
+}
+
+// Write a signed index in the size of the header. The low bytes of the little-endian int
+// are the same index in 1 or 2 bytes.
+static void WritePMXIndex(FILE* fh, int index, byte size)
+{
+	fwrite(&index, size, 1, fh);
+}
+
+// Morph parameters of the targets in the order of the morph plugin
+static void GetMorphParams(const std::vector<PMXMorphInputParam>& inputs, std::vector<PMXMorphParam>& morph_param_list)
+{
+	for (auto bIte = inputs.begin(); bIte != inputs.end(); ++bIte)
+	{
+		for (auto tIte = bIte->target.begin(); tIte != bIte->target.end(); ++tIte)
+		{
+			PMXMorphParam mParam;
+			tIte->first->GetName(mParam.skin_name, 20);
+			mParam.type = tIte->second;
+			morph_param_list.push_back(mParam);
+		}
+	}
+}
+
+// Extract the vertex offsets of the morphs with the options.
+// 'step' is called with the number of bases done and cancels when it returns false.
+// Returns the number of targets turned into group morphs, or -1 if canceled.
+static int ExtractMorphs(const CreateDialogOptionParam& option, const std::vector<PMXMorphPositions>& positions,
+	const std::vector<MQExportObject*>& expobjs, const std::vector<std::vector<int>>& orgvert_vert,
+	const MQPoint& bounds_min, const MQPoint& bounds_max,
+	std::vector<PMXMorphParam>& morph_param_list, PMXMorphBlock& morph_block,
+	const std::function<bool(int)>& step = std::function<bool(int)>())
+{
+	// モーフの頂点情報
+	float tolerance = option.morph_tolerance.GetAbsolute(bounds_min, bounds_max);
+	PMXMorphTolerance radius = option.morph_tolerance;
+	radius.value = option.morph_match_radius;
+	PMXMorphMatchParam match;
+	match.mode = static_cast<PMXMorphMatchMode>(std::min(std::max(option.morph_match, 0), 2));
+	match.radius = radius.GetAbsolute(bounds_min, bounds_max);
+	if (!ExtractMorphOffsets(positions, expobjs, orgvert_vert, tolerance, match, morph_block, step))
+		return -1;
+
+	// 同じ変形のターゲットはグループモーフにまとめる
+	return FindGroupMorphs(morph_block, tolerance, morph_param_list);
+}
+
+// PMXのテキストエンコーディング
+enum PMXTextEncoding
+{
+	PMX_TEXT_UTF16 = 0,
+	PMX_TEXT_UTF8 = 1,
+};
+
+// Writes the texts of a PMX file (a byte length and the string) in the encoding of the header.
+// Names are multi-byte strings of the system code page (host names and toAnsiString()) or wide
+// strings (bone names), and are converted straight to the encoding in a reused buffer. ASCII
+// multi-byte names are written as they are in UTF-8.
+class PMXTextWriter
+{
+public:
+	PMXTextWriter(FILE* fh, byte encoding) : m_fh(fh), m_encoding(encoding), m_converter(GetACP())
+	{
+	}
+
+	byte GetEncoding() const { return m_encoding; }
+
+	// Write a multi-byte string of the system code page
+	void Write(const char* str, size_t length)
+	{
+		if (m_encoding == PMX_TEXT_UTF8)
+		{
+			if (oguna::EncodingConverter::GetAsciiLength(str, length) == length)
+			{
+				writeBytes(str, length);
+				return;
+			}
+			m_converter.AnsiToUtf8(str, static_cast<int>(length), &m_utf8);
+			writeBytes(m_utf8.data(), m_utf8.size());
+		}
+		else
+		{
+			m_converter.AnsiToUtf16(str, static_cast<int>(length), &m_utf16);
+			writeBytes(m_utf16.data(), m_utf16.size() * sizeof(wchar_t));
+		}
+	}
+	void Write(const MAnsiString& str) { Write(str.c_str(), str.length()); }
+
+	// Write a wide string
+	void Write(const wchar_t* str, size_t length)
+	{
+		if (m_encoding == PMX_TEXT_UTF8)
+		{
+			m_converter.Utf16ToUtf8(str, static_cast<int>(length), &m_utf8);
+			writeBytes(m_utf8.data(), m_utf8.size());
+		}
+		else
+		{
+			writeBytes(str, length * sizeof(wchar_t));
+		}
+	}
+	void Write(const wchar_t* str) { Write(str, wcslen(str)); }
+	void Write(const MString& str) { Write(str.c_str(), str.length()); }
+
+	// Write an empty text
+	void WriteEmpty()
+	{
+		writeBytes(nullptr, 0);
+	}
+
+	// Size of the text in the file including the length
+	__int64 GetSize(const MAnsiString& str)
+	{
+		if (m_encoding == PMX_TEXT_UTF8)
+		{
+			return 4 + m_converter.AnsiToUtf8(str.c_str(), static_cast<int>(str.length()), &m_utf8);
+		}
+		return 4 + static_cast<__int64>(m_converter.AnsiToUtf16(str.c_str(), static_cast<int>(str.length()), &m_utf16)) * 2;
+	}
+	__int64 GetSize(const MString& str)
+	{
+		if (m_encoding == PMX_TEXT_UTF8)
+		{
+			return 4 + m_converter.Utf16ToUtf8(str.c_str(), static_cast<int>(str.length()), &m_utf8);
+		}
+		return 4 + static_cast<__int64>(str.length()) * 2;
+	}
+
+private:
+	FILE* m_fh;
+	byte m_encoding;
+	oguna::EncodingConverter m_converter;
+	std::string m_utf8;
+	std::wstring m_utf16;
+
+	void writeBytes(const void* data, size_t size)
+	{
+		int len = static_cast<int>(size);
+		fwrite(&len, sizeof(int), 1, m_fh);
+		if (size > 0)
+		{
+			fwrite(data, size, 1, m_fh);
+		}
+	}
+};
+
+// Write the morphs and the sections after them (display frames, rigid bodies and joints)
+static void WritePMXTail(FILE* fh, byte text_encoding, const std::vector<PMXMorphParam>& morph_param_list, const PMXMorphBlock& morph_block, byte morph_index_size, float scaling)
+{
+	PMXTextWriter text(fh, text_encoding);
+
+	int skin_count = static_cast<int>(morph_param_list.size());
+	fwrite(&skin_count, sizeof(int), 1, fh);
+	for (int i = 0; i < skin_count; i++)
+	{
+		const PMXMorphParam* mParam = &morph_param_list.at(i);
+
+		text.Write(getMultiBytesSubstring(mParam->skin_name, 20));
+		text.WriteEmpty();
+		fwrite(&mParam->type, sizeof(uint8_t), 1, fh);//Panel
+		if (!mParam->group.empty())
+		{
+			uint8_t morph_type = 0;
+			fwrite(&morph_type, sizeof(uint8_t), 1, fh);//Kind=Group
+			int group_count = static_cast<int>(mParam->group.size());
+			fwrite(&group_count, sizeof(int), 1, fh);//num
+			for (int j = 0; j < group_count; ++j)
+			{
+				int morph_index = mParam->group[j];
+				fwrite(&morph_index, morph_index_size, 1, fh);
+				float morph_rate = 1.0f;
+				fwrite(&morph_rate, sizeof(float), 1, fh);
+			}
+			continue;
+		}
+		uint8_t morph_type = 1;
+		fwrite(&morph_type, sizeof(uint8_t), 1, fh);//Kind=Vertex
+		DWORD skin_vert_count = morph_block.GetOffsetCount(i);
+		fwrite(&skin_vert_count, sizeof(int), 1, fh);//num
+		const DWORD* skin_vert_index = morph_block.GetIndexArray(i);
+		const float* skin_vert_offset = morph_block.GetOffsetArray(i);
+		for (DWORD j = 0; j < skin_vert_count; ++j)
+		{
+			float skin_vert_pos[3];
+			skin_vert_pos[0] = skin_vert_offset[j * 3] * scaling;
+			skin_vert_pos[1] = skin_vert_offset[j * 3 + 1] * scaling;
+			skin_vert_pos[2] = -skin_vert_offset[j * 3 + 2] * scaling;
+			fwrite(&skin_vert_index[j], 4, 1, fh);
+			fwrite(skin_vert_pos, 4, 3, fh);
+		}
+	}
+
+	// 表情枠用表示リスト
+	int skin_disp_count = 2;
+	fwrite(&skin_disp_count, sizeof(int), 1, fh);
+	{
+		for (int i = 0; i < skin_disp_count; i++)
+		{
+			if (i == 0)
+			{
+				text.Write(L"Root");
+				text.Write(L"Root");
+			}
+			else
+			{
+				text.Write(L"表情");
+				text.Write(L"Exp");
+			}
+			byte SystemNode = 1;
+			fwrite(&SystemNode, sizeof(byte), 1, fh);
+			int NodeNum = 0;
+			fwrite(&NodeNum, sizeof(int), 1, fh);
+		}
+	}
+
+	int rigid_body_count = 0;
+	fwrite(&rigid_body_count, sizeof(int), 1, fh);
+	int joint_count = 0;
+	fwrite(&joint_count, sizeof(int), 1, fh);
+}
+
+// Result of the dry run of the export
+struct PMXExportAnalysis
+{
+	int vertex_count; // after splitting by normal and UV, and the mesh cleanup
+	int triangle_count;
+	int removed_vertex_count; // by the mesh cleanup
+	int removed_triangle_count;
+	int material_count;
+	int texture_count;
+	int bone_count; // including the generated IK and IK end bones
+	int morph_count;
+	int group_morph_count;
+	__int64 morph_offset_count;
+	int over_weight_vertex_count; // vertices with more than 4 weights, written without skinning
+	__int64 file_size;
+	DWORD time; // msec
+
+	PMXExportAnalysis()
+	{
+		vertex_count = 0;
+		triangle_count = 0;
+		removed_vertex_count = 0;
+		removed_triangle_count = 0;
+		material_count = 0;
+		texture_count = 0;
+		bone_count = 0;
+		morph_count = 0;
+		group_morph_count = 0;
+		morph_offset_count = 0;
+		over_weight_vertex_count = 0;
+		file_size = 0;
+		time = 0;
+	}
+};
+
+// Run only the counting passes of the export with the options.
+// Objects are split and faces are counted the same way as ExportFile, but
+// nothing is written, and the file size is estimated from the record sizes.
+// The texture atlas is not built, so the material count is the one without it.
+static void AnalyzeExport(const CreateDialogOptionParam& option, PMXExportAnalysis& result)
+{
+	DWORD start_time = GetTickCount();
+	MQDocument doc = option.doc;
+	int numObj = doc->GetObjectCount();
+	int numMat = doc->GetMaterialCount();
+	const PMXMorphTopology& morph_topology = *option.morph_topology;
+	bool output_bone = option.output_bone && !option.bone_param->empty();
+	bool output_facial = option.output_facial && morph_topology.GetBaseCount() > 0;
+
+	result = PMXExportAnalysis();
+
+	// Header
+	PMXTextWriter text(nullptr, option.text_utf8 ? PMX_TEXT_UTF8 : PMX_TEXT_UTF16);
+	result.file_size = 4 + 4 + 1 + 8 + text.GetSize(option.modelname) + text.GetSize(option.comment) + 4 + 4;
+
+	// Bones
+	std::vector<PMXBoneParam> bone_param;
+	std::map<UINT, int> bone_id_index;
+	std::vector<int> ik_chain_end_list;
+	if (output_bone)
+	{
+		bone_param = *option.bone_param;
+		result.bone_count = AssignPMXBoneIndices(bone_param, bone_id_index, option.output_ik_end, ik_chain_end_list);
+
+		// 名前は書き出す名前の平均のサイズで見積もる
+		__int64 name_size = 0;
+		for (size_t i = 0; i < bone_param.size(); i++)
+		{
+			name_size += text.GetSize(getWideSubstring(option.bone_names->Get(bone_param[i].name_jp), 20));
+			name_size += text.GetSize(option.bone_names->Get(bone_param[i].name_en));
+		}
+		name_size /= static_cast<__int64>(bone_param.size());
+		__int64 bone_index_size = GetBoneIndexSize(result.bone_count);
+		result.file_size += 4 + result.bone_count * (18 + 2 * bone_index_size + name_size);
+		for (size_t i = 0; i < ik_chain_end_list.size(); i++)
+		{
+			result.file_size += 12 + bone_index_size + (bone_index_size + 1) * static_cast<__int64>(bone_param[ik_chain_end_list[i]].PMX_ik_chain.size());
+		}
+	}
+	else
+	{
+		// センターのみ
+		result.bone_count = 1;
+		result.file_size += 4 + 48;
+	}
+
+	// Vertices
+	MQExportObject::MSeparateParam separate;
+	separate.SeparateNormal = true;
+	separate.SeparateUV = true;
+	separate.SeparateVertexColor = false;
+	PMXArena arena;
+	PMXArena object_arena;
+	std::vector<MQExportObject*> expobjs(numObj, nullptr);
+	std::vector<std::vector<int>> orgvert_vert(numObj);
+	MQPoint bounds_min(FLT_MAX, FLT_MAX, FLT_MAX);
+	MQPoint bounds_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	PMXObjectSnapshot snapshot;
+	std::vector<BYTE> weight_size;
+	std::vector<BYTE> vert_used;
+	int weight_index_size = GetBoneIndexSize(result.bone_count);
+	std::vector<int> vert_remap;
+	__int64 vertex_size = 0;
+	for (int oi = 0; oi < numObj; oi++)
+	{
+		MQObject obj = doc->GetObject(oi);
+		if (obj == nullptr)
+			continue;
+
+		if (option.visible_only && obj->GetVisible() == 0)
+			continue;
+
+		// ターゲットオブジェクトは飛ばす
+		if (output_facial && morph_topology.IsTarget(oi))
+			continue;
+
+		snapshot.Take(obj, output_bone ? option.bone_manager : nullptr);
+		if (output_facial && option.morph_tolerance.relative)
+		{
+			AddObjectBounds(snapshot.positions, bounds_min, bounds_max);
+		}
+
+		// モーフのベースは抽出に使うので残す
+		bool morph_base = output_facial && morph_topology.GetRole(oi) == MORPH_ROLE_BASE;
+		MQExportObject* eobj = new MQExportObject(obj, separate, morph_base ? &arena : &object_arena);
+		int vert_num = eobj->GetVertexCount();
+
+		// 書き出すときと同じく、退化した三角形とそれにしか使われない頂点を除く
+		vert_used.assign(vert_num, option.cleanup_mesh ? 0 : 1);
+		if (option.cleanup_mesh)
+		{
+			result.removed_triangle_count += TriangulateObjectFaces(snapshot, eobj, numMat, true, [&](int mi, const int* tvi)
+			{
+				vert_used[tvi[0]] = vert_used[tvi[1]] = vert_used[tvi[2]] = 1;
+			});
+		}
+		int used_num = CompactVertices(vert_used, vert_remap);
+
+		// ウェイトの数で頂点のサイズが変わる（座標、法線、UV、エッジ倍率とウェイト）
+		weight_size.assign(snapshot.positions.size(), 0);
+		for (int evi = 0; evi < vert_num; evi++)
+		{
+			if (vert_remap[evi] < 0)
+				continue;
+			int org_vi = eobj->GetOriginalVertex(evi);
+			if (weight_size[org_vi] == 0)
+			{
+				int weight_num = snapshot.weights.empty() ? 0 : snapshot.weights[org_vi].count;
+				if (weight_num > 4)
+				{
+					result.over_weight_vertex_count++;
+				}
+				weight_size[org_vi] = static_cast<BYTE>((weight_num == 3 || weight_num == 4) ? 17 + 4 * weight_index_size : 5 + 2 * weight_index_size);
+			}
+			vertex_size += 36 + weight_size[org_vi];
+		}
+
+		if (morph_base)
+		{
+			expobjs[oi] = eobj;
+			orgvert_vert[oi].resize(vert_num);
+			for (int evi = 0; evi < vert_num; evi++)
+			{
+				orgvert_vert[oi][evi] = (vert_remap[evi] < 0) ? -1 : result.vertex_count + vert_remap[evi];
+			}
+		}
+		else
+		{
+			delete eobj;
+			object_arena.Release();
+		}
+		result.vertex_count += used_num;
+		result.removed_vertex_count += vert_num - used_num;
+	}
+	result.file_size += 4 + vertex_size;
+
+	// Faces
+	std::vector<int> material_used;
+	DWORD face_vert_count = CountMaterialTriangles(doc, option.visible_only, output_facial ? &morph_topology : nullptr, material_used);
+	result.triangle_count = static_cast<int>(face_vert_count / 3) - result.removed_triangle_count;
+	result.file_size += 4 + static_cast<__int64>(result.triangle_count) * 3 * 4;
+
+	// Textures and materials
+	std::vector<PMXMaterialParam> materials;
+	PMXTextureTable textures;
+	SnapshotMaterials(doc, material_used, materials, textures);
+	if (option.merge_material)
+	{
+		MergeEquivalentMaterials(materials);
+	}
+	result.material_count = static_cast<int>(materials.size());
+	result.texture_count = textures.GetCount();
+	result.file_size += 4;
+	for (int i = 0; i < textures.GetCount(); i++)
+	{
+		result.file_size += text.GetSize(textures.GetName(i));
+	}
+	result.file_size += 4;
+	for (size_t i = 0; i < materials.size(); i++)
+	{
+		result.file_size += 78 + text.GetSize(materials[i].name);
+	}
+
+	// Morphs
+	result.file_size += 4;
+	if (output_facial)
+	{
+		std::vector<PMXMorphParam> morph_param_list;
+		PMXMorphBlock morph_block;
+		std::vector<PMXMorphPositions> morph_positions;
+		GetMorphParams(morph_topology.GetInputs(), morph_param_list);
+		ReadMorphPositions(morph_topology.GetInputs(), doc, morph_positions);
+		result.group_morph_count = ExtractMorphs(option, morph_positions, expobjs, orgvert_vert, bounds_min, bounds_max, morph_param_list, morph_block);
+
+		result.morph_count = static_cast<int>(morph_param_list.size());
+		int morph_index_size = GetMorphIndexSize(morph_param_list.size());
+		for (int i = 0; i < result.morph_count; i++)
+		{
+			result.file_size += text.GetSize(getMultiBytesSubstring(morph_param_list[i].skin_name, 20)) + 4 + 1 + 1 + 4;
+			if (!morph_param_list[i].group.empty())
+			{
+				result.file_size += static_cast<__int64>(morph_param_list[i].group.size()) * (morph_index_size + 4);
+			}
+			else
+			{
+				result.morph_offset_count += morph_block.GetOffsetCount(i);
+				result.file_size += static_cast<__int64>(morph_block.GetOffsetCount(i)) * 16;
+			}
+		}
+	}
+	for (size_t i = 0; i < expobjs.size(); i++)
+	{
+		delete expobjs[i];
+	}
+
+	// 表示枠、剛体、ジョイント
+	result.file_size += 56 + 4 + 4;
+
+	result.time = GetTickCount() - start_time;
+}
+
+BOOL PMXOptionDialog::ButtonAnalyzeClicked(MQWidgetBase* sender, MQDocument doc)
+{
+	// 今の設定で数える
+	CreateDialogOptionParam current = *option;
+	ReadDialogOption(this, &current);
+
+	PMXExportAnalysis result;
+	AnalyzeExport(current, result);
+
+	std::wstring text;
+	text += MString::format(L"顶点: %d\r\n", result.vertex_count).c_str();
+	text += MString::format(L"面: %d\r\n", result.triangle_count).c_str();
+	if (current.cleanup_mesh)
+	{
+		text += MString::format(L"清理: 退化面 %d, 未使用顶点 %d\r\n", result.removed_triangle_count, result.removed_vertex_count).c_str();
+	}
+	text += MString::format(L"材质: %d\r\n", result.material_count).c_str();
+	text += MString::format(L"纹理: %d\r\n", result.texture_count).c_str();
+	text += MString::format(L"骨骼(含IK): %d\r\n", result.bone_count).c_str();
+	text += MString::format(L"表情: %d (组合 %d)\r\n", result.morph_count, result.group_morph_count).c_str();
+	text += MString::format(L"表情顶点: %I64d\r\n", result.morph_offset_count).c_str();
+	text += MString::format(L"预计文件大小: %.2f MB\r\n", static_cast<double>(result.file_size) / (1024.0 * 1024.0)).c_str();
+	text += MString::format(L"分析用时: %u ms\r\n", static_cast<unsigned int>(result.time)).c_str();
+
+	// テクスチャの番号は1バイト（符号付き）で書き出す。ボーンの番号は数に応じた大きさになる
+	if (result.texture_count > 127)
+	{
+		text += MString::format(L"警告: 纹理超过127个，单字节纹理索引会溢出\r\n").c_str();
+	}
+	if (result.over_weight_vertex_count > 0)
+	{
+		text += MString::format(L"警告: %d个顶点的权重超过4个，将不带权重导出\r\n", result.over_weight_vertex_count).c_str();
+	}
+	memo_analysis->SetText(text);
+	return FALSE;
+}
+
+enum PMXMorphUpdateResult
+{
+	PMX_MORPH_UPDATED = 0,
+	PMX_MORPH_UPDATE_MISMATCH, // the file does not match the document, so the whole file is exported
+	PMX_MORPH_UPDATE_FAILED,   // the file could not be written; it is left as it was
+};
+
+// Rewrite the morphs and the sections after them in the existing PMX file.
+// The sections before the morphs are copied to '<filename>.tmp', which
+// replaces the file when it has been written, as in the full export.
+// The vertices and faces in the file are kept, so it must have been exported
+// from the same layout, which is checked with the fingerprint in the English comment.
+static PMXMorphUpdateResult UpdatePMXMorphs(const char* filename, MQDocument doc, const CreateDialogOptionParam& option,
+	const PMXMorphTopology& morph_topology, float scaling, MString& message)
+{
+	byte text_encoding = option.text_utf8 ? PMX_TEXT_UTF8 : PMX_TEXT_UTF16;
+	unsigned __int64 file_layout = 0;
+	int file_vert_num = 0;
+	__int64 morph_pos = 0;
+	{
+		PMXReader reader;
+		if (!reader.Open(MString::fromAnsiString(filename)))
+		{
+			message = MString::format(L"No PMX file to update (%s)", reader.GetError().c_str());
+			return PMX_MORPH_UPDATE_MISMATCH;
+		}
+		const PMXHeaderInfo& header = reader.GetHeader();
+		if (header.vertex_index_size != 4 || !PMXLayoutFingerprint::Parse(reader.GetCommentEn().ToString(), file_layout))
 		{
-			bone_param[i].name_jp = bone_param[i].name;
-			bone_param[i].name_en = bone_param[i].name;
+			message = L"The PMX file has no layout fingerprint";
+			return PMX_MORPH_UPDATE_MISMATCH;
 		}
-		name_found = false;
-		for (auto it = m_BoneNameSetting.begin(); it != m_BoneNameSetting.end(); ++it)
+		// モーフの名前を同じエンコーディングで書くので、変わっていれば全体を書き出す
+		if (header.encoding != text_encoding)
 		{
-			if ((*it).jp == bone_param[i].tip_name || (*it).en == bone_param[i].tip_name)
+			message = L"The text encoding of the PMX file differs from the option";
+			return PMX_MORPH_UPDATE_MISMATCH;
+		}
+		file_vert_num = reader.GetVertexCount();
+		morph_pos = static_cast<__int64>(reader.GetMorphSectionOffset());
+	}
+
+	// 書き出すときと同じ順に頂点を分けて指紋を取る。ベースは抽出に使うので残す
+	int numObj = doc->GetObjectCount();
+	MQExportObject::MSeparateParam separate;
+	separate.SeparateNormal = true;
+	separate.SeparateUV = true;
+	separate.SeparateVertexColor = false;
+	PMXArena arena;
+	PMXArena object_arena;
+	std::vector<MQExportObject*> expobjs(numObj, nullptr);
+	std::vector<std::vector<int>> orgvert_vert(numObj);
+	MQPoint bounds_min(FLT_MAX, FLT_MAX, FLT_MAX);
+	MQPoint bounds_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	int numMat = doc->GetMaterialCount();
+	PMXObjectSnapshot snapshot;
+	PMXLayoutFingerprint layout;
+	int total_vert_num = 0;
+	std::vector<BYTE> vert_used;
+	std::vector<int> vert_remap;
+	for (int oi = 0; oi < numObj; oi++)
+	{
+		MQObject obj = doc->GetObject(oi);
+		if (obj == nullptr)
+			continue;
+
+		if (option.visible_only && obj->GetVisible() == 0)
+			continue;
+
+		// ターゲットオブジェクトは飛ばす
+		if (morph_topology.IsTarget(oi))
+			continue;
+
+		snapshot.Take(obj, nullptr);
+		if (option.morph_tolerance.relative)
+		{
+			AddObjectBounds(snapshot.positions, bounds_min, bounds_max);
+		}
+
+		bool morph_base = morph_topology.GetRole(oi) == MORPH_ROLE_BASE;
+		MQExportObject* eobj = new MQExportObject(obj, separate, morph_base ? &arena : &object_arena);
+		layout.AddObject(snapshot, eobj);
+		int vert_num = eobj->GetVertexCount();
+
+		// 書き出すときと同じく、退化した三角形にしか使われない頂点を詰める
+		vert_used.assign(vert_num, option.cleanup_mesh ? 0 : 1);
+		if (option.cleanup_mesh)
+		{
+			TriangulateObjectFaces(snapshot, eobj, numMat, true, [&](int mi, const int* tvi)
+			{
+				vert_used[tvi[0]] = vert_used[tvi[1]] = vert_used[tvi[2]] = 1;
+			});
+		}
+		int used_num = CompactVertices(vert_used, vert_remap);
+		if (morph_base)
+		{
+			expobjs[oi] = eobj;
+			orgvert_vert[oi].resize(vert_num);
+			for (int evi = 0; evi < vert_num; evi++)
 			{
-				bone_param[i].tip_name_jp = (*it).jp;
-				bone_param[i].tip_name_en = (*it).en;
-				name_found = true;
-				break;
+				orgvert_vert[oi][evi] = (vert_remap[evi] < 0) ? -1 : total_vert_num + vert_remap[evi];
 			}
 		}
-		if (!name_found)
+		else
+		{
+			delete eobj;
+			object_arena.Release();
+		}
+		total_vert_num += used_num;
+	}
+	layout.Add(&scaling, sizeof(scaling));
+	layout.Add(&option.cleanup_mesh, sizeof(option.cleanup_mesh));
+
+	auto deleteExportObjects = [&]()
+	{
+		for (size_t i = 0; i < expobjs.size(); i++)
+		{
+			delete expobjs[i];
+		}
+	};
+	if (layout.Get() != file_layout || total_vert_num != file_vert_num)
+	{
+		deleteExportObjects();
+		message = L"The vertices or faces changed since the PMX file was exported";
+		return PMX_MORPH_UPDATE_MISMATCH;
+	}
+
+	std::vector<PMXMorphParam> morph_param_list;
+	PMXMorphBlock morph_block;
+	std::vector<PMXMorphPositions> morph_positions;
+	GetMorphParams(morph_topology.GetInputs(), morph_param_list);
+	ReadMorphPositions(morph_topology.GetInputs(), doc, morph_positions);
+	ExtractMorphs(option, morph_positions, expobjs, orgvert_vert, bounds_min, bounds_max, morph_param_list, morph_block);
+	deleteExportObjects();
+
+	FILE* src;
+	if (fopen_s(&src, filename, "rb") != 0)
+	{
+		message = L"Failed to open the PMX file";
+		return PMX_MORPH_UPDATE_FAILED;
+	}
+	std::string temp_filename = std::string(filename) + ".tmp";
+	FILE* fh;
+	if (fopen_s(&fh, temp_filename.c_str(), "wb") != 0)
+	{
+		fclose(src);
+		message = L"Failed to create the temporary file";
+		return PMX_MORPH_UPDATE_FAILED;
+	}
+
+	// モーフの前までをそのまま写す
+	std::vector<char> buffer(1024 * 1024);
+	__int64 remaining = morph_pos;
+	while (remaining > 0)
+	{
+		size_t size = static_cast<size_t>(std::min<__int64>(remaining, static_cast<__int64>(buffer.size())));
+		if (fread(buffer.data(), 1, size, src) != size || fwrite(buffer.data(), 1, size, fh) != size)
+			break;
+		remaining -= size;
+	}
+	bool succeeded = (remaining == 0);
+	fclose(src);
+
+	// ヘッダのモーフ番号のサイズはモーフの数で変わる
+	byte morph_index_size = GetMorphIndexSize(morph_param_list.size());
+	_fseeki64(fh, 15, SEEK_SET);
+	fwrite(&morph_index_size, sizeof(byte), 1, fh);
+	_fseeki64(fh, morph_pos, SEEK_SET);
+	WritePMXTail(fh, text_encoding, morph_param_list, morph_block, morph_index_size, scaling);
+	if (ferror(fh))
+	{
+		succeeded = false;
+	}
+	if (fclose(fh) != 0)
+	{
+		succeeded = false;
+	}
+	if (!succeeded || !MoveFileExA(temp_filename.c_str(), filename, MOVEFILE_REPLACE_EXISTING))
+	{
+		remove(temp_filename.c_str());
+		message = L"Failed to write the PMX file";
+		return PMX_MORPH_UPDATE_FAILED;
+	}
+	message = MString::format(L"%d morph(s) updated", static_cast<int>(morph_param_list.size()));
+	return PMX_MORPH_UPDATED;
+}
+
+BOOL ExportPMXPlugin::ExportFile(int index, const char* filename, MQDocument doc)
+{
+	// 宿主の呼び出しの分析は前回の設定で最初から開始する
+	bool profile_host = false;
+	{
+		MQSetting* setting = OpenSetting();
+		if (setting != nullptr)
 		{
-			bone_param[i].tip_name_jp = bone_param[i].tip_name;
-			bone_param[i].tip_name_en = bone_param[i].tip_name;
+			setting->Load("ProfileHostCalls", profile_host, profile_host);
+			CloseSetting(setting);
 		}
-		name_found = false;
-		for (auto it = m_BoneNameSetting.begin(); it != m_BoneNameSetting.end(); ++it)
+	}
+	PMXHostProfileScope host_profile(profile_host);
+
+	// 各処理の時間と呼び出し回数を計測
+	// statsはhost_profileより先に破棄されるので、途中で戻ってもフックは逆の順に外れる
+	PMXExportStats stats;
+	stats.Begin();
+	stats.Enter(PMX_PHASE_BONE_GATHER);
+
+	// エクスポート中だけ使う一時データの領域。戻るときにまとめて解放される
+	PMXArena arena;
+
+	LoadBoneSettingFile();
+	MQBoneManager bone_manager(this, doc);
+
+	// Query a number of bones
+	int bone_num = bone_manager.GetBoneNum();
+	// Enum bones
+	std::vector<UINT> bone_id;
+	std::vector<PMXBoneParam> bone_param;
+	PMXStringPool bone_names;
+	if (bone_num > 0)
+	{
+		bone_id.resize(bone_num);
+		bone_manager.EnumBoneID(bone_id);
+
+		bone_param.resize(bone_num);
+		std::wstring name, tip_name; // reused for all bones
+		for (int i = 0; i < bone_num; i++)
 		{
-			if ((*it).jp == bone_param[i].ik_name || (*it).en == bone_param[i].ik_name)
+			bone_param[i].id = bone_id[i];
+
+			bone_manager.GetParent(bone_id[i], bone_param[i].parent);
+			bone_manager.GetChildNum(bone_id[i], bone_param[i].child_num);
+			bone_manager.GetBaseRootPos(bone_id[i], bone_param[i].org_root);
+			bone_manager.GetBaseTipPos(bone_id[i], bone_param[i].org_tip);
+			bone_manager.GetDeformRootPos(bone_id[i], bone_param[i].def_root);
+			bone_manager.GetDeformTipPos(bone_id[i], bone_param[i].def_tip);
+			bone_manager.GetDeformMatrix(bone_id[i], bone_param[i].mtx);
+			bone_manager.GetBaseMatrix(bone_id[i], bone_param[i].base_mtx);
+			//bone_manager.GetDeformScale(bone_id[i], bone_param[i].scale);
+			bone_manager.GetName(bone_id[i], name);
+			bone_manager.GetIKChain(bone_id[i], bone_param[i].ikchain);
+			bone_manager.GetDummy(bone_id[i], bone_param[i].dummy);
+			bone_manager.GetEndPoint(bone_id[i], bone_param[i].end_point);
+
+			bone_param[i].name = bone_names.Intern(name);
+			{
+				MQAngle angle_min, angle_max;
+				bone_manager.GetAngleMin(bone_id[i], angle_min);
+				bone_manager.GetAngleMax(bone_id[i], angle_max);
+				bone_param[i].twist = (angle_max.bank == 0 && angle_min.bank == 0 && angle_max.pitch == 0 && angle_min.pitch == 0);
+			}
+			{
+				MQBoneManager::LINK_PARAM param;
+				bone_manager.GetLink(bone_id[i], param);
+				bone_param[i].link_id = param.link_bone_id;
+				bone_param[i].link_rate = int(param.rotate);
+			}
+			{
+				bone_manager.GetMovable(bone_id[i], bone_param[i].movable);
+			}
+			{
+				bone_manager.GetTipBone(bone_id[i], bone_param[i].tip_id);
+			}
+			if (bone_param[i].tip_id == 0)
+			{
+				bone_manager.GetTipName(bone_id[i], name);
+				bone_param[i].tip_name = bone_names.Intern(name);
+			}
+			if (bone_param[i].ikchain != -1)
+			{
+				bone_manager.GetIKName(bone_id[i], name, tip_name);
+				bone_param[i].ik_name = bone_names.Intern(name);
+				bone_param[i].ik_tip_name = bone_names.Intern(tip_name);
+			}
+			if (bone_param[i].ikchain != -1)
 			{
-				bone_param[i].ik_name_jp = (*it).jp;
-				bone_param[i].ik_name_en = (*it).en;
-				name_found = true;
-				break;
+				bone_manager.GetIKParent(bone_id[i], bone_param[i].ikparent, bone_param[i].ikparent_isik);
 			}
 		}
-		if (!name_found)
+	}
+
+	// モーフプラグインから必要な情報を取得
+	stats.Enter(PMX_PHASE_MORPH_QUERY);
+	PMXMorphTopology morph_topology;
+	morph_topology.Query(this, doc);
+	int morph_num = morph_topology.GetBaseCount();
+	int morph_target_size = morph_topology.GetTargetCount();
+	const std::vector<PMXMorphInputParam>& morph_intput_list = morph_topology.GetInputs();
+
+	// Show a dialog for converting axes
+	stats.Enter(PMX_PHASE_DIALOG);
+	// 座標軸変換用ダイアログの表示
+	float scaling = 1;
+	CreateDialogOptionParam option;
+	option.plugin = this;
+	option.doc = doc;
+	option.bone_manager = &bone_manager;
+	option.bone_param = &bone_param;
+	option.bone_names = &bone_names;
+	option.morph_topology = &morph_topology;
+	option.visible_only = false;
+	option.deploy_texture = false;
+	option.merge_material = false;
+	option.cleanup_mesh = false;
+	option.text_utf8 = false;
+	option.texture_atlas = false;
+	option.atlas_max_texture_size = 256;
+	option.stream_export = false;
+	option.update_morphs_only = false;
+	option.export_lod = false;
+	option.lod_levels = L"50, 25";
+	option.export_stats = false;
+	option.profile_host = profile_host;
+	option.bone_exists = (bone_num > 0);
+	option.facial_exists = (morph_num > 0);
+	option.output_bone = true;
+	option.output_ik_end = true;
+	option.output_facial = true;
+	option.morph_match = MORPH_MATCH_INDEX;
+	option.morph_match_radius = 0.01f;
+	option.modelname = getMultiBytesSubstring(MFileUtil::extractFileNameOnly(MString::fromAnsiString(filename)).toAnsiString(), 20);
+	option.comment = MAnsiString();
+	// Load a setting.
+	MQSetting* setting = OpenSetting();
+	if (setting != nullptr)
+	{//设置页面显示的
+		setting->Load("VisibleOnly", option.visible_only, option.visible_only);
+		setting->Load("DeployTexture", option.deploy_texture, option.deploy_texture);
+		setting->Load("MergeMaterial", option.merge_material, option.merge_material);
+		setting->Load("CleanupMesh", option.cleanup_mesh, option.cleanup_mesh);
+		setting->Load("TextUTF8", option.text_utf8, option.text_utf8);
+		setting->Load("TextureAtlas", option.texture_atlas, option.texture_atlas);
+		setting->Load("AtlasMaxTextureSize", option.atlas_max_texture_size, option.atlas_max_texture_size);
+		setting->Load("StreamExport", option.stream_export, option.stream_export);
+		setting->Load("UpdateMorphsOnly", option.update_morphs_only, option.update_morphs_only);
+		setting->Load("LOD", option.export_lod, option.export_lod);
+		setting->Load("LODLevels", option.lod_levels, option.lod_levels);
+		setting->Load("ExportStats", option.export_stats, option.export_stats);
+		setting->Load("ProfileHostCalls", option.profile_host, option.profile_host);
+		setting->Load("Bone", option.output_bone, option.output_bone);
+		setting->Load("IKEnd", option.output_ik_end, option.output_ik_end);
+		setting->Load("Facial", option.output_facial, option.output_facial);
+		setting->Load("MorphTolerance", option.morph_tolerance.value, option.morph_tolerance.value);
+		setting->Load("MorphToleranceRelative", option.morph_tolerance.relative, option.morph_tolerance.relative);
+		setting->Load("MorphMatch", option.morph_match, option.morph_match);
+		setting->Load("MorphMatchRadius", option.morph_match_radius, option.morph_match_radius);
+	}
+	MQFileDialogInfo dlginfo;
+	memset(&dlginfo, 0, sizeof(dlginfo));
+	dlginfo.dwSize = sizeof(dlginfo);
+	dlginfo.scale = scaling;
+	dlginfo.hidden_flag = MQFileDialogInfo::HIDDEN_AXIS | MQFileDialogInfo::HIDDEN_INVERT_FACE;
+	dlginfo.axis_x = MQFILE_TYPE_RIGHT;
+	dlginfo.axis_y = MQFILE_TYPE_UP;
+	dlginfo.axis_z = MQFILE_TYPE_FRONT;
+	dlginfo.softname = "";
+	dlginfo.dialog_callback = CreateDialogOption;
+	dlginfo.dialog_callback_ptr = &option;
+	MQ_ShowFileDialog("PMX Export", &dlginfo);
+
+	// Save a setting.
+	scaling = dlginfo.scale;
+	if (setting != nullptr)
+	{
+		setting->Save("VisibleOnly", option.visible_only);
+		setting->Save("DeployTexture", option.deploy_texture);
+		setting->Save("MergeMaterial", option.merge_material);
+		setting->Save("CleanupMesh", option.cleanup_mesh);
+		setting->Save("TextUTF8", option.text_utf8);
+		setting->Save("TextureAtlas", option.texture_atlas);
+		setting->Save("AtlasMaxTextureSize", option.atlas_max_texture_size);
+		setting->Save("StreamExport", option.stream_export);
+		setting->Save("UpdateMorphsOnly", option.update_morphs_only);
+		setting->Save("LOD", option.export_lod);
+		setting->Save("LODLevels", option.lod_levels);
+		setting->Save("ExportStats", option.export_stats);
+		setting->Save("ProfileHostCalls", option.profile_host);
+		setting->Save("Bone", option.output_bone);
+		setting->Save("IKEnd", option.output_ik_end);
+		setting->Save("Facial", option.output_facial);
+		setting->Save("MorphTolerance", option.morph_tolerance.value);
+		setting->Save("MorphToleranceRelative", option.morph_tolerance.relative);
+		setting->Save("MorphMatch", option.morph_match);
+		setting->Save("MorphMatchRadius", option.morph_match_radius);
+		CloseSetting(setting);
+	}
+	if (option.profile_host != host_profile.IsEnabled())
+	{
+		// 分析のフックは計測のフックの下に付け外しする。フックは付けた逆の順に外す
+		stats.RemoveHook();
+		host_profile.Enable(option.profile_host);
+		stats.InstallHook();
+	}
+
+	if (!option.output_bone)
+	{
+		bone_num = 0;
+		bone_id.clear();
+		bone_param.clear();
+	}
+
+	bool isOutputFacial = option.output_facial;
+	if (!isOutputFacial)
+	{
+		morph_num = 0;
+		morph_target_size = 0;
+	}
+
+	auto writeReports = [&]()
+	{
+		// 計測のフックは分析のフックより後に付けたので先に外す
+		stats.Finish();
+		if (host_profile.IsEnabled())
+		{
+			host_profile.Enable(false);
+			LOG(PMXHostProfiler::GetReport(10).c_str());
+			PMXHostProfiler::WriteReport(MFileUtil::changeExtension(MString::fromAnsiString(filename), L".hostcalls.txt"), 100);
+		}
+
+		LOG(stats.GetSummary().c_str());
+		if (option.export_stats)
+		{
+			stats.WriteJson(MFileUtil::changeExtension(MString::fromAnsiString(filename), L".stats.json"));
+		}
+	};
+
+	// 既存のファイルのモーフ以降だけを書き直す。頂点か面が変わっていれば全体を書き出す
+	if (option.update_morphs_only && isOutputFacial && morph_num > 0)
+	{
+		stats.Enter(PMX_PHASE_MORPH);
+		MString message;
+		PMXMorphUpdateResult update = UpdatePMXMorphs(filename, doc, option, morph_topology, scaling, message);
+		LOG(message.c_str());
+		if (update == PMX_MORPH_UPDATED)
+		{
+			writeReports();
+			return TRUE;
+		}
+		if (update == PMX_MORPH_UPDATE_FAILED)
+		{
+			MQWindow mainwin = MQWindow::GetMainWindow();
+			MQDialog::MessageWarningBox(mainwin, L"表情更新失败，PMX文件未被修改", L"导出错误");
+			return FALSE;
+		}
+	}
+
+	stats.Enter(PMX_PHASE_EXPORT_OBJECT);
+	int numObj = doc->GetObjectCount();
+	int numMat = doc->GetMaterialCount();
+
+	// 進捗の表示。キャンセルされたら書きかけのファイルを残さずに終了する
+	PMXExportProgress progress;
+	// 準備ではVERTEX以外の段階と表情の読み込みを順に通り(逐次出力では面を書き出し時にまとめるのでTRIANGULATEも通らない)、
+	// 書き出しではVERTEXからWRITEまでを順に通る
+	int prepare_stages = (PMX_PHASE_WRITE - PMX_PHASE_EXPORT_OBJECT + 1) - 1 - (option.stream_export ? 1 : 0) + 1;
+	int write_stages = PMX_PHASE_WRITE - PMX_PHASE_VERTEX + 1;
+	progress.Show(prepare_stages + write_stages);
+	progress.Enter(PMX_PHASE_EXPORT_OBJECT, numObj);
+
+	// 頂点をひとまとめにする（単一オブジェクトしか扱えないので）
+	std::vector<MQExportObject*> expobjs(numObj, nullptr);
+	std::vector<std::vector<int>> orgvert_vert(numObj);
+	std::vector<int> vert_orgobj;
+	std::vector<int> vert_expvert;
+	std::vector<MQPoint> vert_normal;
+	std::vector<MQCoordinate> vert_coord;
+	int total_vert_num = 0;
+
+	// 相対許容誤差用のモデル範囲
+	bool need_bounds = isOutputFacial && morph_num > 0 && option.morph_tolerance.relative;
+	MQPoint bounds_min(FLT_MAX, FLT_MAX, FLT_MAX);
+	MQPoint bounds_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	MQExportObject::MSeparateParam separate;
+	separate.SeparateNormal = true;
+	separate.SeparateUV = true;
+	separate.SeparateVertexColor = false;
+	PMXLayoutFingerprint layout;
+	// 宿主のデータをここで写し取り、面の三角形化と頂点の書き出しは宿主を呼ばずに行う
+	std::vector<PMXObjectSnapshot> snapshots(numObj);
+	MQBoneManager* weight_source = (bone_num > 0) ? &bone_manager : nullptr;
+	for (int oi = 0; oi < numObj && progress.Step(oi); oi++)
+	{
+		MQObject org_obj = doc->GetObject(oi);
+		if (org_obj == nullptr)
+			continue;
+
+		if (option.visible_only && org_obj->GetVisible() == 0)
+			continue;
+
+		// 逐次出力では頂点を書き出すときに作る。モーフのベースは抽出に使うので残す
+		MQExportObject* eobj = nullptr;
+		if (!option.stream_export || (isOutputFacial && morph_topology.GetRole(oi) == MORPH_ROLE_BASE))
 		{
-			bone_param[i].ik_name_jp = bone_param[i].ik_name;
-			bone_param[i].ik_name_en = bone_param[i].ik_name;
+			eobj = new MQExportObject(org_obj, separate, &arena);
+			expobjs[oi] = eobj;
 		}
-		name_found = false;
-		for (auto it = m_BoneNameSetting.begin(); it != m_BoneNameSetting.end(); ++it)
+
+		// ターゲットオブジェクトは飛ばす
+		if (isOutputFacial && morph_topology.IsTarget(oi))
+			continue;
+
+		PMXObjectSnapshot& snapshot = snapshots[oi];
+		if (option.stream_export)
 		{
-			if ((*it).jp == bone_param[i].ik_tip_name || (*it).en == bone_param[i].ik_tip_name)
+			// 逐次出力では頂点を書き出すときに写し取る
+			if (need_bounds)
 			{
-				bone_param[i].ik_tip_name_jp = (*it).jp;
-				bone_param[i].ik_tip_name_en = (*it).en;
-				name_found = true;
-				break;
+				snapshot.Take(org_obj, nullptr);
+				AddObjectBounds(snapshot.positions, bounds_min, bounds_max);
+				snapshot.Clear();
 			}
+			continue;
+		}
+
+		snapshot.Take(org_obj, weight_source);
+		if (need_bounds)
+		{
+			AddObjectBounds(snapshot.positions, bounds_min, bounds_max);
+		}
+		layout.AddObject(snapshot, eobj);
+		int vert_num = eobj->GetVertexCount();
+		orgvert_vert[oi].resize(vert_num, -1);
+		for (int evi = 0; evi < vert_num; evi++)
+		{
+			orgvert_vert[oi][evi] = total_vert_num;
+
+			vert_orgobj.push_back(oi);
+			vert_expvert.push_back(evi);
+
+			MQPoint nrm = eobj->GetVertexNormal(evi);
+			MQCoordinate uv = eobj->GetVertexCoordinate(evi);
+
+			vert_normal.push_back(nrm);
+			vert_coord.push_back(uv);
+			total_vert_num++;
 		}
-		if (!name_found)
+	}
+
+	auto deleteExportObjects = [&]()
+	{
+		for (size_t i = 0; i < expobjs.size(); i++)
 		{
-			bone_param[i].ik_tip_name_jp = bone_param[i].ik_tip_name;
-			bone_param[i].ik_tip_name_en = bone_param[i].ik_tip_name;
+			delete expobjs[i];
 		}
+	};
+	if (progress.IsCanceled())
+	{
+		deleteExportObjects();
+		return FALSE;
 	}
-	// モーフ用情報収集
-	std::vector<PMXMorphParam> morph_param_list;
-	if (morph_target_size != 0)
-		morph_param_list.resize(morph_target_size + 1);
 
-	// ベースオブジェクト情報
-	PMXMorphParam* morph_base_param = nullptr;
+	stats.Enter(PMX_PHASE_MATERIAL);
+	progress.Enter(PMX_PHASE_MATERIAL);
+	std::vector<int> material_used;
+	DWORD face_vert_count = CountMaterialTriangles(doc, option.visible_only, isOutputFacial ? &morph_topology : nullptr, material_used);
+
+	// Matrial list
+	std::vector<PMXMaterialParam> materials;
+	PMXTextureTable textures;
+	SnapshotMaterials(doc, material_used, materials, textures);
+
+	// 小さいテクスチャをアトラスにまとめる
+	// 全オブジェクトのUVを書き換えるので、逐次出力では行わない
+	std::vector<MString> atlas_files;
+	// 書き出しを中断したら保存済みのアトラスも消す
+	auto removeAtlasFiles = [&]()
 	{
-		if (!morph_intput_list.empty())
+		for (const MString& file : atlas_files)
 		{
-			morph_base_param = &morph_param_list.front();
-			strcpy_s(morph_base_param->skin_name, "base");
-			morph_base_param->type = MORPH_BASE;
-			morph_base_param->vertNum = 0;
+			DeleteFileW(file.c_str());
 		}
+		atlas_files.clear();
+	};
+	if (option.texture_atlas && option.stream_export)
+	{
+		LOG(L"Texture atlas is skipped in the low memory mode");
+		option.texture_atlas = false;
+	}
+	if (option.texture_atlas)
+	{
+		PMXAtlasParam atlas_param;
+		atlas_param.max_texture_size = option.atlas_max_texture_size;
+		MQImageLoader loader;
+		MString output_base = MFileUtil::changeExtension(MString::fromAnsiString(filename), L"");
+		int packed = ApplyTextureAtlas(doc, expobjs, orgvert_vert, numMat, loader, atlas_param, output_base, materials, textures, vert_coord, atlas_files);
+		LOG(MString::format(L"%d texture(s) packed into atlases", packed).c_str());
 	}
+	if (option.merge_material || option.texture_atlas)
+	{
+		int used_num = static_cast<int>(materials.size());
+		MergeEquivalentMaterials(materials);
+		LOG(MString::format(L"Materials: %d -> %d", used_num, static_cast<int>(materials.size())).c_str());
+		stats.SetCount("materials_before_merge", used_num);
+	}
+	stats.SetCount("materials", static_cast<int>(materials.size()));
+	std::vector<int> material_slot;
+	GetMaterialSlots(materials, numMat, material_slot);
 
-	// ターゲットオブジェクト情報
+	// 表情の頂点位置を読む。差分の抽出は書き出しのスレッドで行う
+	stats.Enter(PMX_PHASE_MORPH_QUERY);
+	progress.Enter(PMX_PHASE_MORPH_QUERY, morph_num);
+	std::vector<PMXMorphParam> morph_param_list;
+	std::vector<PMXMorphPositions> morph_positions;
 	if (isOutputFacial && morph_num > 0)
 	{
-		size_t totalIdx = 1;
-		auto bBegin = morph_intput_list.begin();
-		auto bEnd = morph_intput_list.end();
-		auto tBegin = morph_intput_list.front().target.begin();
-		auto tEnd = morph_intput_list.front().target.end();
-		for (auto bIte = bBegin; bIte != bEnd; ++bIte)
-		{
-			tBegin = bIte->target.begin();
-			tEnd = bIte->target.end();
-
-			for (auto tIte = tBegin; tIte != tEnd; ++tIte)
-			{
-				PMXMorphParam* mParam = &morph_param_list.at(totalIdx++);
-				tIte->first->GetName(mParam->skin_name, 20);
-				mParam->type = tIte->second;
-				mParam->vertNum = 0;
-			}
-		}
+		// ターゲットオブジェクト情報
+		morph_param_list.reserve(morph_target_size);
+		GetMorphParams(morph_intput_list, morph_param_list);
+		ReadMorphPositions(morph_intput_list, doc, morph_positions, [&](int done) { return progress.Step(done); });
+	}
+	if (progress.IsCanceled())
+	{
+		deleteExportObjects();
+		removeAtlasFiles();
+		return FALSE;
 	}
 
-	// モーフの頂点情報
-	std::vector<DWORD> morph_base_vertex_index_list;
-	if (isOutputFacial && morph_num > 0)
+	// 残りは宿主を呼ばないので書き出しのスレッドで行い、その間このスレッドは進捗の窓を動かす。
+	// 逐次出力でオブジェクトを宿主から読むところだけはこのスレッドで行う
+	auto writeModel = [&]() -> bool
 	{
-		auto end = morph_intput_list.end();
-		auto targetList = morph_target_list.front();
-		auto targetIndexList = morph_target_index_list.front();
-		for (auto ite = morph_intput_list.begin(); ite != end; ++ite)
+		// 面を三角形にして材質ごとに並べる。退化した三角形を除き、使われない頂点を詰める
+		// 逐次出力ではオブジェクトごとに頂点を書き出すときに行う
+		std::vector<std::vector<int>> slot_tvi(materials.size());
+		std::vector<BYTE> vert_used;
+		std::vector<int> vert_remap;
+		int removed_face_num = 0;
+		int removed_vert_num = 0;
+		int output_vert_num = 0;
+		if (!option.stream_export)
 		{
-			bool isWriteBase = false;
-
-			size_t paramIdx = distance(morph_intput_list.begin(), ite);
-
-			MQObject base = ite->base;
-			size_t baseIdx = doc->GetObjectIndex(base);
-			if (expobjs[baseIdx] == nullptr)
-				continue;
-			int baseVertSize = expobjs[baseIdx]->GetVertexCount();
-
-			for (int i = 0; i < baseVertSize; ++i)
+			stats.Enter(PMX_PHASE_TRIANGULATE);
+			progress.Enter(PMX_PHASE_TRIANGULATE, numObj);
+			vert_used.assign(total_vert_num, option.cleanup_mesh ? 0 : 1);
+			for (int oi = 0; oi < numObj && progress.Step(oi); oi++)
 			{
-				int baseExpIdx = orgvert_vert.at(baseIdx).at(i);
-				int baseOrgIdx = expobjs[baseIdx]->GetOriginalVertex(i);
-				MQPoint basePos = base->GetVertex(baseOrgIdx);
+				// ターゲットと頂点のないオブジェクトは飛ばす
+				if (orgvert_vert[oi].empty())
+					continue;
 
-				auto tList = &ite->target;
-				auto tEnd = tList->end();
-				for (auto tIte = tList->begin(); tIte != tEnd; ++tIte)
+				int vert_offset = orgvert_vert[oi][0];
+				removed_face_num += TriangulateObjectFaces(snapshots[oi], expobjs[oi], numMat, option.cleanup_mesh, [&](int mi, const int* tvi)
 				{
-					MQObject target = tIte->first;
-					MQPoint targetPos = target->GetVertex(baseOrgIdx);
-					if (!MQPointFuzzyEqual(basePos, targetPos))
+					int m = material_slot[mi];
+					if (m < 0)
+						return;
+					for (int j = 0; j < 3; j++)
 					{
-						isWriteBase = true;
-
-						targetList = morph_target_list.at(paramIdx);
-						targetIndexList = morph_target_index_list.at(paramIdx);
-						PMXMorphParam* param = &morph_param_list.at(targetIndexList.at(distance(targetList.begin(), find(targetList.begin(), targetList.end(), target))));
-						param->vertex.push_back(std::make_pair(baseExpIdx, targetPos - basePos));
-						++param->vertNum;
+						slot_tvi[m].push_back(vert_offset + tvi[j]);
+						vert_used[vert_offset + tvi[j]] = 1;
 					}
-				}
-
-				if (isWriteBase)
-				{
-					morph_base_param->vertex.push_back(std::make_pair(baseExpIdx, basePos));
-					morph_base_vertex_index_list.push_back(baseExpIdx);
-					++morph_base_param->vertNum;
-				}
-			}
-		}
-	}
-
-	// Open a file.
-	FILE* fh;
-	errno_t err = fopen_s(&fh, filename, "wb");
-	//errno_t err = fopen_s(&fh, filename, "w");
-	if (err != 0)
-	{
-		for (size_t i = 0; i < expobjs.size(); i++)
-		{
-			delete expobjs[i];
-		}
-		return FALSE;
-	}
-
-	// Header
-	float version = 2.0f;
-	char magic[4] = {0x50 ,0x4d ,0x58 ,0x20};
-	fwrite(magic, 1, 4, fh);
-	//fprintf(fh,"PMX\n");
-	fwrite(reinterpret_cast<char*>(&version), sizeof(float), 1, fh);
-	byte Header[9] = {8,0,0,4,1,1,1,1,1};
-	fwrite(&Header, sizeof(byte), 9, fh);
-	//fprintf(fh,"%f\n",version);
-
-	oguna::EncodingConverter converter = oguna::EncodingConverter();
-	std::wstring RES;
-	int Len = converter.Cp936ToUtf16(option.modelname, option.modelname.length(), &RES) * 2;
-	fwrite(&Len, sizeof(int), 1, fh);
-	fwrite(RES.c_str(), Len, 1, fh);
-	Len = converter.Cp936ToUtf16(option.modelname, option.comment.length(), &RES) * 2;
-	fwrite(&Len, sizeof(int), 1, fh);
-	fwrite(RES.c_str(), Len, 1, fh);
-	Len = 0;
-	fwrite(&Len, sizeof(int), 1, fh);
-	fwrite(&Len, sizeof(int), 1, fh);
-
-	int dw_vert_num = total_vert_num;
-	fwrite(&dw_vert_num, 4, 1, fh);
-	for (int i = 0; i < total_vert_num; i++)
-	{
-		float pos[3];
-		float nrm[3];
-		float uv[2];
-		byte bone_index[4]; // ボーン番号1、番号2 // モデル変形(頂点移動)時に影響
-		float bone_weight; // ボーン1に与える影響度 // min:0 max:100 // ボーン2への影響度は、(100 - bone_weight)
-		float edge_flag; // 0:通常、1:エッジ無効 // エッジ(輪郭)が有効の場合
-
-		MQObject obj = doc->GetObject(vert_orgobj[i]);
-		MQExportObject* eobj = expobjs[vert_orgobj[i]];
-		MQPoint v = obj->GetVertex(eobj->GetOriginalVertex(vert_expvert[i]));
-		pos[0] = v.x * scaling;
-		pos[1] = v.y * scaling;
-		pos[2] = -v.z * scaling;
-		fwrite(pos, 4, 3, fh);
-
-		nrm[0] = vert_normal[i].x;
-		nrm[1] = vert_normal[i].y;
-		nrm[2] = -vert_normal[i].z;
-		fwrite(nrm, 4, 3, fh);
-
-		uv[0] = vert_coord[i].u;
-		uv[1] = vert_coord[i].v;
-		fwrite(uv, 4, 2, fh);
-
-		UINT vert_bone_id[16];
-		float weights[16];
-		int weight_num = 0;
-
-		if (bone_num > 0)
-		{
-			UINT vert_id = obj->GetVertexUniqueID(eobj->GetOriginalVertex(vert_expvert[i]));
-			int max_num = 16;
-			weight_num = bone_manager.GetVertexWeightArray(obj, vert_id, max_num, vert_bone_id, weights);
-		}
-		if (weight_num == 4)
-		{
-			int max_bone1 = bone_id_index[vert_bone_id[0]];
-			int max_bone2 = bone_id_index[vert_bone_id[1]];
-			int max_bone3 = bone_id_index[vert_bone_id[2]];
-			int max_bone4 = bone_id_index[vert_bone_id[3]];
-			if (bone_param[max_bone1].parent != 0)
-			{
-				bone_index[0] = bone_param[bone_id_index[bone_param[max_bone1].parent]].PMX_tip_index;
-			}
-			else
-			{
-				bone_index[0] = bone_param[max_bone1].PMX_root_index;
-			}
-			if (bone_param[max_bone2].parent != 0)
-			{
-				bone_index[1] = bone_param[bone_id_index[bone_param[max_bone2].parent]].PMX_tip_index;
-			}
-			else
-			{
-				bone_index[1] = bone_param[max_bone2].PMX_root_index;
+				});
 			}
-			if (bone_param[max_bone3].parent != 0)
+			output_vert_num = CompactVertices(vert_used, vert_remap);
+			removed_vert_num = total_vert_num - output_vert_num;
+			for (size_t m = 0; m < slot_tvi.size(); m++)
 			{
-				bone_index[2] = bone_param[bone_id_index[bone_param[max_bone3].parent]].PMX_tip_index;
+				for (int& v : slot_tvi[m])
+				{
+					v = vert_remap[v];
+				}
 			}
-			else
+			for (int oi = 0; oi < numObj; oi++)
 			{
-				bone_index[2] = bone_param[max_bone3].PMX_root_index;
+				for (int& v : orgvert_vert[oi])
+				{
+					v = vert_remap[v];
+				}
 			}
-			if (bone_param[max_bone4].parent != 0)
+			face_vert_count = 0;
+			for (size_t m = 0; m < materials.size(); m++)
 			{
-				bone_index[3] = bone_param[bone_id_index[bone_param[max_bone4].parent]].PMX_tip_index;
+				materials[m].face_count = static_cast<int>(slot_tvi[m].size() / 3);
+				face_vert_count += static_cast<DWORD>(slot_tvi[m].size());
 			}
-			else
+			if (progress.IsCanceled())
 			{
-				bone_index[3] = bone_param[max_bone4].PMX_root_index;
+				deleteExportObjects();
+				removeAtlasFiles();
+				return false;
 			}
-			int type = 2;
-			fwrite(&type, sizeof(byte), 1, fh);
-			fwrite(bone_index, 1, 4, fh);
-			float total_weights = weights[0] + weights[1] + weights[2] + weights[3];
-			float bone_weight1 = floor(weights[0] / total_weights * 100.f + 0.5f) / 100;
-			fwrite(&bone_weight1, sizeof(float), 1, fh);
-			float bone_weight2 = floor(weights[1] / total_weights * 100.f + 0.5f) / 100;
-			fwrite(&bone_weight2, sizeof(float), 1, fh);
-			float bone_weight3 = floor(weights[2] / total_weights * 100.f + 0.5f) / 100;
-			fwrite(&bone_weight3, sizeof(float), 1, fh);
-			float bone_weight4 = 1 - bone_weight1 - bone_weight2 - bone_weight3;
-			fwrite(&bone_weight4, sizeof(float), 1, fh);
-		}
-		else if (weight_num == 3)
-		{
-			int max_bone1 = bone_id_index[vert_bone_id[0]];
-			int max_bone2 = bone_id_index[vert_bone_id[1]];
-			int max_bone3 = bone_id_index[vert_bone_id[2]];
-			if (bone_param[max_bone1].parent != 0)
+		}
+
+		stats.Enter(PMX_PHASE_BONE);
+		progress.Enter(PMX_PHASE_BONE);
+		std::map<UINT, int> bone_id_index;
+		std::vector<int> ik_chain_end_list;
+		int PMXbone_num = AssignPMXBoneIndices(bone_param, bone_id_index, option.output_ik_end, ik_chain_end_list);
+		{
+			// 設定ファイルの名前を一度だけ登録して、ボーンごとにはハンドルで引く。
+			// Entries are added from the back so that the first matching entry wins.
+			std::unordered_map<PMXStringPool::Handle, std::pair<PMXStringPool::Handle, PMXStringPool::Handle>> name_setting;
+			for (size_t k = m_BoneNameSetting.size(); k-- > 0;)
 			{
-				bone_index[0] = bone_param[bone_id_index[bone_param[max_bone1].parent]].PMX_tip_index;
+				PMXStringPool::Handle jp = bone_names.Intern(m_BoneNameSetting[k].jp);
+				PMXStringPool::Handle en = bone_names.Intern(m_BoneNameSetting[k].en);
+				name_setting[en] = std::make_pair(jp, en);
+				name_setting[jp] = std::make_pair(jp, en);
 			}
-			else
+			auto translate = [&](PMXStringPool::Handle name, PMXStringPool::Handle& name_jp, PMXStringPool::Handle& name_en)
 			{
-				bone_index[0] = bone_param[max_bone1].PMX_root_index;
-			}
-			if (bone_param[max_bone2].parent != 0)
+				auto it = name_setting.find(name);
+				if (it != name_setting.end())
+				{
+					name_jp = it->second.first;
+					name_en = it->second.second;
+				}
+				else
+				{
+					name_jp = name;
+					name_en = name;
+				}
+			};
+			for (int i = 0; i < bone_num; i++)
 			{
-				bone_index[1] = bone_param[bone_id_index[bone_param[max_bone2].parent]].PMX_tip_index;
+				translate(bone_param[i].name, bone_param[i].name_jp, bone_param[i].name_en);
+				translate(bone_param[i].tip_name, bone_param[i].tip_name_jp, bone_param[i].tip_name_en);
+				translate(bone_param[i].ik_name, bone_param[i].ik_name_jp, bone_param[i].ik_name_en);
+				translate(bone_param[i].ik_tip_name, bone_param[i].ik_tip_name_jp, bone_param[i].ik_tip_name_en);
 			}
-			else
+		}
+		// モーフ用情報収集
+		// 逐次出力ではベースの頂点番号が書き出すときに決まるので、面の後で抽出する
+		PMXMorphBlock morph_block;
+		auto extractMorphs = [&]() -> bool
+		{
+			stats.Enter(PMX_PHASE_MORPH);
+			progress.Enter(PMX_PHASE_MORPH, morph_num);
+			if (!isOutputFacial || morph_num == 0)
+				return true;
+			int group_num = ExtractMorphs(option, morph_positions, expobjs, orgvert_vert, bounds_min, bounds_max, morph_param_list, morph_block,
+				[&](int done) { return progress.Step(done); });
+			if (group_num > 0)
 			{
-				bone_index[1] = bone_param[max_bone2].PMX_root_index;
+				LOG(MString::format(L"%d morph(s) written as group morphs", group_num).c_str());
 			}
-			if (bone_param[max_bone3].parent != 0)
+			return group_num >= 0;
+		};
+		if (!option.stream_export && !extractMorphs())
+		{
+			deleteExportObjects();
+			removeAtlasFiles();
+			return false;
+		}
+
+		// Open a file.
+		// 一時ファイルに書き込み、完了してから置き換える
+		stats.Enter(PMX_PHASE_WRITE);
+		if (!progress.Enter(PMX_PHASE_WRITE))
+		{
+			deleteExportObjects();
+			removeAtlasFiles();
+			return false;
+		}
+		std::string temp_filename = std::string(filename) + ".tmp";
+		FILE* fh;
+		errno_t err = fopen_s(&fh, temp_filename.c_str(), "wb");
+		//errno_t err = fopen_s(&fh, filename, "w");
+		if (err != 0)
+		{
+			deleteExportObjects();
+			removeAtlasFiles();
+			return false;
+		}
+		stats.SetFile(fh);
+		// 逐次出力の面の一時ファイル
+		std::string face_filename = temp_filename + ".faces";
+		FILE* face_fh = nullptr;
+		auto abortFile = [&]()
+		{
+			stats.SetFile(nullptr);
+			fclose(fh);
+			remove(temp_filename.c_str());
+			if (face_fh != nullptr)
 			{
-				bone_index[2] = bone_param[bone_id_index[bone_param[max_bone3].parent]].PMX_tip_index;
+				fclose(face_fh);
+				remove(face_filename.c_str());
 			}
-			else
+			deleteExportObjects();
+			removeAtlasFiles();
+		};
+
+		// Header
+		float version = 2.0f;
+		char magic[4] = {0x50 ,0x4d ,0x58 ,0x20};
+		fwrite(magic, 1, 4, fh);
+		//fprintf(fh,"PMX\n");
+		fwrite(reinterpret_cast<char*>(&version), sizeof(float), 1, fh);
+		byte morph_index_size = GetMorphIndexSize(morph_param_list.size());
+		byte bone_index_size = GetBoneIndexSize(PMXbone_num);
+		byte text_encoding = option.text_utf8 ? PMX_TEXT_UTF8 : PMX_TEXT_UTF16;
+		byte Header[9] = {8,text_encoding,0,4,1,1,bone_index_size,morph_index_size,1};
+		fwrite(&Header, sizeof(byte), 9, fh);
+		//fprintf(fh,"%f\n",version);
+
+		PMXTextWriter text(fh, text_encoding);
+		text.Write(option.modelname);
+		text.Write(option.comment);
+		text.WriteEmpty();
+		// 英語のコメントに頂点と面の指紋を残し、モーフだけの更新で照合する。値は面の後で書き直す
+		__int64 layout_pos = _ftelli64(fh);
+		MString layout_text = PMXLayoutFingerprint::Format(0);
+		text.Write(layout_text.c_str(), layout_text.length());
+		int Len;
+
+		auto writeVertex = [&](const PMXObjectSnapshot& snapshot, MQExportObject* eobj, int evi, const MQPoint& normal, const MQCoordinate& coord)
+		{
+			float pos[3];
+			float nrm[3];
+			float uv[2];
+			int bone_index[4]; // ボーン番号1、番号2 // モデル変形(頂点移動)時に影響
+			float bone_weight; // ボーン1に与える影響度 // min:0 max:100 // ボーン2への影響度は、(100 - bone_weight)
+			float edge_flag; // 0:通常、1:エッジ無効 // エッジ(輪郭)が有効の場合
+
+			int org_vi = eobj->GetOriginalVertex(evi);
+			MQPoint v = snapshot.positions[org_vi];
+			pos[0] = v.x * scaling;
+			pos[1] = v.y * scaling;
+			pos[2] = -v.z * scaling;
+			fwrite(pos, 4, 3, fh);
+
+			nrm[0] = normal.x;
+			nrm[1] = normal.y;
+			nrm[2] = -normal.z;
+			fwrite(nrm, 4, 3, fh);
+
+			uv[0] = coord.u;
+			uv[1] = coord.v;
+			fwrite(uv, 4, 2, fh);
+
+			const UINT* vert_bone_id = nullptr;
+			const float* weights = nullptr;
+			int weight_num = 0;
+
+			if (bone_num > 0)
 			{
-				bone_index[2] = bone_param[max_bone3].PMX_root_index;
+				const PMXVertexWeights& w = snapshot.weights[org_vi];
+				vert_bone_id = w.bone;
+				weights = w.weight;
+				weight_num = w.count;
 			}
-			int type = 2;
-			fwrite(&type, sizeof(byte), 1, fh);
-			fwrite(bone_index, 1, 4, fh);
-			float total_weights = weights[0] + weights[1] + weights[2];
-			float bone_weight1 = floor(weights[0] / total_weights * 100.f + 0.5f) / 100;
-			fwrite(&bone_weight1, sizeof(float), 1, fh);
-			float bone_weight2 = floor(weights[1] / total_weights * 100.f + 0.5f) / 100;
-			fwrite(&bone_weight2, sizeof(float), 1, fh);
-			float bone_weight3 = 1 - bone_weight1 - bone_weight2;
-			fwrite(&bone_weight3, sizeof(float), 1, fh);
-			float bone_weight4 = 0;
-			fwrite(&bone_weight4, sizeof(float), 1, fh);
-		}
-		else if (weight_num == 2)
-		{
-			int max_bone1 = -1;
-			float max_weight1 = 0.0f;
-			for (int n = 0; n < weight_num; n++)
+			if (weight_num == 4)
 			{
-				if (max_weight1 < weights[n])
+				int max_bone1 = bone_id_index[vert_bone_id[0]];
+				int max_bone2 = bone_id_index[vert_bone_id[1]];
+				int max_bone3 = bone_id_index[vert_bone_id[2]];
+				int max_bone4 = bone_id_index[vert_bone_id[3]];
+				if (bone_param[max_bone1].parent != 0)
 				{
-					max_weight1 = weights[n];
-					max_bone1 = n;
+					bone_index[0] = bone_param[bone_id_index[bone_param[max_bone1].parent]].PMX_tip_index;
 				}
-			}
-			int max_bone2 = -1;
-			float max_weight2 = 0.0f;
-			for (int n = 0; n < weight_num; n++)
-			{
-				if (n == max_bone1) continue;
-				if (max_weight2 < weights[n])
+				else
 				{
-					max_weight2 = weights[n];
-					max_bone2 = n;
+					bone_index[0] = bone_param[max_bone1].PMX_root_index;
 				}
+				if (bone_param[max_bone2].parent != 0)
+				{
+					bone_index[1] = bone_param[bone_id_index[bone_param[max_bone2].parent]].PMX_tip_index;
+				}
+				else
+				{
+					bone_index[1] = bone_param[max_bone2].PMX_root_index;
+				}
+				if (bone_param[max_bone3].parent != 0)
+				{
+					bone_index[2] = bone_param[bone_id_index[bone_param[max_bone3].parent]].PMX_tip_index;
+				}
+				else
+				{
+					bone_index[2] = bone_param[max_bone3].PMX_root_index;
+				}
+				if (bone_param[max_bone4].parent != 0)
+				{
+					bone_index[3] = bone_param[bone_id_index[bone_param[max_bone4].parent]].PMX_tip_index;
+				}
+				else
+				{
+					bone_index[3] = bone_param[max_bone4].PMX_root_index;
+				}
+				int type = 2;
+				fwrite(&type, sizeof(byte), 1, fh);
+				for (int k = 0; k < 4; k++)
+				{
+					WritePMXIndex(fh, bone_index[k], bone_index_size);
+				}
+				float total_weights = weights[0] + weights[1] + weights[2] + weights[3];
+				float bone_weight1 = floor(weights[0] / total_weights * 100.f + 0.5f) / 100;
+				fwrite(&bone_weight1, sizeof(float), 1, fh);
+				float bone_weight2 = floor(weights[1] / total_weights * 100.f + 0.5f) / 100;
+				fwrite(&bone_weight2, sizeof(float), 1, fh);
+				float bone_weight3 = floor(weights[2] / total_weights * 100.f + 0.5f) / 100;
+				fwrite(&bone_weight3, sizeof(float), 1, fh);
+				float bone_weight4 = 1 - bone_weight1 - bone_weight2 - bone_weight3;
+				fwrite(&bone_weight4, sizeof(float), 1, fh);
 			}
-			float total_weights = max_weight1 + max_weight2;
-			int bi1 = bone_id_index[vert_bone_id[max_bone1]];
-			int bi2 = bone_id_index[vert_bone_id[max_bone2]];
-			if (bone_param[bi1].parent != 0)
-			{
-				bone_index[0] = bone_param[bone_id_index[bone_param[bi1].parent]].PMX_tip_index;
-			}
-			else
-			{
-				bone_index[0] = bone_param[bi1].PMX_root_index;
-			}
-			if (bone_param[bi2].parent != 0)
+			else if (weight_num == 3)
 			{
-				bone_index[1] = bone_param[bone_id_index[bone_param[bi2].parent]].PMX_tip_index;
+				int max_bone1 = bone_id_index[vert_bone_id[0]];
+				int max_bone2 = bone_id_index[vert_bone_id[1]];
+				int max_bone3 = bone_id_index[vert_bone_id[2]];
+				if (bone_param[max_bone1].parent != 0)
+				{
+					bone_index[0] = bone_param[bone_id_index[bone_param[max_bone1].parent]].PMX_tip_index;
+				}
+				else
+				{
+					bone_index[0] = bone_param[max_bone1].PMX_root_index;
+				}
+				if (bone_param[max_bone2].parent != 0)
+				{
+					bone_index[1] = bone_param[bone_id_index[bone_param[max_bone2].parent]].PMX_tip_index;
+				}
+				else
+				{
+					bone_index[1] = bone_param[max_bone2].PMX_root_index;
+				}
+				if (bone_param[max_bone3].parent != 0)
+				{
+					bone_index[2] = bone_param[bone_id_index[bone_param[max_bone3].parent]].PMX_tip_index;
+				}
+				else
+				{
+					bone_index[2] = bone_param[max_bone3].PMX_root_index;
+				}
+				int type = 2;
+				fwrite(&type, sizeof(byte), 1, fh);
+				for (int k = 0; k < 4; k++)
+				{
+					WritePMXIndex(fh, bone_index[k], bone_index_size);
+				}
+				float total_weights = weights[0] + weights[1] + weights[2];
+				float bone_weight1 = floor(weights[0] / total_weights * 100.f + 0.5f) / 100;
+				fwrite(&bone_weight1, sizeof(float), 1, fh);
+				float bone_weight2 = floor(weights[1] / total_weights * 100.f + 0.5f) / 100;
+				fwrite(&bone_weight2, sizeof(float), 1, fh);
+				float bone_weight3 = 1 - bone_weight1 - bone_weight2;
+				fwrite(&bone_weight3, sizeof(float), 1, fh);
+				float bone_weight4 = 0;
+				fwrite(&bone_weight4, sizeof(float), 1, fh);
 			}
-			else
+			else if (weight_num == 2)
 			{
-				bone_index[1] = bone_param[bi2].PMX_root_index;
+				int max_bone1 = -1;
+				float max_weight1 = 0.0f;
+				for (int n = 0; n < weight_num; n++)
+				{
+					if (max_weight1 < weights[n])
+					{
+						max_weight1 = weights[n];
+						max_bone1 = n;
+					}
+				}
+				int max_bone2 = -1;
+				float max_weight2 = 0.0f;
+				for (int n = 0; n < weight_num; n++)
+				{
+					if (n == max_bone1) continue;
+					if (max_weight2 < weights[n])
+					{
+						max_weight2 = weights[n];
+						max_bone2 = n;
+					}
+				}
+				float total_weights = max_weight1 + max_weight2;
+				int bi1 = bone_id_index[vert_bone_id[max_bone1]];
+				int bi2 = bone_id_index[vert_bone_id[max_bone2]];
+				if (bone_param[bi1].parent != 0)
+				{
+					bone_index[0] = bone_param[bone_id_index[bone_param[bi1].parent]].PMX_tip_index;
+				}
+				else
+				{
+					bone_index[0] = bone_param[bi1].PMX_root_index;
+				}
+				if (bone_param[bi2].parent != 0)
+				{
+					bone_index[1] = bone_param[bone_id_index[bone_param[bi2].parent]].PMX_tip_index;
+				}
+				else
+				{
+					bone_index[1] = bone_param[bi2].PMX_root_index;
+				}
+				if (bone_index[0] != bone_index[1])
+				{
+					bone_weight = floor(max_weight1 / total_weights * 100.f + 0.5f) / 100;
+				}
+				else
+				{
+					bone_weight = 1;
+				}
+				int type = 1;
+				fwrite(&type, sizeof(byte), 1, fh);
+				WritePMXIndex(fh, bone_index[0], bone_index_size);
+				WritePMXIndex(fh, bone_index[1], bone_index_size);
+				fwrite(&bone_weight, sizeof(float), 1, fh);
 			}
-			if (bone_index[0] != bone_index[1])
+			else if (weight_num == 1)
 			{
-				bone_weight = floor(max_weight1 / total_weights * 100.f + 0.5f) / 100;
+				int bi = bone_id_index[vert_bone_id[0]];
+				if (bone_param[bi].parent != 0)
+				{
+					bone_index[0] = bone_param[bone_id_index[bone_param[bi].parent]].PMX_tip_index;
+				}
+				else
+				{
+					bone_index[0] = bone_param[bi].PMX_root_index;
+				}
+				bone_index[1] = bone_index[0];
+				bone_weight = 1;
+				int type = 1;
+				fwrite(&type, sizeof(byte), 1, fh);
+				WritePMXIndex(fh, bone_index[0], bone_index_size);
+				WritePMXIndex(fh, bone_index[1], bone_index_size);
+				fwrite(&bone_weight, sizeof(float), 1, fh);
 			}
 			else
 			{
+				bone_index[0] = 0;
+				bone_index[1] = 0;
 				bone_weight = 1;
+				int type = 1;
+				fwrite(&type, sizeof(byte), 1, fh);
+				WritePMXIndex(fh, bone_index[0], bone_index_size);
+				WritePMXIndex(fh, bone_index[1], bone_index_size);
+				fwrite(&bone_weight, sizeof(float), 1, fh);
 			}
-			int type = 1;
-			fwrite(&type, sizeof(byte), 1, fh);
-			fwrite(bone_index, 1, 2, fh);
-			fwrite(&bone_weight, sizeof(float), 1, fh);
-		}
-		else if (weight_num == 1)
+			edge_flag = 1;
+			fwrite(&edge_flag, sizeof(float), 1, fh);
+		};
+
+		stats.Enter(PMX_PHASE_VERTEX);
+		int dw_vert_num = option.stream_export ? 0 : output_vert_num;
+		__int64 vert_num_pos = _ftelli64(fh);
+		fwrite(&dw_vert_num, 4, 1, fh);
+		// 逐次出力の一時ファイルでの材質ごとの面の位置と書いた数
+		std::vector<__int64> slot_start(materials.size());
+		std::vector<DWORD> slot_written(materials.size(), 0);
+		if (option.stream_export)
 		{
-			int bi = bone_id_index[vert_bone_id[0]];
-			if (bone_param[bi].parent != 0)
+			// オブジェクトごとに面を三角形にして使われる頂点を書き出し、解放する。
+			// 面は材質順に並べるので、材質ごとの位置を決めて一時ファイルに書き、頂点の後に連結する
+			progress.Enter(PMX_PHASE_VERTEX, numObj);
+			if (fopen_s(&face_fh, face_filename.c_str(), "w+b") != 0)
 			{
-				bone_index[0] = bone_param[bone_id_index[bone_param[bi].parent]].PMX_tip_index;
+				face_fh = nullptr;
+				abortFile();
+				return false;
 			}
-			else
+			__int64 slot_begin = 0;
+			for (size_t m = 0; m < materials.size(); m++)
 			{
-				bone_index[0] = bone_param[bi].PMX_root_index;
+				slot_start[m] = slot_begin;
+				slot_begin += static_cast<__int64>(materials[m].face_count) * 3 * sizeof(int);
 			}
-			bone_index[1] = bone_index[0];
-			bone_weight = 1;
-			int type = 1;
-			fwrite(&type, sizeof(byte), 1, fh);
-			fwrite(bone_index, 1, 2, fh);
-			fwrite(&bone_weight, sizeof(float), 1, fh);
-		}
-		else
-		{
-			bone_index[0] = 0;
-			bone_index[1] = 0;
-			bone_weight = 1;
-			int type = 1;
-			fwrite(&type, sizeof(byte), 1, fh);
-			fwrite(bone_index, 1, 2, fh);
-			fwrite(&bone_weight, sizeof(float), 1, fh);
-		}
-		edge_flag = 1;
-		fwrite(&edge_flag, sizeof(float), 1, fh);
-	}
-
-	DWORD face_vert_count = 0;
-	std::vector<int> material_used(numMat + 1, 0);
-	for (int i = 0; i < numObj; i++)
-	{
-		MQObject obj = doc->GetObject(i);
-		if (obj == nullptr)
-			continue;
-
-		if (option.visible_only && obj->GetVisible() == 0)
-			continue;
-
-		// ターゲットオブジェクトは飛ばす
-		if (isOutputFacial && containsTargetObject(morph_intput_list, obj))
-			continue;
+			PMXArena object_arena;
 
-		int num_face = obj->GetFaceCount();
-		for (int fi = 0; fi < num_face; fi++)
-		{
-			int n = obj->GetFacePointCount(fi);
-			if (n >= 3)
+			for (int oi = 0; oi < numObj && progress.Step(oi); oi++)
 			{
-				face_vert_count += (n - 2) * 3;
-
-				int mi = obj->GetFaceMaterial(fi);
-				if (mi < 0 || mi >= numMat) mi = numMat;
-				material_used[mi] += (n - 2);
-			}
-		}
-	}
-	fwrite(&face_vert_count, 4, 1, fh);
-
-	int output_face_vert_count = 0;
-	for (int m = 0; m <= numMat; m++)
-	{
-		if (material_used[m] == 0) continue;
-
-		for (int i = 0; i < numObj; i++)
-		{
-			MQObject obj = doc->GetObject(i);
-			if (obj == nullptr)
-				continue;
-
-			if (option.visible_only && obj->GetVisible() == 0)
-				continue;
-			if (isOutputFacial && containsTargetObject(morph_intput_list, obj))
-				continue;
-
-			MQExportObject* eobj = expobjs[i];
-			if (eobj == nullptr)
-				continue;
+				if (isOutputFacial && morph_topology.IsTarget(oi))
+					continue;
+
+				// オブジェクトは宿主から読むので、読むところだけ元のスレッドで行う
+				PMXObjectSnapshot& snapshot = snapshots[oi];
+				MQExportObject* eobj = nullptr;
+				bool temporary = false;
+				progress.CallOnMainThread([&]()
+				{
+					MQObject obj = doc->GetObject(oi);
+					if (obj == nullptr)
+						return;
 
-			int num_face = obj->GetFaceCount();
-			for (int fi = 0; fi < num_face; fi++)
-			{
-				int mi = obj->GetFaceMaterial(fi);
-				if (mi < 0 || mi >= numMat) mi = numMat;
+					if (option.visible_only && obj->GetVisible() == 0)
+						return;
 
-				int n = eobj->GetFacePointCount(fi);
-				if (n >= 3 && mi == m)
+					eobj = expobjs[oi];
+					temporary = (eobj == nullptr);
+					if (temporary)
+					{
+						eobj = new MQExportObject(obj, separate, &object_arena);
+					}
+					snapshot.Take(obj, weight_source);
+				});
+				if (eobj == nullptr)
+					continue;
+
+				layout.AddObject(snapshot, eobj);
+				int vert_offset = total_vert_num;
+				int vert_num = eobj->GetVertexCount();
+
+				stats.Enter(PMX_PHASE_TRIANGULATE);
+				vert_used.assign(vert_num, option.cleanup_mesh ? 0 : 1);
+				removed_face_num += TriangulateObjectFaces(snapshot, eobj, numMat, option.cleanup_mesh, [&](int mi, const int* tvi)
 				{
-					std::vector<int> vi(n);
-					std::vector<MQPoint> p(n);
-
-					eobj->GetFacePointArray(fi, vi.data());
-					for (int j = 0; j < n; j++)
+					int m = material_slot[mi];
+					if (m < 0)
+						return;
+					for (int j = 0; j < 3; j++)
 					{
-						p[j] = obj->GetVertex(eobj->GetOriginalVertex(vi[j]));
+						slot_tvi[m].push_back(tvi[j]);
+						vert_used[tvi[j]] = 1;
 					}
-					std::vector<int> tri((n - 2) * 3);
-					doc->Triangulate(p.data(), n, tri.data(), (n - 2) * 3);
-
-					for (int j = 0; j < n - 2; j++)
+				});
+				int used_num = CompactVertices(vert_used, vert_remap);
+				for (size_t m = 0; m < slot_tvi.size(); m++)
+				{
+					if (slot_tvi[m].empty())
+						continue;
+					for (int& v : slot_tvi[m])
 					{
-						int tvi[3];
-						tvi[0] = orgvert_vert[i][vi[tri[j * 3]]];
-						tvi[1] = orgvert_vert[i][vi[tri[j * 3 + 1]]];
-						tvi[2] = orgvert_vert[i][vi[tri[j * 3 + 2]]];
-						fwrite(tvi, 4, 3, fh);
-						//fprintf(fh,"%u %u %u\n",tvi[0],tvi[1],tvi[2]);
-						output_face_vert_count += 3;
+						v = vert_offset + vert_remap[v];
 					}
+					_fseeki64(face_fh, slot_start[m] + static_cast<__int64>(slot_written[m]) * sizeof(int), SEEK_SET);
+					fwrite(slot_tvi[m].data(), sizeof(int), slot_tvi[m].size(), face_fh);
+					slot_written[m] += static_cast<DWORD>(slot_tvi[m].size());
+					slot_tvi[m].clear();
 				}
-			}
-		}
-	}
-	assert(face_vert_count == output_face_vert_count);
 
-	// Matrial list
-	DWORD used_mat_num = 0;
-	for (int i = 0; i <= numMat; i++)
-	{
-		if (material_used[i] > 0) used_mat_num++;
-	}
-	std::unique_ptr<MAnsiString[]> textures = std::make_unique<MAnsiString[]>(numMat);
-	int TexCount = 0;
-	for (int i = 0; i < numMat; i++)
-	{
-		if (material_used[i] == 0) continue;
-		if (i < numMat)
-		{
-			MQMaterial mat = doc->GetMaterial(i);
-			if (mat != nullptr)
-			{
-				char path[_MAX_PATH];
-				mat->GetTextureName(path, _MAX_PATH);
-				MAnsiString texture = MFileUtil::extractFilenameAndExtension(MString::fromAnsiString(path)).toAnsiString();
-				if (texture.length() == 0)continue;
-				for (int j = 0; j < numMat; j++)
+				stats.Enter(PMX_PHASE_VERTEX);
+				if (!temporary)
 				{
-					if (textures[j] == texture)
+					orgvert_vert[oi].resize(vert_num);
+					for (int evi = 0; evi < vert_num; evi++)
 					{
-						break;
+						orgvert_vert[oi][evi] = (vert_remap[evi] < 0) ? -1 : vert_offset + vert_remap[evi];
 					}
-					if (textures[j].length() == 0)
+				}
+				for (int evi = 0; evi < vert_num; evi++)
+				{
+					if (vert_remap[evi] >= 0)
 					{
-						textures[j] = texture;
-						TexCount += 1;
-						break;
+						writeVertex(snapshot, eobj, evi, eobj->GetVertexNormal(evi), eobj->GetVertexCoordinate(evi));
 					}
 				}
+				total_vert_num += used_num;
+				removed_vert_num += vert_num - used_num;
+
+				snapshot.Clear();
+				if (temporary)
+				{
+					delete eobj;
+					object_arena.Release();
+				}
+			}
+
+			// 頂点数と面の数を書き直す
+			dw_vert_num = total_vert_num;
+			_fseeki64(fh, vert_num_pos, SEEK_SET);
+			fwrite(&dw_vert_num, 4, 1, fh);
+			_fseeki64(fh, 0, SEEK_END);
+			face_vert_count = 0;
+			for (size_t m = 0; m < materials.size(); m++)
+			{
+				materials[m].face_count = static_cast<int>(slot_written[m] / 3);
+				face_vert_count += slot_written[m];
 			}
 		}
-	}
+		else
+		{
+			progress.Enter(PMX_PHASE_VERTEX, total_vert_num);
+			for (int i = 0; i < total_vert_num; i++)
+			{
+				if ((i & 1023) == 0 && !progress.Step(i))
+					break;
 
-	fwrite(&TexCount, sizeof(int), 1, fh);
-	for (int i = 0; i < TexCount; i++)
-	{
-		Len = converter.Cp936ToUtf16(textures[i].c_str(), textures[i].length(), &RES) * 2;
-		fwrite(&Len, sizeof(int), 1, fh);
-		fwrite(RES.c_str(), Len, 1, fh);
-	}
-	fwrite(&used_mat_num, 4, 1, fh);
-	for (int i = 0; i < numMat; i++)
-	{
-		if (material_used[i] == 0) continue;
-		MQMaterial mat = doc->GetMaterial(i);
-		if (mat == nullptr)
+				if (vert_remap[i] >= 0)
+				{
+					writeVertex(snapshots[vert_orgobj[i]], expobjs[vert_orgobj[i]], vert_expvert[i], vert_normal[i], vert_coord[i]);
+				}
+			}
+			dw_vert_num = output_vert_num;
+		}
+		if (progress.IsCanceled())
 		{
-			continue;
+			abortFile();
+			return false;
 		}
-		Len = converter.Cp936ToUtf16(mat->GetName().c_str(), mat->GetName().length(), &RES) * 2;
-		fwrite(&Len, sizeof(int), 1, fh);
-		fwrite(RES.c_str(), Len, 1, fh);
-		Len = 0;
-		fwrite(&Len, sizeof(int), 1, fh);
-		MQColor col(1, 1, 1);
-		float dif = 0.8f;
-		float alpha = 1.0f;
-		float spc_pow = 5.0f;
-		MQColor spc_col(0, 0, 0);
-		MQColor amb_col(0.6f, 0.6f, 0.6f);
-		MAnsiString texture;
-		bool edge = false;
-
-		if (i < numMat)
-		{
-			if (mat != nullptr)
+		if (option.cleanup_mesh)
+		{
+			stats.SetCount("removed_triangles", removed_face_num);
+			stats.SetCount("removed_vertices", removed_vert_num);
+			LOG(MString::format(L"Mesh cleanup: %d degenerate triangle(s) and %d unused vertices removed", removed_face_num, removed_vert_num).c_str());
+		}
+
+		stats.Enter(PMX_PHASE_TRIANGULATE);
+		fwrite(&face_vert_count, 4, 1, fh);
+
+		DWORD output_face_vert_count = 0;
+		if (option.stream_export)
+		{
+			// 材質順に並べた面を頂点の後に連結する
+			if (ferror(face_fh))
+			{
+				abortFile();
+				return false;
+			}
+			const size_t copy_size = 1 << 20;
+			__int64 remaining = static_cast<__int64>(face_vert_count) * sizeof(int);
+			progress.Enter(PMX_PHASE_TRIANGULATE, static_cast<int>((remaining + copy_size - 1) / copy_size));
+			std::vector<char> buffer(copy_size);
+			int c = 0;
+			for (size_t m = 0; m < materials.size() && !progress.IsCanceled(); m++)
 			{
-				col = mat->GetColor();
-				dif = mat->GetDiffuse();
-				alpha = mat->GetAlpha();
-				spc_pow = mat->GetPower();
-				spc_col = mat->GetSpecularColor();
-				amb_col = mat->GetAmbientColor();
-				char path[_MAX_PATH];
-				mat->GetTextureName(path, _MAX_PATH);
-				texture = MFileUtil::extractFilenameAndExtension(MString::fromAnsiString(path)).toAnsiString();
-				int shader = mat->GetShader();
-				if (shader == MQMATERIAL_SHADER_HLSL)
+				__int64 slot_remaining = static_cast<__int64>(slot_written[m]) * sizeof(int);
+				_fseeki64(face_fh, slot_start[m], SEEK_SET);
+				while (slot_remaining > 0 && progress.Step(c++))
 				{
-					MAnsiString shader_name = mat->GetShaderName();
-					if (shader_name == "PMX")
-					{
-						//int	toon = mat->GetShaderParameterIntValue("Toon", 0);
-						edge = mat->GetShaderParameterBoolValue("Edge", 0);
-					}
+					size_t size = fread(buffer.data(), 1, static_cast<size_t>(std::min<__int64>(slot_remaining, copy_size)), face_fh);
+					if (size == 0)
+						break;
+					fwrite(buffer.data(), 1, size, fh);
+					slot_remaining -= size;
+					remaining -= size;
 				}
+				if (slot_remaining > 0)
+					break;
+			}
+			output_face_vert_count = static_cast<DWORD>(face_vert_count - remaining / sizeof(int));
+			fclose(face_fh);
+			face_fh = nullptr;
+			remove(face_filename.c_str());
+			if (remaining > 0 && !progress.IsCanceled())
+			{
+				abortFile();
+				return false;
 			}
 		}
-
-		float diffuse_color[3]; // dr, dg, db // 減衰色
-		diffuse_color[0] = col.r * dif;
-		diffuse_color[1] = col.g * dif;
-		diffuse_color[2] = col.b * dif;
-		fwrite(diffuse_color, 4, 3, fh);
-		//fprintf(fh,"%f %f %f\n",diffuse_color[0],diffuse_color[1],diffuse_color[2]);
-		fwrite(&alpha, 4, 1, fh);
-		//fprintf(fh,"%f\n",alpha);
-
-		//float max_spc_col = std::max(spc_col.r, std::max(spc_col.g, spc_col.b));
-		float specular_color[3]; // sr, sg, sb // 光沢色
-		//specular_color[0] = (max_spc_col > 0) ? spc_col.r / max_spc_col : 0.0f;
-		//specular_color[1] = (max_spc_col > 0) ? spc_col.g / max_spc_col : 0.0f;
-		//specular_color[2] = (max_spc_col > 0) ? spc_col.b / max_spc_col : 0.0f;
-		specular_color[0] = sqrtf(spc_col.r);
-		specular_color[1] = sqrtf(spc_col.g);
-		specular_color[2] = sqrtf(spc_col.b);
-		fwrite(&specular_color, 4, 3, fh);
-		//fprintf(fh,"%f %f %f\n",specular_color[0],specular_color[1],specular_color[2]);
-
-		fwrite(&spc_pow, 4, 1, fh);
-		//fprintf(fh,"%f\n",spc_pow);
-
-		float ambient_color[3]; // mr, mg, mb // 環境色(ambient)
-		ambient_color[0] = amb_col.r;
-		ambient_color[1] = amb_col.g;
-		ambient_color[2] = amb_col.b;
-		fwrite(&ambient_color, 4, 3, fh);
-		//fprintf(fh,"%f %f %f\n",ambient_color[0],ambient_color[1],ambient_color[2]);
-
-		BYTE edge_flag = edge ? 1 : 0;
-		fwrite(&edge_flag, 1, 1, fh);
-		//fprintf(fh,"%d\n",edge_flag);
-
-		float edge_color[5] = {0,0,0,0,0};
-		fwrite(&edge_color, sizeof(float), 5, fh);
-		uint8_t size = 255;
-		if (texture != "")
-		{
-			for (int x = 0; x < TexCount; x++)
+		else
+		{
+			progress.Enter(PMX_PHASE_TRIANGULATE, static_cast<int>(materials.size()));
+			for (size_t m = 0; m < materials.size() && progress.Step(static_cast<int>(m)); m++)
 			{
-				if (texture == textures[x])
-				{
-					size = x;
-					break;
-				}
+				fwrite(slot_tvi[m].data(), sizeof(int), slot_tvi[m].size(), fh);
+				output_face_vert_count += static_cast<DWORD>(slot_tvi[m].size());
 			}
 		}
-		fwrite(&size, sizeof(uint8_t), 1, fh);//Tex
-		size = 255;
-		fwrite(&size, sizeof(uint8_t), 1, fh);//Spa
-
-		edge_flag = 0;
-		fwrite(&edge_flag, 1, 1, fh);//SpaMod
-
-		edge_flag = 0;
-		fwrite(&edge_flag, 1, 1, fh);//ToonSelect
-		//BYTE toon_index = (toon >= 1 && toon <= 10) ? static_cast<BYTE>(toon - 1) : 0;
-		BYTE toon_index = 255;
-		fwrite(&toon_index, 1, 1, fh);//Toon
-		int Memo = 0;
-		fwrite(&Memo, sizeof(int), 1, fh);//Memo
-		face_vert_count = material_used[i] * 3;
-		fwrite(&face_vert_count, 4, 1, fh);//Face
-	}
-
-	if (bone_num == 0 || !option.output_bone)
-	{
-		Len = 1;
-		fwrite(&Len, sizeof(int), 1, fh);
-		MAnsiString subname = "センター";
-		Len = converter.Cp936ToUtf16(subname.c_str(), subname.length(), &RES) * 2;
-		fwrite(&Len, sizeof(int), 1, fh);
-		fwrite(RES.c_str(), Len, 1, fh);
-		subname = "center";
-		Len = converter.Cp936ToUtf16(subname.c_str(), subname.length(), &RES) * 2;
-		fwrite(&Len, sizeof(int), 1, fh);
-		fwrite(RES.c_str(), Len, 1, fh);
-
-		float bone_head_pos[3];
-		bone_head_pos[0] = 0;
-		bone_head_pos[1] = 0;
-		bone_head_pos[2] = 0;
-		fwrite(&bone_head_pos, 4, 3, fh);
-		auto parent_bone_index = -1;
-		fwrite(&parent_bone_index, 1, 1, fh);
-		int level = 0;
-		fwrite(&level, sizeof(int), 1, fh);
-		uint16_t BoneFlag = 27;
-		fwrite(&BoneFlag, sizeof(uint16_t), 1, fh);
-		uint8_t target_index = 255;
-		fwrite(&target_index, sizeof(uint8_t), 1, fh);
-	}
-	else
-	{
-		if (option.output_ik_end)
+		if (progress.IsCanceled())
 		{
-			fwrite(&PMXbone_num, sizeof(int), 1, fh);
+			abortFile();
+			return false;
 		}
-		else
+		assert(face_vert_count == output_face_vert_count);
+
+		layout.Add(&scaling, sizeof(scaling));
+		layout.Add(&option.cleanup_mesh, sizeof(option.cleanup_mesh));
+		layout_text = PMXLayoutFingerprint::Format(layout.Get());
+		_fseeki64(fh, layout_pos, SEEK_SET);
+		text.Write(layout_text.c_str(), layout_text.length());
+		_fseeki64(fh, 0, SEEK_END);
+
+		// 逐次出力ではベースの頂点番号が決まったので、ここでモーフを抽出する
+		if (option.stream_export && !extractMorphs())
 		{
-			Len = bone_num + 1;
-			fwrite(&Len, sizeof(int), 1, fh);
+			abortFile();
+			return false;
 		}
 
-		if (PMXbone_num != 0)
+		stats.Enter(PMX_PHASE_MATERIAL);
+		progress.Enter(PMX_PHASE_MATERIAL);
+		int TexCount = textures.GetCount();
+		fwrite(&TexCount, sizeof(int), 1, fh);
+		for (int i = 0; i < TexCount; i++)
 		{
-			int PMXbone_index = 0;
-			for (int i = 0; i < bone_num; i++)
+			text.Write(textures.GetName(i));
+		}
+		DWORD used_mat_num = static_cast<DWORD>(materials.size());
+		fwrite(&used_mat_num, 4, 1, fh);
+		for (const PMXMaterialParam& mat : materials)
+		{
+			text.Write(mat.name);
+			text.WriteEmpty();
+
+			float diffuse_color[3]; // dr, dg, db // 減衰色
+			diffuse_color[0] = mat.col.r * mat.dif;
+			diffuse_color[1] = mat.col.g * mat.dif;
+			diffuse_color[2] = mat.col.b * mat.dif;
+			fwrite(diffuse_color, 4, 3, fh);
+			//fprintf(fh,"%f %f %f\n",diffuse_color[0],diffuse_color[1],diffuse_color[2]);
+			fwrite(&mat.alpha, 4, 1, fh);
+			//fprintf(fh,"%f\n",alpha);
+
+			//float max_spc_col = std::max(spc_col.r, std::max(spc_col.g, spc_col.b));
+			float specular_color[3]; // sr, sg, sb // 光沢色
+			//specular_color[0] = (max_spc_col > 0) ? spc_col.r / max_spc_col : 0.0f;
+			//specular_color[1] = (max_spc_col > 0) ? spc_col.g / max_spc_col : 0.0f;
+			//specular_color[2] = (max_spc_col > 0) ? spc_col.b / max_spc_col : 0.0f;
+			specular_color[0] = sqrtf(mat.spc_col.r);
+			specular_color[1] = sqrtf(mat.spc_col.g);
+			specular_color[2] = sqrtf(mat.spc_col.b);
+			fwrite(&specular_color, 4, 3, fh);
+			//fprintf(fh,"%f %f %f\n",specular_color[0],specular_color[1],specular_color[2]);
+
+			fwrite(&mat.spc_pow, 4, 1, fh);
+			//fprintf(fh,"%f\n",spc_pow);
+
+			float ambient_color[3]; // mr, mg, mb // 環境色(ambient)
+			ambient_color[0] = mat.amb_col.r;
+			ambient_color[1] = mat.amb_col.g;
+			ambient_color[2] = mat.amb_col.b;
+			fwrite(&ambient_color, 4, 3, fh);
+			//fprintf(fh,"%f %f %f\n",ambient_color[0],ambient_color[1],ambient_color[2]);
+
+			BYTE edge_flag = mat.edge ? 1 : 0;
+			fwrite(&edge_flag, 1, 1, fh);
+			//fprintf(fh,"%d\n",edge_flag);
+
+			float edge_color[5] = {0,0,0,0,0};
+			fwrite(&edge_color, sizeof(float), 5, fh);
+			uint8_t size = (mat.texture >= 0) ? static_cast<uint8_t>(mat.texture) : 255;
+			fwrite(&size, sizeof(uint8_t), 1, fh);//Tex
+			size = 255;
+			fwrite(&size, sizeof(uint8_t), 1, fh);//Spa
+
+			edge_flag = 0;
+			fwrite(&edge_flag, 1, 1, fh);//SpaMod
+
+			edge_flag = 0;
+			fwrite(&edge_flag, 1, 1, fh);//ToonSelect
+			//BYTE toon_index = (toon >= 1 && toon <= 10) ? static_cast<BYTE>(toon - 1) : 0;
+			BYTE toon_index = 255;
+			fwrite(&toon_index, 1, 1, fh);//Toon
+			int Memo = 0;
+			fwrite(&Memo, sizeof(int), 1, fh);//Memo
+			face_vert_count = mat.face_count * 3;
+			fwrite(&face_vert_count, 4, 1, fh);//Face
+		}
+
+		stats.Enter(PMX_PHASE_BONE);
+		progress.Enter(PMX_PHASE_BONE);
+		if (bone_num == 0 || !option.output_bone)
+		{
+			Len = 1;
+			fwrite(&Len, sizeof(int), 1, fh);
+			text.Write(L"センター");
+			text.Write(L"center");
+
+			float bone_head_pos[3];
+			bone_head_pos[0] = 0;
+			bone_head_pos[1] = 0;
+			bone_head_pos[2] = 0;
+			fwrite(&bone_head_pos, 4, 3, fh);
+			WritePMXIndex(fh, -1, bone_index_size);
+			int level = 0;
+			fwrite(&level, sizeof(int), 1, fh);
+			uint16_t BoneFlag = 27;
+			fwrite(&BoneFlag, sizeof(uint16_t), 1, fh);
+			WritePMXIndex(fh, -1, bone_index_size);
+		}
+		else
+		{
+			if (option.output_ik_end)
+			{
+				fwrite(&PMXbone_num, sizeof(int), 1, fh);
+			}
+			else
 			{
-				if (bone_param[i].PMX_root_index >= 0 && bone_param[i].PMX_root_index >= PMXbone_index)//判断是否是初始骨骼
+				Len = bone_num + 1;
+				fwrite(&Len, sizeof(int), 1, fh);
+			}
+
+			if (PMXbone_num != 0)
+			{
+				int PMXbone_index = 0;
+				for (int i = 0; i < bone_num; i++)
 				{
-					assert(bone_param[i].PMX_root_index == PMXbone_index);
-					MAnsiString subname = getMultiBytesSubstring(bone_param[i].name_jp.toAnsiString(), 20);
-					Len = converter.Cp936ToUtf16(subname.c_str(), subname.length(), &RES) * 2;
-					fwrite(&Len, sizeof(int), 1, fh);
-					fwrite(RES.c_str(), Len, 1, fh);
-					Len = converter.Cp936ToUtf16(bone_param[i].name_en.toAnsiString(), bone_param[i].name_en.length(), &RES) * 2;
-					fwrite(&Len, sizeof(int), 1, fh);
-					fwrite(RES.c_str(), Len, 1, fh);
-
-					float bone_head_pos[3];
-					bone_head_pos[0] = bone_param[i].org_root.x * scaling;
-					bone_head_pos[1] = bone_param[i].org_root.y * scaling;
-					bone_head_pos[2] = -bone_param[i].org_root.z * scaling;
-					fwrite(&bone_head_pos, 4, 3, fh);
-
-					auto parent_bone_index = -1;
-					fwrite(&parent_bone_index, 1, 1, fh);
-
-					int level = 0;
-					fwrite(&level, sizeof(int), 1, fh); //变形阶层
-					uint16_t BoneFlag = 19;//默认指向骨骼并且带旋转加操作
-					if (bone_param[i].movable == true)//是否移动
+					if (bone_param[i].PMX_root_index >= 0 && bone_param[i].PMX_root_index >= PMXbone_index)//判断是否是初始骨骼
 					{
-						BoneFlag += 4;
-					}
-					if (bone_param[i].dummy == true)//是否显示
-					{
-						BoneFlag += 8;
-					}
-					if (bone_param[i].link_id != 0)//是否旋转+
-					{
-						BoneFlag += 256;
-					}
-					fwrite(&BoneFlag, sizeof(uint16_t), 1, fh);
+						assert(bone_param[i].PMX_root_index == PMXbone_index);
+						text.Write(getWideSubstring(bone_names.Get(bone_param[i].name_jp), 20));
+						text.Write(bone_names.Get(bone_param[i].name_en));
+
+						float bone_head_pos[3];
+						bone_head_pos[0] = bone_param[i].org_root.x * scaling;
+						bone_head_pos[1] = bone_param[i].org_root.y * scaling;
+						bone_head_pos[2] = -bone_param[i].org_root.z * scaling;
+						fwrite(&bone_head_pos, 4, 3, fh);
 
-					if (BoneFlag & 0x0001) //假如指向骨骼，则骨骼序列为
-					{
-						uint8_t target_index = 0;
-						target_index = bone_param[i].PMX_tip_index;
-						if (bone_param[i].link_id != 0 && bone_param[i].link_rate != 100)
+						WritePMXIndex(fh, -1, bone_index_size);
+
+						int level = 0;
+						fwrite(&level, sizeof(int), 1, fh); //变形阶层
+						uint16_t BoneFlag = 19;//默认指向骨骼并且带旋转加操作
+						if (bone_param[i].movable == true)//是否移动
 						{
-							target_index = bone_id_index[bone_param[i].link_id];
+							BoneFlag += 4;
 						}
-						fwrite(&target_index, sizeof(uint8_t), 1, fh);
-					}
-					PMXbone_index++;
-				}
-				if (bone_param[i].PMX_tip_index >= 0 && bone_param[i].PMX_tip_index >= PMXbone_index)
-				{
-					assert(bone_param[i].PMX_tip_index == PMXbone_index);
-					MAnsiString subname;
-					MAnsiString subnameEN;
-					if (bone_param[i].tip_id == 0)
-					{
-						subname = getMultiBytesSubstring(bone_param[i].tip_name_jp.toAnsiString(), 20);
-						subnameEN = getMultiBytesSubstring(bone_param[i].tip_name_en.toAnsiString(), 20);
-					}
-					else
-					{
-						subname = getMultiBytesSubstring(bone_param[bone_id_index[bone_param[i].tip_id]].name_jp.toAnsiString(), 20);
-						subnameEN = getMultiBytesSubstring(bone_param[bone_id_index[bone_param[i].tip_id]].name_en.toAnsiString(), 20);
-					}
-					Len = converter.Cp936ToUtf16(subname.c_str(), subname.length(), &RES) * 2;
-					fwrite(&Len, sizeof(int), 1, fh);
-					fwrite(RES.c_str(), Len, 1, fh);
-					Len = converter.Cp936ToUtf16(subnameEN.c_str(), subnameEN.length(), &RES) * 2;
-					fwrite(&Len, sizeof(int), 1, fh);
-					fwrite(RES.c_str(), Len, 1, fh);
-
-					float bone_head_pos[3];
-					bone_head_pos[0] = bone_param[i].org_tip.x * scaling;
-					bone_head_pos[1] = bone_param[i].org_tip.y * scaling;
-					bone_head_pos[2] = -bone_param[i].org_tip.z * scaling;
-					fwrite(&bone_head_pos, 4, 3, fh);
-
-					uint8_t parent_bone_index = 255;
-					if (bone_param[i].parent != 0)
-					{
-						auto parent_it = bone_id_index.find(bone_param[i].parent);
-						if (parent_it != bone_id_index.end())
+						if (bone_param[i].dummy == true)//是否显示
 						{
-							parent_bone_index = bone_param[(*parent_it).second].PMX_tip_index;
+							BoneFlag += 8;
 						}
-					}
-					else
-					{
-						parent_bone_index = bone_param[i].PMX_root_index;
-					}
-					fwrite(&parent_bone_index, sizeof(uint8_t), 1, fh);
+						if (bone_param[i].link_id != 0)//是否旋转+
+						{
+							BoneFlag += 256;
+						}
+						fwrite(&BoneFlag, sizeof(uint16_t), 1, fh);
 
-					int level = 0;
-					fwrite(&level, sizeof(int), 1, fh); //变形阶层
-					uint16_t BoneFlag = 19;//默认指向骨骼并且带旋转加操作
-					if (!bone_param[i].children.empty())//是否显示
-					{
-						BoneFlag += 8;
+						if (BoneFlag & 0x0001) //假如指向骨骼，则骨骼序列为
+						{
+							int target_index = bone_param[i].PMX_tip_index;
+							if (bone_param[i].link_id != 0 && bone_param[i].link_rate != 100)
+							{
+								target_index = bone_id_index[bone_param[i].link_id];
+							}
+							WritePMXIndex(fh, target_index, bone_index_size);
+						}
+						PMXbone_index++;
 					}
-					if (!bone_param[i].children.empty() && bone_param[bone_param[i].children.front()].link_id != 0)//是否旋转+
+					if (bone_param[i].PMX_tip_index >= 0 && bone_param[i].PMX_tip_index >= PMXbone_index)
 					{
-						BoneFlag += 256;
-					}
-					fwrite(&BoneFlag, sizeof(uint16_t), 1, fh);
+						assert(bone_param[i].PMX_tip_index == PMXbone_index);
+						MString subname;
+						MString subnameEN;
+						if (bone_param[i].tip_id == 0)
+						{
+							subname = getWideSubstring(bone_names.Get(bone_param[i].tip_name_jp), 20);
+							subnameEN = getWideSubstring(bone_names.Get(bone_param[i].tip_name_en), 20);
+						}
+						else
+						{
+							subname = getWideSubstring(bone_names.Get(bone_param[bone_id_index[bone_param[i].tip_id]].name_jp), 20);
+							subnameEN = getWideSubstring(bone_names.Get(bone_param[bone_id_index[bone_param[i].tip_id]].name_en), 20);
+						}
+						text.Write(subname);
+						text.Write(subnameEN);
 
-					/*BYTE bone_type = 0; // ボーンの種類 0:回転 1:回転と移動 2:IK 3:不明 4:IK影響下 5:回転影響下 6:IK接続先 7:非表示
-					if (bone_param[i].tip_id == 0 && bone_param[i].child_num != 0)
-					{
-						bone_type = 7;
-					}
-					else if (bone_param[i].PMX_ik_parent_tip >= 0)
-					{
-						bone_type = 4;
-					}
-					else if (bone_param[i].PMX_ik_index >= 0)
-					{
-						bone_type = 6;
-					}
-					else if (!bone_param[i].children.empty() && bone_param[bone_param[i].children.front()].link_id != 0)
-					{
-						if (bone_param[bone_param[i].children.front()].link_rate == 100)
+						float bone_head_pos[3];
+						bone_head_pos[0] = bone_param[i].org_tip.x * scaling;
+						bone_head_pos[1] = bone_param[i].org_tip.y * scaling;
+						bone_head_pos[2] = -bone_param[i].org_tip.z * scaling;
+						fwrite(&bone_head_pos, 4, 3, fh);
+
+						int parent_bone_index = -1;
+						if (bone_param[i].parent != 0)
 						{
-							bone_type = 5;
+							auto parent_it = bone_id_index.find(bone_param[i].parent);
+							if (parent_it != bone_id_index.end())
+							{
+								parent_bone_index = bone_param[(*parent_it).second].PMX_tip_index;
+							}
 						}
 						else
 						{
-							bone_type = 9;
+							parent_bone_index = bone_param[i].PMX_root_index;
 						}
-					}
-					else if (bone_param[i].twist)
-					{
-						bone_type = 8;
-					}
-					else if (bone_param[i].child_num == 0)
-					{
-						bone_type = 7;
-					}
-					if (!bone_param[i].children.empty() && bone_type <= 1)
-					{
-						bone_type = bone_param[bone_param[i].children.front()].movable;
-					}
-					fwrite(&bone_type, 1, 1, fh);*/
+						WritePMXIndex(fh, parent_bone_index, bone_index_size);
 
-					if (BoneFlag & 0x0001) //假如指向骨骼，则骨骼序列为
-					{
-						uint8_t target_index = -1;
-						if (!bone_param[i].children.empty())
+						int level = 0;
+						fwrite(&level, sizeof(int), 1, fh); //变形阶层
+						uint16_t BoneFlag = 19;//默认指向骨骼并且带旋转加操作
+						if (!bone_param[i].children.empty())//是否显示
+						{
+							BoneFlag += 8;
+						}
+						if (!bone_param[i].children.empty() && bone_param[bone_param[i].children.front()].link_id != 0)//是否旋转+
+						{
+							BoneFlag += 256;
+						}
+						fwrite(&BoneFlag, sizeof(uint16_t), 1, fh);
+
+						/*BYTE bone_type = 0; // ボーンの種類 0:回転 1:回転と移動 2:IK 3:不明 4:IK影響下 5:回転影響下 6:IK接続先 7:非表示
+						if (bone_param[i].tip_id == 0 && bone_param[i].child_num != 0)
+						{
+							bone_type = 7;
+						}
+						else if (bone_param[i].PMX_ik_parent_tip >= 0)
 						{
-							target_index = bone_param[bone_param[i].children.front()].PMX_tip_index;
-							if (bone_param[bone_param[i].children.front()].link_id != 0 && bone_param[bone_param[i].children.front()].link_rate != 100)
+							bone_type = 4;
+						}
+						else if (bone_param[i].PMX_ik_index >= 0)
+						{
+							bone_type = 6;
+						}
+						else if (!bone_param[i].children.empty() && bone_param[bone_param[i].children.front()].link_id != 0)
+						{
+							if (bone_param[bone_param[i].children.front()].link_rate == 100)
 							{
-								target_index = bone_id_index[bone_param[bone_param[i].children.front()].link_id];
+								bone_type = 5;
+							}
+							else
+							{
+								bone_type = 9;
 							}
 						}
-						fwrite(&target_index, sizeof(uint8_t), 1, fh);
-					}
-					if (BoneFlag & (0x0100 | 0x0200))
-					{
-						uint8_t grant_parent_index = bone_id_index[bone_param[bone_param[i].children.front()].link_id];
-						fwrite(&grant_parent_index, sizeof(uint8_t), 1, fh);
-						float grant_weight = 1;
-						fwrite(&grant_weight, sizeof(float), 1, fh);
+						else if (bone_param[i].twist)
+						{
+							bone_type = 8;
+						}
+						else if (bone_param[i].child_num == 0)
+						{
+							bone_type = 7;
+						}
+						if (!bone_param[i].children.empty() && bone_type <= 1)
+						{
+							bone_type = bone_param[bone_param[i].children.front()].movable;
+						}
+						fwrite(&bone_type, 1, 1, fh);*/
+
+						if (BoneFlag & 0x0001) //假如指向骨骼，则骨骼序列为
+						{
+							int target_index = -1;
+							if (!bone_param[i].children.empty())
+							{
+								target_index = bone_param[bone_param[i].children.front()].PMX_tip_index;
+								if (bone_param[bone_param[i].children.front()].link_id != 0 && bone_param[bone_param[i].children.front()].link_rate != 100)
+								{
+									target_index = bone_id_index[bone_param[bone_param[i].children.front()].link_id];
+								}
+							}
+							WritePMXIndex(fh, target_index, bone_index_size);
+						}
+						if (BoneFlag & (0x0100 | 0x0200))
+						{
+							int grant_parent_index = bone_id_index[bone_param[bone_param[i].children.front()].link_id];
+							WritePMXIndex(fh, grant_parent_index, bone_index_size);
+							float grant_weight = 1;
+							fwrite(&grant_weight, sizeof(float), 1, fh);
+						}
+						PMXbone_index++;
 					}
-					PMXbone_index++;
 				}
-			}
-			if (option.output_ik_end)
-			{
-				for (int i = 0; i < bone_num; i++)
+				if (option.output_ik_end)
 				{
-					if (bone_param[i].PMX_ik_chain.empty()) continue;
+					for (int i = 0; i < bone_num; i++)
+					{
+						if (bone_param[i].PMX_ik_chain.empty()) continue;
 
-					MString name = bone_param[i].ik_name_jp;
-					MString ik_end_name = bone_param[i].ik_tip_name_jp;
+						MString name = bone_names.Get(bone_param[i].ik_name_jp);
+						MString ik_end_name = bone_names.Get(bone_param[i].ik_tip_name_jp);
 
-					if (name.length() == 0 || ik_end_name.length() == 0)
-					{
-						for (auto ikt = m_BoneIKNameSetting.begin(); ikt != m_BoneIKNameSetting.end(); ++ikt)
+						if (name.length() == 0 || ik_end_name.length() == 0)
 						{
-							if ((*ikt).bone == bone_param[i].name || (*ikt).bone == bone_param[i].name_en)
+							for (auto ikt = m_BoneIKNameSetting.begin(); ikt != m_BoneIKNameSetting.end(); ++ikt)
 							{
-								MString n = (*ikt).ik;
-								MString en = (*ikt).ikend;
-								for (auto it = m_BoneNameSetting.begin(); it != m_BoneNameSetting.end(); ++it)
+								if ((*ikt).bone == bone_names.Get(bone_param[i].name) || (*ikt).bone == bone_names.Get(bone_param[i].name_en))
 								{
-									if ((*it).en == name)
+									MString n = (*ikt).ik;
+									MString en = (*ikt).ikend;
+									for (auto it = m_BoneNameSetting.begin(); it != m_BoneNameSetting.end(); ++it)
 									{
-										n = (*it).jp;
-										break;
+										if ((*it).en == name)
+										{
+											n = (*it).jp;
+											break;
+										}
 									}
-								}
-								for (auto it = m_BoneNameSetting.begin(); it != m_BoneNameSetting.end(); ++it)
-								{
-									if ((*it).en == ik_end_name)
+									for (auto it = m_BoneNameSetting.begin(); it != m_BoneNameSetting.end(); ++it)
 									{
-										en = (*it).jp;
-										break;
+										if ((*it).en == ik_end_name)
+										{
+											en = (*it).jp;
+											break;
+										}
 									}
+									if (name.length() == 0)
+									{
+										name = n;
+									}
+									if (ik_end_name.length() == 0)
+									{
+										ik_end_name = en;
+									}
+									break;
 								}
-								if (name.length() == 0)
-								{
-									name = n;
-								}
-								if (ik_end_name.length() == 0)
-								{
-									ik_end_name = en;
-								}
-								break;
 							}
 						}
-					}
-					if (name.length() == 0)
-					{
-						name = MString(L"IK-") + bone_param[i].name;
-					}
-					if (ik_end_name.length() == 0)
-					{
-						ik_end_name = name + MString(L" end");
-					}
-
-					MAnsiString subname = getMultiBytesSubstring(name.toAnsiString(), 20);
-
-					Len = converter.Cp936ToUtf16(subname.c_str(), subname.length(), &RES) * 2;
-					bool IKMode = false;
-					if (subname.indexOf("足", 0) != -1)
-					{
-						IKMode = true;
-					}
-					fwrite(&Len, sizeof(int), 1, fh);
-					fwrite(RES.c_str(), Len, 1, fh);
-					Len = 0;
-					fwrite(&Len, sizeof(int), 1, fh);
-
-					float bone_head_pos[3];
-					bone_head_pos[0] = bone_param[i].org_tip.x * scaling;
-					bone_head_pos[1] = bone_param[i].org_tip.y * scaling;
-					bone_head_pos[2] = -bone_param[i].org_tip.z * scaling;
-					fwrite(&bone_head_pos, 4, 3, fh);
-
-					uint8_t parent_bone_index = 255;
-					if (bone_param[i].ikparent != 0)
-					{
-						if (!bone_param[i].ikparent_isik)
+						if (name.length() == 0)
 						{
-							parent_bone_index = bone_id_index[bone_param[i].ikparent];
+							name = MString(L"IK-") + bone_names.Get(bone_param[i].name);
 						}
-						else
+						if (ik_end_name.length() == 0)
 						{
-							parent_bone_index = bone_param[bone_id_index[bone_param[i].ikparent]].PMX_ik_index;
+							ik_end_name = name + MString(L" end");
 						}
-					}
-					fwrite(&parent_bone_index, sizeof(uint8_t), 1, fh);
-					int level = 0;
-					fwrite(&level, sizeof(int), 1, fh); //变形阶层
 
-					uint16_t BoneFlag = 63;//
-					fwrite(&BoneFlag, sizeof(uint16_t), 1, fh);
+						MString subname = getWideSubstring(name, 20);
 
-					if (BoneFlag & 0x0001) //假如指向骨骼，则骨骼序列为
-					{
-						uint8_t target_index = -1;
-						if (bone_param[i].PMX_ik_end_index >= 0)
-						{
-							target_index = bone_param[i].PMX_ik_end_index;
-						}
-						else if (bone_param[i].PMX_ik_parent_tip >= 0)
-						{
-							target_index = bone_param[i].PMX_ik_parent_tip;
-						}
-						fwrite(&target_index, sizeof(uint8_t), 1, fh);
-					}
-					if (BoneFlag & 0x0020)
-					{
-						uint8_t ik_target_bone_index = bone_param[i].PMX_tip_index; // IKターゲットボーン番号 // IKボーンが最初に接続するボーン
-						fwrite(&ik_target_bone_index, sizeof(uint8_t), 1, fh);
-						int ik_loop = 3; // 再帰演算回数 // IK値1
-						float ik_loop_angle_limit = 4;
-						if (IKMode)
+						// 書き出す名前で判定する。ナロー文字列のリテラルはビルド時のコードページになるのでワイド文字列で比べる
+						bool IKMode = false;
+						if (subname.indexOf(L"足", 0) != MString::kInvalid)
 						{
-							ik_loop = 40;
-							ik_loop_angle_limit = 2;
+							IKMode = true;
 						}
-						fwrite(&ik_loop, sizeof(int), 1, fh);
-						fwrite(&ik_loop_angle_limit, sizeof(float), 1, fh);
-						int ik_link_count = bone_param[i].PMX_ik_chain.size();
-						fwrite(&ik_link_count, sizeof(int), 1, fh);
-						for (size_t j = 0; j < ik_link_count; j++)
+						text.Write(subname);
+						text.WriteEmpty();
+
+						float bone_head_pos[3];
+						bone_head_pos[0] = bone_param[i].org_tip.x * scaling;
+						bone_head_pos[1] = bone_param[i].org_tip.y * scaling;
+						bone_head_pos[2] = -bone_param[i].org_tip.z * scaling;
+						fwrite(&bone_head_pos, 4, 3, fh);
+
+						int parent_bone_index = -1;
+						if (bone_param[i].ikparent != 0)
 						{
-							uint8_t link_target = -1;
-							if (j + 1 == ik_link_count && !bone_param[i].PMX_ik_root_tip)
+							if (!bone_param[i].ikparent_isik)
 							{
-								link_target = bone_param[bone_param[i].PMX_ik_chain[j]].PMX_root_index;
+								parent_bone_index = bone_id_index[bone_param[i].ikparent];
 							}
 							else
 							{
-								link_target = bone_param[bone_param[i].PMX_ik_chain[j]].PMX_tip_index;
-							}
-							fwrite(&link_target, sizeof(uint8_t), 1, fh);
-							byte angle_lock = 0;
-							if (IKMode && j == 0) angle_lock = 1;
-							fwrite(&angle_lock, 1, 1, fh);
-							if (angle_lock == 1 && j == 0)
-							{
-								float max_radian[3];
-								max_radian[0] = -3.14159f;
-								max_radian[1] = 0;
-								max_radian[2] = 0;
-								fwrite(&max_radian, 4, 3, fh);
-								float min_radian[3];
-								min_radian[0] = -0.0872f;
-								min_radian[1] = 0;
-								min_radian[2] = 0;
-								fwrite(&min_radian, 4, 3, fh);
+								parent_bone_index = bone_param[bone_id_index[bone_param[i].ikparent]].PMX_ik_index;
 							}
 						}
-					}
-					assert(PMXbone_index == bone_param[i].PMX_ik_index);
-					PMXbone_index++;
+						WritePMXIndex(fh, parent_bone_index, bone_index_size);
+						int level = 0;
+						fwrite(&level, sizeof(int), 1, fh); //变形阶层
 
-					if (option.output_ik_end)
-					{
-						subname = getMultiBytesSubstring(ik_end_name.toAnsiString(), 20);
-						Len = converter.Cp936ToUtf16(subname.c_str(), subname.length(), &RES) * 2;
-						fwrite(&Len, sizeof(int), 1, fh);
-						fwrite(RES.c_str(), Len, 1, fh);
-						Len = 0;
-						fwrite(&Len, sizeof(int), 1, fh);
-						MQPoint parent_dir = bone_param[i].org_root - bone_param[i].org_tip;
-						parent_dir.normalize();
-						MQPoint vec1(0, -1, 0), vec2(0, 0, -1);
-						MQPoint ik_end_dir;
-						if (fabs(GetInnerProduct(parent_dir, vec1)) < fabs(GetInnerProduct(parent_dir, vec2)))
+						uint16_t BoneFlag = 63;//
+						fwrite(&BoneFlag, sizeof(uint16_t), 1, fh);
+
+						if (BoneFlag & 0x0001) //假如指向骨骼，则骨骼序列为
 						{
-							ik_end_dir = vec1;
+							int target_index = -1;
+							if (bone_param[i].PMX_ik_end_index >= 0)
+							{
+								target_index = bone_param[i].PMX_ik_end_index;
+							}
+							else if (bone_param[i].PMX_ik_parent_tip >= 0)
+							{
+								target_index = bone_param[i].PMX_ik_parent_tip;
+							}
+							WritePMXIndex(fh, target_index, bone_index_size);
 						}
-						else
+						if (BoneFlag & 0x0020)
 						{
-							ik_end_dir = vec2;
+							int ik_target_bone_index = bone_param[i].PMX_tip_index; // IKターゲットボーン番号 // IKボーンが最初に接続するボーン
+							WritePMXIndex(fh, ik_target_bone_index, bone_index_size);
+							int ik_loop = 3; // 再帰演算回数 // IK値1
+							float ik_loop_angle_limit = 4;
+							if (IKMode)
+							{
+								ik_loop = 40;
+								ik_loop_angle_limit = 2;
+							}
+							fwrite(&ik_loop, sizeof(int), 1, fh);
+							fwrite(&ik_loop_angle_limit, sizeof(float), 1, fh);
+							int ik_link_count = bone_param[i].PMX_ik_chain.size();
+							fwrite(&ik_link_count, sizeof(int), 1, fh);
+							for (size_t j = 0; j < ik_link_count; j++)
+							{
+								int link_target = -1;
+								if (j + 1 == ik_link_count && !bone_param[i].PMX_ik_root_tip)
+								{
+									link_target = bone_param[bone_param[i].PMX_ik_chain[j]].PMX_root_index;
+								}
+								else
+								{
+									link_target = bone_param[bone_param[i].PMX_ik_chain[j]].PMX_tip_index;
+								}
+								WritePMXIndex(fh, link_target, bone_index_size);
+								byte angle_lock = 0;
+								if (IKMode && j == 0) angle_lock = 1;
+								fwrite(&angle_lock, 1, 1, fh);
+								if (angle_lock == 1 && j == 0)
+								{
+									float max_radian[3];
+									max_radian[0] = -3.14159f;
+									max_radian[1] = 0;
+									max_radian[2] = 0;
+									fwrite(&max_radian, 4, 3, fh);
+									float min_radian[3];
+									min_radian[0] = -0.0872f;
+									min_radian[1] = 0;
+									min_radian[2] = 0;
+									fwrite(&min_radian, 4, 3, fh);
+								}
+							}
 						}
+						assert(PMXbone_index == bone_param[i].PMX_ik_index);
+						PMXbone_index++;
 
-						if (!bone_param[i].children.empty())
+						if (option.output_ik_end)
 						{
-							MQPoint child_dir = bone_param[bone_param[i].children.front()].org_tip - bone_param[i].org_tip;
-							child_dir.normalize();
-							if (GetInnerProduct(child_dir, ik_end_dir) > 0)
+							text.Write(getWideSubstring(ik_end_name, 20));
+							text.WriteEmpty();
+							MQPoint parent_dir = bone_param[i].org_root - bone_param[i].org_tip;
+							parent_dir.normalize();
+							MQPoint vec1(0, -1, 0), vec2(0, 0, -1);
+							MQPoint ik_end_dir;
+							if (fabs(GetInnerProduct(parent_dir, vec1)) < fabs(GetInnerProduct(parent_dir, vec2)))
 							{
-								ik_end_dir = -ik_end_dir;
+								ik_end_dir = vec1;
+							}
+							else
+							{
+								ik_end_dir = vec2;
 							}
-						}
 
-						MQPoint ik_end_pos = bone_param[i].org_tip + ik_end_dir;
-						bone_head_pos[3];
-						bone_head_pos[0] = ik_end_pos.x * scaling;
-						bone_head_pos[1] = ik_end_pos.y * scaling;
-						bone_head_pos[2] = -ik_end_pos.z * scaling;
-						fwrite(&bone_head_pos, 4, 3, fh);
+							if (!bone_param[i].children.empty())
+							{
+								MQPoint child_dir = bone_param[bone_param[i].children.front()].org_tip - bone_param[i].org_tip;
+								child_dir.normalize();
+								if (GetInnerProduct(child_dir, ik_end_dir) > 0)
+								{
+									ik_end_dir = -ik_end_dir;
+								}
+							}
 
-						parent_bone_index = bone_param[i].PMX_ik_index;
-						fwrite(&parent_bone_index, sizeof(uint8_t), 1, fh);
-						Len = 0;
-						fwrite(&Len, sizeof(int), 1, fh); //变形阶层
+							MQPoint ik_end_pos = bone_param[i].org_tip + ik_end_dir;
+							bone_head_pos[3];
+							bone_head_pos[0] = ik_end_pos.x * scaling;
+							bone_head_pos[1] = ik_end_pos.y * scaling;
+							bone_head_pos[2] = -ik_end_pos.z * scaling;
+							fwrite(&bone_head_pos, 4, 3, fh);
 
-						BoneFlag = 19;
-						fwrite(&BoneFlag, sizeof(uint16_t), 1, fh);
+							parent_bone_index = bone_param[i].PMX_ik_index;
+							WritePMXIndex(fh, parent_bone_index, bone_index_size);
+							Len = 0;
+							fwrite(&Len, sizeof(int), 1, fh); //变形阶层
 
-						uint8_t target_index = -1;
-						fwrite(&target_index, sizeof(uint8_t), 1, fh);
+							BoneFlag = 19;
+							fwrite(&BoneFlag, sizeof(uint16_t), 1, fh);
 
-						assert(PMXbone_index == bone_param[i].PMX_ik_end_index);
+							WritePMXIndex(fh, -1, bone_index_size);
 
-						PMXbone_index++;
+							assert(PMXbone_index == bone_param[i].PMX_ik_end_index);
+
+							PMXbone_index++;
+						}
 					}
 				}
 			}
 		}
-	}
 
-	int skin_count = static_cast<int>(morph_param_list.size());
-	if (skin_count != 0)
-	{
-		int Save_skin_count = skin_count - 1;
-		fwrite(&Save_skin_count, sizeof(int), 1, fh);
-		float skin_vert_pos[3];
-		int skin_vert_index = 0;
-		int MAXCOUNT = 0;
-		int MAXTEMP = 0;
-		PMXMorphParam MaxParam;
-		for (int i = 0; i < skin_count; i++)
-		{
-			int TEMP = morph_param_list.at(i).vertNum;
-			if (TEMP > MAXCOUNT)
-			{
-				MAXCOUNT = TEMP;
-				MaxParam = morph_param_list.at(i);
-			}
-		}
-		std::vector<int> MaxList;
-		for (size_t i = 0; i < MAXCOUNT; i++)
+		stats.Enter(PMX_PHASE_MORPH);
+		progress.Enter(PMX_PHASE_MORPH);
+		WritePMXTail(fh, text_encoding, morph_param_list, morph_block, morph_index_size, scaling);
+		stats.Enter(PMX_PHASE_WRITE);
+		progress.Enter(PMX_PHASE_WRITE);
+
+		if (progress.IsCanceled() || ferror(fh))
 		{
-			MaxList.push_back(MaxParam.vertex.at(i).first);
+			abortFile();
+			return false;
 		}
+		deleteExportObjects();
 
-		for (int i = 0; i < skin_count; i++)
+		stats.SetFile(nullptr);
+		if (fclose(fh) != 0)
 		{
-			if (i == MAXTEMP)
-			{
-				continue;
-			}
-			PMXMorphParam* mParam = &morph_param_list.at(i);
+			remove(temp_filename.c_str());
+			removeAtlasFiles();
+			return false;
+		}
+		if (!MoveFileExA(temp_filename.c_str(), filename, MOVEFILE_REPLACE_EXISTING))
+		{
+			remove(temp_filename.c_str());
+			removeAtlasFiles();
+			return false;
+		}
 
-			auto subname = getMultiBytesSubstring(mParam->skin_name, 20);
-			Len = converter.Cp936ToUtf16(subname.c_str(), subname.length(), &RES) * 2;
-			fwrite(&Len, sizeof(int), 1, fh);
-			fwrite(RES.c_str(), Len, 1, fh);
-			Len = 0;
-			fwrite(&Len, sizeof(int), 1, fh);
-			fwrite(&mParam->type, sizeof(uint8_t), 1, fh);//Panel
-			uint8_t morph_type = 1;
-			fwrite(&morph_type, sizeof(uint8_t), 1, fh);//Kind=Vertex
-			fwrite(&mParam->vertNum, sizeof(int), 1, fh);//num
-			DWORD skin_vert_count = mParam->vertNum;
-			for (DWORD j = 0; j < skin_vert_count; ++j)
+		// 書き出したPMXから面を減らしたPMXを作る
+		if (option.export_lod)
+		{
+			std::vector<int> levels;
+			ParsePMXLodLevels(MString(option.lod_levels), levels);
+			MString pmx_filename = MString::fromAnsiString(filename);
+			PMXReader reader;
+			if (!levels.empty() && reader.Open(pmx_filename))
 			{
-				auto vertex = &mParam->vertex.at(j);
-				if (i == 0)
-				{
-					skin_vert_index = vertex->first;
-				}
-				else
+				for (size_t i = 0; i < levels.size(); i++)
 				{
-					skin_vert_index = static_cast<int>(distance(morph_base_vertex_index_list.begin(), find(morph_base_vertex_index_list.begin(), morph_base_vertex_index_list.end(), vertex->first)));
+					MString lod_filename = MFileUtil::changeExtension(pmx_filename, MString::format(L"_lod%d.pmx", levels[i]));
+					PMXLodResult lod;
+					MString error;
+					if (WritePMXLod(reader, lod_filename, levels[i] / 100.0f, lod, error))
+					{
+						LOG(MString::format(L"LOD %d%%: %d vertices, %d triangles", levels[i], lod.vertex_count, lod.triangle_count).c_str());
+					}
+					else
+					{
+						LOG(error.c_str());
+					}
 				}
-				skin_vert_index = MaxList[skin_vert_index];
-				fwrite(&skin_vert_index, 4, 1, fh);
-				skin_vert_pos[0] = vertex->second.x * scaling;
-				skin_vert_pos[1] = vertex->second.y * scaling;
-				skin_vert_pos[2] = -vertex->second.z * scaling;
-				fwrite(skin_vert_pos, 4, 3, fh);
 			}
 		}
-	}
-	else
+		return true;
+	};
+	bool exported = false;
+	progress.Run([&]()
 	{
-		fwrite(&skin_count, sizeof(int), 1, fh);
-	}
+		exported = writeModel();
+	});
+	progress.Close();
+	if (!exported)
+		return FALSE;
 
-	// 表情枠用表示リスト
-	int skin_disp_count = 2;
-	fwrite(&skin_disp_count, sizeof(int), 1, fh);
+	// PMXと同じフォルダにテクスチャをコピーする（バックグラウンド）
+	if (option.deploy_texture)
 	{
-		for (int i = 0; i < skin_disp_count; i++)
+		MString dst_dir = MFileUtil::extractDirectory(MString::fromAnsiString(filename));
+		std::vector<PMXTextureCopyJob> jobs;
+		for (int i = 0; i < textures.GetCount(); i++)
 		{
-			MAnsiString subname;
-			MAnsiString subnameEN;
-			if (i == 0)
-			{
-				subname = "Root";
-				subnameEN = "Root";
-			}
-			else
-			{
-				subname = "表情";
-				subnameEN = "Exp";
-			}
-			Len = converter.Cp936ToUtf16(subname.c_str(), subname.length(), &RES) * 2;
-			fwrite(&Len, sizeof(int), 1, fh);
-			fwrite(RES.c_str(), Len, 1, fh);
-			Len = converter.Cp936ToUtf16(subnameEN.c_str(), subnameEN.length(), &RES) * 2;
-			fwrite(&Len, sizeof(int), 1, fh);
-			fwrite(RES.c_str(), Len, 1, fh);
-			byte SystemNode = 1;
-			fwrite(&SystemNode, sizeof(byte), 1, fh);
-			int NodeNum = 0;
-			fwrite(&NodeNum, sizeof(int), 1, fh);
-		}
-	}
-
-	int rigid_body_count = 0;
-	fwrite(&rigid_body_count, sizeof(int), 1, fh);
-	int joint_count = 0;
-	fwrite(&joint_count, sizeof(int), 1, fh);
+			char path[_MAX_PATH];
+			if (!doc->FindMappingFile(path, textures.GetPath(i).c_str(), MQMAPPING_TEXTURE))
+				continue;
 
-	for (size_t i = 0; i < expobjs.size(); i++)
-	{
-		delete expobjs[i];
+			PMXTextureCopyJob job;
+			job.src = MString::fromAnsiString(path);
+			job.dst = MFileUtil::combinePath(dst_dir, MString::fromAnsiString(textures.GetName(i)));
+			if (_wcsicmp(job.src.c_str(), job.dst.c_str()) == 0)
+				continue;
+			jobs.push_back(job);
+		}
+		m_TextureDeployer.Start(std::move(jobs));
 	}
 
-	if (fclose(fh) != 0)
-	{
-		return FALSE;
-	}
+	writeReports();
 	return TRUE;
 }
 
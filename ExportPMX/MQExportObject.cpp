@@ -1,6 +1,7 @@
 ﻿#include "MQExportObject.h"
 
-MQExportObject::MQExportObject(MQObject obj, const MSeparateParam& separate_param)
+MQExportObject::MQExportObject(MQObject obj, const MSeparateParam& separate_param, PMXArena* arena)
+	: vert_face_begin(PMXArenaAllocator<int>(arena)), vert_faces(PMXArenaAllocator<int>(arena))
 {
 	int org_vc = obj->GetVertexCount();
 	int i, j;
@@ -38,16 +39,21 @@ MQExportObject::MQExportObject(MQObject obj, const MSeparateParam& separate_para
 		ch->next = -1;
 	}
 
-	std::vector<int> expvert_hash;
+	PMXArenaVector<int> expvert_hash((PMXArenaAllocator<int>(arena)));
+	expvert_hash.reserve(hashsize - org_vc);
+
+	// Reused for all faces
+	PMXArenaVector<int> ptarray((PMXArenaAllocator<int>(arena)));
+	PMXArenaVector<MQCoordinate> uvarray((PMXArenaAllocator<MQCoordinate>(arena)));
 
 	for (i = 0; i < m_fc; i++)
 	{
 		m_f[i].count = obj->GetFacePointCount(i);
 
-		std::vector<int> ptarray(m_f[i].count);
+		ptarray.resize(m_f[i].count);
 		obj->GetFacePointArray(i, ptarray.data());
 
-		std::vector<MQCoordinate> uvarray(m_f[i].count);
+		uvarray.resize(m_f[i].count);
 		obj->GetFaceCoordinateArray(i, uvarray.data());
 
 		for (j = 0; j < m_f[i].count; j++)
@@ -116,12 +122,28 @@ MQExportObject::MQExportObject(MQObject obj, const MSeparateParam& separate_para
 		m_v[i].col = hash[chi].col;
 	}
 
-	vert_faces.resize(m_vc);
+	// Count the faces of each vertex, then fill the lists in face order
+	vert_face_begin.assign(m_vc + 1, 0);
 	for (i = 0; i < m_fc; i++)
 	{
 		for (j = 0; j < m_f[i].count; j++)
 		{
-			vert_faces[m_vi[i][j]].push_back(i);
+			vert_face_begin[m_vi[i][j] + 1]++;
+		}
+	}
+	for (i = 0; i < m_vc; i++)
+	{
+		vert_face_begin[i + 1] += vert_face_begin[i];
+	}
+	vert_faces.resize(vert_face_begin[m_vc]);
+	{
+		PMXArenaVector<int> fill(vert_face_begin.begin(), vert_face_begin.end() - 1, PMXArenaAllocator<int>(arena));
+		for (i = 0; i < m_fc; i++)
+		{
+			for (j = 0; j < m_f[i].count; j++)
+			{
+				vert_faces[fill[m_vi[i][j]]++] = i;
+			}
 		}
 	}
 
@@ -135,44 +157,46 @@ MQExportObject::~MQExportObject()
 	delete[] m_f;
 }
 
-int MQExportObject::GetOriginalVertex(int vi)
+int MQExportObject::GetOriginalVertex(int vi) const
 {
 	return m_v[vi].vi;
 }
 
-MQPoint MQExportObject::GetVertexNormal(int vi)
+MQPoint MQExportObject::GetVertexNormal(int vi) const
 {
 	return m_v[vi].normal;
 }
 
-MQCoordinate MQExportObject::GetVertexCoordinate(int vi)
+MQCoordinate MQExportObject::GetVertexCoordinate(int vi) const
 {
 	return m_v[vi].t;
 }
 
-DWORD MQExportObject::GetVertexColor(int vi)
+DWORD MQExportObject::GetVertexColor(int vi) const
 {
 	return m_v[vi].col;
 }
 
-int MQExportObject::GetVertexRelatedFaces(int vi, int* array)
+int MQExportObject::GetVertexRelatedFaces(int vi, int* array) const
 {
+	int begin = vert_face_begin[vi];
+	int count = vert_face_begin[vi + 1] - begin;
 	if (array != nullptr)
 	{
-		for (size_t i = 0; i < vert_faces[vi].size(); i++)
+		for (int i = 0; i < count; i++)
 		{
-			array[i] = vert_faces[vi][i];
+			array[i] = vert_faces[begin + i];
 		}
 	}
-	return (int)vert_faces[vi].size();
+	return count;
 }
 
-int MQExportObject::GetFacePointCount(int fi)
+int MQExportObject::GetFacePointCount(int fi) const
 {
 	return m_f[fi].count;
 }
 
-void MQExportObject::GetFacePointArray(int fi, int* array)
+void MQExportObject::GetFacePointArray(int fi, int* array) const
 {
 	for (int i = 0; i < m_f[fi].count; i++)
 	{
@@ -4,6 +4,7 @@
 #include <windows.h>
 #include "MQPlugin.h"
 #include "MQ3DLib.h"
+#include "PMXArena.h"
 #include <vector>
 
 class MQExportObject
@@ -37,25 +38,28 @@ public:
 	};
 
 public:
-	MQExportObject(MQObject obj, const MSeparateParam& separate_param);
+	// The face lists of the vertices are taken from the arena if given.
+	MQExportObject(MQObject obj, const MSeparateParam& separate_param, PMXArena* arena = nullptr);
 	~MQExportObject();
 
 	int GetVertexCount() const { return m_vc; }
-	int GetOriginalVertex(int vi);
-	MQPoint GetVertexNormal(int vi);
-	MQCoordinate GetVertexCoordinate(int vi);
-	DWORD GetVertexColor(int vi);
-	int GetVertexRelatedFaces(int vi, int* array);
+	int GetOriginalVertex(int vi) const;
+	MQPoint GetVertexNormal(int vi) const;
+	MQCoordinate GetVertexCoordinate(int vi) const;
+	DWORD GetVertexColor(int vi) const;
+	int GetVertexRelatedFaces(int vi, int* array) const;
 
 	int GetFaceCount() const { return m_fc; }
-	int GetFacePointCount(int fi);
-	void GetFacePointArray(int fi, int* array);
+	int GetFacePointCount(int fi) const;
+	void GetFacePointArray(int fi, int* array) const;
 
 private:
 	MExportVertex* m_v;
 	MTexFace* m_f;
 	MQApexValueBase<int> m_vi;
-	std::vector<std::vector<int>> vert_faces;
+	// Faces of vertex vi are vert_faces[vert_face_begin[vi]] .. vert_faces[vert_face_begin[vi + 1] - 1]
+	PMXArenaVector<int> vert_face_begin;
+	PMXArenaVector<int> vert_faces;
 	int m_vc, m_fc;
 
 private:
@@ -0,0 +1,136 @@
+﻿#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <new>
+#include <vector>
+
+// Monotonic arena for the transient data of one export.
+// Memory is taken from large blocks and is never freed one by one; all
+// blocks are released at once by Release() or the destructor.
+// An arena must be used from one thread at a time.
+class PMXArena
+{
+public:
+	explicit PMXArena(size_t block_size = 1 << 20)
+	{
+		m_block_size = block_size;
+		m_head = nullptr;
+		m_ptr = nullptr;
+		m_end = nullptr;
+		m_total = 0;
+	}
+	~PMXArena()
+	{
+		Release();
+	}
+
+	void* Allocate(size_t bytes, size_t align)
+	{
+		char* p = alignUp(m_ptr, align);
+		if (p == nullptr || p + bytes > m_end)
+		{
+			addBlock(bytes + align);
+			p = alignUp(m_ptr, align);
+		}
+		m_ptr = p + bytes;
+		return p;
+	}
+
+	// Free all blocks. Memory handed out before is invalid after this.
+	void Release()
+	{
+		while (m_head != nullptr)
+		{
+			Block* next = m_head->next;
+			free(m_head);
+			m_head = next;
+		}
+		m_ptr = nullptr;
+		m_end = nullptr;
+		m_total = 0;
+	}
+
+	// Bytes reserved from the system
+	size_t GetReservedBytes() const { return m_total; }
+
+private:
+	struct Block
+	{
+		Block* next;
+		size_t size;
+	};
+
+	size_t m_block_size;
+	Block* m_head;
+	char* m_ptr;
+	char* m_end;
+	size_t m_total;
+
+	static char* alignUp(char* p, size_t align)
+	{
+		return (p == nullptr) ? nullptr : reinterpret_cast<char*>((reinterpret_cast<size_t>(p) + align - 1) & ~(align - 1));
+	}
+
+	void addBlock(size_t min_bytes)
+	{
+		// Blocks grow with the arena so that large exports need few of them
+		size_t size = m_block_size;
+		if (size < m_total / 2)
+			size = m_total / 2;
+		if (size < min_bytes + sizeof(Block))
+			size = min_bytes + sizeof(Block);
+		Block* block = static_cast<Block*>(malloc(size));
+		if (block == nullptr)
+			throw std::bad_alloc();
+		block->next = m_head;
+		block->size = size;
+		m_head = block;
+		m_ptr = reinterpret_cast<char*>(block + 1);
+		m_end = reinterpret_cast<char*>(block) + size;
+		m_total += size;
+	}
+
+	PMXArena(const PMXArena&);
+	PMXArena& operator=(const PMXArena&);
+};
+
+// STL allocator drawing from a PMXArena.
+// A default-constructed allocator (no arena) uses the heap, so containers
+// of this type also work outside an export session.
+template <typename T>
+class PMXArenaAllocator
+{
+public:
+	typedef T value_type;
+
+	PMXArenaAllocator() : m_arena(nullptr) {}
+	explicit PMXArenaAllocator(PMXArena* arena) : m_arena(arena) {}
+	template <typename U>
+	PMXArenaAllocator(const PMXArenaAllocator<U>& other) : m_arena(other.GetArena()) {}
+
+	T* allocate(size_t n)
+	{
+		if (m_arena != nullptr)
+			return static_cast<T*>(m_arena->Allocate(n * sizeof(T), alignof(T)));
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+	void deallocate(T* p, size_t)
+	{
+		if (m_arena == nullptr)
+			::operator delete(p);
+	}
+
+	PMXArena* GetArena() const { return m_arena; }
+
+private:
+	PMXArena* m_arena;
+};
+
+template <typename T, typename U>
+bool operator==(const PMXArenaAllocator<T>& a, const PMXArenaAllocator<U>& b) { return a.GetArena() == b.GetArena(); }
+template <typename T, typename U>
+bool operator!=(const PMXArenaAllocator<T>& a, const PMXArenaAllocator<U>& b) { return a.GetArena() != b.GetArena(); }
+
+template <typename T>
+using PMXArenaVector = std::vector<T, PMXArenaAllocator<T>>;
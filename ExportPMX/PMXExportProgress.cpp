@@ -0,0 +1,247 @@
+﻿#include "PMXExportProgress.h"
+#include "MQWidget.h"
+#include "MString.h"
+#include <algorithm>
+
+// Interval of repainting and pumping the messages
+static const DWORD PROGRESS_UPDATE_INTERVAL = 50;
+
+class PMXExportProgressWindow : public MQWindow
+{
+public:
+	PMXExportProgressWindow(MQWindowBase& parent, std::atomic<bool>* canceled);
+
+	void Update(const wchar_t* text, double position);
+
+private:
+	MQLabel* m_label;
+	MQProgressBar* m_bar;
+	MQButton* m_cancel;
+	std::atomic<bool>* m_canceled;
+
+	BOOL CancelClicked(MQWidgetBase* sender, MQDocument doc);
+};
+
+PMXExportProgressWindow::PMXExportProgressWindow(MQWindowBase& parent, std::atomic<bool>* canceled) : MQWindow(parent)
+{
+	m_canceled = canceled;
+
+	SetTitle(L"导出PMX");
+	SetCloseButton(false);
+	SetMinimizeButton(false);
+	SetMaximizeButton(false);
+	SetCanResize(false);
+
+	MQFrame* frame = CreateVerticalFrame(this);
+	m_label = CreateLabel(frame, L"");
+	m_bar = CreateProgressBar(frame);
+	m_bar->SetMin(0.0);
+	m_bar->SetMax(1.0);
+	m_bar->SetHintSizeRateX(30);
+	m_cancel = CreateButton(frame, L"取消");
+	m_cancel->AddClickEvent(this, &PMXExportProgressWindow::CancelClicked);
+}
+
+void PMXExportProgressWindow::Update(const wchar_t* text, double position)
+{
+	m_label->SetText(text);
+	m_bar->SetPosition(position);
+}
+
+BOOL PMXExportProgressWindow::CancelClicked(MQWidgetBase* sender, MQDocument doc)
+{
+	*m_canceled = true;
+	m_label->SetText(L"正在取消...");
+	m_cancel->SetEnabled(false);
+	return FALSE;
+}
+
+static const wchar_t* getPhaseLabel(PMXExportPhase phase)
+{
+	switch (phase)
+	{
+	case PMX_PHASE_BONE_GATHER: return L"读取骨骼";
+	case PMX_PHASE_MORPH_QUERY: return L"读取表情";
+	case PMX_PHASE_EXPORT_OBJECT: return L"处理对象";
+	case PMX_PHASE_VERTEX: return L"写入顶点";
+	case PMX_PHASE_TRIANGULATE: return L"写入面";
+	case PMX_PHASE_MATERIAL: return L"处理材质";
+	case PMX_PHASE_BONE: return L"处理骨骼";
+	case PMX_PHASE_MORPH: return L"处理表情";
+	case PMX_PHASE_WRITE: return L"写入文件";
+	default: return L"";
+	}
+}
+
+PMXExportProgress::PMXExportProgress() : m_canceled(false), m_stage(0), m_total(0), m_done(0), m_phase(PMX_PHASE_NONE)
+{
+	m_window = nullptr;
+	m_stage_num = 1;
+	m_last_update = 0;
+	m_main_thread = GetCurrentThreadId();
+	m_quit = false;
+	m_work = nullptr;
+	m_call = nullptr;
+	m_call_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+	m_call_done_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+}
+
+PMXExportProgress::~PMXExportProgress()
+{
+	Close();
+	CloseHandle(m_call_event);
+	CloseHandle(m_call_done_event);
+}
+
+void PMXExportProgress::Show(int stage_num)
+{
+	m_stage = 0;
+	m_stage_num = (stage_num > 0) ? stage_num : 1;
+	if (m_window != nullptr)
+		return;
+
+	MQWindow mainwin = MQWindow::GetMainWindow();
+	if (mainwin.GetID() <= MQWidgetBase::NullID)
+		return;
+
+	m_window = new PMXExportProgressWindow(mainwin, &m_canceled);
+	m_window->SetVisible(true);
+	// Keep the document from being edited while it is exported
+	m_window->SetModal();
+	update(true);
+}
+
+void PMXExportProgress::Close()
+{
+	if (m_window == nullptr)
+		return;
+	m_window->ReleaseModal();
+	m_window->SetVisible(false);
+	delete m_window;
+	m_window = nullptr;
+}
+
+bool PMXExportProgress::Enter(PMXExportPhase phase, int total)
+{
+	m_done = 0;
+	m_total = total;
+	m_phase = phase;
+	m_stage++;
+	if (isMainThread())
+	{
+		update(true);
+	}
+	return !m_canceled;
+}
+
+bool PMXExportProgress::Step(int done)
+{
+	m_done = done;
+	if (isMainThread())
+	{
+		update(false);
+	}
+	return !m_canceled;
+}
+
+void PMXExportProgress::Run(const std::function<void()>& work)
+{
+	m_work = &work;
+	HANDLE thread = CreateThread(nullptr, 0, threadProc, this, 0, nullptr);
+	if (thread == nullptr)
+	{
+		// Export on this thread as before when no thread can be started
+		work();
+		m_work = nullptr;
+		return;
+	}
+
+	HANDLE handles[2] = { thread, m_call_event };
+	for (;;)
+	{
+		// After WM_QUIT the messages are left to the host
+		DWORD wait = m_quit
+			? WaitForMultipleObjects(2, handles, FALSE, PROGRESS_UPDATE_INTERVAL)
+			: MsgWaitForMultipleObjects(2, handles, FALSE, PROGRESS_UPDATE_INTERVAL, QS_ALLINPUT);
+		if (wait == WAIT_OBJECT_0)
+			break;
+		if (wait == WAIT_OBJECT_0 + 1)
+		{
+			(*m_call)();
+			SetEvent(m_call_done_event);
+		}
+		pumpMessages();
+		update(false);
+	}
+	CloseHandle(thread);
+	m_work = nullptr;
+	update(true);
+}
+
+void PMXExportProgress::CallOnMainThread(const std::function<void()>& func)
+{
+	if (isMainThread())
+	{
+		func();
+		return;
+	}
+	m_call = &func;
+	SetEvent(m_call_event);
+	WaitForSingleObject(m_call_done_event, INFINITE);
+	m_call = nullptr;
+}
+
+DWORD WINAPI PMXExportProgress::threadProc(LPVOID param)
+{
+	PMXExportProgress* progress = static_cast<PMXExportProgress*>(param);
+	(*progress->m_work)();
+	return 0;
+}
+
+void PMXExportProgress::update(bool force)
+{
+	if (m_window == nullptr)
+		return;
+
+	DWORD now = GetTickCount();
+	if (!force && now - m_last_update < PROGRESS_UPDATE_INTERVAL)
+		return;
+	m_last_update = now;
+
+	int done = m_done;
+	int total = m_total;
+	PMXExportPhase phase = static_cast<PMXExportPhase>(m_phase.load());
+	double stage_rate = (total > 0) ? static_cast<double>(std::min(done, total)) / total : 0.0;
+	double position = (std::max(m_stage - 1, 0) + stage_rate) / m_stage_num;
+	if (!m_canceled)
+	{
+		MString text = (total > 0)
+			? MString::format(L"%s  %d / %d", getPhaseLabel(phase), done, total)
+			: MString(getPhaseLabel(phase));
+		m_window->Update(text.c_str(), std::min(position, 1.0));
+	}
+
+	pumpMessages();
+}
+
+void PMXExportProgress::pumpMessages()
+{
+	if (m_window == nullptr || m_quit)
+		return;
+
+	MSG msg;
+	while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE))
+	{
+		if (msg.message == WM_QUIT)
+		{
+			// The host is closing. Cancel the export and leave WM_QUIT to the
+			// message loop of the host, which would never see it otherwise.
+			m_quit = true;
+			m_canceled = true;
+			PostQuitMessage(static_cast<int>(msg.wParam));
+			return;
+		}
+		TranslateMessage(&msg);
+		DispatchMessage(&msg);
+	}
+}
@@ -0,0 +1,69 @@
+﻿#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "PMXExportStats.h"
+#include <atomic>
+#include <functional>
+
+class PMXExportProgressWindow;
+
+// Progress window of an export with a Cancel button.
+// The host may only be called on the main thread, so ExportFile copies the
+// document out on the main thread first and then does the rest in Run(), which
+// starts a worker thread and keeps the window repainting and the Cancel button
+// responding until the worker returns. Enter() and Step() may be called on
+// either thread; the window is only touched on the main thread, and on the
+// worker they only record the progress.
+// The main thread is the thread that created the object.
+// Nothing is shown without a main window (e.g. on the headless host).
+class PMXExportProgress
+{
+public:
+	PMXExportProgress();
+	~PMXExportProgress();
+
+	// Show the window. stage_num is the number of Enter() calls expected.
+	void Show(int stage_num);
+	void Close();
+
+	// Start the next stage with 'total' chunks of work.
+	// Returns false if the export has been canceled.
+	bool Enter(PMXExportPhase phase, int total = 0);
+	// 'done' chunks of the current stage are finished.
+	// Returns false if the export has been canceled.
+	bool Step(int done);
+
+	bool IsCanceled() const { return m_canceled; }
+
+	// Run 'work' in a worker thread and wait for it, updating the window.
+	// Must be called on the main thread.
+	void Run(const std::function<void()>& work);
+	// Run 'func' on the main thread and wait for it, e.g. to read an object from
+	// the host in the worker. Runs it at once when called on the main thread.
+	void CallOnMainThread(const std::function<void()>& func);
+
+private:
+	PMXExportProgressWindow* m_window;
+	std::atomic<bool> m_canceled;
+	std::atomic<int> m_stage;
+	int m_stage_num;
+	std::atomic<int> m_total;
+	std::atomic<int> m_done;
+	std::atomic<int> m_phase;
+	DWORD m_last_update;
+	DWORD m_main_thread;
+	bool m_quit; // WM_QUIT was taken from the queue and posted again
+	const std::function<void()>* m_work;
+	const std::function<void()>* m_call;
+	HANDLE m_call_event;
+	HANDLE m_call_done_event;
+
+	bool isMainThread() const { return GetCurrentThreadId() == m_main_thread; }
+	void update(bool force);
+	void pumpMessages();
+	static DWORD WINAPI threadProc(LPVOID param);
+
+	PMXExportProgress(const PMXExportProgress&);
+	PMXExportProgress& operator=(const PMXExportProgress&);
+};
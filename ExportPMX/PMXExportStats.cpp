@@ -0,0 +1,245 @@
+﻿#include "PMXExportStats.h"
+#include <psapi.h>
+#include <assert.h>
+#include <atomic>
+#include <vector>
+
+// Host messages are counted by putting a counting function in front of
+// MQ_SendMessage while an export is measured. The bone and morph plugins are
+// reached through it, so this covers the calls per vertex and per bone.
+static std::atomic<unsigned __int64> s_host_messages(0);
+static decltype(MQ_SendMessage) s_org_send_message = nullptr;
+
+static PMXExportStats s_last;
+
+static BOOL MQAPICALL countingSendMessage(int message_type, MQSendMessageInfo* info)
+{
+	s_host_messages++;
+	return s_org_send_message(message_type, info);
+}
+
+static unsigned __int64 getCommitSize(bool peak)
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	memset(&counters, 0, sizeof(counters));
+	counters.cb = sizeof(counters);
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return peak ? counters.PeakPagefileUsage : counters.PagefileUsage;
+}
+
+PMXExportStats::PMXExportStats()
+{
+	m_phase = PMX_PHASE_NONE;
+	m_phase_host_messages = 0;
+	m_phase_file_pos = 0;
+	m_file = nullptr;
+	m_counting = false;
+	for (int i = 0; i < PMX_PHASE_NUM; i++)
+	{
+		m_phase_ms[i] = 0;
+		m_host_messages[i] = 0;
+		m_bytes[i] = 0;
+	}
+	m_start_commit = 0;
+	m_end_commit = 0;
+	m_peak_commit = 0;
+}
+
+PMXExportStats::~PMXExportStats()
+{
+	// ExportFile may return before finishing
+	Finish();
+}
+
+void PMXExportStats::Begin()
+{
+	m_start_commit = getCommitSize(false);
+	InstallHook();
+}
+
+void PMXExportStats::InstallHook()
+{
+	if (!m_counting && MQ_SendMessage != nullptr && MQ_SendMessage != countingSendMessage)
+	{
+		s_org_send_message = MQ_SendMessage;
+		MQ_SendMessage = countingSendMessage;
+		m_counting = true;
+	}
+}
+
+void PMXExportStats::RemoveHook()
+{
+	if (!m_counting)
+		return;
+	// A hook installed over this one must have been removed first
+	assert(MQ_SendMessage == countingSendMessage);
+	if (MQ_SendMessage == countingSendMessage)
+		MQ_SendMessage = s_org_send_message;
+	m_counting = false;
+}
+
+void PMXExportStats::Enter(PMXExportPhase phase)
+{
+	closePhase();
+	m_phase = phase;
+	m_phase_start = Clock::now();
+	m_phase_host_messages = s_host_messages;
+	if (m_file != nullptr)
+		m_phase_file_pos = _ftelli64(m_file);
+}
+
+void PMXExportStats::SetFile(FILE* fh)
+{
+	// Bytes written so far belong to the current phase
+	if (m_file != nullptr && m_phase != PMX_PHASE_NONE)
+	{
+		__int64 pos = _ftelli64(m_file);
+		m_bytes[m_phase] += pos - m_phase_file_pos;
+		m_phase_file_pos = pos;
+	}
+	m_file = fh;
+	if (m_file != nullptr)
+		m_phase_file_pos = _ftelli64(m_file);
+}
+
+void PMXExportStats::Finish()
+{
+	// Already finished
+	if (m_phase == PMX_PHASE_NONE && !m_counting)
+		return;
+
+	closePhase();
+	m_phase = PMX_PHASE_NONE;
+	m_file = nullptr;
+	RemoveHook();
+	m_end_commit = getCommitSize(false);
+	m_peak_commit = getCommitSize(true);
+	s_last = *this;
+}
+
+void PMXExportStats::closePhase()
+{
+	if (m_phase == PMX_PHASE_NONE)
+		return;
+	m_phase_ms[m_phase] += std::chrono::duration<double, std::milli>(Clock::now() - m_phase_start).count();
+	m_host_messages[m_phase] += s_host_messages - m_phase_host_messages;
+	if (m_file != nullptr)
+		m_bytes[m_phase] += _ftelli64(m_file) - m_phase_file_pos;
+}
+
+__int64 PMXExportStats::getCommitGrowth() const
+{
+	return static_cast<__int64>(m_end_commit) - static_cast<__int64>(m_start_commit);
+}
+
+void PMXExportStats::SetCount(const char* name, __int64 value)
+{
+	for (auto it = m_counts.begin(); it != m_counts.end(); ++it)
+	{
+		if (it->first == name)
+		{
+			it->second = value;
+			return;
+		}
+	}
+	m_counts.push_back(std::make_pair(std::string(name), value));
+}
+
+double PMXExportStats::GetTotalMs() const
+{
+	double total = 0;
+	for (int i = 0; i < PMX_PHASE_NUM; i++)
+	{
+		if (i != PMX_PHASE_DIALOG)
+			total += m_phase_ms[i];
+	}
+	return total;
+}
+
+unsigned __int64 PMXExportStats::GetHostMessages() const
+{
+	unsigned __int64 total = 0;
+	for (int i = 0; i < PMX_PHASE_NUM; i++)
+		total += m_host_messages[i];
+	return total;
+}
+
+unsigned __int64 PMXExportStats::GetBytesWritten() const
+{
+	unsigned __int64 total = 0;
+	for (int i = 0; i < PMX_PHASE_NUM; i++)
+		total += m_bytes[i];
+	return total;
+}
+
+const PMXExportStats& PMXExportStats::GetLast()
+{
+	return s_last;
+}
+
+const char* PMXExportStats::GetPhaseName(PMXExportPhase phase)
+{
+	static const char* names[PMX_PHASE_NUM] = {
+		"bone_gather",
+		"morph_query",
+		"dialog",
+		"export_object",
+		"vertex",
+		"triangulate",
+		"material",
+		"bone",
+		"morph",
+		"write",
+	};
+	return (phase >= 0 && phase < PMX_PHASE_NUM) ? names[phase] : "";
+}
+
+MString PMXExportStats::GetSummary() const
+{
+	std::vector<MString> phases;
+	for (int i = 0; i < PMX_PHASE_NUM; i++)
+	{
+		MString name = MString::fromAnsiString(GetPhaseName(static_cast<PMXExportPhase>(i)));
+		phases.push_back(MString::format(L"%s %.1f", name.c_str(), m_phase_ms[i]));
+	}
+	MString summary = MString::format(L"Export: %.1f ms without the dialog (%s), %I64u host messages, %I64u bytes, commit %+I64d KB (process peak %I64u KB)",
+		GetTotalMs(), MString::combine(phases, L", ").c_str(), GetHostMessages(), GetBytesWritten(), getCommitGrowth() / 1024, m_peak_commit / 1024);
+	for (auto it = m_counts.begin(); it != m_counts.end(); ++it)
+	{
+		summary += MString::format(L", %s %I64d", MString::fromAnsiString(it->first.c_str()).c_str(), it->second);
+	}
+	return summary;
+}
+
+bool PMXExportStats::WriteJson(const MString& filename) const
+{
+	FILE* fh;
+	if (_wfopen_s(&fh, filename.c_str(), L"w") != 0)
+		return false;
+
+	fprintf(fh, "{\n");
+	fprintf(fh, "  \"total_ms\": %.3f,\n", GetTotalMs());
+	fprintf(fh, "  \"host_messages\": %I64u,\n", GetHostMessages());
+	fprintf(fh, "  \"bytes_written\": %I64u,\n", GetBytesWritten());
+	fprintf(fh, "  \"start_commit_bytes\": %I64u,\n", m_start_commit);
+	fprintf(fh, "  \"end_commit_bytes\": %I64u,\n", m_end_commit);
+	fprintf(fh, "  \"commit_growth_bytes\": %I64d,\n", getCommitGrowth());
+	fprintf(fh, "  \"process_peak_commit_bytes\": %I64u,\n", m_peak_commit);
+	fprintf(fh, "  \"counts\": {");
+	for (size_t i = 0; i < m_counts.size(); i++)
+	{
+		fprintf(fh, "%s\n    \"%s\": %I64d", (i > 0) ? "," : "", m_counts[i].first.c_str(), m_counts[i].second);
+	}
+	fprintf(fh, m_counts.empty() ? "},\n" : "\n  },\n");
+	fprintf(fh, "  \"phases\": [\n");
+	for (int i = 0; i < PMX_PHASE_NUM; i++)
+	{
+		fprintf(fh, "    { \"name\": \"%s\", \"ms\": %.3f, \"host_messages\": %I64u, \"bytes\": %I64u }%s\n",
+			GetPhaseName(static_cast<PMXExportPhase>(i)), m_phase_ms[i], m_host_messages[i], m_bytes[i], (i + 1 < PMX_PHASE_NUM) ? "," : "");
+	}
+	fprintf(fh, "  ]\n");
+	fprintf(fh, "}\n");
+
+	return fclose(fh) == 0;
+}
@@ -0,0 +1,94 @@
+﻿#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "MQPlugin.h"
+#include "MString.h"
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Phases of ExportFile
+enum PMXExportPhase
+{
+	PMX_PHASE_NONE = -1,
+	PMX_PHASE_BONE_GATHER = 0, // query bones from the bone plugin
+	PMX_PHASE_MORPH_QUERY,     // query morph setup from the morph plugin
+	PMX_PHASE_DIALOG,          // option dialog (includes the user's time)
+	PMX_PHASE_EXPORT_OBJECT,   // build MQExportObject
+	PMX_PHASE_VERTEX,          // encode vertices and weights
+	PMX_PHASE_TRIANGULATE,     // triangulate and write faces
+	PMX_PHASE_MATERIAL,        // collect and write materials and textures
+	PMX_PHASE_BONE,            // sort and write bones
+	PMX_PHASE_MORPH,           // extract and write morphs and display frames
+	PMX_PHASE_WRITE,           // header, remaining sections and closing the file
+	PMX_PHASE_NUM,
+};
+
+// Timings and counters of an export.
+// ExportFile enters each phase in turn; the time, host messages and bytes
+// written since the previous Enter() are added to the previous phase.
+// Only MQ_SendMessage is counted (this includes the bone and morph plugins);
+// the object and document functions are ranked by PMXHostProfiler.
+class PMXExportStats
+{
+public:
+	PMXExportStats();
+	~PMXExportStats();
+
+	// Start counting. Host messages are counted until Finish().
+	void Begin();
+	// Switch to the phase
+	void Enter(PMXExportPhase phase);
+	// The file the written bytes are counted from, or nullptr before closing it
+	void SetFile(FILE* fh);
+	// Stop counting
+	void Finish();
+	// Take the counting function out of MQ_SendMessage and put it back, so
+	// that another hook can be installed or removed under it. Hooks must be
+	// removed in the reverse order of installing them.
+	void RemoveHook();
+	void InstallHook();
+
+	// Time of the phases but the option dialog, which waits for the user
+	double GetTotalMs() const;
+	double GetPhaseMs(PMXExportPhase phase) const { return m_phase_ms[phase]; }
+	unsigned __int64 GetHostMessages() const;
+	unsigned __int64 GetBytesWritten() const;
+
+	// Set a named count of the export (e.g. the materials before and after
+	// merging). Counts are listed in the summary and the JSON in the order set.
+	void SetCount(const char* name, __int64 value);
+	const std::vector<std::pair<std::string, __int64>>& GetCounts() const { return m_counts; }
+
+	static const char* GetPhaseName(PMXExportPhase phase);
+	// The statistics of the last finished export (e.g. for the benchmark)
+	static const PMXExportStats& GetLast();
+
+	// One line summary for the log
+	MString GetSummary() const;
+	// Write the statistics as JSON
+	bool WriteJson(const MString& filename) const;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	PMXExportPhase m_phase;
+	Clock::time_point m_phase_start;
+	unsigned __int64 m_phase_host_messages;
+	__int64 m_phase_file_pos;
+	FILE* m_file;
+	bool m_counting;
+
+	double m_phase_ms[PMX_PHASE_NUM];
+	unsigned __int64 m_host_messages[PMX_PHASE_NUM];
+	unsigned __int64 m_bytes[PMX_PHASE_NUM];
+	unsigned __int64 m_start_commit;
+	unsigned __int64 m_end_commit;
+	unsigned __int64 m_peak_commit; // peak of the process, not of the export
+	std::vector<std::pair<std::string, __int64>> m_counts;
+
+	void closePhase();
+	__int64 getCommitGrowth() const;
+};
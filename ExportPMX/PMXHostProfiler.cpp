@@ -0,0 +1,453 @@
+﻿#include "PMXHostProfiler.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+
+// Function pointers of MQInit.cpp except MQ_SendMessage, which has its own probe
+#define PMX_HOST_FUNCTIONS(X) \
+	X(MQ_GetWindowHandle) \
+	X(MQ_CreateObject) \
+	X(MQ_CreateMaterial) \
+	X(MQ_ShowFileDialog) \
+	X(MQ_ImportAxis) \
+	X(MQ_ExportAxis) \
+	X(MQ_LoadImage) \
+	X(MQ_LoadImageW) \
+	X(MQ_GetSystemPath) \
+	X(MQ_GetSystemPathW) \
+	X(MQ_RefreshView) \
+	X(MQ_StationCallback) \
+	X(MQDoc_GetObjectCount) \
+	X(MQDoc_GetObject) \
+	X(MQDoc_GetObjectFromUniqueID) \
+	X(MQDoc_GetCurrentObjectIndex) \
+	X(MQDoc_SetCurrentObjectIndex) \
+	X(MQDoc_AddObject) \
+	X(MQDoc_DeleteObject) \
+	X(MQDoc_GetObjectIndex) \
+	X(MQDoc_GetUnusedObjectName) \
+	X(MQDoc_GetMaterialCount) \
+	X(MQDoc_GetMaterial) \
+	X(MQDoc_GetMaterialFromUniqueID) \
+	X(MQDoc_GetCurrentMaterialIndex) \
+	X(MQDoc_SetCurrentMaterialIndex) \
+	X(MQDoc_AddMaterial) \
+	X(MQDoc_DeleteMaterial) \
+	X(MQDoc_GetUnusedMaterialName) \
+	X(MQDoc_Compact) \
+	X(MQDoc_ClearSelect) \
+	X(MQDoc_AddSelectVertex) \
+	X(MQDoc_DeleteSelectVertex) \
+	X(MQDoc_IsSelectVertex) \
+	X(MQDoc_AddSelectLine) \
+	X(MQDoc_DeleteSelectLine) \
+	X(MQDoc_IsSelectLine) \
+	X(MQDoc_AddSelectFace) \
+	X(MQDoc_DeleteSelectFace) \
+	X(MQDoc_IsSelectFace) \
+	X(MQDoc_AddSelectUVVertex) \
+	X(MQDoc_DeleteSelectUVVertex) \
+	X(MQDoc_IsSelectUVVertex) \
+	X(MQDoc_FindMappingFile) \
+	X(MQDoc_FindMappingFileW) \
+	X(MQDoc_GetScene) \
+	X(MQDoc_GetMappingImage) \
+	X(MQDoc_GetMappingImageW) \
+	X(MQDoc_GetParentObject) \
+	X(MQDoc_GetChildObjectCount) \
+	X(MQDoc_GetChildObject) \
+	X(MQDoc_GetGlobalMatrix) \
+	X(MQDoc_GetGlobalInverseMatrix) \
+	X(MQDoc_InsertObject) \
+	X(MQDoc_CreateUserData) \
+	X(MQDoc_DeleteUserData) \
+	X(MQDoc_Triangulate) \
+	X(MQScene_InitSize) \
+	X(MQScene_GetProjMatrix) \
+	X(MQScene_GetViewMatrix) \
+	X(MQScene_FloatValue) \
+	X(MQScene_GetVisibleFace) \
+	X(MQScene_IntValue) \
+	X(MQObj_Delete) \
+	X(MQObj_Clone) \
+	X(MQObj_Merge) \
+	X(MQObj_Freeze) \
+	X(MQObj_GetName) \
+	X(MQObj_GetVertexCount) \
+	X(MQObj_GetVertex) \
+	X(MQObj_SetVertex) \
+	X(MQObj_GetVertexArray) \
+	X(MQObj_GetFaceCount) \
+	X(MQObj_GetFacePointCount) \
+	X(MQObj_GetFacePointArray) \
+	X(MQObj_GetFaceCoordinateArray) \
+	X(MQObj_GetFaceMaterial) \
+	X(MQObj_GetFaceUniqueID) \
+	X(MQObj_GetFaceIndexFromUniqueID) \
+	X(MQObj_SetName) \
+	X(MQObj_AddVertex) \
+	X(MQObj_DeleteVertex) \
+	X(MQObj_GetVertexRefCount) \
+	X(MQObj_GetVertexUniqueID) \
+	X(MQObj_GetVertexIndexFromUniqueID) \
+	X(MQObj_GetVertexRelatedFaces) \
+	X(MQObj_GetVertexWeight) \
+	X(MQObj_SetVertexWeight) \
+	X(MQObj_CopyVertexAttribute) \
+	X(MQObj_AddFace) \
+	X(MQObj_InsertFace) \
+	X(MQObj_DeleteFace) \
+	X(MQObj_InvertFace) \
+	X(MQObj_SetFaceMaterial) \
+	X(MQObj_SetFaceCoordinateArray) \
+	X(MQObj_GetFaceVertexColor) \
+	X(MQObj_SetFaceVertexColor) \
+	X(MQObj_GetFaceEdgeCrease) \
+	X(MQObj_SetFaceEdgeCrease) \
+	X(MQObj_GetFaceVisible) \
+	X(MQObj_SetFaceVisible) \
+	X(MQObj_OptimizeVertex) \
+	X(MQObj_Compact) \
+	X(MQObj_GetVisible) \
+	X(MQObj_SetVisible) \
+	X(MQObj_GetPatchType) \
+	X(MQObj_SetPatchType) \
+	X(MQObj_GetPatchSegment) \
+	X(MQObj_SetPatchSegment) \
+	X(MQObj_GetShading) \
+	X(MQObj_SetShading) \
+	X(MQObj_GetSmoothAngle) \
+	X(MQObj_SetSmoothAngle) \
+	X(MQObj_GetMirrorType) \
+	X(MQObj_SetMirrorType) \
+	X(MQObj_GetMirrorAxis) \
+	X(MQObj_SetMirrorAxis) \
+	X(MQObj_GetMirrorDistance) \
+	X(MQObj_SetMirrorDistance) \
+	X(MQObj_GetLatheType) \
+	X(MQObj_SetLatheType) \
+	X(MQObj_GetLatheAxis) \
+	X(MQObj_SetLatheAxis) \
+	X(MQObj_GetLatheSegment) \
+	X(MQObj_SetLatheSegment) \
+	X(MQObj_GetIntValue) \
+	X(MQObj_GetFloatArray) \
+	X(MQObj_SetIntValue) \
+	X(MQObj_SetFloatArray) \
+	X(MQObj_PointerArray) \
+	X(MQObj_AllocUserData) \
+	X(MQObj_FreeUserData) \
+	X(MQObj_GetUserData) \
+	X(MQObj_SetUserData) \
+	X(MQObj_AllocVertexUserData) \
+	X(MQObj_FreeVertexUserData) \
+	X(MQObj_GetVertexUserData) \
+	X(MQObj_SetVertexUserData) \
+	X(MQObj_AllocFaceUserData) \
+	X(MQObj_FreeFaceUserData) \
+	X(MQObj_GetFaceUserData) \
+	X(MQObj_SetFaceUserData) \
+	X(MQMat_Delete) \
+	X(MQMat_GetIntValue) \
+	X(MQMat_GetFloatArray) \
+	X(MQMat_GetName) \
+	X(MQMat_GetColor) \
+	X(MQMat_GetAlpha) \
+	X(MQMat_GetDiffuse) \
+	X(MQMat_GetAmbient) \
+	X(MQMat_GetEmission) \
+	X(MQMat_GetSpecular) \
+	X(MQMat_GetPower) \
+	X(MQMat_GetTextureName) \
+	X(MQMat_GetAlphaName) \
+	X(MQMat_GetBumpName) \
+	X(MQMat_SetIntValue) \
+	X(MQMat_SetFloatArray) \
+	X(MQMat_SetName) \
+	X(MQMat_SetColor) \
+	X(MQMat_SetAlpha) \
+	X(MQMat_SetDiffuse) \
+	X(MQMat_SetAmbient) \
+	X(MQMat_SetEmission) \
+	X(MQMat_SetSpecular) \
+	X(MQMat_SetPower) \
+	X(MQMat_SetTextureName) \
+	X(MQMat_SetAlphaName) \
+	X(MQMat_SetBumpName) \
+	X(MQMat_AllocUserData) \
+	X(MQMat_FreeUserData) \
+	X(MQMat_GetUserData) \
+	X(MQMat_SetUserData) \
+	X(MQMat_GetValueArray) \
+	X(MQMat_SetValueArray) \
+	X(MQShaderNode_GetValueArray) \
+	X(MQShaderNode_SetValueArray) \
+	X(MQMatrix_FloatValue) \
+	X(MQXmlElem_Value) \
+	X(MQXmlDoc_Value) \
+	X(MQWidget_Value) \
+	X(MQCanvas_Value)
+
+enum PMXHostFunctionID
+{
+#define PMX_HOST_ID(name) PMX_HOST_##name,
+	PMX_HOST_FUNCTIONS(PMX_HOST_ID)
+#undef PMX_HOST_ID
+	PMX_HOST_MQ_SendMessage,
+	PMX_HOST_FUNCTION_NUM,
+};
+
+static const char* s_function_names[PMX_HOST_FUNCTION_NUM] = {
+#define PMX_HOST_NAME(name) #name,
+	PMX_HOST_FUNCTIONS(PMX_HOST_NAME)
+#undef PMX_HOST_NAME
+	"MQ_SendMessage",
+};
+
+typedef std::chrono::steady_clock HostClock;
+
+struct PMXHostCounter
+{
+	unsigned __int64 calls;
+	HostClock::duration time;
+};
+
+static PMXHostCounter s_counters[PMX_HOST_FUNCTION_NUM];
+static std::unordered_map<std::string, PMXHostCounter> s_message_counters;
+static bool s_running = false;
+
+// Adds the time until the end of the scope to the counter
+class PMXHostCallTimer
+{
+public:
+	explicit PMXHostCallTimer(PMXHostCounter& counter) : m_counter(counter), m_start(HostClock::now()) {}
+	~PMXHostCallTimer()
+	{
+		m_counter.calls++;
+		m_counter.time += HostClock::now() - m_start;
+	}
+
+private:
+	PMXHostCounter& m_counter;
+	HostClock::time_point m_start;
+};
+
+// A probe calls the original function of the slot ID
+template <int ID, typename F> struct PMXHostProbe;
+
+template <int ID, typename R, typename... A>
+struct PMXHostProbe<ID, R (MQAPICALL *)(A...)>
+{
+	static R (MQAPICALL *org)(A...);
+
+	static R MQAPICALL Call(A... args)
+	{
+		PMXHostCallTimer timer(s_counters[ID]);
+		return org(args...);
+	}
+};
+
+template <int ID, typename R, typename... A>
+R (MQAPICALL *PMXHostProbe<ID, R (MQAPICALL *)(A...)>::org)(A...) = nullptr;
+
+static decltype(MQ_SendMessage) s_org_send_message = nullptr;
+
+static std::string getMessageName(int message_type, MQSendMessageInfo* info)
+{
+	if (message_type == MQMESSAGE_USER_MESSAGE && info != nullptr && info->option != nullptr)
+	{
+		// {"description", desc, ...} in the option array of SendUserMessage
+		void** array = static_cast<void**>(info->option);
+		for (int i = 0; array[i] != nullptr; i += 2)
+		{
+			if (strcmp(static_cast<const char*>(array[i]), "description") == 0)
+				return std::string("SendUserMessage(") + static_cast<const char*>(array[i + 1]) + ")";
+		}
+	}
+	char name[32];
+	sprintf_s(name, "MQ_SendMessage(%d)", message_type);
+	return name;
+}
+
+static BOOL MQAPICALL probeSendMessage(int message_type, MQSendMessageInfo* info)
+{
+	HostClock::time_point start = HostClock::now();
+	BOOL result = s_org_send_message(message_type, info);
+	HostClock::duration time = HostClock::now() - start;
+
+	PMXHostCounter& counter = s_counters[PMX_HOST_MQ_SendMessage];
+	counter.calls++;
+	counter.time += time;
+
+	auto ite = s_message_counters.emplace(getMessageName(message_type, info), PMXHostCounter()).first;
+	ite->second.calls++;
+	ite->second.time += time;
+	return result;
+}
+
+#pragma warning(push)
+#pragma warning(disable:4996)
+void PMXHostProfiler::Start()
+{
+	if (s_running)
+		Stop();
+
+	for (int i = 0; i < PMX_HOST_FUNCTION_NUM; i++)
+	{
+		s_counters[i].calls = 0;
+		s_counters[i].time = HostClock::duration::zero();
+	}
+	s_message_counters.clear();
+
+#define PMX_HOST_INSTALL(name) \
+	if (name != nullptr) \
+	{ \
+		typedef PMXHostProbe<PMX_HOST_##name, decltype(name)> Probe; \
+		Probe::org = name; \
+		name = Probe::Call; \
+	}
+	PMX_HOST_FUNCTIONS(PMX_HOST_INSTALL)
+#undef PMX_HOST_INSTALL
+
+	if (MQ_SendMessage != nullptr)
+	{
+		s_org_send_message = MQ_SendMessage;
+		MQ_SendMessage = probeSendMessage;
+	}
+	s_running = true;
+}
+
+void PMXHostProfiler::Stop()
+{
+	if (!s_running)
+		return;
+
+	// Pointers replaced by someone else after Start() are left as they are
+#define PMX_HOST_UNINSTALL(name) \
+	{ \
+		typedef PMXHostProbe<PMX_HOST_##name, decltype(name)> Probe; \
+		if (name == Probe::Call) \
+			name = Probe::org; \
+	}
+	PMX_HOST_FUNCTIONS(PMX_HOST_UNINSTALL)
+#undef PMX_HOST_UNINSTALL
+
+	if (MQ_SendMessage == probeSendMessage)
+		MQ_SendMessage = s_org_send_message;
+	s_running = false;
+}
+#pragma warning(pop)
+
+bool PMXHostProfiler::IsRunning()
+{
+	return s_running;
+}
+
+static double toMs(HostClock::duration time)
+{
+	return std::chrono::duration<double, std::milli>(time).count();
+}
+
+static void sortEntries(std::vector<PMXHostProfiler::Entry>& entries)
+{
+	std::sort(entries.begin(), entries.end(), [](const PMXHostProfiler::Entry& a, const PMXHostProfiler::Entry& b)
+	{
+		return (a.ms != b.ms) ? a.ms > b.ms : a.calls > b.calls;
+	});
+}
+
+std::vector<PMXHostProfiler::Entry> PMXHostProfiler::GetFunctionRanking()
+{
+	std::vector<Entry> entries;
+	for (int i = 0; i < PMX_HOST_FUNCTION_NUM; i++)
+	{
+		if (s_counters[i].calls == 0)
+			continue;
+		Entry entry;
+		entry.name = s_function_names[i];
+		entry.calls = s_counters[i].calls;
+		entry.ms = toMs(s_counters[i].time);
+		entries.push_back(entry);
+	}
+	sortEntries(entries);
+	return entries;
+}
+
+std::vector<PMXHostProfiler::Entry> PMXHostProfiler::GetMessageRanking()
+{
+	std::vector<Entry> entries;
+	for (auto ite = s_message_counters.begin(); ite != s_message_counters.end(); ++ite)
+	{
+		Entry entry;
+		entry.name = ite->first;
+		entry.calls = ite->second.calls;
+		entry.ms = toMs(ite->second.time);
+		entries.push_back(entry);
+	}
+	sortEntries(entries);
+	return entries;
+}
+
+static void appendTable(MString& report, const wchar_t* title, const std::vector<PMXHostProfiler::Entry>& entries, size_t max_lines)
+{
+	double total_ms = 0;
+	unsigned __int64 total_calls = 0;
+	for (const auto& entry : entries)
+	{
+		total_ms += entry.ms;
+		total_calls += entry.calls;
+	}
+
+	report += MString::format(L"%s: %I64u calls, %.3f ms\n", title, total_calls, total_ms);
+	report += L"  rank  share      time(ms)         calls   avg(us)  name\n";
+	for (size_t i = 0; i < entries.size() && i < max_lines; i++)
+	{
+		const PMXHostProfiler::Entry& entry = entries[i];
+		double share = (total_ms > 0) ? entry.ms / total_ms * 100.0 : 0.0;
+		double avg_us = entry.ms * 1000.0 / static_cast<double>(entry.calls);
+		report += MString::format(L"  %4d %5.1f%% %13.3f %13I64u %9.3f  %s\n",
+			static_cast<int>(i + 1), share, entry.ms, entry.calls, avg_us, MString::fromAnsiString(entry.name.c_str()).c_str());
+	}
+}
+
+MString PMXHostProfiler::GetReport(size_t max_lines)
+{
+	MString report;
+	appendTable(report, L"Host functions", GetFunctionRanking(), max_lines);
+	report += L"\n";
+	appendTable(report, L"MQ_SendMessage", GetMessageRanking(), max_lines);
+	return report;
+}
+
+bool PMXHostProfiler::WriteReport(const MString& filename, size_t max_lines)
+{
+	FILE* fh;
+	if (_wfopen_s(&fh, filename.c_str(), L"w") != 0)
+		return false;
+	fputs(GetReport(max_lines).toAnsiString().c_str(), fh);
+	return fclose(fh) == 0;
+}
+
+PMXHostProfileScope::PMXHostProfileScope(bool enable)
+{
+	m_enabled = false;
+	Enable(enable);
+}
+
+PMXHostProfileScope::~PMXHostProfileScope()
+{
+	Enable(false);
+}
+
+void PMXHostProfileScope::Enable(bool enable)
+{
+	if (enable == m_enabled)
+		return;
+	if (enable)
+		PMXHostProfiler::Start();
+	else
+		PMXHostProfiler::Stop();
+	m_enabled = enable;
+}
@@ -0,0 +1,54 @@
+﻿#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "MQPlugin.h"
+#include "MString.h"
+#include <string>
+#include <vector>
+
+// Counts and times every call into the host.
+// Start() puts a probe in front of each function pointer resolved by MQInit()
+// and Stop() puts the original pointers back. Calls of MQ_SendMessage are also
+// broken down by the message, and user messages (MQBasePlugin::SendUserMessage)
+// by the description string, e.g. "GetVertexWeight".
+// The host must only be called from the main thread while profiling.
+class PMXHostProfiler
+{
+public:
+	struct Entry
+	{
+		std::string name;
+		unsigned __int64 calls;
+		double ms;
+	};
+
+	// Clear the counters and start profiling
+	static void Start();
+	// Stop profiling. The counters are kept until the next Start().
+	static void Stop();
+	static bool IsRunning();
+
+	// Functions sorted by the total time (descending)
+	static std::vector<Entry> GetFunctionRanking();
+	// MQ_SendMessage calls by the message, sorted by the total time
+	static std::vector<Entry> GetMessageRanking();
+
+	// Ranked report as text. Up to max_lines entries are listed in each table.
+	static MString GetReport(size_t max_lines);
+	static bool WriteReport(const MString& filename, size_t max_lines);
+};
+
+// Profiles the host calls while the object is alive if 'enable' is true
+class PMXHostProfileScope
+{
+public:
+	explicit PMXHostProfileScope(bool enable);
+	~PMXHostProfileScope();
+
+	void Enable(bool enable);
+	bool IsEnabled() const { return m_enabled; }
+
+private:
+	bool m_enabled;
+};
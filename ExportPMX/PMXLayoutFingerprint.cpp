@@ -0,0 +1,82 @@
+﻿#include "PMXLayoutFingerprint.h"
+#include "MQExportObject.h"
+#include "PMXObjectSnapshot.h"
+#include <vector>
+#include <wchar.h>
+
+static const wchar_t* const s_LayoutTag = L"ExportPMX layout ";
+
+PMXLayoutFingerprint::PMXLayoutFingerprint()
+{
+	m_hash = 14695981039346656037ULL;
+}
+
+void PMXLayoutFingerprint::Add(const void* data, size_t size)
+{
+	const BYTE* p = static_cast<const BYTE*>(data);
+	unsigned __int64 h = m_hash;
+	for (size_t i = 0; i < size; i++)
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	m_hash = h;
+}
+
+void PMXLayoutFingerprint::AddObject(const PMXObjectSnapshot& snapshot, const MQExportObject* eobj)
+{
+	const std::vector<MQPoint>& pts = snapshot.positions;
+	int vert_num = eobj->GetVertexCount();
+	Add(&vert_num, sizeof(vert_num));
+	for (int evi = 0; evi < vert_num; evi++)
+	{
+		MQPoint pos = pts[eobj->GetOriginalVertex(evi)];
+		MQPoint nrm = eobj->GetVertexNormal(evi);
+		MQCoordinate uv = eobj->GetVertexCoordinate(evi);
+		Add(&pos, sizeof(pos));
+		Add(&nrm, sizeof(nrm));
+		Add(&uv, sizeof(uv));
+	}
+
+	int face_num = eobj->GetFaceCount();
+	std::vector<int> vi;
+	Add(&face_num, sizeof(face_num));
+	for (int fi = 0; fi < face_num; fi++)
+	{
+		int mi = snapshot.face_material[fi];
+		int n = eobj->GetFacePointCount(fi);
+		Add(&mi, sizeof(mi));
+		Add(&n, sizeof(n));
+		if (n > 0)
+		{
+			vi.resize(n);
+			eobj->GetFacePointArray(fi, vi.data());
+			Add(vi.data(), n * sizeof(int));
+		}
+	}
+}
+
+MString PMXLayoutFingerprint::Format(unsigned __int64 value)
+{
+	return MString::format(L"%s%016I64x", s_LayoutTag, value);
+}
+
+bool PMXLayoutFingerprint::Parse(const MString& text, unsigned __int64& value)
+{
+	size_t tag_len = wcslen(s_LayoutTag);
+	if (text.length() != tag_len + 16 || wcsncmp(text.c_str(), s_LayoutTag, tag_len) != 0)
+		return false;
+
+	value = 0;
+	for (size_t i = tag_len; i < text.length(); i++)
+	{
+		wchar_t c = text.c_str()[i];
+		int digit;
+		if (c >= L'0' && c <= L'9') digit = c - L'0';
+		else if (c >= L'a' && c <= L'f') digit = c - L'a' + 10;
+		else if (c >= L'A' && c <= L'F') digit = c - L'A' + 10;
+		else return false;
+		value = (value << 4) | static_cast<unsigned __int64>(digit);
+	}
+	return true;
+}
@@ -0,0 +1,33 @@
+﻿#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "MQPlugin.h"
+#include "MString.h"
+
+class MQExportObject;
+struct PMXObjectSnapshot;
+
+// Fingerprint of the vertices and faces written to the PMX file (FNV-1a).
+// Morphs refer to the vertices by index, so the morph section of an existing
+// file can be rewritten only while the fingerprint is the same.
+// The positions, normals, UVs and faces are covered, the bone weights are not.
+class PMXLayoutFingerprint
+{
+public:
+	PMXLayoutFingerprint();
+
+	// Add an exported object in the order written to the file
+	void AddObject(const PMXObjectSnapshot& snapshot, const MQExportObject* eobj);
+	void Add(const void* data, size_t size);
+
+	unsigned __int64 Get() const { return m_hash; }
+
+	// Text stored in the English comment of the file.
+	// The length is fixed so it can be written before the value is known.
+	static MString Format(unsigned __int64 value);
+	static bool Parse(const MString& text, unsigned __int64& value);
+
+private:
+	unsigned __int64 m_hash;
+};
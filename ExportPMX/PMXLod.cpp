@@ -0,0 +1,559 @@
+﻿#include "PMXLod.h"
+#include "PMXReader.h"
+#include "ParallelHelper.h"
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <math.h>
+#include <stdio.h>
+
+void ParsePMXLodLevels(const MString& text, std::vector<int>& levels)
+{
+	levels.clear();
+	const wchar_t* p = text.c_str();
+	while (*p != L'\0')
+	{
+		if (*p < L'0' || *p > L'9')
+		{
+			p++;
+			continue;
+		}
+		int value = 0;
+		while (*p >= L'0' && *p <= L'9')
+		{
+			value = std::min(value * 10 + (*p - L'0'), 1000);
+			p++;
+		}
+		if (value > 0 && value < 100 && std::find(levels.begin(), levels.end(), value) == levels.end())
+		{
+			levels.push_back(value);
+		}
+	}
+}
+
+namespace
+{
+
+// Sum of squared distances to the planes (symmetric 4x4 matrix)
+struct Quadric
+{
+	double a[10];
+
+	Quadric()
+	{
+		for (int i = 0; i < 10; i++) a[i] = 0.0;
+	}
+
+	void AddPlane(double nx, double ny, double nz, double d, double weight)
+	{
+		a[0] += weight * nx * nx; a[1] += weight * nx * ny; a[2] += weight * nx * nz; a[3] += weight * nx * d;
+		a[4] += weight * ny * ny; a[5] += weight * ny * nz; a[6] += weight * ny * d;
+		a[7] += weight * nz * nz; a[8] += weight * nz * d;
+		a[9] += weight * d * d;
+	}
+
+	void Add(const Quadric& q)
+	{
+		for (int i = 0; i < 10; i++) a[i] += q.a[i];
+	}
+
+	double Evaluate(const double* p) const
+	{
+		double x = p[0], y = p[1], z = p[2];
+		return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+			+ a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+			+ a[7] * z * z + 2 * a[8] * z
+			+ a[9];
+	}
+};
+
+struct Collapse
+{
+	double cost;
+	int from, to;
+	unsigned int from_version, to_version;
+
+	bool operator>(const Collapse& c) const { return cost > c.cost; }
+};
+
+// Bones with a weight, sorted
+struct SkinKey
+{
+	int count;
+	int bone[4];
+
+	bool operator==(const SkinKey& k) const
+	{
+		if (count != k.count) return false;
+		for (int i = 0; i < count; i++)
+		{
+			if (bone[i] != k.bone[i]) return false;
+		}
+		return true;
+	}
+};
+
+static void triangleNormal(const double* p0, const double* p1, const double* p2, double* n)
+{
+	double e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+	double e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+	n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+// Simplify the triangles of one material.
+// 'tri' holds the vertex indices in the file, 'shared' marks vertices used by other materials.
+class MaterialSimplifier
+{
+public:
+	MaterialSimplifier(const PMXReader& reader, const std::vector<BYTE>& shared)
+		: m_reader(reader), m_shared(shared) {}
+
+	void Run(const int* tri, int tri_num, int target_num, std::vector<int>& output);
+
+private:
+	const PMXReader& m_reader;
+	const std::vector<BYTE>& m_shared;
+
+	std::vector<int> m_tri;              // local vertex indices, 3 per triangle
+	std::vector<BYTE> m_tri_alive;
+	std::vector<std::vector<int>> m_vert_tris;
+	std::vector<double> m_pos;           // x, y, z per local vertex
+	std::vector<Quadric> m_quadric;
+	std::vector<SkinKey> m_skin;
+	std::vector<BYTE> m_locked;
+	std::vector<BYTE> m_removed;
+	std::vector<unsigned int> m_version;
+	std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> m_heap;
+
+	void pushCollapse(int from, int to);
+	void pushVertex(int v);
+	bool canCollapse(int from, int to) const;
+	int collapse(int from, int to);
+};
+
+void MaterialSimplifier::Run(const int* tri, int tri_num, int target_num, std::vector<int>& output)
+{
+	// ファイルの頂点番号を材質内の番号に付け替える
+	std::unordered_map<int, int> local;
+	std::vector<int> global;
+	m_tri.resize(static_cast<size_t>(tri_num) * 3);
+	for (int i = 0; i < tri_num * 3; i++)
+	{
+		auto it = local.emplace(tri[i], static_cast<int>(global.size()));
+		if (it.second)
+			global.push_back(tri[i]);
+		m_tri[i] = it.first->second;
+	}
+
+	int vert_num = static_cast<int>(global.size());
+	m_pos.resize(static_cast<size_t>(vert_num) * 3);
+	m_skin.resize(vert_num);
+	m_locked.assign(vert_num, 0);
+	m_removed.assign(vert_num, 0);
+	m_version.assign(vert_num, 0);
+	m_quadric.assign(vert_num, Quadric());
+	m_vert_tris.assign(vert_num, std::vector<int>());
+	for (int v = 0; v < vert_num; v++)
+	{
+		PMXVertexView view;
+		m_reader.GetVertex(global[v], view);
+		m_pos[v * 3] = view.position[0];
+		m_pos[v * 3 + 1] = view.position[1];
+		m_pos[v * 3 + 2] = view.position[2];
+
+		SkinKey& key = m_skin[v];
+		key.count = 0;
+		for (int b = 0; b < view.bone_count; b++)
+		{
+			if (view.bone[b] >= 0 && view.weight[b] > 0.0f)
+				key.bone[key.count++] = view.bone[b];
+		}
+		std::sort(key.bone, key.bone + key.count);
+		key.count = static_cast<int>(std::unique(key.bone, key.bone + key.count) - key.bone);
+
+		m_locked[v] = m_shared[global[v]];
+	}
+
+	// 面の平面を頂点に集め、2枚の面で共有されない辺の頂点は動かさない
+	m_tri_alive.assign(tri_num, 1);
+	std::unordered_map<unsigned __int64, int> edge_count;
+	for (int t = 0; t < tri_num; t++)
+	{
+		const int* vi = &m_tri[t * 3];
+		if (vi[0] == vi[1] || vi[1] == vi[2] || vi[2] == vi[0])
+		{
+			m_tri_alive[t] = 0;
+			continue;
+		}
+		double n[3];
+		triangleNormal(&m_pos[vi[0] * 3], &m_pos[vi[1] * 3], &m_pos[vi[2] * 3], n);
+		double len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		if (len > 0.0)
+		{
+			n[0] /= len; n[1] /= len; n[2] /= len;
+			double d = -(n[0] * m_pos[vi[0] * 3] + n[1] * m_pos[vi[0] * 3 + 1] + n[2] * m_pos[vi[0] * 3 + 2]);
+			for (int j = 0; j < 3; j++)
+			{
+				m_quadric[vi[j]].AddPlane(n[0], n[1], n[2], d, len * 0.5);
+			}
+		}
+		for (int j = 0; j < 3; j++)
+		{
+			m_vert_tris[vi[j]].push_back(t);
+			unsigned int a = vi[j], b = vi[(j + 1) % 3];
+			unsigned __int64 key = (static_cast<unsigned __int64>(std::min(a, b)) << 32) | std::max(a, b);
+			edge_count[key]++;
+		}
+	}
+	for (auto it = edge_count.begin(); it != edge_count.end(); ++it)
+	{
+		if (it->second != 2)
+		{
+			m_locked[static_cast<int>(it->first >> 32)] = 1;
+			m_locked[static_cast<int>(it->first & 0xFFFFFFFF)] = 1;
+		}
+	}
+
+	int alive_num = 0;
+	for (int t = 0; t < tri_num; t++)
+	{
+		alive_num += m_tri_alive[t];
+	}
+	for (int v = 0; v < vert_num; v++)
+	{
+		pushVertex(v);
+	}
+
+	while (alive_num > target_num && !m_heap.empty())
+	{
+		Collapse c = m_heap.top();
+		m_heap.pop();
+		if (m_removed[c.from] || m_removed[c.to] || m_version[c.from] != c.from_version || m_version[c.to] != c.to_version)
+			continue;
+		if (!canCollapse(c.from, c.to))
+			continue;
+		alive_num -= collapse(c.from, c.to);
+	}
+
+	output.clear();
+	output.reserve(static_cast<size_t>(alive_num) * 3);
+	for (int t = 0; t < tri_num; t++)
+	{
+		if (!m_tri_alive[t])
+			continue;
+		for (int j = 0; j < 3; j++)
+		{
+			output.push_back(global[m_tri[t * 3 + j]]);
+		}
+	}
+}
+
+void MaterialSimplifier::pushCollapse(int from, int to)
+{
+	if (m_locked[from] || !(m_skin[from] == m_skin[to]))
+		return;
+
+	Quadric q = m_quadric[from];
+	q.Add(m_quadric[to]);
+	Collapse c;
+	c.cost = q.Evaluate(&m_pos[to * 3]);
+	c.from = from;
+	c.to = to;
+	c.from_version = m_version[from];
+	c.to_version = m_version[to];
+	m_heap.push(c);
+}
+
+// Push the collapses of the vertex with its neighbors in both directions
+void MaterialSimplifier::pushVertex(int v)
+{
+	for (size_t i = 0; i < m_vert_tris[v].size(); i++)
+	{
+		int t = m_vert_tris[v][i];
+		if (!m_tri_alive[t])
+			continue;
+		for (int j = 0; j < 3; j++)
+		{
+			int w = m_tri[t * 3 + j];
+			if (w == v)
+				continue;
+			pushCollapse(v, w);
+			pushCollapse(w, v);
+		}
+	}
+}
+
+bool MaterialSimplifier::canCollapse(int from, int to) const
+{
+	// 両端に共通の隣接頂点は辺の両側の2つだけ（それ以外は面が重なる）
+	std::vector<int> from_neighbors, to_neighbors;
+	int shared_tris = 0;
+	for (size_t i = 0; i < m_vert_tris[from].size(); i++)
+	{
+		int t = m_vert_tris[from][i];
+		if (!m_tri_alive[t])
+			continue;
+		const int* vi = &m_tri[t * 3];
+		bool has_to = (vi[0] == to || vi[1] == to || vi[2] == to);
+		if (has_to)
+		{
+			shared_tris++;
+		}
+		else
+		{
+			// 移動後に面が裏返るものは不可
+			double p[3][3];
+			for (int j = 0; j < 3; j++)
+			{
+				int v = (vi[j] == from) ? to : vi[j];
+				p[j][0] = m_pos[v * 3]; p[j][1] = m_pos[v * 3 + 1]; p[j][2] = m_pos[v * 3 + 2];
+			}
+			double n0[3], n1[3];
+			triangleNormal(&m_pos[vi[0] * 3], &m_pos[vi[1] * 3], &m_pos[vi[2] * 3], n0);
+			triangleNormal(p[0], p[1], p[2], n1);
+			double dot = n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2];
+			double len0 = n0[0] * n0[0] + n0[1] * n0[1] + n0[2] * n0[2];
+			double len1 = n1[0] * n1[0] + n1[1] * n1[1] + n1[2] * n1[2];
+			if (dot <= 0.0 || dot * dot < 0.04 * len0 * len1)
+				return false;
+		}
+		for (int j = 0; j < 3; j++)
+		{
+			if (vi[j] != from)
+				from_neighbors.push_back(vi[j]);
+		}
+	}
+	if (shared_tris != 2)
+		return false;
+
+	for (size_t i = 0; i < m_vert_tris[to].size(); i++)
+	{
+		int t = m_vert_tris[to][i];
+		if (!m_tri_alive[t])
+			continue;
+		for (int j = 0; j < 3; j++)
+		{
+			if (m_tri[t * 3 + j] != to)
+				to_neighbors.push_back(m_tri[t * 3 + j]);
+		}
+	}
+	std::sort(from_neighbors.begin(), from_neighbors.end());
+	from_neighbors.erase(std::unique(from_neighbors.begin(), from_neighbors.end()), from_neighbors.end());
+	std::sort(to_neighbors.begin(), to_neighbors.end());
+	to_neighbors.erase(std::unique(to_neighbors.begin(), to_neighbors.end()), to_neighbors.end());
+	int common = 0;
+	for (size_t i = 0, j = 0; i < from_neighbors.size() && j < to_neighbors.size();)
+	{
+		if (from_neighbors[i] < to_neighbors[j]) i++;
+		else if (from_neighbors[i] > to_neighbors[j]) j++;
+		else { common++; i++; j++; }
+	}
+	return common == 2;
+}
+
+// Move 'from' onto 'to'. Returns the number of removed triangles.
+int MaterialSimplifier::collapse(int from, int to)
+{
+	int removed = 0;
+	for (size_t i = 0; i < m_vert_tris[from].size(); i++)
+	{
+		int t = m_vert_tris[from][i];
+		if (!m_tri_alive[t])
+			continue;
+		int* vi = &m_tri[t * 3];
+		if (vi[0] == to || vi[1] == to || vi[2] == to)
+		{
+			m_tri_alive[t] = 0;
+			removed++;
+			continue;
+		}
+		for (int j = 0; j < 3; j++)
+		{
+			if (vi[j] == from)
+				vi[j] = to;
+		}
+		m_vert_tris[to].push_back(t);
+	}
+	m_vert_tris[from].clear();
+	m_removed[from] = 1;
+	m_quadric[to].Add(m_quadric[from]);
+	m_version[to]++;
+
+	// 消えた面を詰めて、隣接する頂点との候補を入れ直す
+	std::vector<int>& tris = m_vert_tris[to];
+	tris.erase(std::remove_if(tris.begin(), tris.end(), [this](int t) { return !m_tri_alive[t]; }), tris.end());
+	pushVertex(to);
+	return removed;
+}
+
+} // namespace
+
+bool WritePMXLod(const PMXReader& reader, const MString& filename, float rate, PMXLodResult& result, MString& error)
+{
+	const PMXHeaderInfo& h = reader.GetHeader();
+	const BYTE* data = reader.GetData();
+	int vert_num = reader.GetVertexCount();
+	int mat_num = reader.GetMaterialCount();
+
+	// 材質ごとの面の範囲。複数の材質で使われる頂点は動かさない
+	std::vector<int> tri_begin(mat_num + 1, 0);
+	for (int m = 0; m < mat_num; m++)
+	{
+		PMXMaterialView view;
+		reader.GetMaterial(m, view);
+		tri_begin[m + 1] = tri_begin[m] + view.index_count / 3;
+	}
+	if (tri_begin[mat_num] * 3 > reader.GetIndexCount())
+	{
+		error = L"The materials have more faces than the file";
+		return false;
+	}
+	std::vector<int> indices(static_cast<size_t>(tri_begin[mat_num]) * 3);
+	for (size_t i = 0; i < indices.size(); i++)
+	{
+		indices[i] = reader.GetIndex(static_cast<int>(i));
+		if (indices[i] < 0 || indices[i] >= vert_num)
+		{
+			error = MString::format(L"Face index %d is out of the vertices", static_cast<int>(i));
+			return false;
+		}
+	}
+	std::vector<int> vert_material(vert_num, -1);
+	std::vector<BYTE> shared(vert_num, 0);
+	for (int m = 0; m < mat_num; m++)
+	{
+		for (int i = tri_begin[m] * 3; i < tri_begin[m + 1] * 3; i++)
+		{
+			int v = indices[i];
+			if (vert_material[v] >= 0 && vert_material[v] != m)
+				shared[v] = 1;
+			vert_material[v] = m;
+		}
+	}
+
+	std::vector<std::vector<int>> mat_tris(mat_num);
+	ParallelFor(mat_num, [&](int m)
+	{
+		int tri_num = tri_begin[m + 1] - tri_begin[m];
+		int target = static_cast<int>(ceil(tri_num * rate));
+		MaterialSimplifier simplifier(reader, shared);
+		simplifier.Run(indices.data() + tri_begin[m] * 3, tri_num, target, mat_tris[m]);
+	});
+
+	// 残った面が使う頂点だけを詰める
+	std::vector<int> remap(vert_num, -1);
+	int new_vert_num = 0;
+	int new_index_num = 0;
+	for (int m = 0; m < mat_num; m++)
+	{
+		new_index_num += static_cast<int>(mat_tris[m].size());
+		for (size_t i = 0; i < mat_tris[m].size(); i++)
+		{
+			remap[mat_tris[m][i]] = 1;
+		}
+	}
+	for (int v = 0; v < vert_num; v++)
+	{
+		if (remap[v] >= 0)
+			remap[v] = new_vert_num++;
+	}
+
+	MString temp_filename = filename + L".tmp";
+	FILE* fh;
+	if (_wfopen_s(&fh, temp_filename.c_str(), L"wb") != 0)
+	{
+		error = MString::format(L"Cannot write %s", temp_filename.c_str());
+		return false;
+	}
+
+	// ヘッダとモデル情報。英語のコメント（頂点の指紋）は頂点が変わるので空にする
+	const BYTE* comment_en = reader.GetCommentEn().data - 4;
+	fwrite(data, 1, comment_en - data, fh);
+	int zero = 0;
+	fwrite(&zero, sizeof(int), 1, fh);
+
+	fwrite(&new_vert_num, sizeof(int), 1, fh);
+	for (int v = 0; v < vert_num; v++)
+	{
+		if (remap[v] < 0)
+			continue;
+		size_t size;
+		const BYTE* record = reader.GetVertexRecord(v, size);
+		fwrite(record, 1, size, fh);
+	}
+
+	fwrite(&new_index_num, sizeof(int), 1, fh);
+	for (int m = 0; m < mat_num; m++)
+	{
+		for (size_t i = 0; i < mat_tris[m].size(); i++)
+		{
+			int index = remap[mat_tris[m][i]];
+			fwrite(&index, h.vertex_index_size, 1, fh);
+		}
+	}
+
+	// テクスチャはそのまま、材質は面の数だけ書き換える
+	fwrite(data + reader.GetTextureSectionOffset(), 1, reader.GetMaterialSectionOffset() - reader.GetTextureSectionOffset(), fh);
+	fwrite(&mat_num, sizeof(int), 1, fh);
+	for (int m = 0; m < mat_num; m++)
+	{
+		size_t size;
+		const BYTE* record = reader.GetMaterialRecord(m, size);
+		fwrite(record, 1, size - 4, fh);
+		int index_count = static_cast<int>(mat_tris[m].size());
+		fwrite(&index_count, sizeof(int), 1, fh);
+	}
+	fwrite(data + reader.GetBoneSectionOffset(), 1, reader.GetMorphSectionOffset() - reader.GetBoneSectionOffset(), fh);
+
+	// 頂点とUVのモーフは消えた頂点を除いて番号を付け替える
+	int morph_num = reader.GetMorphCount();
+	fwrite(&morph_num, sizeof(int), 1, fh);
+	for (int i = 0; i < morph_num; i++)
+	{
+		PMXMorphView view;
+		reader.GetMorph(i, view);
+		const BYTE* record = view.name.data - 4;
+		bool vertex = (view.kind == PMX_MORPH_VERTEX || (view.kind >= PMX_MORPH_UV && view.kind <= PMX_MORPH_UV4));
+		if (!vertex)
+		{
+			fwrite(record, 1, (view.offsets - record) + static_cast<size_t>(view.offset_count) * view.offset_size, fh);
+			continue;
+		}
+		fwrite(record, 1, (view.offsets - 4) - record, fh);
+		int count = 0;
+		for (int j = 0; j < view.offset_count; j++)
+		{
+			int v = view.GetOffsetIndex(j, h);
+			if (v >= 0 && v < vert_num && remap[v] >= 0)
+				count++;
+		}
+		fwrite(&count, sizeof(int), 1, fh);
+		int data_size = view.offset_size - h.vertex_index_size;
+		for (int j = 0; j < view.offset_count; j++)
+		{
+			int v = view.GetOffsetIndex(j, h);
+			if (v < 0 || v >= vert_num || remap[v] < 0)
+				continue;
+			fwrite(&remap[v], h.vertex_index_size, 1, fh);
+			fwrite(view.GetOffsetData(j, h), 1, data_size, fh);
+		}
+	}
+
+	// 表示枠、剛体、ジョイントはそのまま
+	size_t frame_pos = reader.GetDisplayFrameSectionOffset();
+	fwrite(data + frame_pos, 1, reader.GetFileSize() - frame_pos, fh);
+
+	bool failed = ferror(fh) != 0;
+	if (fclose(fh) != 0 || failed || !MoveFileExW(temp_filename.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFileW(temp_filename.c_str());
+		error = MString::format(L"Cannot write %s", filename.c_str());
+		return false;
+	}
+	result.vertex_count = new_vert_num;
+	result.triangle_count = new_index_num / 3;
+	return true;
+}
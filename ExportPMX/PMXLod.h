@@ -0,0 +1,31 @@
+﻿#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "MString.h"
+#include <vector>
+
+class PMXReader;
+
+struct PMXLodResult
+{
+	int vertex_count;
+	int triangle_count;
+
+	PMXLodResult() : vertex_count(0), triangle_count(0) {}
+};
+
+// Parse the triangle rates of the levels, e.g. "50, 25" in percent.
+// Values out of (0, 100) are ignored.
+void ParsePMXLodLevels(const MString& text, std::vector<int>& levels);
+
+// Write a copy of the PMX file with fewer triangles (level of detail).
+// The triangles of each material are reduced to 'rate' of their count by
+// quadric error edge collapses, on the vertices as split for the export.
+// A vertex collapses onto a neighbor, so the kept vertices are copied with
+// their normal, UV and weights. Vertices on open edges (UV seams and mesh
+// borders) or shared by materials are kept, and vertices weighted to
+// different bones are not collapsed together.
+// Materials are simplified in parallel. Vertices no longer used are removed
+// and the vertex and UV morphs are remapped.
+bool WritePMXLod(const PMXReader& reader, const MString& filename, float rate, PMXLodResult& result, MString& error);
@@ -0,0 +1,158 @@
+﻿#include "PMXMaterial.h"
+#include <MFileUtil.h>
+#include <string.h>
+#include <math.h>
+
+int PMXTextureTable::Add(const MAnsiString& name, const MAnsiString& path)
+{
+	if (name.length() == 0)
+		return -1;
+
+	auto result = m_index.emplace(std::string(name.c_str()), static_cast<int>(m_names.size()));
+	if (result.second)
+	{
+		m_names.push_back(name);
+		m_paths.push_back(path);
+	}
+	return result.first->second;
+}
+
+// Parameters of the material as written to the PMX file
+struct PMXMaterialVisibleParam
+{
+	float diffuse[3];
+	float alpha;
+	float specular[3];
+	float power;
+	float ambient[3];
+	int texture;
+	int edge;
+
+	explicit PMXMaterialVisibleParam(const PMXMaterialParam& mat)
+	{
+		memset(this, 0, sizeof(*this));
+		diffuse[0] = mat.col.r * mat.dif;
+		diffuse[1] = mat.col.g * mat.dif;
+		diffuse[2] = mat.col.b * mat.dif;
+		alpha = mat.alpha;
+		specular[0] = sqrtf(mat.spc_col.r);
+		specular[1] = sqrtf(mat.spc_col.g);
+		specular[2] = sqrtf(mat.spc_col.b);
+		power = mat.spc_pow;
+		ambient[0] = mat.amb_col.r;
+		ambient[1] = mat.amb_col.g;
+		ambient[2] = mat.amb_col.b;
+		texture = mat.texture;
+		edge = mat.edge ? 1 : 0;
+	}
+
+	bool operator==(const PMXMaterialVisibleParam& p) const
+	{
+		return memcmp(this, &p, sizeof(*this)) == 0;
+	}
+};
+
+struct PMXMaterialVisibleParamHash
+{
+	size_t operator()(const PMXMaterialVisibleParam& p) const
+	{
+		const BYTE* ptr = reinterpret_cast<const BYTE*>(&p);
+		size_t h = 2166136261U;
+		for (size_t i = 0; i < sizeof(p); i++)
+		{
+			h ^= ptr[i];
+			h *= 16777619U;
+		}
+		return h;
+	}
+};
+
+void SnapshotMaterials(MQDocument doc,
+	const std::vector<int>& material_used,
+	std::vector<PMXMaterialParam>& materials,
+	PMXTextureTable& textures)
+{
+	int numMat = static_cast<int>(material_used.size()) - 1;
+
+	materials.clear();
+	for (int i = 0; i <= numMat; i++)
+	{
+		if (material_used[i] == 0) continue;
+
+		PMXMaterialParam param;
+		param.mq_index = i;
+		param.face_count = material_used[i];
+
+		MQMaterial mat = (i < numMat) ? doc->GetMaterial(i) : nullptr;
+		if (mat != nullptr)
+		{
+			param.name = mat->GetName();
+			param.col = mat->GetColor();
+			param.dif = mat->GetDiffuse();
+			param.alpha = mat->GetAlpha();
+			param.spc_pow = mat->GetPower();
+			param.spc_col = mat->GetSpecularColor();
+			param.amb_col = mat->GetAmbientColor();
+
+			char path[_MAX_PATH];
+			mat->GetTextureName(path, _MAX_PATH);
+			MAnsiString texture = MFileUtil::extractFilenameAndExtension(MString::fromAnsiString(path)).toAnsiString();
+			param.texture = textures.Add(texture, path);
+
+			int shader = mat->GetShader();
+			if (shader == MQMATERIAL_SHADER_HLSL)
+			{
+				MAnsiString shader_name = mat->GetShaderName();
+				if (shader_name == "PMX")
+				{
+					//int	toon = mat->GetShaderParameterIntValue("Toon", 0);
+					param.edge = mat->GetShaderParameterBoolValue("Edge", 0);
+				}
+			}
+		}
+		else
+		{
+			// 材質なしの面
+			param.name = "default";
+		}
+		materials.push_back(param);
+	}
+}
+
+int MergeEquivalentMaterials(std::vector<PMXMaterialParam>& materials)
+{
+	std::unordered_map<PMXMaterialVisibleParam, int, PMXMaterialVisibleParamHash> first;
+	std::vector<PMXMaterialParam> result;
+	result.reserve(materials.size());
+
+	for (PMXMaterialParam& mat : materials)
+	{
+		auto ite = first.emplace(PMXMaterialVisibleParam(mat), static_cast<int>(result.size()));
+		if (ite.second)
+		{
+			result.push_back(std::move(mat));
+		}
+		else
+		{
+			PMXMaterialParam& dst = result[ite.first->second];
+			dst.face_count += mat.face_count;
+			dst.merged.push_back(mat.mq_index);
+			dst.merged.insert(dst.merged.end(), mat.merged.begin(), mat.merged.end());
+		}
+	}
+
+	int removed = static_cast<int>(materials.size() - result.size());
+	materials.swap(result);
+	return removed;
+}
+
+void GetMaterialSlots(const std::vector<PMXMaterialParam>& materials, int numMat, std::vector<int>& slots)
+{
+	slots.assign(numMat + 1, -1);
+	for (size_t i = 0; i < materials.size(); i++)
+	{
+		slots[materials[i].mq_index] = static_cast<int>(i);
+		for (int mi : materials[i].merged)
+			slots[mi] = static_cast<int>(i);
+	}
+}
@@ -0,0 +1,76 @@
+﻿#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "MQPlugin.h"
+#include "MAnsiString.h"
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+// Texture table of the PMX file.
+// Textures are identified by the file name written to the PMX file.
+class PMXTextureTable
+{
+public:
+	// Add the texture and return its index. The same file name gets the same index.
+	// Returns -1 for an empty name.
+	int Add(const MAnsiString& name, const MAnsiString& path);
+
+	int GetCount() const { return static_cast<int>(m_names.size()); }
+	const MAnsiString& GetName(int index) const { return m_names[index]; }
+	// Full path of the texture given in the first material using it
+	const MAnsiString& GetPath(int index) const { return m_paths[index]; }
+
+private:
+	std::vector<MAnsiString> m_names;
+	std::vector<MAnsiString> m_paths;
+	std::unordered_map<std::string, int> m_index;
+};
+
+// Properties of a material as written to the PMX file
+struct PMXMaterialParam
+{
+	int mq_index; // material index in the document (numMat for faces without material)
+	MAnsiString name;
+	MQColor col;
+	float dif;
+	float alpha;
+	float spc_pow;
+	MQColor spc_col;
+	MQColor amb_col;
+	bool edge;
+	int texture; // index in PMXTextureTable, -1 if none
+	int face_count; // number of triangles
+	std::vector<int> merged; // material indices in the document merged into this one
+
+	PMXMaterialParam()
+	{
+		mq_index = -1;
+		col = MQColor(1, 1, 1);
+		dif = 0.8f;
+		alpha = 1.0f;
+		spc_pow = 5.0f;
+		spc_col = MQColor(0, 0, 0);
+		amb_col = MQColor(0.6f, 0.6f, 0.6f);
+		edge = false;
+		texture = -1;
+		face_count = 0;
+	}
+};
+
+// Read the properties of the used materials from the document in one pass.
+// material_used has numMat + 1 entries; the last one counts the faces without material.
+void SnapshotMaterials(MQDocument doc,
+	const std::vector<int>& material_used,
+	std::vector<PMXMaterialParam>& materials,
+	PMXTextureTable& textures);
+
+// Merge materials whose parameters written to the PMX file are the same,
+// keeping the name of the first one. Their triangle counts are summed.
+// Returns the number of materials removed.
+int MergeEquivalentMaterials(std::vector<PMXMaterialParam>& materials);
+
+// Index of the PMX material for each material index in the document
+// (numMat + 1 entries, -1 if not used).
+void GetMaterialSlots(const std::vector<PMXMaterialParam>& materials, int numMat, std::vector<int>& slots);
@@ -0,0 +1,528 @@
+﻿#include "PMXMorph.h"
+#include "MQExportObject.h"
+#include "MQBasePlugin.h"
+#include "ParallelHelper.h"
+#include <math.h>
+#include <float.h>
+#include <assert.h>
+#include <algorithm>
+#include <unordered_map>
+
+float PMXMorphTolerance::GetAbsolute(const MQPoint& bounds_min, const MQPoint& bounds_max) const
+{
+	if (!relative)
+		return value;
+
+	MQPoint size = bounds_max - bounds_min;
+	if (size.x < 0 || size.y < 0 || size.z < 0)
+		return value;
+	return value * size.abs();
+}
+
+static const DWORD morph_plugin_product = 0x56A31D20;
+static const DWORD morph_plugin_id = 0xC452C6DB;
+
+PMXMorphTopology::PMXMorphTopology()
+{
+	m_target_count = 0;
+}
+
+void PMXMorphTopology::Query(MQBasePlugin* plugin, MQDocument doc)
+{
+	query(plugin, doc);
+	buildRoles(doc);
+}
+
+void PMXMorphTopology::query(MQBasePlugin* plugin, MQDocument doc)
+{
+	// モーフプラグインから必要な情報を取得
+	m_inputs.clear();
+	m_target_count = 0;
+
+	int morph_num = plugin->SendUserMessage(doc, morph_plugin_product, morph_plugin_id, "getMorphObjectSize", nullptr);
+	if (morph_num <= 0)
+		return;
+	m_inputs.resize(morph_num);
+
+	{
+		// モーフのベースオブジェクトを取得
+		std::vector<MQObject> baseObj;
+		baseObj.resize(morph_num);
+#ifdef _DEBUG
+		assert(plugin->SendUserMessage(doc, morph_plugin_product, morph_plugin_id, "getBaseObjectList", baseObj.data()) == morph_num);
+#else
+		plugin->SendUserMessage(doc, morph_plugin_product, morph_plugin_id, "getBaseObjectList", baseObj.data());
+#endif
+
+		for (int i = 0; i < morph_num; ++i)
+			m_inputs.at(i).base = baseObj.at(i);
+	}
+
+	// モーフターゲット情報を取得
+	std::vector<std::pair<MQObject, MorphType>> target;
+	for (int i = 0; i < morph_num; ++i)
+	{
+		PMXMorphInputParam* iParam = &m_inputs.at(i);
+		int target_size = plugin->SendUserMessage(doc, morph_plugin_product, morph_plugin_id, "getTargetSize", iParam->base);
+
+		target.resize(target_size + 1);
+		target.at(0) = std::make_pair(iParam->base, MORPH_BASE);
+#ifdef _DEBUG
+		assert(plugin->SendUserMessage(doc, morph_plugin_product, morph_plugin_id, "getTargetList", target.data()) == target_size);
+#else
+		plugin->SendUserMessage(doc, morph_plugin_product, morph_plugin_id, "getTargetList", target.data());
+#endif
+
+		iParam->target.assign(target.begin() + 1, target.end());
+		m_target_count += target_size;
+	}
+}
+
+void PMXMorphTopology::buildRoles(MQDocument doc)
+{
+	m_roles.assign(doc->GetObjectCount(), MORPH_ROLE_ORDINARY);
+	for (auto ite = m_inputs.begin(); ite != m_inputs.end(); ++ite)
+	{
+		int bi = doc->GetObjectIndex(ite->base);
+		if (bi >= 0 && bi < static_cast<int>(m_roles.size()) && m_roles[bi] == MORPH_ROLE_ORDINARY)
+			m_roles[bi] = MORPH_ROLE_BASE;
+		for (auto tIte = ite->target.begin(); tIte != ite->target.end(); ++tIte)
+		{
+			int ti = doc->GetObjectIndex(tIte->first);
+			if (ti >= 0 && ti < static_cast<int>(m_roles.size()))
+				m_roles[ti] = MORPH_ROLE_TARGET;
+		}
+	}
+}
+
+namespace
+{
+	struct MorphTargetOffsets
+	{
+		std::vector<DWORD> index;
+		std::vector<float> offset;
+	};
+
+	void getVertexArray(MQObject obj, std::vector<MQPoint>& pts)
+	{
+		pts.resize(obj->GetVertexCount());
+		if (!pts.empty())
+		{
+			obj->GetVertexArray(pts.data());
+		}
+	}
+
+	// Uniform grid over the vertices of a target to find the nearest vertex.
+	// The cell size is at least the search radius, so only the 27 cells
+	// around a point need to be visited.
+	class VertexGrid
+	{
+	public:
+		VertexGrid(const std::vector<MQPoint>& pts, float radius) : m_pts(pts), m_radius(radius)
+		{
+			m_min = MQPoint(FLT_MAX, FLT_MAX, FLT_MAX);
+			MQPoint max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			for (auto it = pts.begin(); it != pts.end(); ++it)
+			{
+				m_min.x = std::min(m_min.x, it->x);
+				m_min.y = std::min(m_min.y, it->y);
+				m_min.z = std::min(m_min.z, it->z);
+				max.x = std::max(max.x, it->x);
+				max.y = std::max(max.y, it->y);
+				max.z = std::max(max.z, it->z);
+			}
+			if (pts.empty())
+			{
+				m_min.zero();
+				max.zero();
+			}
+
+			// Keep the number of cells around the number of vertices.
+			MQPoint size = max - m_min;
+			float spacing = size.abs() / std::max(1.0f, std::cbrt(static_cast<float>(pts.size())));
+			m_cell = std::max(std::max(radius, spacing), FLT_MIN);
+			m_nx = static_cast<int>(size.x / m_cell) + 1;
+			m_ny = static_cast<int>(size.y / m_cell) + 1;
+			m_nz = static_cast<int>(size.z / m_cell) + 1;
+
+			// Counting sort of the vertices by cell
+			std::vector<int> cell_of(pts.size());
+			m_begin.assign(static_cast<size_t>(m_nx) * m_ny * m_nz + 1, 0);
+			for (size_t i = 0; i < pts.size(); i++)
+			{
+				int ix, iy, iz;
+				getCell(pts[i], ix, iy, iz);
+				cell_of[i] = (iz * m_ny + iy) * m_nx + ix;
+				m_begin[cell_of[i] + 1]++;
+			}
+			for (size_t c = 1; c < m_begin.size(); c++)
+			{
+				m_begin[c] += m_begin[c - 1];
+			}
+			m_items.resize(pts.size());
+			std::vector<int> fill(m_begin.begin(), m_begin.end() - 1);
+			for (size_t i = 0; i < pts.size(); i++)
+			{
+				m_items[fill[cell_of[i]]++] = static_cast<int>(i);
+			}
+		}
+
+		// Return the nearest vertex within the radius, or -1.
+		int FindNearest(const MQPoint& p) const
+		{
+			int cx, cy, cz;
+			getCell(p, cx, cy, cz);
+			int nearest = -1;
+			float nearest_dist = m_radius * m_radius;
+			for (int iz = std::max(cz - 1, 0); iz <= std::min(cz + 1, m_nz - 1); iz++)
+			{
+				for (int iy = std::max(cy - 1, 0); iy <= std::min(cy + 1, m_ny - 1); iy++)
+				{
+					for (int ix = std::max(cx - 1, 0); ix <= std::min(cx + 1, m_nx - 1); ix++)
+					{
+						int c = (iz * m_ny + iy) * m_nx + ix;
+						for (int k = m_begin[c]; k < m_begin[c + 1]; k++)
+						{
+							float dist = (m_pts[m_items[k]] - p).norm();
+							if (dist <= nearest_dist)
+							{
+								nearest_dist = dist;
+								nearest = m_items[k];
+							}
+						}
+					}
+				}
+			}
+			return nearest;
+		}
+
+	private:
+		const std::vector<MQPoint>& m_pts;
+		float m_radius;
+		float m_cell;
+		MQPoint m_min;
+		int m_nx, m_ny, m_nz;
+		std::vector<int> m_begin;
+		std::vector<int> m_items;
+
+		void getCell(const MQPoint& p, int& ix, int& iy, int& iz) const
+		{
+			ix = std::min(std::max(static_cast<int>((p.x - m_min.x) / m_cell), 0), m_nx - 1);
+			iy = std::min(std::max(static_cast<int>((p.y - m_min.y) / m_cell), 0), m_ny - 1);
+			iz = std::min(std::max(static_cast<int>((p.z - m_min.z) / m_cell), 0), m_nz - 1);
+		}
+	};
+
+	// Find the target vertex of each base vertex.
+	void matchNearestVertices(const std::vector<MQPoint>& base_pts, const std::vector<MQPoint>& target_pts, float radius, std::vector<int>& target_index)
+	{
+		VertexGrid grid(target_pts, radius);
+		target_index.resize(base_pts.size());
+
+		const int chunk = 4096;
+		int chunk_num = static_cast<int>((base_pts.size() + chunk - 1) / chunk);
+		ParallelFor(chunk_num, [&](int c)
+		{
+			size_t end = std::min(base_pts.size(), static_cast<size_t>(c + 1) * chunk);
+			for (size_t i = static_cast<size_t>(c) * chunk; i < end; i++)
+			{
+				target_index[i] = grid.FindNearest(base_pts[i]);
+			}
+		});
+	}
+}
+
+bool ReadMorphPositions(const std::vector<PMXMorphInputParam>& inputs,
+	MQDocument doc,
+	std::vector<PMXMorphPositions>& positions,
+	const std::function<bool(int)>& step)
+{
+	positions.resize(inputs.size());
+	for (size_t b = 0; b < inputs.size(); b++)
+	{
+		const PMXMorphInputParam& input = inputs[b];
+		PMXMorphPositions& dst = positions[b];
+		dst.base_index = doc->GetObjectIndex(input.base);
+		// Keep one entry per target so the targets are numbered as in 'inputs'
+		dst.targets.resize(input.target.size());
+		if (dst.base_index >= 0)
+		{
+			getVertexArray(input.base, dst.base);
+			for (size_t t = 0; t < input.target.size(); t++)
+			{
+				getVertexArray(input.target[t].first, dst.targets[t]);
+			}
+		}
+		if (step && !step(static_cast<int>(b) + 1))
+			return false;
+	}
+	return true;
+}
+
+bool ExtractMorphOffsets(const std::vector<PMXMorphPositions>& positions,
+	const std::vector<MQExportObject*>& expobjs,
+	const std::vector<std::vector<int>>& orgvert_vert,
+	float tolerance,
+	const PMXMorphMatchParam& match,
+	PMXMorphBlock& block,
+	const std::function<bool(int)>& step)
+{
+	size_t target_num = 0;
+	for (auto ite = positions.begin(); ite != positions.end(); ++ite)
+	{
+		target_num += ite->targets.size();
+	}
+	std::vector<MorphTargetOffsets> offsets(target_num);
+
+	std::vector<std::vector<int>> target_match;
+	size_t first_target = 0;
+	for (size_t b = 0; b < positions.size(); first_target += positions[b].targets.size(), b++)
+	{
+		if (step && !step(static_cast<int>(b)))
+			return false;
+
+		const PMXMorphPositions& pos = positions[b];
+		if (pos.base_index < 0 || expobjs[pos.base_index] == nullptr)
+			continue;
+
+		const std::vector<MQPoint>& base_pts = pos.base;
+		target_match.resize(pos.targets.size());
+		for (size_t t = 0; t < pos.targets.size(); t++)
+		{
+			// Vertex correspondence for targets whose topology drifted
+			bool nearest = (match.mode == MORPH_MATCH_NEAREST)
+				|| (match.mode == MORPH_MATCH_AUTO && pos.targets[t].size() != base_pts.size());
+			if (nearest)
+			{
+				matchNearestVertices(base_pts, pos.targets[t], match.radius, target_match[t]);
+			}
+			else
+			{
+				target_match[t].clear();
+			}
+		}
+
+		const MQExportObject* eobj = expobjs[pos.base_index];
+		const std::vector<int>& expvert = orgvert_vert[pos.base_index];
+		int baseVertSize = eobj->GetVertexCount();
+
+		ParallelFor(static_cast<int>(pos.targets.size()), [&](int t)
+		{
+			const std::vector<MQPoint>& tpts = pos.targets[t];
+			const std::vector<int>& tmatch = target_match[t];
+			MorphTargetOffsets& dst = offsets[first_target + t];
+			auto getOffset = [&](int i, MQPoint& d) -> bool
+			{
+				// Vertices removed by the mesh cleanup are not written
+				if (expvert[i] < 0)
+					return false;
+
+				int baseOrgIdx = eobj->GetOriginalVertex(i);
+				int targetIdx = tmatch.empty() ? baseOrgIdx : tmatch[baseOrgIdx];
+				if (targetIdx < 0 || targetIdx >= static_cast<int>(tpts.size()))
+					return false;
+
+				d = tpts[targetIdx] - base_pts[baseOrgIdx];
+				return !(fabs(d.x) < tolerance && fabs(d.y) < tolerance && fabs(d.z) < tolerance);
+			};
+
+			// Count first so that each list is allocated once at its final size;
+			// growing them on all workers at once makes the threads wait on the heap.
+			size_t count = 0;
+			MQPoint d;
+			for (int i = 0; i < baseVertSize; ++i)
+			{
+				if (getOffset(i, d))
+					count++;
+			}
+			dst.index.reserve(count);
+			dst.offset.reserve(count * 3);
+			for (int i = 0; i < baseVertSize; ++i)
+			{
+				if (!getOffset(i, d))
+					continue;
+
+				// Exported vertices of an object are numbered in ascending order,
+				// so the index list stays sorted.
+				dst.index.push_back(expvert[i]);
+				dst.offset.push_back(d.x);
+				dst.offset.push_back(d.y);
+				dst.offset.push_back(d.z);
+			}
+		});
+	}
+	if (step && !step(static_cast<int>(positions.size())))
+		return false;
+
+	// Pack into a single CSR block.
+	block.begin.resize(target_num + 1);
+	block.begin[0] = 0;
+	for (size_t t = 0; t < target_num; t++)
+	{
+		block.begin[t + 1] = block.begin[t] + static_cast<DWORD>(offsets[t].index.size());
+	}
+	block.index.resize(block.begin[target_num]);
+	block.offset.resize(block.begin[target_num] * 3);
+	ParallelFor(static_cast<int>(target_num), [&](int t)
+	{
+		std::copy(offsets[t].index.begin(), offsets[t].index.end(), block.index.begin() + block.begin[t]);
+		std::copy(offsets[t].offset.begin(), offsets[t].offset.end(), block.offset.begin() + block.begin[t] * 3);
+	});
+	return true;
+}
+
+namespace
+{
+	// Fingerprint of the vertex set moved by a target (FNV-1a)
+	unsigned long long fingerprintIndices(const DWORD* index, DWORD count)
+	{
+		unsigned long long h = 14695981039346656037ULL;
+		for (DWORD i = 0; i < count; i++)
+		{
+			h ^= index[i];
+			h *= 1099511628211ULL;
+		}
+		h ^= count;
+		return h;
+	}
+
+	bool offsetEqual(const float* a, const float* b, float tolerance)
+	{
+		return fabs(a[0] - b[0]) <= tolerance && fabs(a[1] - b[1]) <= tolerance && fabs(a[2] - b[2]) <= tolerance;
+	}
+
+	// Check if target 'part' moves a subset of the vertices of 'whole' by the same offsets.
+	bool isPartOf(const PMXMorphBlock& block, int part, int whole, float tolerance)
+	{
+		DWORD pn = block.GetOffsetCount(part);
+		DWORD wn = block.GetOffsetCount(whole);
+		const DWORD* pi = block.GetIndexArray(part);
+		const DWORD* wi = block.GetIndexArray(whole);
+		if (pn == 0 || pn > wn || pi[0] < wi[0] || pi[pn - 1] > wi[wn - 1])
+			return false;
+
+		const float* po = block.GetOffsetArray(part);
+		const float* wo = block.GetOffsetArray(whole);
+		DWORD w = 0;
+		for (DWORD p = 0; p < pn; p++)
+		{
+			w = static_cast<DWORD>(std::lower_bound(wi + w, wi + wn, pi[p]) - wi);
+			if (w == wn || wi[w] != pi[p])
+				return false;
+			if (!offsetEqual(po + p * 3, wo + w * 3, tolerance))
+				return false;
+		}
+		return true;
+	}
+}
+
+int FindGroupMorphs(const PMXMorphBlock& block, float tolerance, std::vector<PMXMorphParam>& params)
+{
+	int target_num = block.GetTargetCount();
+	int found = 0;
+
+	// Identical targets refer to the first one.
+	std::unordered_multimap<unsigned long long, int> fingerprints;
+	std::vector<bool> vertex_morph(target_num, true);
+	for (int t = 0; t < target_num; t++)
+	{
+		DWORD count = block.GetOffsetCount(t);
+		if (count == 0)
+			continue;
+
+		unsigned long long h = fingerprintIndices(block.GetIndexArray(t), count);
+		auto range = fingerprints.equal_range(h);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			int org = it->second;
+			if (block.GetOffsetCount(org) == count && isPartOf(block, t, org, tolerance))
+			{
+				params[t].group.push_back(org);
+				vertex_morph[t] = false;
+				found++;
+				break;
+			}
+		}
+		if (vertex_morph[t])
+		{
+			fingerprints.emplace(h, t);
+		}
+	}
+
+	// Collect the smaller targets contained in each target.
+	std::vector<std::vector<int>> parts(target_num);
+	ParallelFor(target_num, [&](int t)
+	{
+		if (!vertex_morph[t])
+			return;
+		DWORD count = block.GetOffsetCount(t);
+		for (int p = 0; p < target_num; p++)
+		{
+			if (p != t && vertex_morph[p] && block.GetOffsetCount(p) < count && isPartOf(block, p, t, tolerance))
+			{
+				parts[t].push_back(p);
+			}
+		}
+	});
+
+	// Decide from the smallest target, so that the parts are settled as
+	// vertex morphs before a larger target refers to them.
+	std::vector<int> order;
+	for (int t = 0; t < target_num; t++)
+	{
+		if (!parts[t].empty())
+			order.push_back(t);
+	}
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return block.GetOffsetCount(a) < block.GetOffsetCount(b); });
+
+	std::vector<DWORD> covered;
+	for (auto oit = order.begin(); oit != order.end(); ++oit)
+	{
+		int t = *oit;
+		std::vector<int>& cand = parts[t];
+		std::stable_sort(cand.begin(), cand.end(), [&](int a, int b) { return block.GetOffsetCount(a) > block.GetOffsetCount(b); });
+
+		// Pick larger parts first while they do not overlap.
+		std::vector<int> used;
+		covered.clear();
+		for (auto it = cand.begin(); it != cand.end(); ++it)
+		{
+			if (!vertex_morph[*it])
+				continue;
+			const DWORD* idx = block.GetIndexArray(*it);
+			DWORD n = block.GetOffsetCount(*it);
+			bool overlap = false;
+			for (DWORD i = 0; i < n && !overlap; i++)
+			{
+				overlap = std::binary_search(covered.begin(), covered.end(), idx[i]);
+			}
+			if (overlap)
+				continue;
+
+			std::vector<DWORD> merged(covered.size() + n);
+			std::merge(covered.begin(), covered.end(), idx, idx + n, merged.begin());
+			covered.swap(merged);
+			used.push_back(*it);
+		}
+
+		if (used.size() >= 2 && covered.size() == block.GetOffsetCount(t))
+		{
+			params[t].group = used;
+			vertex_morph[t] = false;
+			found++;
+		}
+	}
+
+	// A target copied by others may have become a group morph itself.
+	// PMX does not nest group morphs, so the copies refer to its parts instead.
+	for (int t = 0; t < target_num; t++)
+	{
+		if (params[t].group.size() == 1 && !vertex_morph[params[t].group[0]])
+		{
+			std::vector<int> group = params[params[t].group[0]].group;
+			params[t].group.swap(group);
+		}
+	}
+
+	return found;
+}
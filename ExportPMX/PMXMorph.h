@@ -0,0 +1,168 @@
+﻿#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "MQPlugin.h"
+#include <vector>
+#include <functional>
+
+class MQExportObject;
+class MQBasePlugin;
+
+//Facial
+enum MorphType
+{
+	MORPH_BASE = 0,
+	MORPH_BROW,
+	MORPH_EYE,
+	MORPH_LIP,
+	MORPH_OTHER,
+};
+
+struct PMXMorphInputParam
+{
+	MQObject base;
+	std::vector<std::pair<MQObject, MorphType>> target;
+};
+
+// Role of an object in the morph plugin setup
+enum PMXMorphObjectRole
+{
+	MORPH_ROLE_ORDINARY = 0,
+	MORPH_ROLE_BASE = 1,
+	MORPH_ROLE_TARGET = 2,
+};
+
+// Morph setup queried from the morph plugin, with the role of each object.
+// It is queried again on every export, because edits made in the morph plugin do
+// not change the undo state of the document, and the object handles are taken
+// fresh so that none survive the document. The role table makes the target checks
+// in the object and face loops O(1).
+class PMXMorphTopology
+{
+public:
+	PMXMorphTopology();
+
+	// Query the morph plugin and build the roles.
+	void Query(MQBasePlugin* plugin, MQDocument doc);
+
+	const std::vector<PMXMorphInputParam>& GetInputs() const { return m_inputs; }
+	int GetBaseCount() const { return static_cast<int>(m_inputs.size()); }
+	int GetTargetCount() const { return m_target_count; }
+
+	// Role of the object at the index in the document
+	PMXMorphObjectRole GetRole(int object_index) const
+	{
+		return (object_index >= 0 && object_index < static_cast<int>(m_roles.size())) ? static_cast<PMXMorphObjectRole>(m_roles[object_index]) : MORPH_ROLE_ORDINARY;
+	}
+	bool IsTarget(int object_index) const { return GetRole(object_index) == MORPH_ROLE_TARGET; }
+
+private:
+	std::vector<PMXMorphInputParam> m_inputs;
+	int m_target_count;
+	std::vector<BYTE> m_roles;
+
+	void query(MQBasePlugin* plugin, MQDocument doc);
+	void buildRoles(MQDocument doc);
+};
+
+struct PMXMorphParam
+{
+	char skin_name[20]; //　表情名
+	MorphType type;
+
+	// Morphs referred with a weight of 1 when written as a group morph.
+	// The morph is written as a vertex morph if empty.
+	std::vector<int> group;
+};
+
+// Vertex offsets of all morph targets in CSR layout.
+// The offsets of target t are stored in [begin[t], begin[t+1]) of index/offset,
+// sorted by the exported vertex index.
+struct PMXMorphBlock
+{
+	std::vector<DWORD> begin;
+	std::vector<DWORD> index;
+	std::vector<float> offset; // x, y, z per index
+
+	int GetTargetCount() const { return begin.empty() ? 0 : static_cast<int>(begin.size()) - 1; }
+	DWORD GetOffsetCount(int t) const { return begin[t + 1] - begin[t]; }
+	const DWORD* GetIndexArray(int t) const { return index.data() + begin[t]; }
+	const float* GetOffsetArray(int t) const { return offset.data() + begin[t] * 3; }
+};
+
+// Tolerance to drop vertices that hardly move in a morph target
+struct PMXMorphTolerance
+{
+	float value;
+	bool relative; // value is a rate of the diagonal length of the model bounds
+
+	PMXMorphTolerance()
+	{
+		value = 0.00001f;
+		relative = false;
+	}
+
+	float GetAbsolute(const MQPoint& bounds_min, const MQPoint& bounds_max) const;
+};
+
+// How a base vertex finds its vertex in a target
+enum PMXMorphMatchMode
+{
+	MORPH_MATCH_INDEX = 0, // same vertex index
+	MORPH_MATCH_AUTO,      // nearest vertex if the vertex count differs from the base
+	MORPH_MATCH_NEAREST,   // nearest vertex always
+};
+
+struct PMXMorphMatchParam
+{
+	PMXMorphMatchMode mode;
+	float radius; // absolute search radius for the nearest vertex
+
+	PMXMorphMatchParam()
+	{
+		mode = MORPH_MATCH_INDEX;
+		radius = 0.0f;
+	}
+};
+
+// Vertex positions of a morph base and its targets
+struct PMXMorphPositions
+{
+	int base_index; // index of the base in the document, -1 if it is not there
+	std::vector<MQPoint> base;
+	std::vector<std::vector<MQPoint>> targets;
+};
+
+// Read the positions of all bases and targets from the host, in the order of 'inputs'.
+// This is the only part of the morph extraction that calls the host, so it is
+// done on the main thread and the offsets are extracted in the export thread.
+// 'step' is called with the number of bases read and stops the reading when it
+// returns false. Returns false if stopped.
+bool ReadMorphPositions(const std::vector<PMXMorphInputParam>& inputs,
+	MQDocument doc,
+	std::vector<PMXMorphPositions>& positions,
+	const std::function<bool(int)>& step = std::function<bool(int)>());
+
+// Extract the vertex offsets of all morph targets.
+// The targets of each base object are compared in parallel.
+// Targets are numbered in the order of 'positions'.
+// When the nearest vertex is used, a base vertex without a target vertex
+// within the search radius is treated as not moved.
+// Split vertices mapped to -1 in 'orgvert_vert' are not exported and skipped.
+// 'step' is called with the number of bases done and cancels the extraction
+// when it returns false. Returns false if canceled.
+bool ExtractMorphOffsets(const std::vector<PMXMorphPositions>& positions,
+	const std::vector<MQExportObject*>& expobjs,
+	const std::vector<std::vector<int>>& orgvert_vert,
+	float tolerance,
+	const PMXMorphMatchParam& match,
+	PMXMorphBlock& block,
+	const std::function<bool(int)>& step = std::function<bool(int)>());
+
+// Detect targets that are copies of another target, or the sum of other
+// targets moving disjoint vertices (e.g. left and right halves of a full
+// target), and turn them into group morphs so their offsets are written once.
+// A group morph only refers to vertex morphs.
+// Returns the number of targets turned into group morphs.
+int FindGroupMorphs(const PMXMorphBlock& block, float tolerance, std::vector<PMXMorphParam>& params);
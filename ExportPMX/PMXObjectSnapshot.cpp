@@ -0,0 +1,44 @@
+﻿#include "PMXObjectSnapshot.h"
+#include "MQBoneManager.h"
+
+void PMXObjectSnapshot::Take(MQObject obj, MQBoneManager* bone_manager)
+{
+	int vert_num = obj->GetVertexCount();
+	positions.resize(vert_num);
+	if (vert_num > 0)
+	{
+		obj->GetVertexArray(positions.data());
+	}
+
+	int face_num = obj->GetFaceCount();
+	face_material.resize(face_num);
+	for (int fi = 0; fi < face_num; fi++)
+	{
+		face_material[fi] = obj->GetFaceMaterial(fi);
+	}
+
+	weights.clear();
+	if (bone_manager == nullptr)
+		return;
+
+	weights.resize(vert_num);
+	UINT bone_ids[16];
+	float bone_weights[16];
+	for (int vi = 0; vi < vert_num; vi++)
+	{
+		PMXVertexWeights& w = weights[vi];
+		w.count = bone_manager->GetVertexWeightArray(obj, obj->GetVertexUniqueID(vi), 16, bone_ids, bone_weights);
+		for (int k = 0; k < 4; k++)
+		{
+			w.bone[k] = (k < w.count) ? bone_ids[k] : 0;
+			w.weight[k] = (k < w.count) ? bone_weights[k] : 0.0f;
+		}
+	}
+}
+
+void PMXObjectSnapshot::Clear()
+{
+	std::vector<MQPoint>().swap(positions);
+	std::vector<int>().swap(face_material);
+	std::vector<PMXVertexWeights>().swap(weights);
+}
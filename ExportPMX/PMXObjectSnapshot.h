@@ -0,0 +1,31 @@
+﻿#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "MQPlugin.h"
+#include <vector>
+
+class MQBoneManager;
+
+// Skin weights of a vertex as returned by the bone plugin.
+// Only the first 4 are kept; vertices with more are written without skinning.
+struct PMXVertexWeights
+{
+	int count;
+	UINT bone[4];
+	float weight[4];
+};
+
+// Host data of an object that is needed after its MQExportObject is built.
+// It is copied on the main thread, so that the faces can be triangulated and the
+// vertices written in the export thread without calling the host.
+struct PMXObjectSnapshot
+{
+	std::vector<MQPoint> positions;        // of the original vertices
+	std::vector<int> face_material;        // as returned by the host, may be out of range
+	std::vector<PMXVertexWeights> weights; // of the original vertices, empty without bones
+
+	// The weights are not read when 'bone_manager' is nullptr.
+	void Take(MQObject obj, MQBoneManager* bone_manager);
+	void Clear();
+};
@@ -0,0 +1,849 @@
+﻿#include "PMXReader.h"
+#include <string.h>
+#include <string>
+
+//---------------------------------------------------------------------------
+//  PMXFileMapping
+//---------------------------------------------------------------------------
+
+PMXFileMapping::PMXFileMapping()
+{
+	m_file = INVALID_HANDLE_VALUE;
+	m_mapping = nullptr;
+	m_data = nullptr;
+	m_size = 0;
+}
+
+PMXFileMapping::~PMXFileMapping()
+{
+	Close();
+}
+
+bool PMXFileMapping::Open(const MString& filename)
+{
+	Close();
+
+	m_file = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+	{
+		Close();
+		return false;
+	}
+	m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (m_mapping == nullptr)
+	{
+		Close();
+		return false;
+	}
+	m_data = static_cast<const BYTE*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+	if (m_data == nullptr)
+	{
+		Close();
+		return false;
+	}
+	m_size = static_cast<size_t>(size.QuadPart);
+	return true;
+}
+
+void PMXFileMapping::Close()
+{
+	if (m_data != nullptr)
+		UnmapViewOfFile(m_data);
+	if (m_mapping != nullptr)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+	m_file = INVALID_HANDLE_VALUE;
+	m_mapping = nullptr;
+	m_data = nullptr;
+	m_size = 0;
+}
+
+//---------------------------------------------------------------------------
+//  Helpers
+//---------------------------------------------------------------------------
+
+MString PMXText::ToString() const
+{
+	if (data == nullptr || bytes <= 0)
+		return MString();
+	if (utf8)
+	{
+		std::string str(reinterpret_cast<const char*>(data), bytes);
+		return MString::fromUtf8String(str.c_str());
+	}
+	std::wstring str(bytes / 2, L'\0');
+	memcpy(&str[0], data, (bytes / 2) * 2);
+	return MString(str);
+}
+
+int ReadPMXIndex(const BYTE* p, int size, bool vertex_index)
+{
+	switch (size)
+	{
+	case 1:
+		return vertex_index ? static_cast<int>(p[0]) : static_cast<int>(static_cast<signed char>(p[0]));
+	case 2:
+		{
+			WORD v;
+			memcpy(&v, p, 2);
+			return vertex_index ? static_cast<int>(v) : static_cast<int>(static_cast<short>(v));
+		}
+	default:
+		{
+			int v;
+			memcpy(&v, p, 4);
+			return v;
+		}
+	}
+}
+
+static float readFloat(const BYTE* p)
+{
+	float v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static int readInt(const BYTE* p)
+{
+	int v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+// Bounds-checked reading position in the file
+class PMXCursor
+{
+public:
+	PMXCursor(const BYTE* data, size_t size) : m_data(data), m_size(size), m_pos(0) {}
+
+	size_t GetPos() const { return m_pos; }
+	const BYTE* GetPtr() const { return m_data + m_pos; }
+
+	bool Skip(size_t bytes)
+	{
+		if (bytes > m_size - m_pos)
+			return false;
+		m_pos += bytes;
+		return true;
+	}
+	bool ReadByte(BYTE& v)
+	{
+		if (m_pos >= m_size)
+			return false;
+		v = m_data[m_pos++];
+		return true;
+	}
+	bool ReadInt(int& v)
+	{
+		if (4 > m_size - m_pos)
+			return false;
+		v = readInt(m_data + m_pos);
+		m_pos += 4;
+		return true;
+	}
+	bool ReadIndex(int size, int& v)
+	{
+		if (static_cast<size_t>(size) > m_size - m_pos)
+			return false;
+		v = ReadPMXIndex(m_data + m_pos, size, false);
+		m_pos += size;
+		return true;
+	}
+	// Read a count that must be non-negative and fit in the rest of the file
+	bool ReadCount(int& v, size_t min_record_size)
+	{
+		if (!ReadInt(v) || v < 0)
+			return false;
+		return static_cast<size_t>(v) * min_record_size <= m_size - m_pos;
+	}
+	bool ReadText(PMXText& text, bool utf8)
+	{
+		int bytes;
+		if (!ReadInt(bytes) || bytes < 0 || static_cast<size_t>(bytes) > m_size - m_pos)
+			return false;
+		text.data = m_data + m_pos;
+		text.bytes = bytes;
+		text.utf8 = utf8;
+		m_pos += bytes;
+		return true;
+	}
+	bool SkipText()
+	{
+		int bytes;
+		return ReadInt(bytes) && bytes >= 0 && Skip(bytes);
+	}
+
+private:
+	const BYTE* m_data;
+	size_t m_size;
+	size_t m_pos;
+};
+
+//---------------------------------------------------------------------------
+//  PMXReader
+//---------------------------------------------------------------------------
+
+PMXReader::PMXReader()
+{
+	m_data = nullptr;
+	m_size = 0;
+	memset(&m_header, 0, sizeof(m_header));
+	m_indices = nullptr;
+	m_index_count = 0;
+	m_rigid_count = 0;
+	m_joint_count = 0;
+	m_soft_count = 0;
+	m_vertex_section = 0;
+	m_index_section = 0;
+	m_texture_section = 0;
+	m_material_section = 0;
+	m_bone_section = 0;
+	m_morph_section = 0;
+	m_frame_section = 0;
+	m_rigid_section = 0;
+}
+
+bool PMXReader::Open(const MString& filename)
+{
+	Close();
+	if (!m_mapping.Open(filename))
+	{
+		m_error = MString::format(L"Cannot open %s", filename.c_str());
+		return false;
+	}
+	m_data = m_mapping.GetData();
+	m_size = m_mapping.GetSize();
+	return parseOrClose();
+}
+
+bool PMXReader::Parse(const BYTE* data, size_t size)
+{
+	Close();
+	m_data = data;
+	m_size = size;
+	return parseOrClose();
+}
+
+bool PMXReader::parseOrClose()
+{
+	if (parse())
+		return true;
+
+	// Do not leave half-read sections behind
+	MString error = m_error;
+	Close();
+	m_error = error;
+	return false;
+}
+
+void PMXReader::Close()
+{
+	m_mapping.Close();
+	m_data = nullptr;
+	m_size = 0;
+	m_error = MString();
+	m_vertices.clear();
+	m_indices = nullptr;
+	m_index_count = 0;
+	m_textures.clear();
+	m_materials.clear();
+	m_bones.clear();
+	m_morphs.clear();
+	m_frames.clear();
+	m_rigid_count = 0;
+	m_joint_count = 0;
+	m_soft_count = 0;
+	m_vertex_section = 0;
+	m_index_section = 0;
+	m_texture_section = 0;
+	m_material_section = 0;
+	m_bone_section = 0;
+	m_morph_section = 0;
+	m_frame_section = 0;
+	m_rigid_section = 0;
+}
+
+static bool isIndexSize(int size)
+{
+	return size == 1 || size == 2 || size == 4;
+}
+
+static int getMorphOffsetSize(int kind, const PMXHeaderInfo& h)
+{
+	switch (kind)
+	{
+	case PMX_MORPH_GROUP:
+	case PMX_MORPH_FLIP:
+		return h.morph_index_size + 4;
+	case PMX_MORPH_VERTEX:
+		return h.vertex_index_size + 12;
+	case PMX_MORPH_BONE:
+		return h.bone_index_size + 12 + 16;
+	case PMX_MORPH_UV:
+	case PMX_MORPH_UV1:
+	case PMX_MORPH_UV2:
+	case PMX_MORPH_UV3:
+	case PMX_MORPH_UV4:
+		return h.vertex_index_size + 16;
+	case PMX_MORPH_MATERIAL:
+		return h.material_index_size + 1 + 112;
+	case PMX_MORPH_IMPULSE:
+		return h.rigid_index_size + 1 + 24;
+	}
+	return -1;
+}
+
+static int getMorphIndexSize(int kind, const PMXHeaderInfo& h)
+{
+	switch (kind)
+	{
+	case PMX_MORPH_GROUP:
+	case PMX_MORPH_FLIP:
+		return h.morph_index_size;
+	case PMX_MORPH_BONE:
+		return h.bone_index_size;
+	case PMX_MORPH_MATERIAL:
+		return h.material_index_size;
+	case PMX_MORPH_IMPULSE:
+		return h.rigid_index_size;
+	}
+	return h.vertex_index_size;
+}
+
+int PMXMorphView::GetOffsetIndex(int i, const PMXHeaderInfo& header) const
+{
+	bool vertex = (kind == PMX_MORPH_VERTEX || (kind >= PMX_MORPH_UV && kind <= PMX_MORPH_UV4));
+	return ReadPMXIndex(offsets + static_cast<size_t>(i) * offset_size, getMorphIndexSize(kind, header), vertex);
+}
+
+const BYTE* PMXMorphView::GetOffsetData(int i, const PMXHeaderInfo& header) const
+{
+	return offsets + static_cast<size_t>(i) * offset_size + getMorphIndexSize(kind, header);
+}
+
+bool PMXReader::parse()
+{
+	PMXCursor c(m_data, m_size);
+
+	// Header
+	BYTE globals_num;
+	if (m_size < 9 || memcmp(m_data, "PMX ", 4) != 0)
+	{
+		m_error = L"Not a PMX file";
+		return false;
+	}
+	c.Skip(4);
+	m_header.version = readFloat(c.GetPtr());
+	c.Skip(4);
+	if (m_header.version < 2.0f || m_header.version > 2.1f + 1e-4f)
+	{
+		m_error = MString::format(L"Unsupported version %.1f", m_header.version);
+		return false;
+	}
+	if (!c.ReadByte(globals_num) || globals_num < 8 || !c.Skip(0))
+	{
+		m_error = L"Broken header";
+		return false;
+	}
+	const BYTE* g = c.GetPtr();
+	if (!c.Skip(globals_num))
+	{
+		m_error = L"Broken header";
+		return false;
+	}
+	m_header.encoding = g[0];
+	m_header.additional_uv = g[1];
+	m_header.vertex_index_size = g[2];
+	m_header.texture_index_size = g[3];
+	m_header.material_index_size = g[4];
+	m_header.bone_index_size = g[5];
+	m_header.morph_index_size = g[6];
+	m_header.rigid_index_size = g[7];
+	const PMXHeaderInfo& h = m_header;
+	if (h.encoding > 1 || h.additional_uv > 4
+		|| !isIndexSize(h.vertex_index_size) || !isIndexSize(h.texture_index_size) || !isIndexSize(h.material_index_size)
+		|| !isIndexSize(h.bone_index_size) || !isIndexSize(h.morph_index_size) || !isIndexSize(h.rigid_index_size))
+	{
+		m_error = L"Invalid header values";
+		return false;
+	}
+	bool utf8 = (h.encoding == 1);
+
+	if (!c.ReadText(m_model_name, utf8) || !c.ReadText(m_model_name_en, utf8)
+		|| !c.ReadText(m_comment, utf8) || !c.ReadText(m_comment_en, utf8))
+	{
+		m_error = L"Broken model information";
+		return false;
+	}
+
+	// Vertices
+	m_vertex_section = c.GetPos();
+	{
+		int base_size = 32 + 16 * h.additional_uv + 1;
+		int weight_size[5];
+		weight_size[PMX_WEIGHT_BDEF1] = h.bone_index_size;
+		weight_size[PMX_WEIGHT_BDEF2] = h.bone_index_size * 2 + 4;
+		weight_size[PMX_WEIGHT_BDEF4] = h.bone_index_size * 4 + 16;
+		weight_size[PMX_WEIGHT_SDEF] = h.bone_index_size * 2 + 4 + 36;
+		weight_size[PMX_WEIGHT_QDEF] = weight_size[PMX_WEIGHT_BDEF4];
+
+		int num;
+		if (!c.ReadCount(num, base_size + h.bone_index_size + 4))
+		{
+			m_error = L"Broken vertex count";
+			return false;
+		}
+		m_vertices.resize(num);
+		size_t pos = c.GetPos();
+		for (int i = 0; i < num; i++)
+		{
+			if (pos + base_size > m_size)
+			{
+				m_error = MString::format(L"Vertex %d is out of the file", i);
+				return false;
+			}
+			BYTE type = m_data[pos + base_size - 1];
+			if (type > PMX_WEIGHT_QDEF || (type == PMX_WEIGHT_QDEF && h.version < 2.1f))
+			{
+				m_error = MString::format(L"Vertex %d has an invalid weight type %d", i, type);
+				return false;
+			}
+			m_vertices[i] = static_cast<DWORD>(pos);
+			pos += base_size + weight_size[type] + 4;
+		}
+		if (pos > m_size || !c.Skip(pos - c.GetPos()))
+		{
+			m_error = L"Vertices are out of the file";
+			return false;
+		}
+	}
+
+	// Faces
+	m_index_section = c.GetPos();
+	if (!c.ReadCount(m_index_count, h.vertex_index_size))
+	{
+		m_error = L"Broken face count";
+		return false;
+	}
+	m_indices = c.GetPtr();
+	c.Skip(static_cast<size_t>(m_index_count) * h.vertex_index_size);
+
+	// Textures
+	m_texture_section = c.GetPos();
+	{
+		int num;
+		if (!c.ReadCount(num, 4))
+		{
+			m_error = L"Broken texture count";
+			return false;
+		}
+		m_textures.resize(num);
+		for (int i = 0; i < num; i++)
+		{
+			if (!c.ReadText(m_textures[i], utf8))
+			{
+				m_error = MString::format(L"Texture %d is out of the file", i);
+				return false;
+			}
+		}
+	}
+
+	// Materials
+	m_material_section = c.GetPos();
+	{
+		int num;
+		if (!c.ReadCount(num, 8))
+		{
+			m_error = L"Broken material count";
+			return false;
+		}
+		m_materials.resize(num);
+		for (int i = 0; i < num; i++)
+		{
+			m_materials[i] = static_cast<DWORD>(c.GetPos());
+			BYTE shared_toon = 0;
+			bool ok = c.SkipText() && c.SkipText() && c.Skip(44 + 1 + 20 + h.texture_index_size * 2 + 1) && c.ReadByte(shared_toon)
+				&& c.Skip(shared_toon ? 1 : h.texture_index_size) && c.SkipText() && c.Skip(4);
+			if (!ok)
+			{
+				m_error = MString::format(L"Material %d is out of the file", i);
+				return false;
+			}
+		}
+	}
+
+	// Bones
+	m_bone_section = c.GetPos();
+	{
+		int num;
+		if (!c.ReadCount(num, 8))
+		{
+			m_error = L"Broken bone count";
+			return false;
+		}
+		m_bones.resize(num);
+		for (int i = 0; i < num; i++)
+		{
+			m_bones[i] = static_cast<DWORD>(c.GetPos());
+			bool ok = c.SkipText() && c.SkipText() && c.Skip(12 + h.bone_index_size + 4);
+			WORD flags = 0;
+			if (ok && c.Skip(2))
+				memcpy(&flags, c.GetPtr() - 2, 2);
+			else
+				ok = false;
+			if (ok)
+				ok = c.Skip((flags & PMX_BONE_TAIL_INDEX) ? h.bone_index_size : 12);
+			if (ok && (flags & (PMX_BONE_INHERIT_ROTATION | PMX_BONE_INHERIT_TRANSLATION)))
+				ok = c.Skip(h.bone_index_size + 4);
+			if (ok && (flags & PMX_BONE_FIXED_AXIS))
+				ok = c.Skip(12);
+			if (ok && (flags & PMX_BONE_LOCAL_AXIS))
+				ok = c.Skip(24);
+			if (ok && (flags & PMX_BONE_EXTERNAL_PARENT))
+				ok = c.Skip(4);
+			if (ok && (flags & PMX_BONE_IK))
+			{
+				int link_num = 0;
+				ok = c.Skip(h.bone_index_size + 8) && c.ReadCount(link_num, h.bone_index_size + 1);
+				for (int l = 0; ok && l < link_num; l++)
+				{
+					BYTE limited = 0;
+					ok = c.Skip(h.bone_index_size) && c.ReadByte(limited) && (!limited || c.Skip(24));
+				}
+			}
+			if (!ok)
+			{
+				m_error = MString::format(L"Bone %d is out of the file", i);
+				return false;
+			}
+		}
+	}
+
+	// Morphs
+	m_morph_section = c.GetPos();
+	{
+		int num;
+		if (!c.ReadCount(num, 14))
+		{
+			m_error = L"Broken morph count";
+			return false;
+		}
+		m_morphs.resize(num);
+		for (int i = 0; i < num; i++)
+		{
+			m_morphs[i] = static_cast<DWORD>(c.GetPos());
+			BYTE kind = 0;
+			int offset_num = 0;
+			bool ok = c.SkipText() && c.SkipText() && c.Skip(1) && c.ReadByte(kind);
+			int offset_size = ok ? getMorphOffsetSize(kind, h) : -1;
+			if (offset_size < 0 || (kind >= PMX_MORPH_FLIP && h.version < 2.1f))
+			{
+				m_error = MString::format(L"Morph %d has an invalid type", i);
+				return false;
+			}
+			ok = c.ReadCount(offset_num, offset_size) && c.Skip(static_cast<size_t>(offset_num) * offset_size);
+			if (!ok)
+			{
+				m_error = MString::format(L"Morph %d is out of the file", i);
+				return false;
+			}
+		}
+	}
+
+	// Display frames
+	m_frame_section = c.GetPos();
+	{
+		int num;
+		if (!c.ReadCount(num, 13))
+		{
+			m_error = L"Broken display frame count";
+			return false;
+		}
+		m_frames.resize(num);
+		for (int i = 0; i < num; i++)
+		{
+			m_frames[i] = static_cast<DWORD>(c.GetPos());
+			int element_num = 0;
+			bool ok = c.SkipText() && c.SkipText() && c.Skip(1) && c.ReadCount(element_num, 2);
+			for (int e = 0; ok && e < element_num; e++)
+			{
+				BYTE target = 0;
+				ok = c.ReadByte(target) && target <= 1 && c.Skip(target == 0 ? h.bone_index_size : h.morph_index_size);
+			}
+			if (!ok)
+			{
+				m_error = MString::format(L"Display frame %d is broken", i);
+				return false;
+			}
+		}
+	}
+
+	// Rigid bodies and joints are only counted
+	m_rigid_section = c.GetPos();
+	if (!c.ReadCount(m_rigid_count, 8))
+	{
+		m_error = L"Broken rigid body count";
+		return false;
+	}
+	for (int i = 0; i < m_rigid_count; i++)
+	{
+		if (!(c.SkipText() && c.SkipText() && c.Skip(h.bone_index_size + 61)))
+		{
+			m_error = MString::format(L"Rigid body %d is out of the file", i);
+			return false;
+		}
+	}
+	if (!c.ReadCount(m_joint_count, 8))
+	{
+		m_error = L"Broken joint count";
+		return false;
+	}
+	for (int i = 0; i < m_joint_count; i++)
+	{
+		if (!(c.SkipText() && c.SkipText() && c.Skip(1 + h.rigid_index_size * 2 + 96)))
+		{
+			m_error = MString::format(L"Joint %d is out of the file", i);
+			return false;
+		}
+	}
+
+	// Soft bodies (2.1)
+	m_soft_count = 0;
+	if (h.version >= 2.1f && c.GetPos() < m_size)
+	{
+		if (!c.ReadCount(m_soft_count, 8))
+		{
+			m_error = L"Broken soft body count";
+			return false;
+		}
+		for (int i = 0; i < m_soft_count; i++)
+		{
+			int anchor_num = 0, pin_num = 0;
+			bool ok = c.SkipText() && c.SkipText() && c.Skip(1 + h.material_index_size + 1 + 2 + 1 + 4 * 5 + 48 + 24 + 16 + 12)
+				&& c.ReadCount(anchor_num, h.rigid_index_size + h.vertex_index_size + 1)
+				&& c.Skip(static_cast<size_t>(anchor_num) * (h.rigid_index_size + h.vertex_index_size + 1))
+				&& c.ReadCount(pin_num, h.vertex_index_size)
+				&& c.Skip(static_cast<size_t>(pin_num) * h.vertex_index_size);
+			if (!ok)
+			{
+				m_error = MString::format(L"Soft body %d is out of the file", i);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void PMXReader::GetVertex(int index, PMXVertexView& view) const
+{
+	const PMXHeaderInfo& h = m_header;
+	const BYTE* p = m_data + m_vertices[index];
+	view.position = reinterpret_cast<const float*>(p);
+	view.normal = reinterpret_cast<const float*>(p + 12);
+	view.uv = reinterpret_cast<const float*>(p + 24);
+	view.additional_uv = reinterpret_cast<const float*>(p + 32);
+	p += 32 + 16 * h.additional_uv;
+	view.weight_type = *p++;
+
+	int bs = h.bone_index_size;
+	for (int i = 0; i < 4; i++)
+	{
+		view.bone[i] = -1;
+		view.weight[i] = 0.0f;
+	}
+	switch (view.weight_type)
+	{
+	case PMX_WEIGHT_BDEF1:
+		view.bone_count = 1;
+		view.bone[0] = ReadPMXIndex(p, bs, false);
+		view.weight[0] = 1.0f;
+		p += bs;
+		break;
+	case PMX_WEIGHT_BDEF2:
+	case PMX_WEIGHT_SDEF:
+		view.bone_count = 2;
+		view.bone[0] = ReadPMXIndex(p, bs, false);
+		view.bone[1] = ReadPMXIndex(p + bs, bs, false);
+		view.weight[0] = readFloat(p + bs * 2);
+		view.weight[1] = 1.0f - view.weight[0];
+		p += bs * 2 + 4 + ((view.weight_type == PMX_WEIGHT_SDEF) ? 36 : 0);
+		break;
+	default:
+		view.bone_count = 4;
+		for (int i = 0; i < 4; i++)
+		{
+			view.bone[i] = ReadPMXIndex(p + bs * i, bs, false);
+			view.weight[i] = readFloat(p + bs * 4 + 4 * i);
+		}
+		p += bs * 4 + 16;
+		break;
+	}
+	view.edge_scale = readFloat(p);
+}
+
+const BYTE* PMXReader::GetVertexRecord(int index, size_t& size) const
+{
+	size_t end = (index + 1 < static_cast<int>(m_vertices.size())) ? m_vertices[index + 1] : m_index_section;
+	size = end - m_vertices[index];
+	return m_data + m_vertices[index];
+}
+
+int PMXReader::GetIndex(int i) const
+{
+	return ReadPMXIndex(m_indices + static_cast<size_t>(i) * m_header.vertex_index_size, m_header.vertex_index_size, true);
+}
+
+const BYTE* PMXReader::GetMaterialRecord(int index, size_t& size) const
+{
+	size_t end = (index + 1 < static_cast<int>(m_materials.size())) ? m_materials[index + 1] : m_bone_section;
+	size = end - m_materials[index];
+	return m_data + m_materials[index];
+}
+
+void PMXReader::GetMaterial(int index, PMXMaterialView& view) const
+{
+	const PMXHeaderInfo& h = m_header;
+	bool utf8 = (h.encoding == 1);
+	PMXCursor c(m_data + m_materials[index], m_size - m_materials[index]);
+	c.ReadText(view.name, utf8);
+	c.ReadText(view.name_en, utf8);
+	const BYTE* p = c.GetPtr();
+	view.diffuse = reinterpret_cast<const float*>(p);
+	view.specular = reinterpret_cast<const float*>(p + 16);
+	view.ambient = reinterpret_cast<const float*>(p + 32);
+	view.flags = p[44];
+	view.edge_color = reinterpret_cast<const float*>(p + 45);
+	c.Skip(65);
+	c.ReadIndex(h.texture_index_size, view.texture);
+	c.ReadIndex(h.texture_index_size, view.sphere);
+	c.ReadByte(view.sphere_mode);
+	c.ReadByte(view.shared_toon);
+	if (view.shared_toon)
+	{
+		BYTE toon = 0;
+		c.ReadByte(toon);
+		view.toon = toon;
+	}
+	else
+	{
+		c.ReadIndex(h.texture_index_size, view.toon);
+	}
+	c.ReadText(view.memo, utf8);
+	c.ReadInt(view.index_count);
+}
+
+void PMXReader::GetBone(int index, PMXBoneView& view) const
+{
+	const PMXHeaderInfo& h = m_header;
+	bool utf8 = (h.encoding == 1);
+	int bs = h.bone_index_size;
+	PMXCursor c(m_data + m_bones[index], m_size - m_bones[index]);
+	c.ReadText(view.name, utf8);
+	c.ReadText(view.name_en, utf8);
+	view.position = reinterpret_cast<const float*>(c.GetPtr());
+	c.Skip(12);
+	c.ReadIndex(bs, view.parent);
+	c.ReadInt(view.layer);
+	memcpy(&view.flags, c.GetPtr(), 2);
+	c.Skip(2);
+
+	view.tail_bone = -1;
+	view.tail_offset = nullptr;
+	view.inherit_bone = -1;
+	view.inherit_rate = 0.0f;
+	view.fixed_axis = nullptr;
+	view.local_axis_x = nullptr;
+	view.local_axis_z = nullptr;
+	view.external_key = 0;
+	view.ik_target = -1;
+	view.ik_loop = 0;
+	view.ik_limit = 0.0f;
+	view.ik_links.clear();
+
+	if (view.flags & PMX_BONE_TAIL_INDEX)
+	{
+		c.ReadIndex(bs, view.tail_bone);
+	}
+	else
+	{
+		view.tail_offset = reinterpret_cast<const float*>(c.GetPtr());
+		c.Skip(12);
+	}
+	if (view.flags & (PMX_BONE_INHERIT_ROTATION | PMX_BONE_INHERIT_TRANSLATION))
+	{
+		c.ReadIndex(bs, view.inherit_bone);
+		view.inherit_rate = readFloat(c.GetPtr());
+		c.Skip(4);
+	}
+	if (view.flags & PMX_BONE_FIXED_AXIS)
+	{
+		view.fixed_axis = reinterpret_cast<const float*>(c.GetPtr());
+		c.Skip(12);
+	}
+	if (view.flags & PMX_BONE_LOCAL_AXIS)
+	{
+		view.local_axis_x = reinterpret_cast<const float*>(c.GetPtr());
+		view.local_axis_z = view.local_axis_x + 3;
+		c.Skip(24);
+	}
+	if (view.flags & PMX_BONE_EXTERNAL_PARENT)
+	{
+		c.ReadInt(view.external_key);
+	}
+	if (view.flags & PMX_BONE_IK)
+	{
+		int link_num = 0;
+		c.ReadIndex(bs, view.ik_target);
+		c.ReadInt(view.ik_loop);
+		view.ik_limit = readFloat(c.GetPtr());
+		c.Skip(4);
+		c.ReadInt(link_num);
+		view.ik_links.resize(link_num);
+		for (int l = 0; l < link_num; l++)
+		{
+			PMXBoneIKLink& link = view.ik_links[l];
+			BYTE limited = 0;
+			c.ReadIndex(bs, link.bone);
+			c.ReadByte(limited);
+			link.limited = (limited != 0);
+			link.limit_min = nullptr;
+			link.limit_max = nullptr;
+			if (link.limited)
+			{
+				link.limit_min = reinterpret_cast<const float*>(c.GetPtr());
+				link.limit_max = link.limit_min + 3;
+				c.Skip(24);
+			}
+		}
+	}
+}
+
+void PMXReader::GetMorph(int index, PMXMorphView& view) const
+{
+	bool utf8 = (m_header.encoding == 1);
+	PMXCursor c(m_data + m_morphs[index], m_size - m_morphs[index]);
+	c.ReadText(view.name, utf8);
+	c.ReadText(view.name_en, utf8);
+	c.ReadByte(view.panel);
+	c.ReadByte(view.kind);
+	c.ReadInt(view.offset_count);
+	view.offsets = c.GetPtr();
+	view.offset_size = getMorphOffsetSize(view.kind, m_header);
+}
+
+void PMXReader::GetDisplayFrame(int index, PMXDisplayFrameView& view) const
+{
+	bool utf8 = (m_header.encoding == 1);
+	PMXCursor c(m_data + m_frames[index], m_size - m_frames[index]);
+	c.ReadText(view.name, utf8);
+	c.ReadText(view.name_en, utf8);
+	c.ReadByte(view.special);
+	c.ReadInt(view.element_count);
+	view.elements = c.GetPtr();
+}
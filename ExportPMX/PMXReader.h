@@ -0,0 +1,283 @@
+﻿#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "MString.h"
+#include <vector>
+
+// Read-only memory mapping of a file
+class PMXFileMapping
+{
+public:
+	PMXFileMapping();
+	~PMXFileMapping();
+
+	bool Open(const MString& filename);
+	void Close();
+
+	const BYTE* GetData() const { return m_data; }
+	size_t GetSize() const { return m_size; }
+
+private:
+	HANDLE m_file;
+	HANDLE m_mapping;
+	const BYTE* m_data;
+	size_t m_size;
+
+	PMXFileMapping(const PMXFileMapping&);
+	PMXFileMapping& operator=(const PMXFileMapping&);
+};
+
+// Text in the file (UTF-16LE or UTF-8, not null-terminated)
+struct PMXText
+{
+	const BYTE* data;
+	int bytes;
+	bool utf8;
+
+	PMXText() : data(nullptr), bytes(0), utf8(false) {}
+
+	MString ToString() const;
+};
+
+struct PMXHeaderInfo
+{
+	float version;
+	int encoding;            // 0:UTF-16LE 1:UTF-8
+	int additional_uv;       // 0-4
+	int vertex_index_size;   // 1, 2 or 4
+	int texture_index_size;
+	int material_index_size;
+	int bone_index_size;
+	int morph_index_size;
+	int rigid_index_size;
+};
+
+enum PMXWeightType
+{
+	PMX_WEIGHT_BDEF1 = 0,
+	PMX_WEIGHT_BDEF2 = 1,
+	PMX_WEIGHT_BDEF4 = 2,
+	PMX_WEIGHT_SDEF = 3,
+	PMX_WEIGHT_QDEF = 4, // 2.1
+};
+
+// A vertex decoded from the mapped file.
+// The float arrays point into the file.
+struct PMXVertexView
+{
+	const float* position; // x, y, z
+	const float* normal;
+	const float* uv;
+	const float* additional_uv; // 4 floats per additional UV
+	int weight_type;
+	int bone_count;  // 1, 2 or 4
+	int bone[4];     // -1 if none
+	float weight[4]; // BDEF2/SDEF: weight[1] = 1 - weight[0]
+	float edge_scale;
+};
+
+struct PMXMaterialView
+{
+	PMXText name;
+	PMXText name_en;
+	const float* diffuse;  // r, g, b, a
+	const float* specular; // r, g, b, power
+	const float* ambient;  // r, g, b
+	BYTE flags;
+	const float* edge_color; // r, g, b, a, size
+	int texture;     // -1 if none
+	int sphere;      // -1 if none
+	BYTE sphere_mode;
+	BYTE shared_toon;
+	int toon;        // shared toon number or texture index
+	PMXText memo;
+	int index_count; // number of face indices of the material
+};
+
+struct PMXBoneIKLink
+{
+	int bone;
+	bool limited;
+	const float* limit_min; // nullptr if not limited
+	const float* limit_max;
+};
+
+enum PMXBoneFlag
+{
+	PMX_BONE_TAIL_INDEX = 0x0001,
+	PMX_BONE_ROTATABLE = 0x0002,
+	PMX_BONE_MOVABLE = 0x0004,
+	PMX_BONE_VISIBLE = 0x0008,
+	PMX_BONE_ENABLED = 0x0010,
+	PMX_BONE_IK = 0x0020,
+	PMX_BONE_INHERIT_ROTATION = 0x0100,
+	PMX_BONE_INHERIT_TRANSLATION = 0x0200,
+	PMX_BONE_FIXED_AXIS = 0x0400,
+	PMX_BONE_LOCAL_AXIS = 0x0800,
+	PMX_BONE_AFTER_PHYSICS = 0x1000,
+	PMX_BONE_EXTERNAL_PARENT = 0x2000,
+};
+
+struct PMXBoneView
+{
+	PMXText name;
+	PMXText name_en;
+	const float* position;
+	int parent;
+	int layer;
+	WORD flags;
+	int tail_bone;          // with PMX_BONE_TAIL_INDEX
+	const float* tail_offset; // without PMX_BONE_TAIL_INDEX
+	int inherit_bone;
+	float inherit_rate;
+	const float* fixed_axis;
+	const float* local_axis_x;
+	const float* local_axis_z;
+	int external_key;
+	int ik_target;
+	int ik_loop;
+	float ik_limit;
+	std::vector<PMXBoneIKLink> ik_links;
+};
+
+enum PMXMorphKind
+{
+	PMX_MORPH_GROUP = 0,
+	PMX_MORPH_VERTEX = 1,
+	PMX_MORPH_BONE = 2,
+	PMX_MORPH_UV = 3,
+	PMX_MORPH_UV1 = 4,
+	PMX_MORPH_UV2 = 5,
+	PMX_MORPH_UV3 = 6,
+	PMX_MORPH_UV4 = 7,
+	PMX_MORPH_MATERIAL = 8,
+	PMX_MORPH_FLIP = 9,     // 2.1
+	PMX_MORPH_IMPULSE = 10, // 2.1
+};
+
+struct PMXMorphView
+{
+	PMXText name;
+	PMXText name_en;
+	BYTE panel;
+	BYTE kind;
+	int offset_count;
+	const BYTE* offsets; // offset_count records of offset_size bytes
+	int offset_size;
+
+	// Index at the head of the offset record (vertex, bone, morph, material or rigid body)
+	int GetOffsetIndex(int i, const PMXHeaderInfo& header) const;
+	// Data after the index
+	const BYTE* GetOffsetData(int i, const PMXHeaderInfo& header) const;
+};
+
+struct PMXDisplayFrameView
+{
+	PMXText name;
+	PMXText name_en;
+	BYTE special;
+	int element_count;
+	const BYTE* elements; // byte target (0:bone 1:morph) + index
+};
+
+// PMX 2.0/2.1 reader.
+// The file is memory-mapped and the sections are scanned once to find the
+// records; the views point into the mapped file, so the reader must be kept
+// open while they are used.
+class PMXReader
+{
+public:
+	PMXReader();
+
+	bool Open(const MString& filename);
+	// Parse a file already in memory. The data must outlive the reader.
+	bool Parse(const BYTE* data, size_t size);
+	void Close();
+
+	const MString& GetError() const { return m_error; }
+	size_t GetFileSize() const { return m_size; }
+	const BYTE* GetData() const { return m_data; }
+
+	const PMXHeaderInfo& GetHeader() const { return m_header; }
+	PMXText GetModelName() const { return m_model_name; }
+	PMXText GetModelNameEn() const { return m_model_name_en; }
+	PMXText GetComment() const { return m_comment; }
+	PMXText GetCommentEn() const { return m_comment_en; }
+
+	int GetVertexCount() const { return static_cast<int>(m_vertices.size()); }
+	void GetVertex(int index, PMXVertexView& view) const;
+	// Bytes of the vertex record, to copy it to another file
+	const BYTE* GetVertexRecord(int index, size_t& size) const;
+
+	int GetIndexCount() const { return m_index_count; }
+	int GetIndex(int i) const;
+
+	int GetTextureCount() const { return static_cast<int>(m_textures.size()); }
+	PMXText GetTexture(int index) const { return m_textures[index]; }
+
+	int GetMaterialCount() const { return static_cast<int>(m_materials.size()); }
+	void GetMaterial(int index, PMXMaterialView& view) const;
+	// Bytes of the material record. The index count is the last 4 bytes.
+	const BYTE* GetMaterialRecord(int index, size_t& size) const;
+
+	int GetBoneCount() const { return static_cast<int>(m_bones.size()); }
+	void GetBone(int index, PMXBoneView& view) const;
+
+	int GetMorphCount() const { return static_cast<int>(m_morphs.size()); }
+	void GetMorph(int index, PMXMorphView& view) const;
+
+	int GetDisplayFrameCount() const { return static_cast<int>(m_frames.size()); }
+	void GetDisplayFrame(int index, PMXDisplayFrameView& view) const;
+
+	int GetRigidBodyCount() const { return m_rigid_count; }
+	int GetJointCount() const { return m_joint_count; }
+	int GetSoftBodyCount() const { return m_soft_count; }
+
+	// File offsets of the sections (at the record count), to rewrite parts of the file
+	size_t GetVertexSectionOffset() const { return m_vertex_section; }
+	size_t GetIndexSectionOffset() const { return m_index_section; }
+	size_t GetTextureSectionOffset() const { return m_texture_section; }
+	size_t GetMaterialSectionOffset() const { return m_material_section; }
+	size_t GetBoneSectionOffset() const { return m_bone_section; }
+	size_t GetMorphSectionOffset() const { return m_morph_section; }
+	size_t GetDisplayFrameSectionOffset() const { return m_frame_section; }
+	size_t GetRigidBodySectionOffset() const { return m_rigid_section; }
+
+private:
+	PMXFileMapping m_mapping;
+	const BYTE* m_data;
+	size_t m_size;
+	MString m_error;
+
+	PMXHeaderInfo m_header;
+	PMXText m_model_name, m_model_name_en, m_comment, m_comment_en;
+
+	// File offsets of the records
+	std::vector<DWORD> m_vertices;
+	const BYTE* m_indices;
+	int m_index_count;
+	std::vector<PMXText> m_textures;
+	std::vector<DWORD> m_materials;
+	std::vector<DWORD> m_bones;
+	std::vector<DWORD> m_morphs;
+	std::vector<DWORD> m_frames;
+	int m_rigid_count;
+	int m_joint_count;
+	int m_soft_count;
+	size_t m_vertex_section;
+	size_t m_index_section;
+	size_t m_texture_section;
+	size_t m_material_section;
+	size_t m_bone_section;
+	size_t m_morph_section;
+	size_t m_frame_section;
+	size_t m_rigid_section;
+
+	bool parse();
+	bool parseOrClose();
+};
+
+// Read an index of 'size' bytes. Vertex indices of 1 or 2 bytes are unsigned,
+// the others are signed (-1 means none).
+int ReadPMXIndex(const BYTE* p, int size, bool vertex_index);
@@ -0,0 +1,86 @@
+﻿#pragma once
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <wchar.h>
+#include "MString.h"
+
+// Interned strings of one export.
+// Equal strings share one handle, so a name copied into many records (e.g. the
+// bone, tip and IK names of a rig) is stored once, and records holding only
+// handles stay cheap to copy, move and compare.
+// Handle 0 is always the empty string. Handles are valid until Clear().
+class PMXStringPool
+{
+public:
+	typedef unsigned int Handle;
+
+	PMXStringPool()
+	{
+		Clear();
+	}
+
+	void Clear()
+	{
+		m_strings.clear();
+		m_index.clear();
+		m_strings.push_back(MString());
+	}
+
+	Handle Intern(const wchar_t* str, size_t length)
+	{
+		if (str == nullptr || length == 0)
+			return 0;
+
+		// Looked up by a view of the argument, so a hit does not copy the string
+		auto it = m_index.find(Key(str, length));
+		if (it != m_index.end())
+			return it->second;
+
+		// The key views the stored string, which stays at the same address until Clear()
+		Handle h = static_cast<Handle>(m_strings.size());
+		m_strings.push_back(MString(str, length));
+		const MString& stored = m_strings.back();
+		m_index.emplace(Key(stored.c_str(), stored.length()), h);
+		return h;
+	}
+	Handle Intern(const std::wstring& str) { return Intern(str.c_str(), str.length()); }
+	Handle Intern(const MString& str) { return Intern(str.c_str(), str.length()); }
+
+	// The string is kept at the same address until Clear().
+	const MString& Get(Handle h) const { return m_strings[h]; }
+
+	size_t GetCount() const { return m_strings.size(); }
+
+private:
+	struct Key
+	{
+		const wchar_t* str;
+		size_t length;
+
+		Key(const wchar_t* s, size_t len) : str(s), length(len) {}
+
+		bool operator==(const Key& k) const
+		{
+			return length == k.length && wmemcmp(str, k.str, length) == 0;
+		}
+	};
+
+	struct KeyHash
+	{
+		size_t operator()(const Key& k) const
+		{
+			size_t h = 2166136261U;
+			for (size_t i = 0; i < k.length; i++)
+			{
+				h ^= static_cast<size_t>(k.str[i]);
+				h *= 16777619U;
+			}
+			return h;
+		}
+	};
+
+	std::deque<MString> m_strings;
+	std::unordered_map<Key, Handle, KeyHash> m_index;
+};
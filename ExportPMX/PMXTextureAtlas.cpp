@@ -0,0 +1,1178 @@
+﻿#include "PMXTextureAtlas.h"
+#include "MQExportObject.h"
+#include <MFileUtil.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+
+bool MQImageLoader::Load(const MString& path, PMXImage& image)
+{
+	LPVOID header = nullptr;
+	LPVOID buffer = nullptr;
+	if (!MQ_LoadImageW(path.c_str(), &header, &buffer, 0))
+		return false;
+
+	// ボトムアップのDIBで返される
+	const BITMAPINFOHEADER* bih = static_cast<const BITMAPINFOHEADER*>(header);
+	const BYTE* src = static_cast<const BYTE*>(buffer);
+	int bpp = bih->biBitCount / 8;
+	bool result = (bih->biCompression == BI_RGB && (bpp == 3 || bpp == 4));
+	if (result)
+	{
+		image.width = bih->biWidth;
+		image.height = abs(bih->biHeight);
+		image.pixels.resize(image.width * image.height * 4);
+		int pitch = (image.width * bpp + 3) & ~3;
+		for (int y = 0; y < image.height; y++)
+		{
+			int sy = (bih->biHeight > 0) ? image.height - 1 - y : y;
+			const BYTE* s = src + sy * pitch;
+			BYTE* d = image.pixels.data() + y * image.width * 4;
+			for (int x = 0; x < image.width; x++, s += bpp, d += 4)
+			{
+				d[0] = s[0];
+				d[1] = s[1];
+				d[2] = s[2];
+				d[3] = (bpp == 4) ? s[3] : 255;
+			}
+		}
+	}
+
+	// 確保されたメモリは呼び出し側で解放する
+	free(header);
+	free(buffer);
+	return result;
+}
+
+static DWORD readLE(const BYTE* p, int size)
+{
+	DWORD v = 0;
+	for (int i = size - 1; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static bool readFile(const MString& path, std::vector<BYTE>& data)
+{
+	FILE* fh;
+	if (_wfopen_s(&fh, path.c_str(), L"rb") != 0)
+		return false;
+
+	data.clear();
+	BYTE buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fh)) > 0)
+		data.insert(data.end(), buf, buf + n);
+	fclose(fh);
+	return true;
+}
+
+bool BMPImageLoader::Load(const MString& path, PMXImage& image)
+{
+	std::vector<BYTE> data;
+	if (!readFile(path, data))
+		return false;
+
+	// BITMAPFILEHEADER(14) + BITMAPINFOHEADER(40)
+	if (data.size() < 54 || data[0] != 'B' || data[1] != 'M')
+		return false;
+	DWORD bits_offset = readLE(&data[10], 4);
+	int width = static_cast<int>(readLE(&data[18], 4));
+	int height = static_cast<int>(readLE(&data[22], 4));
+	int bpp = static_cast<int>(readLE(&data[28], 2)) / 8;
+	DWORD compression = readLE(&data[30], 4);
+	// BI_RGB, or BI_BITFIELDS with the standard BGRA masks
+	if ((compression != 0 && compression != 3) || (bpp != 3 && bpp != 4) || width <= 0 || height == 0)
+		return false;
+
+	int abs_height = abs(height);
+	int pitch = (width * bpp + 3) & ~3;
+	if (bits_offset + static_cast<size_t>(pitch) * abs_height > data.size())
+		return false;
+
+	image.width = width;
+	image.height = abs_height;
+	image.pixels.resize(width * abs_height * 4);
+	for (int y = 0; y < abs_height; y++)
+	{
+		int sy = (height > 0) ? abs_height - 1 - y : y;
+		const BYTE* s = data.data() + bits_offset + sy * pitch;
+		BYTE* d = image.pixels.data() + y * width * 4;
+		for (int x = 0; x < width; x++, s += bpp, d += 4)
+		{
+			d[0] = s[0];
+			d[1] = s[1];
+			d[2] = s[2];
+			d[3] = (bpp == 4) ? s[3] : 255;
+		}
+	}
+	return true;
+}
+
+namespace
+{
+	// CRC table of the PNG chunks, built once when the module is loaded
+	struct Crc32Table
+	{
+		DWORD value[256];
+
+		Crc32Table()
+		{
+			for (DWORD i = 0; i < 256; i++)
+			{
+				DWORD c = i;
+				for (int k = 0; k < 8; k++)
+					c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : (c >> 1);
+				value[i] = c;
+			}
+		}
+	};
+	const Crc32Table s_crc32_table;
+
+	// zlib stream encoder (RFC 1950/1951) for SavePNG.
+	// Matches are searched in hash chains of 3 bytes and written in one block with the
+	// fixed Huffman codes, which is enough for the flat areas and repeated rows of an atlas.
+	class Deflater
+	{
+	public:
+		explicit Deflater(std::vector<BYTE>& out) : m_out(out), m_bitbuf(0), m_bitcnt(0) {}
+
+		void Run(const BYTE* data, size_t size)
+		{
+			m_out.push_back(0x78);
+			m_out.push_back(0x01);
+			bits(1, 1); // last block
+			bits(1, 2); // fixed Huffman codes
+
+			std::vector<int> head(HASH_SIZE, -1);
+			std::vector<int> prev(WINDOW_SIZE, -1);
+			auto insert = [&](size_t pos)
+			{
+				if (pos + MIN_MATCH > size)
+					return;
+				DWORD h = hash(data + pos);
+				prev[pos & (WINDOW_SIZE - 1)] = head[h];
+				head[h] = static_cast<int>(pos);
+			};
+
+			size_t pos = 0;
+			while (pos < size)
+			{
+				size_t best_len = 0;
+				size_t best_dist = 0;
+				if (pos + MIN_MATCH <= size)
+				{
+					size_t max_len = std::min<size_t>(MAX_MATCH, size - pos);
+					int chain = MAX_CHAIN;
+					int p = head[hash(data + pos)];
+					while (p >= 0 && pos - p <= WINDOW_SIZE && chain-- > 0)
+					{
+						const BYTE* s = data + p;
+						if (s[best_len] == data[pos + best_len])
+						{
+							size_t len = 0;
+							while (len < max_len && s[len] == data[pos + len])
+								len++;
+							if (len > best_len)
+							{
+								best_len = len;
+								best_dist = pos - p;
+								if (len == max_len)
+									break;
+							}
+						}
+						// The slot may have been reused by a newer position
+						int next = prev[p & (WINDOW_SIZE - 1)];
+						if (next >= p)
+							break;
+						p = next;
+					}
+				}
+
+				if (best_len >= MIN_MATCH)
+				{
+					writeMatch(best_len, best_dist);
+					for (size_t i = 0; i < best_len; i++)
+						insert(pos + i);
+					pos += best_len;
+				}
+				else
+				{
+					writeSymbol(data[pos]);
+					insert(pos);
+					pos++;
+				}
+			}
+			writeSymbol(256);
+			if (m_bitcnt > 0)
+				m_out.push_back(static_cast<BYTE>(m_bitbuf));
+
+			DWORD a = 1, b = 0;
+			for (size_t i = 0; i < size; i++)
+			{
+				a = (a + data[i]) % 65521;
+				b = (b + a) % 65521;
+			}
+			m_out.push_back(static_cast<BYTE>(b >> 8));
+			m_out.push_back(static_cast<BYTE>(b));
+			m_out.push_back(static_cast<BYTE>(a >> 8));
+			m_out.push_back(static_cast<BYTE>(a));
+		}
+
+	private:
+		enum
+		{
+			MIN_MATCH = 3,
+			MAX_MATCH = 258,
+			MAX_CHAIN = 32,
+			WINDOW_SIZE = 32768,
+			HASH_SIZE = 1 << 15,
+		};
+
+		std::vector<BYTE>& m_out;
+		DWORD m_bitbuf;
+		int m_bitcnt;
+
+		static DWORD hash(const BYTE* p)
+		{
+			return ((static_cast<DWORD>(p[0]) << 16 | static_cast<DWORD>(p[1]) << 8 | p[2]) * 2654435761U) >> 17;
+		}
+
+		// Bits are packed from the least significant bit
+		void bits(DWORD value, int count)
+		{
+			m_bitbuf |= value << m_bitcnt;
+			m_bitcnt += count;
+			while (m_bitcnt >= 8)
+			{
+				m_out.push_back(static_cast<BYTE>(m_bitbuf));
+				m_bitbuf >>= 8;
+				m_bitcnt -= 8;
+			}
+		}
+
+		// Huffman codes are packed from the most significant bit
+		void code(DWORD value, int length)
+		{
+			DWORD reversed = 0;
+			for (int i = 0; i < length; i++)
+				reversed |= ((value >> i) & 1) << (length - 1 - i);
+			bits(reversed, length);
+		}
+
+		void writeSymbol(int symbol)
+		{
+			if (symbol < 144)
+				code(0x30 + symbol, 8);
+			else if (symbol < 256)
+				code(0x190 + symbol - 144, 9);
+			else if (symbol < 280)
+				code(symbol - 256, 7);
+			else
+				code(0xC0 + symbol - 280, 8);
+		}
+
+		void writeMatch(size_t len, size_t dist)
+		{
+			static const short lbase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+			static const short lext[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+			static const int dbase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+			static const short dext[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+			int l = 28;
+			while (lbase[l] > static_cast<int>(len))
+				l--;
+			writeSymbol(257 + l);
+			bits(static_cast<DWORD>(len - lbase[l]), lext[l]);
+
+			int d = 29;
+			while (dbase[d] > static_cast<int>(dist))
+				d--;
+			code(d, 5);
+			bits(static_cast<DWORD>(dist - dbase[d]), dext[d]);
+		}
+	};
+
+	// Filter a row of RGBA pixels with the filter that gives the smallest sum of the
+	// absolute differences, which usually compresses best
+	void filterRow(const BYTE* row, const BYTE* prior, size_t length, std::vector<BYTE>& out, std::vector<BYTE>& work)
+	{
+		const size_t bpp = 4;
+		work.resize(length * 5);
+		unsigned __int64 best_sum = ULLONG_MAX;
+		int best = 0;
+		for (int type = 0; type < 5; type++)
+		{
+			BYTE* d = work.data() + length * type;
+			unsigned __int64 sum = 0;
+			for (size_t i = 0; i < length; i++)
+			{
+				int a = (i >= bpp) ? row[i - bpp] : 0;
+				int b = (prior != nullptr) ? prior[i] : 0;
+				int c = (i >= bpp && prior != nullptr) ? prior[i - bpp] : 0;
+				int pred = 0;
+				switch (type)
+				{
+				case 1: pred = a; break;
+				case 2: pred = b; break;
+				case 3: pred = (a + b) / 2; break;
+				case 4:
+					{
+						int p = a + b - c;
+						int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+						pred = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+					}
+					break;
+				}
+				d[i] = static_cast<BYTE>(row[i] - pred);
+				sum += (d[i] < 128) ? d[i] : 256 - d[i];
+			}
+			if (sum < best_sum)
+			{
+				best_sum = sum;
+				best = type;
+			}
+		}
+		out.push_back(static_cast<BYTE>(best));
+		out.insert(out.end(), work.begin() + length * best, work.begin() + length * (best + 1));
+	}
+}
+
+static DWORD crc32(DWORD crc, const BYTE* data, size_t size)
+{
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++)
+		crc = s_crc32_table.value[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void appendBE(std::vector<BYTE>& out, DWORD v)
+{
+	out.push_back(static_cast<BYTE>(v >> 24));
+	out.push_back(static_cast<BYTE>(v >> 16));
+	out.push_back(static_cast<BYTE>(v >> 8));
+	out.push_back(static_cast<BYTE>(v));
+}
+
+static void writeChunk(FILE* fh, const char* type, const std::vector<BYTE>& data)
+{
+	std::vector<BYTE> chunk;
+	chunk.reserve(data.size() + 12);
+	appendBE(chunk, static_cast<DWORD>(data.size()));
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	appendBE(chunk, crc32(0, chunk.data() + 4, data.size() + 4));
+	fwrite(chunk.data(), 1, chunk.size(), fh);
+}
+
+bool SavePNG(const MString& path, const PMXImage& image)
+{
+	FILE* fh;
+	if (_wfopen_s(&fh, path.c_str(), L"wb") != 0)
+		return false;
+
+	const BYTE signature[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+	fwrite(signature, 1, 8, fh);
+
+	std::vector<BYTE> ihdr;
+	appendBE(ihdr, image.width);
+	appendBE(ihdr, image.height);
+	ihdr.push_back(8); // bit depth
+	ihdr.push_back(6); // RGBA
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	writeChunk(fh, "IHDR", ihdr);
+
+	// 行ごとにフィルタを選んでRGBAの行を並べ、deflateで圧縮する
+	size_t row_size = static_cast<size_t>(image.width) * 4;
+	std::vector<BYTE> raw;
+	raw.reserve((row_size + 1) * image.height);
+	std::vector<BYTE> row(row_size), prior(row_size), work;
+	for (int y = 0; y < image.height; y++)
+	{
+		const BYTE* s = image.pixels.data() + y * row_size;
+		for (size_t x = 0; x < row_size; x += 4)
+		{
+			row[x] = s[x + 2];
+			row[x + 1] = s[x + 1];
+			row[x + 2] = s[x];
+			row[x + 3] = s[x + 3];
+		}
+		filterRow(row.data(), (y > 0) ? prior.data() : nullptr, row_size, raw, work);
+		row.swap(prior);
+	}
+
+	std::vector<BYTE> idat;
+	idat.reserve(raw.size() / 4 + 64);
+	Deflater(idat).Run(raw.data(), raw.size());
+	writeChunk(fh, "IDAT", idat);
+	writeChunk(fh, "IEND", std::vector<BYTE>());
+
+	bool result = (ferror(fh) == 0);
+	if (fclose(fh) != 0)
+		result = false;
+	if (!result)
+		DeleteFileW(path.c_str());
+	return result;
+}
+
+namespace
+{
+	// zlib stream decoder (RFC 1950/1951) for the PNG loader.
+	// Huffman codes are decoded bit by bit, which is fast enough for textures.
+	class Inflater
+	{
+	public:
+		Inflater(const BYTE* data, size_t size) : m_data(data), m_size(size), m_pos(0), m_bitbuf(0), m_bitcnt(0), m_error(false) {}
+
+		bool Run(std::vector<BYTE>& out)
+		{
+			if (m_size < 2 || (m_data[0] & 0x0F) != 8 || ((m_data[0] << 8) | m_data[1]) % 31 != 0 || (m_data[1] & 0x20) != 0)
+				return false;
+			m_pos = 2;
+
+			int last;
+			do
+			{
+				last = bits(1);
+				int type = bits(2);
+				bool ok;
+				switch (type)
+				{
+				case 0: ok = stored(out); break;
+				case 1: ok = fixed(out); break;
+				case 2: ok = dynamic(out); break;
+				default: ok = false; break;
+				}
+				if (!ok || m_error)
+					return false;
+			} while (!last);
+			return true;
+		}
+
+	private:
+		struct Huffman
+		{
+			short count[16];  // number of codes of each length
+			short symbol[288]; // symbols ordered by code
+		};
+
+		const BYTE* m_data;
+		size_t m_size;
+		size_t m_pos;
+		DWORD m_bitbuf;
+		int m_bitcnt;
+		bool m_error;
+
+		int bits(int need)
+		{
+			while (m_bitcnt < need)
+			{
+				if (m_pos >= m_size)
+				{
+					m_error = true;
+					return 0;
+				}
+				m_bitbuf |= static_cast<DWORD>(m_data[m_pos++]) << m_bitcnt;
+				m_bitcnt += 8;
+			}
+			int v = static_cast<int>(m_bitbuf & ((1UL << need) - 1));
+			m_bitbuf >>= need;
+			m_bitcnt -= need;
+			return v;
+		}
+
+		// Returns false if the code lengths are over-subscribed
+		static bool build(Huffman& h, const short* length, int n)
+		{
+			memset(h.count, 0, sizeof(h.count));
+			for (int i = 0; i < n; i++)
+				h.count[length[i]]++;
+			if (h.count[0] == n)
+				return true;
+
+			int left = 1;
+			for (int len = 1; len < 16; len++)
+			{
+				left <<= 1;
+				left -= h.count[len];
+				if (left < 0)
+					return false;
+			}
+
+			short offs[16];
+			offs[1] = 0;
+			for (int len = 1; len < 15; len++)
+				offs[len + 1] = offs[len] + h.count[len];
+			for (int i = 0; i < n; i++)
+			{
+				if (length[i] != 0)
+					h.symbol[offs[length[i]]++] = static_cast<short>(i);
+			}
+			return true;
+		}
+
+		int decode(const Huffman& h)
+		{
+			int code = 0, first = 0, index = 0;
+			for (int len = 1; len < 16; len++)
+			{
+				code |= bits(1);
+				if (m_error)
+					return -1;
+				int count = h.count[len];
+				if (code - count < first)
+					return h.symbol[index + (code - first)];
+				index += count;
+				first += count;
+				first <<= 1;
+				code <<= 1;
+			}
+			return -1;
+		}
+
+		bool stored(std::vector<BYTE>& out)
+		{
+			// The block starts at a byte boundary
+			m_bitbuf = 0;
+			m_bitcnt = 0;
+			if (m_pos + 4 > m_size)
+				return false;
+			size_t len = m_data[m_pos] | (m_data[m_pos + 1] << 8);
+			size_t nlen = m_data[m_pos + 2] | (m_data[m_pos + 3] << 8);
+			m_pos += 4;
+			if (len != (~nlen & 0xFFFF) || m_pos + len > m_size)
+				return false;
+			out.insert(out.end(), m_data + m_pos, m_data + m_pos + len);
+			m_pos += len;
+			return true;
+		}
+
+		bool codes(std::vector<BYTE>& out, const Huffman& lencode, const Huffman& distcode)
+		{
+			static const short lbase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+			static const short lext[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+			static const short dbase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+			static const short dext[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+			for (;;)
+			{
+				int symbol = decode(lencode);
+				if (symbol < 0)
+					return false;
+				if (symbol < 256)
+				{
+					out.push_back(static_cast<BYTE>(symbol));
+					continue;
+				}
+				if (symbol == 256)
+					return true;
+
+				symbol -= 257;
+				if (symbol >= 29)
+					return false;
+				size_t len = lbase[symbol] + bits(lext[symbol]);
+				symbol = decode(distcode);
+				if (symbol < 0 || symbol >= 30)
+					return false;
+				size_t dist = dbase[symbol] + bits(dext[symbol]);
+				if (m_error || dist > out.size())
+					return false;
+				size_t from = out.size() - dist;
+				for (size_t i = 0; i < len; i++)
+					out.push_back(out[from + i]);
+			}
+		}
+
+		bool fixed(std::vector<BYTE>& out)
+		{
+			Huffman lencode, distcode;
+			short length[288];
+			int i = 0;
+			for (; i < 144; i++) length[i] = 8;
+			for (; i < 256; i++) length[i] = 9;
+			for (; i < 280; i++) length[i] = 7;
+			for (; i < 288; i++) length[i] = 8;
+			build(lencode, length, 288);
+			for (i = 0; i < 30; i++) length[i] = 5;
+			build(distcode, length, 30);
+			return codes(out, lencode, distcode);
+		}
+
+		bool dynamic(std::vector<BYTE>& out)
+		{
+			static const BYTE order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+			int nlen = bits(5) + 257;
+			int ndist = bits(5) + 1;
+			int ncode = bits(4) + 4;
+			if (m_error || nlen > 286 || ndist > 30)
+				return false;
+
+			short length[320];
+			memset(length, 0, sizeof(length));
+			for (int i = 0; i < ncode; i++)
+				length[order[i]] = static_cast<short>(bits(3));
+			Huffman lencode, distcode;
+			if (!build(lencode, length, 19))
+				return false;
+
+			int index = 0;
+			while (index < nlen + ndist)
+			{
+				int symbol = decode(lencode);
+				if (symbol < 0)
+					return false;
+				if (symbol < 16)
+				{
+					length[index++] = static_cast<short>(symbol);
+					continue;
+				}
+
+				short len = 0;
+				int repeat;
+				if (symbol == 16)
+				{
+					if (index == 0)
+						return false;
+					len = length[index - 1];
+					repeat = 3 + bits(2);
+				}
+				else if (symbol == 17)
+				{
+					repeat = 3 + bits(3);
+				}
+				else
+				{
+					repeat = 11 + bits(7);
+				}
+				if (m_error || index + repeat > nlen + ndist)
+					return false;
+				while (repeat-- > 0)
+					length[index++] = len;
+			}
+			if (length[256] == 0)
+				return false;
+
+			if (!build(lencode, length, nlen) || !build(distcode, length + nlen, ndist))
+				return false;
+			return codes(out, lencode, distcode);
+		}
+	};
+
+	DWORD readBE(const BYTE* p)
+	{
+		return (static_cast<DWORD>(p[0]) << 24) | (static_cast<DWORD>(p[1]) << 16) | (static_cast<DWORD>(p[2]) << 8) | p[3];
+	}
+
+	int paeth(int a, int b, int c)
+	{
+		int p = a + b - c;
+		int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+		if (pa <= pb && pa <= pc)
+			return a;
+		return (pb <= pc) ? b : c;
+	}
+
+	// Sample of channel c of pixel x in an unfiltered row
+	int getSample(const BYTE* row, int x, int c, int channels, int depth)
+	{
+		if (depth == 8)
+			return row[x * channels + c];
+		if (depth == 16)
+			return (row[(x * channels + c) * 2] << 8) | row[(x * channels + c) * 2 + 1];
+		// 1, 2 and 4 bit depths have a single channel
+		int bit = x * depth;
+		return (row[bit >> 3] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+	}
+}
+
+bool PNGImageLoader::Load(const MString& path, PMXImage& image)
+{
+	std::vector<BYTE> data;
+	if (!readFile(path, data))
+		return false;
+
+	const BYTE signature[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+	if (data.size() < 8 || memcmp(data.data(), signature, 8) != 0)
+		return false;
+
+	int width = 0, height = 0, depth = 0, color_type = -1, interlace = 0;
+	std::vector<BYTE> palette; // RGBA
+	std::vector<BYTE> trns;
+	std::vector<BYTE> idat;
+	bool end = false;
+	for (size_t pos = 8; pos + 12 <= data.size() && !end;)
+	{
+		DWORD len = readBE(&data[pos]);
+		const BYTE* type = &data[pos + 4];
+		const BYTE* body = &data[pos + 8];
+		if (len > data.size() - pos - 12)
+			return false;
+
+		if (memcmp(type, "IHDR", 4) == 0)
+		{
+			if (len < 13)
+				return false;
+			width = static_cast<int>(readBE(body));
+			height = static_cast<int>(readBE(body + 4));
+			depth = body[8];
+			color_type = body[9];
+			interlace = body[12];
+		}
+		else if (memcmp(type, "PLTE", 4) == 0)
+		{
+			palette.assign(len / 3 * 4, 255);
+			for (DWORD i = 0; i < len / 3; i++)
+				memcpy(&palette[i * 4], body + i * 3, 3);
+		}
+		else if (memcmp(type, "tRNS", 4) == 0)
+		{
+			trns.assign(body, body + len);
+		}
+		else if (memcmp(type, "IDAT", 4) == 0)
+		{
+			idat.insert(idat.end(), body, body + len);
+		}
+		else if (memcmp(type, "IEND", 4) == 0)
+		{
+			end = true;
+		}
+		pos += 12 + len;
+	}
+
+	int channels;
+	switch (color_type)
+	{
+	case 0: channels = 1; break; // gray
+	case 2: channels = 3; break; // RGB
+	case 3: channels = 1; break; // palette
+	case 4: channels = 2; break; // gray + alpha
+	case 6: channels = 4; break; // RGBA
+	default: return false;
+	}
+	bool depth_ok = (depth == 8) || (depth == 16 && color_type != 3) || ((depth == 1 || depth == 2 || depth == 4) && (color_type == 0 || color_type == 3));
+	if (!depth_ok || interlace != 0 || width <= 0 || height <= 0 || width > 16384 || height > 16384)
+		return false;
+	if (color_type == 3 && palette.empty())
+		return false;
+
+	std::vector<BYTE> raw;
+	if (!Inflater(idat.data(), idat.size()).Run(raw))
+		return false;
+
+	size_t stride = (static_cast<size_t>(width) * channels * depth + 7) / 8;
+	size_t filter_bpp = std::max<size_t>(1, channels * depth / 8);
+	if (raw.size() < (stride + 1) * height)
+		return false;
+
+	// Palette transparency
+	for (size_t i = 0; color_type == 3 && i < trns.size() && i * 4 < palette.size(); i++)
+		palette[i * 4 + 3] = trns[i];
+
+	image.width = width;
+	image.height = height;
+	image.pixels.resize(static_cast<size_t>(width) * height * 4);
+	std::vector<BYTE> prev(stride, 0), cur(stride);
+	int max_value = (1 << depth) - 1;
+	for (int y = 0; y < height; y++)
+	{
+		const BYTE* src = raw.data() + y * (stride + 1);
+		BYTE filter = src[0];
+		src++;
+		for (size_t i = 0; i < stride; i++)
+		{
+			int a = (i >= filter_bpp) ? cur[i - filter_bpp] : 0;
+			int b = prev[i];
+			int c = (i >= filter_bpp) ? prev[i - filter_bpp] : 0;
+			int v = src[i];
+			switch (filter)
+			{
+			case 0: break;
+			case 1: v += a; break;
+			case 2: v += b; break;
+			case 3: v += (a + b) / 2; break;
+			case 4: v += paeth(a, b, c); break;
+			default: return false;
+			}
+			cur[i] = static_cast<BYTE>(v);
+		}
+
+		BYTE* d = image.pixels.data() + static_cast<size_t>(y) * width * 4;
+		for (int x = 0; x < width; x++, d += 4)
+		{
+			BYTE r, g, b, a = 255;
+			if (color_type == 3)
+			{
+				size_t index = getSample(cur.data(), x, 0, 1, depth);
+				if (index * 4 >= palette.size())
+					return false;
+				r = palette[index * 4];
+				g = palette[index * 4 + 1];
+				b = palette[index * 4 + 2];
+				a = palette[index * 4 + 3];
+			}
+			else if (color_type == 0 || color_type == 4)
+			{
+				int v = getSample(cur.data(), x, 0, channels, depth);
+				if (color_type == 0 && trns.size() >= 2 && v == ((trns[0] << 8) | trns[1]))
+					a = 0;
+				r = g = b = static_cast<BYTE>(v * 255 / max_value);
+				if (color_type == 4)
+					a = static_cast<BYTE>(getSample(cur.data(), x, 1, channels, depth) * 255 / max_value);
+			}
+			else
+			{
+				int vr = getSample(cur.data(), x, 0, channels, depth);
+				int vg = getSample(cur.data(), x, 1, channels, depth);
+				int vb = getSample(cur.data(), x, 2, channels, depth);
+				if (color_type == 2 && trns.size() >= 6 && vr == ((trns[0] << 8) | trns[1]) && vg == ((trns[2] << 8) | trns[3]) && vb == ((trns[4] << 8) | trns[5]))
+					a = 0;
+				r = static_cast<BYTE>(vr * 255 / max_value);
+				g = static_cast<BYTE>(vg * 255 / max_value);
+				b = static_cast<BYTE>(vb * 255 / max_value);
+				if (color_type == 6)
+					a = static_cast<BYTE>(getSample(cur.data(), x, 3, channels, depth) * 255 / max_value);
+			}
+			d[0] = b;
+			d[1] = g;
+			d[2] = r;
+			d[3] = a;
+		}
+		prev.swap(cur);
+	}
+	return true;
+}
+
+// Skyline bottom-left rectangle packer
+class SkylinePacker
+{
+public:
+	SkylinePacker(int width, int height) : m_width(width), m_height(height)
+	{
+		m_nodes.push_back(Node{0, 0, width});
+	}
+
+	bool Insert(int w, int h, int& out_x, int& out_y)
+	{
+		int best_index = -1;
+		int best_y = INT_MAX;
+		int best_x = 0;
+		int best_width = INT_MAX;
+		for (size_t i = 0; i < m_nodes.size(); i++)
+		{
+			int y;
+			if (!fit(i, w, h, y))
+				continue;
+			if (y < best_y || (y == best_y && m_nodes[i].width < best_width))
+			{
+				best_index = static_cast<int>(i);
+				best_y = y;
+				best_x = m_nodes[i].x;
+				best_width = m_nodes[i].width;
+			}
+		}
+		if (best_index < 0)
+			return false;
+
+		add(best_index, best_x, best_y, w, h);
+		out_x = best_x;
+		out_y = best_y;
+		return true;
+	}
+
+	int GetUsedHeight() const
+	{
+		int h = 0;
+		for (const Node& n : m_nodes)
+			h = std::max(h, n.y);
+		return h;
+	}
+
+private:
+	struct Node
+	{
+		int x, y, width;
+	};
+	int m_width, m_height;
+	std::vector<Node> m_nodes;
+
+	bool fit(size_t index, int w, int h, int& y) const
+	{
+		int x = m_nodes[index].x;
+		if (x + w > m_width)
+			return false;
+		y = m_nodes[index].y;
+		int left = w;
+		for (size_t i = index; left > 0; i++)
+		{
+			if (i >= m_nodes.size())
+				return false;
+			y = std::max(y, m_nodes[i].y);
+			if (y + h > m_height)
+				return false;
+			left -= m_nodes[i].width;
+		}
+		return true;
+	}
+
+	void add(int index, int x, int y, int w, int h)
+	{
+		m_nodes.insert(m_nodes.begin() + index, Node{x, y + h, w});
+		for (size_t i = index + 1; i < m_nodes.size(); i++)
+		{
+			Node& prev = m_nodes[i - 1];
+			Node& node = m_nodes[i];
+			if (node.x >= prev.x + prev.width)
+				break;
+			int shrink = prev.x + prev.width - node.x;
+			node.x += shrink;
+			node.width -= shrink;
+			if (node.width > 0)
+				break;
+			m_nodes.erase(m_nodes.begin() + i);
+			i--;
+		}
+		// 同じ高さの隣接ノードを統合
+		for (size_t i = 0; i + 1 < m_nodes.size();)
+		{
+			if (m_nodes[i].y == m_nodes[i + 1].y)
+			{
+				m_nodes[i].width += m_nodes[i + 1].width;
+				m_nodes.erase(m_nodes.begin() + i + 1);
+			}
+			else
+			{
+				i++;
+			}
+		}
+	}
+};
+
+static void blitWithPadding(PMXImage& dst, const PMXImage& src, int dx, int dy, int padding)
+{
+	for (int y = -padding; y < src.height + padding; y++)
+	{
+		int sy = std::min(std::max(y, 0), src.height - 1);
+		BYTE* d = dst.pixels.data() + ((dy + y) * dst.width + dx - padding) * 4;
+		for (int x = -padding; x < src.width + padding; x++, d += 4)
+		{
+			int sx = std::min(std::max(x, 0), src.width - 1);
+			memcpy(d, src.pixels.data() + (sy * src.width + sx) * 4, 4);
+		}
+	}
+}
+
+int PackTextureAtlas(const std::vector<const PMXImage*>& images,
+	const PMXAtlasParam& param,
+	std::vector<PMXAtlasPlacement>& placements,
+	std::vector<PMXImage>& atlases)
+{
+	placements.assign(images.size(), PMXAtlasPlacement());
+	atlases.clear();
+
+	// 高さの降順に詰める
+	std::vector<int> order;
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		if (images[i] != nullptr && images[i]->width + param.padding * 2 <= param.atlas_size && images[i]->height + param.padding * 2 <= param.atlas_size)
+			order.push_back(static_cast<int>(i));
+	}
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return images[a]->height > images[b]->height; });
+
+	std::vector<SkylinePacker> packers;
+	int packed = 0;
+	for (int i : order)
+	{
+		int w = images[i]->width + param.padding * 2;
+		int h = images[i]->height + param.padding * 2;
+		int x = 0, y = 0;
+		size_t page = 0;
+		for (; page < packers.size(); page++)
+		{
+			if (packers[page].Insert(w, h, x, y))
+				break;
+		}
+		if (page == packers.size())
+		{
+			packers.push_back(SkylinePacker(param.atlas_size, param.atlas_size));
+			packers.back().Insert(w, h, x, y);
+		}
+		placements[i].atlas = static_cast<int>(page);
+		placements[i].x = x + param.padding;
+		placements[i].y = y + param.padding;
+		packed++;
+	}
+
+	// 使った高さまで縮める（2の累乗）
+	atlases.resize(packers.size());
+	for (size_t page = 0; page < packers.size(); page++)
+	{
+		int height = 1;
+		while (height < packers[page].GetUsedHeight())
+			height *= 2;
+		atlases[page].width = param.atlas_size;
+		atlases[page].height = std::min(height, param.atlas_size);
+		atlases[page].pixels.assign(atlases[page].width * atlases[page].height * 4, 0);
+	}
+
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		PMXAtlasPlacement& p = placements[i];
+		if (p.atlas < 0)
+			continue;
+		PMXImage& atlas = atlases[p.atlas];
+		blitWithPadding(atlas, *images[i], p.x, p.y, param.padding);
+		p.offset_u = static_cast<float>(p.x) / atlas.width;
+		p.offset_v = static_cast<float>(p.y) / atlas.height;
+		p.scale_u = static_cast<float>(images[i]->width) / atlas.width;
+		p.scale_v = static_cast<float>(images[i]->height) / atlas.height;
+	}
+	return packed;
+}
+
+int ApplyTextureAtlas(MQDocument doc,
+	const std::vector<MQExportObject*>& expobjs,
+	const std::vector<std::vector<int>>& orgvert_vert,
+	int numMat,
+	PMXImageLoader& loader,
+	const PMXAtlasParam& param,
+	const MString& output_base,
+	std::vector<PMXMaterialParam>& materials,
+	PMXTextureTable& textures,
+	std::vector<MQCoordinate>& vert_coord,
+	std::vector<MString>& atlas_files)
+{
+	int numTex = textures.GetCount();
+	if (numTex == 0)
+		return 0;
+
+	std::vector<int> material_slot;
+	GetMaterialSlots(materials, numMat, material_slot);
+
+	// 頂点ごとのテクスチャ。複数のテクスチャで共有される頂点はUVを書き換えられない
+	std::vector<int> vert_tex(vert_coord.size(), -1);
+	std::vector<bool> excluded(numTex, false);
+	std::vector<int> vi;
+	for (size_t oi = 0; oi < expobjs.size(); oi++)
+	{
+		MQExportObject* eobj = expobjs[oi];
+		if (eobj == nullptr || orgvert_vert[oi].empty())
+			continue;
+		MQObject obj = doc->GetObject(static_cast<int>(oi));
+
+		int num_face = eobj->GetFaceCount();
+		for (int fi = 0; fi < num_face; fi++)
+		{
+			int n = eobj->GetFacePointCount(fi);
+			if (n < 3)
+				continue;
+			int mi = obj->GetFaceMaterial(fi);
+			if (mi < 0 || mi >= numMat) mi = numMat;
+			if (material_slot[mi] < 0)
+				continue;
+			int t = materials[material_slot[mi]].texture;
+			if (t < 0)
+				continue;
+
+			vi.resize(n);
+			eobj->GetFacePointArray(fi, vi.data());
+			for (int j = 0; j < n; j++)
+			{
+				int v = orgvert_vert[oi][vi[j]];
+				if (vert_tex[v] < 0)
+				{
+					vert_tex[v] = t;
+				}
+				else if (vert_tex[v] != t)
+				{
+					excluded[t] = true;
+					excluded[vert_tex[v]] = true;
+				}
+			}
+		}
+	}
+
+	// 繰り返しのUVは詰められない
+	const float uv_eps = 0.001f;
+	for (size_t v = 0; v < vert_coord.size(); v++)
+	{
+		int t = vert_tex[v];
+		if (t < 0) continue;
+		const MQCoordinate& uv = vert_coord[v];
+		if (uv.u < -uv_eps || uv.u > 1 + uv_eps || uv.v < -uv_eps || uv.v > 1 + uv_eps)
+			excluded[t] = true;
+	}
+
+	std::vector<PMXImage> images(numTex);
+	std::vector<const PMXImage*> candidates(numTex, nullptr);
+	for (int t = 0; t < numTex; t++)
+	{
+		if (excluded[t])
+			continue;
+
+		char path[_MAX_PATH];
+		if (!doc->FindMappingFile(path, textures.GetPath(t).c_str(), MQMAPPING_TEXTURE))
+			continue;
+		if (!loader.Load(MString::fromAnsiString(path), images[t]))
+			continue;
+		if (images[t].width > param.max_texture_size || images[t].height > param.max_texture_size)
+			continue;
+		candidates[t] = &images[t];
+	}
+
+	std::vector<PMXAtlasPlacement> placements;
+	std::vector<PMXImage> atlases;
+	int packed = PackTextureAtlas(candidates, param, placements, atlases);
+	if (packed == 0)
+		return 0;
+
+	// アトラスを保存してテクスチャ一覧を作り直す
+	// 保存できなかったら、それまでに保存したアトラスを消して元のテクスチャのままにする
+	PMXTextureTable new_textures;
+	std::vector<int> atlas_index(atlases.size(), -1);
+	std::vector<MString> saved;
+	for (size_t page = 0; page < atlases.size(); page++)
+	{
+		MString path = MString::format(L"%s_atlas%d.png", output_base.c_str(), static_cast<int>(page));
+		if (!SavePNG(path, atlases[page]))
+		{
+			for (const MString& file : saved)
+				DeleteFileW(file.c_str());
+			return 0;
+		}
+		saved.push_back(path);
+		atlas_index[page] = new_textures.Add(MFileUtil::extractFilenameAndExtension(path).toAnsiString(), path.toAnsiString());
+	}
+	atlas_files.insert(atlas_files.end(), saved.begin(), saved.end());
+	std::vector<int> texture_map(numTex, -1);
+	for (int t = 0; t < numTex; t++)
+	{
+		if (placements[t].atlas >= 0)
+			texture_map[t] = atlas_index[placements[t].atlas];
+	}
+	for (PMXMaterialParam& mat : materials)
+	{
+		if (mat.texture < 0)
+			continue;
+		if (texture_map[mat.texture] < 0)
+			texture_map[mat.texture] = new_textures.Add(textures.GetName(mat.texture), textures.GetPath(mat.texture));
+		mat.texture = texture_map[mat.texture];
+	}
+
+	for (size_t v = 0; v < vert_coord.size(); v++)
+	{
+		int t = vert_tex[v];
+		if (t < 0 || placements[t].atlas < 0)
+			continue;
+		const PMXAtlasPlacement& p = placements[t];
+		vert_coord[v].u = p.offset_u + vert_coord[v].u * p.scale_u;
+		vert_coord[v].v = p.offset_v + vert_coord[v].v * p.scale_v;
+	}
+
+	textures = new_textures;
+	return packed;
+}
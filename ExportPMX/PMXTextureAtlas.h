@@ -0,0 +1,118 @@
+﻿#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "MQPlugin.h"
+#include "MString.h"
+#include "PMXMaterial.h"
+#include <vector>
+
+class MQExportObject;
+
+// 32bit BGRA image, top row first
+struct PMXImage
+{
+	int width;
+	int height;
+	std::vector<BYTE> pixels;
+
+	PMXImage()
+	{
+		width = 0;
+		height = 0;
+	}
+};
+
+// Reads a texture image for the atlas
+class PMXImageLoader
+{
+public:
+	virtual ~PMXImageLoader() {}
+	virtual bool Load(const MString& path, PMXImage& image) = 0;
+};
+
+// Loads any image supported by the host through MQ_LoadImageW.
+// Must be used on the main thread.
+class MQImageLoader : public PMXImageLoader
+{
+public:
+	bool Load(const MString& path, PMXImage& image) override;
+};
+
+// Loads uncompressed 24/32bit BMP files without the host
+class BMPImageLoader : public PMXImageLoader
+{
+public:
+	bool Load(const MString& path, PMXImage& image) override;
+};
+
+// Loads non-interlaced PNG files of any color type without the host
+// (e.g. the atlases saved by SavePNG, in tests)
+class PNGImageLoader : public PMXImageLoader
+{
+public:
+	bool Load(const MString& path, PMXImage& image) override;
+};
+
+// Save the image as a PNG file (filtered per row and compressed with the fixed Huffman codes).
+// A partly written file is removed when saving fails.
+bool SavePNG(const MString& path, const PMXImage& image);
+
+struct PMXAtlasParam
+{
+	int max_texture_size; // textures larger than this in width or height are not packed
+	int atlas_size;       // width and maximum height of an atlas
+	int padding;          // pixels around each texture filled with its edge
+
+	PMXAtlasParam()
+	{
+		max_texture_size = 256;
+		atlas_size = 2048;
+		padding = 2;
+	}
+};
+
+// Location of a texture in an atlas
+struct PMXAtlasPlacement
+{
+	int atlas; // -1 if not packed
+	int x, y;
+	float offset_u, offset_v;
+	float scale_u, scale_v;
+
+	PMXAtlasPlacement()
+	{
+		atlas = -1;
+		x = y = 0;
+		offset_u = offset_v = 0.0f;
+		scale_u = scale_v = 1.0f;
+	}
+};
+
+// Pack the images into atlases with the skyline bottom-left method.
+// A null image is not packed. Returns the number of packed images.
+int PackTextureAtlas(const std::vector<const PMXImage*>& images,
+	const PMXAtlasParam& param,
+	std::vector<PMXAtlasPlacement>& placements,
+	std::vector<PMXImage>& atlases);
+
+// Pack the small textures used by the materials into atlases saved as
+// '<output_base>_atlas<N>.png', point the materials to the atlases and remap
+// the UVs of the exported vertices.
+// A texture is left as it is if its UVs are out of [0, 1] (repeated), or if
+// it shares a vertex with another texture.
+// The saved atlases are added to atlas_files, so that the caller can remove
+// them if the export is canceled. If an atlas cannot be saved, the ones saved
+// before are removed and nothing is changed.
+// Returns the number of packed textures.
+int ApplyTextureAtlas(MQDocument doc,
+	const std::vector<MQExportObject*>& expobjs,
+	const std::vector<std::vector<int>>& orgvert_vert,
+	int numMat,
+	PMXImageLoader& loader,
+	const PMXAtlasParam& param,
+	const MString& output_base,
+	std::vector<PMXMaterialParam>& materials,
+	PMXTextureTable& textures,
+	std::vector<MQCoordinate>& vert_coord,
+	std::vector<MString>& atlas_files);
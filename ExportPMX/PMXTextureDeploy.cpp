@@ -0,0 +1,210 @@
+﻿#include "PMXTextureDeploy.h"
+#include "ParallelHelper.h"
+#include <MFileUtil.h>
+#include <iterator>
+
+static unsigned __int64 getFileSize(const WIN32_FILE_ATTRIBUTE_DATA& attr)
+{
+	return (static_cast<unsigned __int64>(attr.nFileSizeHigh) << 32) | attr.nFileSizeLow;
+}
+
+// FNV-1a hash of the file content
+static bool hashFile(const MString& path, unsigned __int64& hash)
+{
+	HANDLE fh = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (fh == INVALID_HANDLE_VALUE)
+		return false;
+
+	std::vector<BYTE> buffer(64 * 1024);
+	unsigned __int64 h = 14695981039346656037ULL;
+	bool result = true;
+	for (;;)
+	{
+		DWORD read_size = 0;
+		if (!ReadFile(fh, buffer.data(), static_cast<DWORD>(buffer.size()), &read_size, nullptr))
+		{
+			result = false;
+			break;
+		}
+		if (read_size == 0)
+			break;
+		for (DWORD i = 0; i < read_size; i++)
+		{
+			h ^= buffer[i];
+			h *= 1099511628211ULL;
+		}
+	}
+	CloseHandle(fh);
+
+	hash = h;
+	return result;
+}
+
+PMXTextureDeployer::PMXTextureDeployer() : m_thread(nullptr), m_module(nullptr), m_running(false), m_busy(false), m_cancel(false)
+{
+}
+
+PMXTextureDeployer::~PMXTextureDeployer()
+{
+	// The plugin object is destroyed at DLL unload under the loader lock, where
+	// joining a thread can deadlock. A running worker keeps the DLL loaded, so
+	// this only runs when the worker is gone or was killed at process exit.
+	m_cancel = true;
+	if (m_thread != nullptr)
+		CloseHandle(m_thread);
+}
+
+void PMXTextureDeployer::Start(std::vector<PMXTextureCopyJob> jobs)
+{
+	if (jobs.empty())
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_pending.insert(m_pending.end(), std::make_move_iterator(jobs.begin()), std::make_move_iterator(jobs.end()));
+	m_cancel = false;
+	if (m_running)
+		return; // the worker takes the new jobs after the current ones
+
+	if (m_thread != nullptr)
+	{
+		CloseHandle(m_thread); // finished
+		m_thread = nullptr;
+	}
+
+	// Keep the DLL loaded until the worker exits
+	m_module = nullptr;
+	GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, reinterpret_cast<LPCWSTR>(&PMXTextureDeployer::threadProc), &m_module);
+
+	m_running = true;
+	m_busy = true;
+	m_thread = CreateThread(nullptr, 0, threadProc, this, 0, nullptr);
+	if (m_thread == nullptr)
+	{
+		m_running = false;
+		m_busy = false;
+		m_pending.clear();
+		if (m_module != nullptr)
+			FreeLibrary(m_module);
+		m_module = nullptr;
+	}
+}
+
+void PMXTextureDeployer::Wait()
+{
+	HANDLE thread;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_running)
+			return;
+		thread = m_thread;
+	}
+	WaitForSingleObject(thread, INFINITE);
+}
+
+DWORD WINAPI PMXTextureDeployer::threadProc(LPVOID param)
+{
+	PMXTextureDeployer* self = static_cast<PMXTextureDeployer*>(param);
+	HMODULE module = self->m_module;
+	self->runPending();
+	// The deployer must not be touched from here on
+	if (module != nullptr)
+		FreeLibraryAndExitThread(module, 0);
+	return 0;
+}
+
+void PMXTextureDeployer::runPending()
+{
+	for (;;)
+	{
+		std::vector<PMXTextureCopyJob> jobs;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_pending.empty() || m_cancel)
+			{
+				m_pending.clear();
+				m_running = false;
+				m_busy = false;
+				return;
+			}
+			jobs.swap(m_pending);
+		}
+		run(jobs);
+	}
+}
+
+void PMXTextureDeployer::run(const std::vector<PMXTextureCopyJob>& jobs)
+{
+	std::atomic<int> copied(0);
+	std::atomic<int> skipped(0);
+	std::atomic<int> failed(0);
+
+	ParallelFor(static_cast<int>(jobs.size()), [&](int i)
+	{
+		if (m_cancel)
+			return;
+
+		const PMXTextureCopyJob& job = jobs[i];
+		if (isUpToDate(job))
+		{
+			skipped++;
+		}
+		else if (MFileUtil::copyFileWithRetry(job.dst, job.src))
+		{
+			copied++;
+		}
+		else
+		{
+			failed++;
+			OutputDebugString(MString::format(L"Failed to copy texture %s\n", job.src.c_str()).c_str());
+		}
+	});
+
+	OutputDebugString(MString::format(L"Textures: %d copied, %d up to date, %d failed\n", copied.load(), skipped.load(), failed.load()).c_str());
+}
+
+bool PMXTextureDeployer::isUpToDate(const PMXTextureCopyJob& job)
+{
+	WIN32_FILE_ATTRIBUTE_DATA src_attr, dst_attr;
+	if (!GetFileAttributesExW(job.src.c_str(), GetFileExInfoStandard, &src_attr))
+		return false;
+	if (!GetFileAttributesExW(job.dst.c_str(), GetFileExInfoStandard, &dst_attr))
+		return false;
+
+	if (getFileSize(src_attr) != getFileSize(dst_attr))
+		return false;
+	// CopyFile keeps the time stamp, so a file copied before has the same time
+	if (CompareFileTime(&src_attr.ftLastWriteTime, &dst_attr.ftLastWriteTime) == 0)
+		return true;
+
+	unsigned __int64 src_hash, dst_hash;
+	if (!getSourceHash(job.src, src_attr, src_hash))
+		return false;
+	if (!hashFile(job.dst, dst_hash))
+		return false;
+	return src_hash == dst_hash;
+}
+
+bool PMXTextureDeployer::getSourceHash(const MString& path, const WIN32_FILE_ATTRIBUTE_DATA& attr, unsigned __int64& hash)
+{
+	unsigned __int64 size = getFileSize(attr);
+	std::wstring key(path.c_str());
+	{
+		std::lock_guard<std::mutex> lock(m_hash_mutex);
+		auto ite = m_hash_cache.find(key);
+		if (ite != m_hash_cache.end() && ite->second.size == size && CompareFileTime(&ite->second.time, &attr.ftLastWriteTime) == 0)
+		{
+			hash = ite->second.hash;
+			return true;
+		}
+	}
+
+	if (!hashFile(path, hash))
+		return false;
+
+	std::lock_guard<std::mutex> lock(m_hash_mutex);
+	HashEntry& entry = m_hash_cache[key];
+	entry.size = size;
+	entry.time = attr.ftLastWriteTime;
+	entry.hash = hash;
+	return true;
+}
@@ -0,0 +1,66 @@
+﻿#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "MString.h"
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+struct PMXTextureCopyJob
+{
+	MString src;
+	MString dst;
+};
+
+// Copy textures next to the exported PMX file on a background thread.
+// A texture is skipped when the destination has the same size and time stamp,
+// or the same size and content hash. Copies are retried like
+// MFileUtil::copyFileWithRetry.
+// The worker holds a reference to the plugin DLL while it runs, so the DLL is
+// never unloaded under it and the destructor does not have to wait for it.
+class PMXTextureDeployer
+{
+public:
+	PMXTextureDeployer();
+	~PMXTextureDeployer();
+
+	// Queue the jobs and return at once. The jobs are copied after the ones
+	// still pending from the previous exports.
+	// The jobs must be resolved on the main thread since the worker threads
+	// do not call into the host.
+	void Start(std::vector<PMXTextureCopyJob> jobs);
+
+	// Wait until all queued jobs are done (e.g. before a headless run exits).
+	void Wait();
+
+	bool IsBusy() const { return m_busy; }
+
+private:
+	struct HashEntry
+	{
+		unsigned __int64 size;
+		FILETIME time;
+		unsigned __int64 hash;
+	};
+
+	std::mutex m_mutex;
+	HANDLE m_thread;
+	HMODULE m_module;
+	bool m_running;
+	std::vector<PMXTextureCopyJob> m_pending;
+	std::atomic<bool> m_busy;
+	std::atomic<bool> m_cancel;
+
+	// Content hash of source files keyed by the path, reused while the file is unchanged
+	std::mutex m_hash_mutex;
+	std::unordered_map<std::wstring, HashEntry> m_hash_cache;
+
+	static DWORD WINAPI threadProc(LPVOID param);
+	void runPending();
+	void run(const std::vector<PMXTextureCopyJob>& jobs);
+	bool isUpToDate(const PMXTextureCopyJob& job);
+	bool getSourceHash(const MString& path, const WIN32_FILE_ATTRIBUTE_DATA& attr, unsigned __int64& hash);
+};
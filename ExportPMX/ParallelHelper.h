@@ -0,0 +1,55 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Number of worker threads used by ParallelFor (including the calling thread)
+inline int GetParallelWorkerCount()
+{
+	unsigned int n = std::thread::hardware_concurrency();
+	return (n == 0) ? 1 : static_cast<int>(n);
+}
+
+// Call func(i) for every i in [0, count) on all cores.
+// Items are handed out one by one through an atomic counter, so uneven items
+// (e.g. morph targets of different size) are balanced automatically.
+// The function must not call into the host application.
+template <typename Func>
+void ParallelFor(int count, Func func)
+{
+	if (count <= 0)
+		return;
+
+	int worker_num = std::min(GetParallelWorkerCount(), count);
+	if (worker_num <= 1)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			func(i);
+		}
+		return;
+	}
+
+	std::atomic<int> next(0);
+	auto worker = [&]()
+	{
+		for (int i = next++; i < count; i = next++)
+		{
+			func(i);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(worker_num - 1);
+	for (int t = 1; t < worker_num; t++)
+	{
+		threads.emplace_back(worker);
+	}
+	worker();
+	for (auto& th : threads)
+	{
+		th.join();
+	}
+}
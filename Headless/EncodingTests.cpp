@@ -0,0 +1,161 @@
+﻿//---------------------------------------------------------------------------
+//
+//   EncodingTests.cpp
+//
+//     Tests of the built-in code page tables (EncodingTable.cpp) and the
+//    conversions of EncodingHelper.h. They do not use the host or the
+//    system code pages.
+//
+//---------------------------------------------------------------------------
+
+#include "PMXTests.h"
+#include "EncodingHelper.h"
+#include "EncodingTable.h"
+#include <string>
+
+using namespace oguna;
+
+// Code page bytes and the UTF-16 text they decode to
+struct EncodingSample
+{
+	unsigned int codepage;
+	const char* bytes;
+	const wchar_t* text;
+};
+
+static const EncodingSample s_samples[] = {
+	{936, "abc", L"abc"},
+	{936, "\xD6\xD0\xCE\xC4", L"中文"},
+	{936, "\xB1\xED\xC7\xE9 morph", L"表情 morph"},
+	{936, "\x80", L"€"}, // euro sign
+	{932, "\x93\xFA\x96\x7B\x8C\xEA", L"日本語"},
+	{932, "\x83\x5A\x83\x93\x83\x5E\x81\x5B", L"センター"},
+	{932, "\xB1\xB2", L"ｱｲ"}, // half-width katakana
+	{1252, "caf\xE9", L"café"},
+	{1252, "\x80\x93\x94", L"€“”"},
+};
+
+PMX_TEST(CodePageTablesExist)
+{
+	PMX_CHECK(GetCodePageTable(936) != nullptr);
+	PMX_CHECK(GetCodePageTable(932) != nullptr);
+	PMX_CHECK(GetCodePageTable(1252) != nullptr);
+	PMX_CHECK(GetCodePageTable(437) == nullptr);
+	PMX_CHECK(GetCodePageReverseTable(nullptr) == nullptr);
+	for (unsigned int codepage : {936u, 932u, 1252u})
+	{
+		const CodePageTable* table = GetCodePageTable(codepage);
+		PMX_CHECK(table != nullptr && table->codepage == codepage);
+		PMX_CHECK(table != nullptr && GetCodePageReverseTable(table) != nullptr);
+	}
+	PMX_CHECK(!GetCodePageTable(1252)->IsLeadByte(0x93));
+	PMX_CHECK(GetCodePageTable(932)->IsLeadByte(0x93));
+	PMX_CHECK(!GetCodePageTable(932)->IsLeadByte(0xB1));
+}
+
+PMX_TEST(CodePageSamples)
+{
+	EncodingConverter converter;
+	for (const EncodingSample& sample : s_samples)
+	{
+		int length = static_cast<int>(strlen(sample.bytes));
+		std::wstring text;
+		converter.MultiByteToUtf16(sample.codepage, sample.bytes, length, &text);
+		PMX_CHECK(text == sample.text);
+
+		std::string bytes;
+		converter.Utf16ToMultiByte(sample.codepage, text.c_str(), static_cast<int>(text.length()), &bytes);
+		PMX_CHECK(bytes == sample.bytes);
+
+		// The direct conversion to UTF-8 gives the same text as the one through UTF-16
+		std::string utf8;
+		std::string expected;
+		converter.MultiByteToUtf8(sample.codepage, sample.bytes, length, &utf8);
+		converter.Utf16ToUtf8(text.c_str(), static_cast<int>(text.length()), &expected);
+		PMX_CHECK(utf8 == expected);
+	}
+}
+
+PMX_TEST(CodePageInvalidBytes)
+{
+	EncodingConverter converter;
+	const CodePageTable* table = GetCodePageTable(932);
+	std::wstring text;
+
+	// A lead byte at the end or before a byte that is not a trail byte
+	converter.MultiByteToUtf16(932, "a\x93", 2, &text);
+	PMX_CHECK(text.length() == 2 && text[0] == L'a' && text[1] == table->default_char);
+	converter.MultiByteToUtf16(932, "\x93\x20", 2, &text);
+	PMX_CHECK(text.length() == 2 && text[0] == table->default_char && text[1] == L' ');
+
+	// Characters the code page does not have
+	std::string bytes;
+	converter.Utf16ToMultiByte(932, L"a€", 2, &bytes);
+	PMX_CHECK(bytes == "a?");
+}
+
+// Every character of a table is converted back to a code that decodes to it
+static void checkReverseTable(unsigned int codepage)
+{
+	const CodePageTable* table = GetCodePageTable(codepage);
+	const unsigned short* rev = GetCodePageReverseTable(table);
+	PMX_CHECK(table != nullptr && rev != nullptr);
+	if (table == nullptr || rev == nullptr)
+		return;
+
+	auto decode = [table](unsigned short code) -> unsigned short
+	{
+		if (code < 0x100)
+			return table->single[code];
+		unsigned char lead = static_cast<unsigned char>(code >> 8);
+		unsigned char trail = static_cast<unsigned char>(code & 0xFF);
+		if (!table->IsLeadByte(lead) || !table->IsTrailByte(trail))
+			return 0;
+		return table->GetDoubleByteChar(lead, trail);
+	};
+
+	int mismatch = 0;
+	for (int c = 0x80; c < 0x100; c++)
+	{
+		unsigned char lead = static_cast<unsigned char>(c);
+		if (!table->IsLeadByte(lead))
+		{
+			unsigned short u = table->single[c];
+			if (u >= 0x80 && decode(rev[u]) != u)
+				mismatch++;
+			continue;
+		}
+		for (int t = 0x40; t <= table->trail_max; t++)
+		{
+			if (!table->IsTrailByte(static_cast<unsigned char>(t)))
+				continue;
+			unsigned short u = table->GetDoubleByteChar(lead, static_cast<unsigned char>(t));
+			if (u >= 0x80 && decode(rev[u]) != u)
+				mismatch++;
+		}
+	}
+	PMX_CHECK(mismatch == 0);
+}
+
+PMX_TEST(CodePageReverseTables)
+{
+	checkReverseTable(936);
+	checkReverseTable(932);
+	checkReverseTable(1252);
+}
+
+PMX_TEST(Utf8Conversion)
+{
+	EncodingConverter converter;
+	std::wstring text;
+	// 2, 3 and 4 byte characters
+	converter.Utf8ToUtf16("\xC3\xA9\xE4\xB8\xAD\xF0\x9F\x98\x80", 9, &text);
+	std::string utf8;
+	converter.Utf16ToUtf8(text.c_str(), static_cast<int>(text.length()), &utf8);
+	PMX_CHECK(utf8 == "\xC3\xA9\xE4\xB8\xAD\xF0\x9F\x98\x80");
+	PMX_CHECK(text[0] == 0xE9 && text[1] == 0x4E2D);
+
+	// Broken sequences become U+FFFD
+	converter.Utf8ToUtf16("a\xE4\xB8" "b\xC0\xAF", 6, &text);
+	PMX_CHECK(text.length() >= 3 && text[0] == L'a' && text[1] == 0xFFFD);
+}
@@ -0,0 +1,356 @@
+﻿//---------------------------------------------------------------------------
+//
+//   ExportPMXBench.cpp
+//
+//     Export benchmark on the headless host.
+//
+//     Usage: ExportPMXBench [options]
+//       --preset small|medium|large  scene size (default: small)
+//       --objects N --grid N --materials N --bones N
+//       --weights-min N --weights-max N --morphs N --seed N
+//                                    override the preset
+//                                    (bones are reduced to 127 PMX bones)
+//       --repeat N                   number of runs (default: 3)
+//       --out FILE                   exported PMX (default: bench.pmx)
+//       --json FILE                  write the results as JSON (default: stdout)
+//       --profile                    add a profiled run and rank the host calls
+//       --verify                     read the exported PMX back and verify it
+//
+//---------------------------------------------------------------------------
+
+#include "MQSceneGenerator.h"
+#include "MQBasePlugin.h"
+#include "PMXExportStats.h"
+#include "PMXMorph.h"
+#include "PMXHostProfiler.h"
+#include "PMXVerifier.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+MQBasePlugin* GetPluginClass();
+
+typedef std::chrono::steady_clock BenchClock;
+
+static double elapsedMs(BenchClock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(BenchClock::now() - start).count();
+}
+
+// Times of a phase over all runs
+struct BenchPhase
+{
+	std::string name;
+	std::vector<double> ms;
+
+	double GetMin() const { return *std::min_element(ms.begin(), ms.end()); }
+	double GetMedian() const
+	{
+		std::vector<double> sorted(ms);
+		std::sort(sorted.begin(), sorted.end());
+		size_t n = sorted.size();
+		return (n % 2 == 1) ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) * 0.5;
+	}
+};
+
+class BenchResult
+{
+public:
+	void Add(const char* name, double ms)
+	{
+		for (auto& phase : m_phases)
+		{
+			if (phase.name == name)
+			{
+				phase.ms.push_back(ms);
+				return;
+			}
+		}
+		m_phases.push_back(BenchPhase());
+		m_phases.back().name = name;
+		m_phases.back().ms.push_back(ms);
+	}
+	const std::vector<BenchPhase>& GetPhases() const { return m_phases; }
+
+private:
+	std::vector<BenchPhase> m_phases;
+};
+
+// Face indices ExportFile writes for the document
+static int countFaceIndices(MQDocument doc, const PMXMorphTopology& morph_topology)
+{
+	int count = 0;
+	int num = doc->GetObjectCount();
+	for (int i = 0; i < num; i++)
+	{
+		MQObject obj = doc->GetObject(i);
+		if (obj == nullptr || morph_topology.IsTarget(i))
+			continue;
+		int num_face = obj->GetFaceCount();
+		for (int fi = 0; fi < num_face; fi++)
+		{
+			int n = obj->GetFacePointCount(fi);
+			if (n >= 3)
+				count += (n - 2) * 3;
+		}
+	}
+	return count;
+}
+
+// Result of reading the exported file back
+struct BenchVerify
+{
+	bool done;
+	bool parsed;
+	double parse_ms;
+	double verify_ms;
+	PMXVerifyResult result;
+
+	BenchVerify() : done(false), parsed(false), parse_ms(0.0), verify_ms(0.0) {}
+};
+
+static void verifyExport(const char* filename, MQDocument doc, BenchVerify& verify)
+{
+	PMXMorphTopology morph_topology;
+	morph_topology.Query(GetPluginClass(), doc);
+	PMXVerifyExpect expect;
+	expect.index_count = countFaceIndices(doc, morph_topology);
+
+	verify.done = true;
+	PMXReader reader;
+	BenchClock::time_point start = BenchClock::now();
+	verify.parsed = reader.Open(MString::fromAnsiString(filename));
+	verify.parse_ms = elapsedMs(start);
+	if (!verify.parsed)
+	{
+		verify.result.errors.push_back(reader.GetError().toAnsiString().c_str());
+		verify.result.error_count++;
+		return;
+	}
+	start = BenchClock::now();
+	VerifyPMX(reader, expect, verify.result);
+	verify.verify_ms = elapsedMs(start);
+}
+
+static std::string escapeJson(const std::string& str)
+{
+	std::string ret;
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+			ret += '\\';
+		ret += c;
+	}
+	return ret;
+}
+
+static long long getFileSize(const char* filename)
+{
+	FILE* fh;
+	if (fopen_s(&fh, filename, "rb") != 0)
+		return -1;
+	fseek(fh, 0, SEEK_END);
+	long long size = ftell(fh);
+	fclose(fh);
+	return size;
+}
+
+static void writeEntries(FILE* fh, const char* name, const std::vector<PMXHostProfiler::Entry>& entries)
+{
+	fprintf(fh, "  \"%s\": [\n", name);
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		const PMXHostProfiler::Entry& entry = entries[i];
+		fprintf(fh, "    { \"name\": \"%s\", \"calls\": %llu, \"ms\": %.3f }%s\n",
+			entry.name.c_str(), static_cast<unsigned long long>(entry.calls), entry.ms, (i + 1 < entries.size()) ? "," : "");
+	}
+	fprintf(fh, "  ]");
+}
+
+static void writeJson(FILE* fh, const char* preset, const MQSceneParam& param, MQHeadlessDocument& doc, long long pmx_size, const BenchResult& result, bool profiled, const BenchVerify& verify)
+{
+	size_t face_num = 0;
+	size_t weight_num = 0;
+	for (auto& obj : doc.objects)
+	{
+		face_num += obj->GetFaceCount();
+		weight_num += obj->weight_bone.size();
+	}
+
+	fprintf(fh, "{\n");
+	fprintf(fh, "  \"preset\": \"%s\",\n", preset);
+	fprintf(fh, "  \"scene\": {\n");
+	fprintf(fh, "    \"objects\": %d,\n", static_cast<int>(doc.objects.size()));
+	fprintf(fh, "    \"vertices\": %d,\n", param.GetVertexCount());
+	fprintf(fh, "    \"faces\": %zu,\n", face_num);
+	fprintf(fh, "    \"weights\": %zu,\n", weight_num);
+	fprintf(fh, "    \"materials\": %d,\n", param.material_count);
+	fprintf(fh, "    \"bones\": %d,\n", param.bone_count);
+	fprintf(fh, "    \"ik\": %d,\n", param.ik_count);
+	fprintf(fh, "    \"morphs\": %d,\n", param.morph_count);
+	fprintf(fh, "    \"seed\": %u\n", param.seed);
+	fprintf(fh, "  },\n");
+	fprintf(fh, "  \"pmx_bytes\": %lld,\n", pmx_size);
+	fprintf(fh, "  \"phases\": [\n");
+	const std::vector<BenchPhase>& phases = result.GetPhases();
+	for (size_t i = 0; i < phases.size(); i++)
+	{
+		const BenchPhase& phase = phases[i];
+		fprintf(fh, "    { \"name\": \"%s\", \"min_ms\": %.3f, \"median_ms\": %.3f, \"runs_ms\": [", phase.name.c_str(), phase.GetMin(), phase.GetMedian());
+		for (size_t r = 0; r < phase.ms.size(); r++)
+			fprintf(fh, "%s%.3f", (r == 0) ? "" : ", ", phase.ms[r]);
+		fprintf(fh, "] }%s\n", (i + 1 < phases.size()) ? "," : "");
+	}
+	fprintf(fh, "  ]");
+	if (profiled)
+	{
+		fprintf(fh, ",\n");
+		writeEntries(fh, "host_functions", PMXHostProfiler::GetFunctionRanking());
+		fprintf(fh, ",\n");
+		writeEntries(fh, "host_messages", PMXHostProfiler::GetMessageRanking());
+	}
+	if (verify.done)
+	{
+		fprintf(fh, ",\n");
+		fprintf(fh, "  \"verify\": {\n");
+		fprintf(fh, "    \"valid\": %s,\n", verify.result.IsValid() ? "true" : "false");
+		fprintf(fh, "    \"parse_ms\": %.3f,\n", verify.parse_ms);
+		fprintf(fh, "    \"verify_ms\": %.3f,\n", verify.verify_ms);
+		fprintf(fh, "    \"error_count\": %d,\n", verify.result.error_count);
+		fprintf(fh, "    \"errors\": [");
+		for (size_t i = 0; i < verify.result.errors.size(); i++)
+			fprintf(fh, "%s\"%s\"", (i == 0) ? "" : ", ", escapeJson(verify.result.errors[i]).c_str());
+		fprintf(fh, "]\n  }");
+	}
+	fprintf(fh, "\n}\n");
+}
+
+static bool parseInt(int argc, char** argv, int& i, const char* name, int& value)
+{
+	if (strcmp(argv[i], name) != 0 || i + 1 >= argc)
+		return false;
+	value = atoi(argv[++i]);
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	const char* preset = "small";
+	const char* filename = "bench.pmx";
+	const char* json = nullptr;
+	int repeat = 3;
+	bool profile = false;
+	bool verify_pmx = false;
+	MQSceneParam param;
+
+	// The preset is applied first so that the other options override it
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		if (strcmp(argv[i], "--preset") == 0)
+			preset = argv[i + 1];
+	}
+	if (!param.SetPreset(preset))
+	{
+		fprintf(stderr, "Unknown preset: %s\n", preset);
+		return 1;
+	}
+	for (int i = 1; i < argc; i++)
+	{
+		int seed;
+		if (strcmp(argv[i], "--preset") == 0 && i + 1 < argc) i++;
+		else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) filename = argv[++i];
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) json = argv[++i];
+		else if (strcmp(argv[i], "--profile") == 0) profile = true;
+		else if (strcmp(argv[i], "--verify") == 0) verify_pmx = true;
+		else if (parseInt(argc, argv, i, "--repeat", repeat)) ;
+		else if (parseInt(argc, argv, i, "--objects", param.object_count)) ;
+		else if (parseInt(argc, argv, i, "--grid", param.grid_size)) ;
+		else if (parseInt(argc, argv, i, "--materials", param.material_count)) ;
+		else if (parseInt(argc, argv, i, "--bones", param.bone_count)) ;
+		else if (parseInt(argc, argv, i, "--weights-min", param.weight_min)) ;
+		else if (parseInt(argc, argv, i, "--weights-max", param.weight_max)) ;
+		else if (parseInt(argc, argv, i, "--morphs", param.morph_count)) ;
+		else if (parseInt(argc, argv, i, "--seed", seed)) param.seed = static_cast<unsigned int>(seed);
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	repeat = std::max(repeat, 1);
+	param.weight_max = std::max(param.weight_max, param.weight_min);
+	param.texture_count = std::min(param.texture_count, param.material_count);
+
+	MQHeadless_Install();
+	MQBasePlugin* plugin = GetPluginClass();
+	MQExportPlugin* exporter = static_cast<MQExportPlugin*>(plugin);
+
+	BenchResult result;
+	MQHeadlessDocument hdoc;
+	BenchClock::time_point start = BenchClock::now();
+	GenerateScene(param, hdoc);
+	result.Add("generate", elapsedMs(start));
+	MQDocument doc = hdoc.GetDocument();
+
+	for (int r = 0; r < repeat; r++)
+	{
+		// Each run starts from a new undo state, so the morph setup is
+		// queried again as after an edit.
+		hdoc.undo_state++;
+
+		start = BenchClock::now();
+		BOOL ret = exporter->ExportFile(0, filename, doc);
+		result.Add("export_file", elapsedMs(start));
+		if (!ret)
+		{
+			fprintf(stderr, "ExportFile failed: %s\n", filename);
+			return 1;
+		}
+
+		// Phases as measured by ExportFile itself
+		const PMXExportStats& stats = PMXExportStats::GetLast();
+		for (int i = 0; i < PMX_PHASE_NUM; i++)
+		{
+			PMXExportPhase phase = static_cast<PMXExportPhase>(i);
+			result.Add(PMXExportStats::GetPhaseName(phase), stats.GetPhaseMs(phase));
+		}
+	}
+
+	// The probes slow the calls down, so the profiled run is not timed
+	if (profile)
+	{
+		hdoc.undo_state++;
+		PMXHostProfiler::Start();
+		BOOL ret = exporter->ExportFile(0, filename, doc);
+		PMXHostProfiler::Stop();
+		if (!ret)
+		{
+			fprintf(stderr, "ExportFile failed: %s\n", filename);
+			return 1;
+		}
+	}
+
+	BenchVerify verify;
+	if (verify_pmx)
+		verifyExport(filename, doc, verify);
+
+	FILE* fh = stdout;
+	if (json != nullptr && fopen_s(&fh, json, "w") != 0)
+	{
+		fprintf(stderr, "Cannot open %s\n", json);
+		return 1;
+	}
+	writeJson(fh, preset, param, hdoc, getFileSize(filename), result, profile, verify);
+	if (fh != stdout)
+		fclose(fh);
+	if (verify.done && !verify.result.IsValid())
+	{
+		fprintf(stderr, "Verification failed: %s\n", filename);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,700 @@
+﻿//---------------------------------------------------------------------------
+//
+//   MQHeadlessHost.cpp
+//
+//     An in-memory stand-in for Metasequoia.
+//
+//---------------------------------------------------------------------------
+
+#include "MQHeadlessHost.h"
+#include "PMXTextureAtlas.h"
+#include <MFileUtil.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+static const DWORD plugin_product = 0x56A31D20;
+static const DWORD bone_plugin_id = 0x71F282AB;
+static const DWORD morph_plugin_id = 0xC452C6DB;
+
+MQHeadlessObject::MQHeadlessObject()
+{
+	visible = 0xFFFFFFFF;
+	shading = MQOBJECT_SHADE_GOURAUD;
+	smooth_angle = 59.5f;
+	unique_id = 0;
+	face_begin.push_back(0);
+}
+
+int MQHeadlessObject::AddVertex(const MQPoint& p)
+{
+	vertices.push_back(p);
+	return static_cast<int>(vertices.size()) - 1;
+}
+
+int MQHeadlessObject::AddFace(int count, const int* points, const MQCoordinate* uv, int material)
+{
+	face_points.insert(face_points.end(), points, points + count);
+	if (uv != nullptr)
+		face_uv.insert(face_uv.end(), uv, uv + count);
+	else
+		face_uv.resize(face_points.size(), MQCoordinate(0, 0));
+	face_begin.push_back(static_cast<int>(face_points.size()));
+	face_material.push_back(material);
+	return static_cast<int>(face_material.size()) - 1;
+}
+
+void MQHeadlessObject::AddVertexWeights(int vertex, int count, const UINT* bone_ids, const float* weights)
+{
+	if (weight_begin.empty())
+		weight_begin.push_back(0);
+	// 飛ばした頂点はウェイトなし
+	while (static_cast<int>(weight_begin.size()) <= vertex)
+		weight_begin.push_back(weight_begin.back());
+	assert(static_cast<int>(weight_begin.size()) == vertex + 1);
+
+	weight_bone.insert(weight_bone.end(), bone_ids, bone_ids + count);
+	weight_value.insert(weight_value.end(), weights, weights + count);
+	weight_begin.push_back(static_cast<int>(weight_bone.size()));
+}
+
+MQHeadlessMaterial::MQHeadlessMaterial()
+{
+	color = MQColor(1, 1, 1);
+	alpha = 1.0f;
+	diffuse = 0.8f;
+	power = 5.0f;
+	ambient_color = MQColor(0.6f, 0.6f, 0.6f);
+	specular_color = MQColor(0, 0, 0);
+	emission_color = MQColor(0, 0, 0);
+	shader = 0;
+	edge = false;
+	unique_id = 0;
+}
+
+MQHeadlessBone::MQHeadlessBone()
+{
+	id = 0;
+	parent = 0;
+	tip_bone = 0;
+	root = MQPoint(0, 0, 0);
+	tip = MQPoint(0, 0, 0);
+	ikchain = -1;
+	ik_parent = 0;
+	ik_parent_isik = false;
+	dummy = false;
+	end_point = false;
+	movable = false;
+	angle_min = MQAngle(0, 0, 0);
+	angle_max = MQAngle(0, 0, 0);
+	link = 0;
+	link_rotate = 100.0f;
+}
+
+MQHeadlessDocument::MQHeadlessDocument()
+{
+	undo_state = 1;
+}
+
+MQHeadlessObject* MQHeadlessDocument::AddObject(const char* name)
+{
+	objects.emplace_back(new MQHeadlessObject());
+	MQHeadlessObject* obj = objects.back().get();
+	obj->name = name;
+	obj->unique_id = static_cast<UINT>(objects.size());
+	return obj;
+}
+
+MQHeadlessMaterial* MQHeadlessDocument::AddMaterial(const char* name)
+{
+	materials.emplace_back(new MQHeadlessMaterial());
+	MQHeadlessMaterial* mat = materials.back().get();
+	mat->name = name;
+	mat->unique_id = static_cast<UINT>(materials.size());
+	return mat;
+}
+
+UINT MQHeadlessDocument::AddBone(const MQHeadlessBone& bone)
+{
+	UINT id = bone.id != 0 ? bone.id : static_cast<UINT>(bones.size() + 1);
+	m_bone_index[id] = static_cast<int>(bones.size());
+	bones.push_back(bone);
+	bones.back().id = id;
+	bones.back().children.clear();
+
+	MQHeadlessBone* parent = FindBone(bone.parent);
+	if (parent != nullptr)
+		parent->children.push_back(id);
+	return id;
+}
+
+int MQHeadlessDocument::GetObjectIndex(const MQHeadlessObject* obj) const
+{
+	if (obj == nullptr)
+		return -1;
+	// オブジェクトのユニークIDは追加順
+	int index = static_cast<int>(obj->unique_id) - 1;
+	if (index >= 0 && index < static_cast<int>(objects.size()) && objects[index].get() == obj)
+		return index;
+	return -1;
+}
+
+MQHeadlessBone* MQHeadlessDocument::FindBone(UINT id)
+{
+	auto ite = m_bone_index.find(id);
+	return (ite != m_bone_index.end()) ? &bones[ite->second] : nullptr;
+}
+
+MQHeadlessObject* MQHeadlessDocument::FindObject(UINT unique_id)
+{
+	int index = static_cast<int>(unique_id) - 1;
+	return (index >= 0 && index < static_cast<int>(objects.size())) ? objects[index].get() : nullptr;
+}
+
+//---------------------------------------------------------------------------
+//  Host functions
+//---------------------------------------------------------------------------
+
+static MQHeadlessDocument* toDoc(MQDocument doc) { return MQHeadlessDocument::FromDocument(doc); }
+static MQHeadlessObject* toObj(MQObject obj) { return reinterpret_cast<MQHeadlessObject*>(obj); }
+static MQHeadlessMaterial* toMat(MQMaterial mat) { return reinterpret_cast<MQHeadlessMaterial*>(mat); }
+
+static void copyString(char* buffer, int size, const std::string& str)
+{
+	if (buffer == nullptr || size <= 0)
+		return;
+	size_t len = std::min(str.length(), static_cast<size_t>(size - 1));
+	memcpy(buffer, str.c_str(), len);
+	buffer[len] = '\0';
+}
+
+// Find the value for the key in a null-terminated key/value array
+static void* findArrayValue(void** array, const char* key)
+{
+	if (array == nullptr)
+		return nullptr;
+	for (int i = 0; array[i] != nullptr; i += 2)
+	{
+		if (strcmp(static_cast<const char*>(array[i]), key) == 0)
+			return array[i + 1];
+	}
+	return nullptr;
+}
+
+static int MQAPICALL Doc_GetObjectCount(MQDocument doc)
+{
+	return static_cast<int>(toDoc(doc)->objects.size());
+}
+
+static MQObject MQAPICALL Doc_GetObject(MQDocument doc, int index)
+{
+	MQHeadlessDocument* hdoc = toDoc(doc);
+	if (index < 0 || index >= static_cast<int>(hdoc->objects.size()))
+		return nullptr;
+	return reinterpret_cast<MQObject>(hdoc->objects[index].get());
+}
+
+static int MQAPICALL Doc_GetObjectIndex(MQDocument doc, MQObject obj)
+{
+	return toDoc(doc)->GetObjectIndex(toObj(obj));
+}
+
+static int MQAPICALL Doc_GetMaterialCount(MQDocument doc)
+{
+	return static_cast<int>(toDoc(doc)->materials.size());
+}
+
+static MQMaterial MQAPICALL Doc_GetMaterial(MQDocument doc, int index)
+{
+	MQHeadlessDocument* hdoc = toDoc(doc);
+	if (index < 0 || index >= static_cast<int>(hdoc->materials.size()))
+		return nullptr;
+	return reinterpret_cast<MQMaterial>(hdoc->materials[index].get());
+}
+
+static BOOL MQAPICALL Doc_FindMappingFileW(MQDocument doc, wchar_t* out_path, const wchar_t* filename, DWORD map_type)
+{
+	MString path(filename);
+	if (MFileUtil::isPathRelative(path))
+		path = MFileUtil::combinePath(toDoc(doc)->texture_dir, path);
+	if (!MFileUtil::fileExists(path))
+		return FALSE;
+	wcsncpy(out_path, path.c_str(), MAX_PATH - 1);
+	out_path[MAX_PATH - 1] = L'\0';
+	return TRUE;
+}
+
+static BOOL MQAPICALL Doc_FindMappingFile(MQDocument doc, char* out_path, const char* filename, DWORD map_type)
+{
+	wchar_t path[MAX_PATH];
+	if (!Doc_FindMappingFileW(doc, path, MString::fromAnsiString(filename).c_str(), map_type))
+		return FALSE;
+	copyString(out_path, MAX_PATH, MString(path).toAnsiString().c_str());
+	return TRUE;
+}
+
+// 凸多角形として扇状に分割する
+static BOOL MQAPICALL Doc_Triangulate(MQDocument doc, const MQPoint* points, int points_num, int* index_array, int index_num)
+{
+	if (points_num < 3 || index_num < (points_num - 2) * 3)
+		return FALSE;
+	for (int i = 0; i < points_num - 2; i++)
+	{
+		index_array[i * 3] = 0;
+		index_array[i * 3 + 1] = i + 1;
+		index_array[i * 3 + 2] = i + 2;
+	}
+	return TRUE;
+}
+
+static void MQAPICALL Obj_GetName(MQObject obj, char* buffer, int size)
+{
+	copyString(buffer, size, toObj(obj)->name);
+}
+
+static int MQAPICALL Obj_GetVertexCount(MQObject obj)
+{
+	return static_cast<int>(toObj(obj)->vertices.size());
+}
+
+static void MQAPICALL Obj_GetVertex(MQObject obj, int index, MQPoint* pts)
+{
+	*pts = toObj(obj)->vertices[index];
+}
+
+static void MQAPICALL Obj_GetVertexArray(MQObject obj, MQPoint* ptsarray)
+{
+	const std::vector<MQPoint>& v = toObj(obj)->vertices;
+	if (!v.empty())
+		memcpy(ptsarray, v.data(), v.size() * sizeof(MQPoint));
+}
+
+static UINT MQAPICALL Obj_GetVertexUniqueID(MQObject obj, int index)
+{
+	return MQHeadlessObject::GetVertexUniqueID(index);
+}
+
+static int MQAPICALL Obj_GetFaceCount(MQObject obj)
+{
+	return toObj(obj)->GetFaceCount();
+}
+
+static int MQAPICALL Obj_GetFacePointCount(MQObject obj, int face)
+{
+	return toObj(obj)->GetFacePointCount(face);
+}
+
+static void MQAPICALL Obj_GetFacePointArray(MQObject obj, int face, int* vertex)
+{
+	MQHeadlessObject* hobj = toObj(obj);
+	int begin = hobj->face_begin[face];
+	memcpy(vertex, hobj->face_points.data() + begin, hobj->GetFacePointCount(face) * sizeof(int));
+}
+
+static void MQAPICALL Obj_GetFaceCoordinateArray(MQObject obj, int face, MQCoordinate* uvarray)
+{
+	MQHeadlessObject* hobj = toObj(obj);
+	int begin = hobj->face_begin[face];
+	memcpy(uvarray, hobj->face_uv.data() + begin, hobj->GetFacePointCount(face) * sizeof(MQCoordinate));
+}
+
+static int MQAPICALL Obj_GetFaceMaterial(MQObject obj, int face)
+{
+	return toObj(obj)->face_material[face];
+}
+
+static DWORD MQAPICALL Obj_GetFaceVertexColor(MQObject obj, int face, int vertex)
+{
+	return 0xFFFFFFFF;
+}
+
+static DWORD MQAPICALL Obj_GetVisible(MQObject obj)
+{
+	return toObj(obj)->visible;
+}
+
+static int MQAPICALL Obj_GetShading(MQObject obj)
+{
+	return toObj(obj)->shading;
+}
+
+static float MQAPICALL Obj_GetSmoothAngle(MQObject obj)
+{
+	return toObj(obj)->smooth_angle;
+}
+
+static int MQAPICALL Obj_GetIntValue(MQObject obj, int type_id)
+{
+	switch (type_id)
+	{
+	case MQOBJ_ID_UNIQUE_ID:
+		return static_cast<int>(toObj(obj)->unique_id);
+	}
+	return 0;
+}
+
+static void MQAPICALL Mat_GetName(MQMaterial mat, char* buffer, int size)
+{
+	copyString(buffer, size, toMat(mat)->name);
+}
+
+static int MQAPICALL Mat_GetIntValue(MQMaterial mat, int type_id)
+{
+	switch (type_id)
+	{
+	case MQMAT_ID_SHADER:
+		return toMat(mat)->shader;
+	case MQMAT_ID_UNIQUE_ID:
+		return static_cast<int>(toMat(mat)->unique_id);
+	}
+	return 0;
+}
+
+static void MQAPICALL Mat_GetFloatArray(MQMaterial mat, int type_id, float* array)
+{
+	const MQColor* col = nullptr;
+	switch (type_id)
+	{
+	case MQMAT_ID_AMBIENT_COLOR:
+		col = &toMat(mat)->ambient_color;
+		break;
+	case MQMAT_ID_SPECULAR_COLOR:
+		col = &toMat(mat)->specular_color;
+		break;
+	case MQMAT_ID_EMISSION_COLOR:
+		col = &toMat(mat)->emission_color;
+		break;
+	}
+	if (col != nullptr)
+	{
+		array[0] = col->r;
+		array[1] = col->g;
+		array[2] = col->b;
+	}
+}
+
+static void MQAPICALL Mat_GetColor(MQMaterial mat, MQColor* color)
+{
+	*color = toMat(mat)->color;
+}
+
+static float MQAPICALL Mat_GetAlpha(MQMaterial mat)
+{
+	return toMat(mat)->alpha;
+}
+
+static float MQAPICALL Mat_GetDiffuse(MQMaterial mat)
+{
+	return toMat(mat)->diffuse;
+}
+
+static float MQAPICALL Mat_GetPower(MQMaterial mat)
+{
+	return toMat(mat)->power;
+}
+
+static void MQAPICALL Mat_GetTextureName(MQMaterial mat, char* buffer, int size)
+{
+	copyString(buffer, size, toMat(mat)->texture);
+}
+
+static void MQAPICALL Mat_GetValueArray(MQMaterial mat, int type_id, void** array)
+{
+	MQHeadlessMaterial* hmat = toMat(mat);
+	switch (type_id)
+	{
+	case MQMAT_ID_SHADER_NAME:
+		{
+			char* buffer = static_cast<char*>(array[0]);
+			int buffer_size = *static_cast<int*>(array[1]);
+			copyString(buffer, buffer_size, hmat->shader_name);
+			*static_cast<int*>(array[2]) = static_cast<int>(hmat->shader_name.length());
+		}
+		break;
+	case MQMAT_ID_SHADER_PARAM_INT_VALUE:
+		{
+			const char* name = static_cast<const char*>(array[1]);
+			int* value = static_cast<int*>(array[3]);
+			if (name != nullptr && strcmp(name, "Edge") == 0)
+				*value = hmat->edge ? 1 : 0;
+		}
+		break;
+	}
+}
+
+static BOOL MQAPICALL Host_LoadImageW(const wchar_t* filename, LPVOID* header, LPVOID* buffer, DWORD reserved)
+{
+	// BMPのみ。ヘッダとバッファはmallocで確保し、呼び出し側がfreeする
+	PMXImage image;
+	BMPImageLoader loader;
+	if (!loader.Load(MString(filename), image))
+		return FALSE;
+
+	BITMAPINFOHEADER* bih = static_cast<BITMAPINFOHEADER*>(malloc(sizeof(BITMAPINFOHEADER)));
+	memset(bih, 0, sizeof(BITMAPINFOHEADER));
+	bih->biSize = sizeof(BITMAPINFOHEADER);
+	bih->biWidth = image.width;
+	bih->biHeight = -image.height; // top-down
+	bih->biPlanes = 1;
+	bih->biBitCount = 32;
+	bih->biCompression = BI_RGB;
+	void* pixels = malloc(image.pixels.size());
+	memcpy(pixels, image.pixels.data(), image.pixels.size());
+
+	*header = bih;
+	*buffer = pixels;
+	return TRUE;
+}
+
+static BOOL MQAPICALL Host_LoadImage(const char* filename, LPVOID* header, LPVOID* buffer, DWORD reserved)
+{
+	return Host_LoadImageW(MString::fromAnsiString(filename).c_str(), header, buffer, reserved);
+}
+
+// The file dialog is not shown; the exporter uses its saved or default options.
+static void MQAPICALL Host_ShowFileDialog(const char* title, MQFileDialogInfo* info)
+{
+}
+
+//---------------------------------------------------------------------------
+//  Bone plugin
+//---------------------------------------------------------------------------
+
+static void setBoneValue(MQHeadlessBone& bone, const char* key, void* value)
+{
+	static const MQMatrix identity;
+
+	if (strcmp(key, "name") == 0)
+		*static_cast<const wchar_t**>(value) = bone.name.c_str();
+	else if (strcmp(key, "tip_name") == 0)
+		*static_cast<const wchar_t**>(value) = bone.tip_name.c_str();
+	else if (strcmp(key, "parent") == 0)
+		*static_cast<UINT*>(value) = bone.parent;
+	else if (strcmp(key, "child_num") == 0)
+		*static_cast<int*>(value) = static_cast<int>(bone.children.size());
+	else if (strcmp(key, "children") == 0)
+		std::copy(bone.children.begin(), bone.children.end(), static_cast<UINT*>(value));
+	else if (strcmp(key, "brother_num") == 0)
+		*static_cast<int*>(value) = 0;
+	else if (strcmp(key, "org_root") == 0 || strcmp(key, "def_root") == 0)
+		*static_cast<MQPoint*>(value) = bone.root;
+	else if (strcmp(key, "org_tip") == 0 || strcmp(key, "def_tip") == 0)
+		*static_cast<MQPoint*>(value) = bone.tip;
+	else if (strcmp(key, "base_matrix") == 0 || strcmp(key, "matrix") == 0 || strcmp(key, "rotate_matrix") == 0 || strcmp(key, "upvector_matrix") == 0)
+		memcpy(value, identity.t, sizeof(identity.t));
+	else if (strcmp(key, "scale") == 0)
+		*static_cast<MQPoint*>(value) = MQPoint(1, 1, 1);
+	else if (strcmp(key, "rotate") == 0)
+		*static_cast<MQAngle*>(value) = MQAngle(0, 0, 0);
+	else if (strcmp(key, "translate") == 0)
+		*static_cast<MQPoint*>(value) = MQPoint(0, 0, 0);
+	else if (strcmp(key, "angle_min") == 0)
+		*static_cast<MQAngle*>(value) = bone.angle_min;
+	else if (strcmp(key, "angle_max") == 0)
+		*static_cast<MQAngle*>(value) = bone.angle_max;
+	else if (strcmp(key, "ikchain") == 0)
+		*static_cast<int*>(value) = bone.ikchain;
+	else if (strcmp(key, "dummy") == 0)
+		*static_cast<bool*>(value) = bone.dummy;
+	else if (strcmp(key, "end_point") == 0)
+		*static_cast<bool*>(value) = bone.end_point;
+	else if (strcmp(key, "movable") == 0)
+		*static_cast<bool*>(value) = bone.movable;
+	else if (strcmp(key, "tip_bone") == 0)
+		*static_cast<UINT*>(value) = bone.tip_bone;
+}
+
+static int respondBonePlugin(MQHeadlessDocument* doc, const char* description, void* message)
+{
+	void** array = static_cast<void**>(message);
+
+	if (strcmp(description, "QueryAPIVersion") == 0)
+		return 1;
+	if (strcmp(description, "QueryBoneNum") == 0)
+		return static_cast<int>(doc->bones.size());
+	if (strcmp(description, "EnumBoneID") == 0)
+	{
+		UINT* ids = static_cast<UINT*>(message);
+		for (size_t i = 0; i < doc->bones.size(); i++)
+			ids[i] = doc->bones[i].id;
+		return static_cast<int>(doc->bones.size());
+	}
+	if (strcmp(description, "GetBone") == 0)
+	{
+		MQHeadlessBone* bone = doc->FindBone(*static_cast<UINT*>(findArrayValue(array, "id")));
+		if (bone == nullptr)
+			return 0;
+		for (int i = 2; array[i] != nullptr; i += 2)
+			setBoneValue(*bone, static_cast<const char*>(array[i]), array[i + 1]);
+		return 1;
+	}
+	if (strcmp(description, "GetIKName") == 0)
+	{
+		MQHeadlessBone* bone = doc->FindBone(*static_cast<UINT*>(findArrayValue(array, "bone")));
+		if (bone == nullptr)
+			return 0;
+		*static_cast<const wchar_t**>(findArrayValue(array, "name")) = bone->ik_name.c_str();
+		*static_cast<const wchar_t**>(findArrayValue(array, "tip_name")) = bone->ik_tip_name.c_str();
+		return 1;
+	}
+	if (strcmp(description, "GetIKParent") == 0)
+	{
+		MQHeadlessBone* bone = doc->FindBone(*static_cast<UINT*>(findArrayValue(array, "bone")));
+		if (bone == nullptr)
+			return 0;
+		*static_cast<UINT*>(findArrayValue(array, "parent")) = bone->ik_parent;
+		*static_cast<bool*>(findArrayValue(array, "isIK")) = bone->ik_parent_isik;
+		return 1;
+	}
+	if (strcmp(description, "GetLink") == 0)
+	{
+		MQHeadlessBone* bone = doc->FindBone(*static_cast<UINT*>(findArrayValue(array, "bone")));
+		if (bone == nullptr)
+			return 0;
+		*static_cast<UINT*>(findArrayValue(array, "link")) = bone->link;
+		*static_cast<float*>(findArrayValue(array, "rot")) = bone->link_rotate;
+		return 1;
+	}
+	if (strcmp(description, "GetVertexWeight") == 0)
+	{
+		// obj_id, vertex_id, array_num, bone_ids, weights
+		MQHeadlessObject* obj = doc->FindObject(*static_cast<UINT*>(array[0]));
+		int vi = static_cast<int>(*static_cast<UINT*>(array[1])) - 1;
+		int array_num = *static_cast<int*>(array[2]);
+		if (obj == nullptr || vi < 0 || vi + 1 >= static_cast<int>(obj->weight_begin.size()))
+			return 0;
+		int begin = obj->weight_begin[vi];
+		int num = std::min(obj->weight_begin[vi + 1] - begin, array_num);
+		memcpy(array[3], obj->weight_bone.data() + begin, num * sizeof(UINT));
+		memcpy(array[4], obj->weight_value.data() + begin, num * sizeof(float));
+		return num;
+	}
+	return 0;
+}
+
+//---------------------------------------------------------------------------
+//  Morph plugin
+//---------------------------------------------------------------------------
+
+static int respondMorphPlugin(MQHeadlessDocument* doc, const char* description, void* message)
+{
+	if (strcmp(description, "getMorphObjectSize") == 0)
+		return static_cast<int>(doc->morphs.size());
+	if (strcmp(description, "getBaseObjectList") == 0)
+	{
+		MQObject* list = static_cast<MQObject*>(message);
+		for (size_t i = 0; i < doc->morphs.size(); i++)
+			list[i] = reinterpret_cast<MQObject>(doc->objects[doc->morphs[i].base].get());
+		return static_cast<int>(doc->morphs.size());
+	}
+
+	const MQHeadlessMorph* morph = nullptr;
+	MQObject base = nullptr;
+	if (strcmp(description, "getTargetSize") == 0)
+		base = static_cast<MQObject>(message);
+	else if (strcmp(description, "getTargetList") == 0)
+		base = static_cast<std::pair<MQObject, MorphType>*>(message)->first;
+	else
+		return 0;
+	for (const MQHeadlessMorph& m : doc->morphs)
+	{
+		if (reinterpret_cast<MQObject>(doc->objects[m.base].get()) == base)
+			morph = &m;
+	}
+	if (morph == nullptr)
+		return 0;
+
+	if (strcmp(description, "getTargetList") == 0)
+	{
+		// 先頭はベース
+		std::pair<MQObject, MorphType>* list = static_cast<std::pair<MQObject, MorphType>*>(message);
+		for (size_t i = 0; i < morph->targets.size(); i++)
+		{
+			list[i + 1].first = reinterpret_cast<MQObject>(doc->objects[morph->targets[i].first].get());
+			list[i + 1].second = morph->targets[i].second;
+		}
+	}
+	return static_cast<int>(morph->targets.size());
+}
+
+static BOOL MQAPICALL Host_SendMessage(int message_type, MQSendMessageInfo* info)
+{
+	void** array = static_cast<void**>(info->option);
+	switch (message_type)
+	{
+	case MQMESSAGE_USER_MESSAGE:
+		{
+			MQHeadlessDocument* doc = toDoc(static_cast<MQDocument>(findArrayValue(array, "document")));
+			DWORD product = *static_cast<DWORD*>(findArrayValue(array, "target_product"));
+			DWORD id = *static_cast<DWORD*>(findArrayValue(array, "target_id"));
+			const char* description = static_cast<const char*>(findArrayValue(array, "description"));
+			void* message = findArrayValue(array, "message");
+			int* result = static_cast<int*>(findArrayValue(array, "result"));
+			if (doc == nullptr || product != plugin_product)
+				return FALSE;
+			if (id == bone_plugin_id)
+				*result = respondBonePlugin(doc, description, message);
+			else if (id == morph_plugin_id)
+				*result = respondMorphPlugin(doc, description, message);
+			else
+				return FALSE;
+		}
+		return TRUE;
+
+	case MQMESSAGE_GET_UNDO_STATE:
+		{
+			MQHeadlessDocument* doc = toDoc(static_cast<MQDocument>(findArrayValue(array, "document")));
+			int* result = static_cast<int*>(findArrayValue(array, "result"));
+			if (doc == nullptr || result == nullptr)
+				return FALSE;
+			*result = doc->undo_state;
+		}
+		return TRUE;
+	}
+
+	// Settings are not stored (MQMESSAGE_GET_SETTING_ELEMENT returns no element).
+	return FALSE;
+}
+
+void MQHeadless_Install()
+{
+	MQ_ShowFileDialog = Host_ShowFileDialog;
+	MQ_LoadImage = Host_LoadImage;
+	MQ_LoadImageW = Host_LoadImageW;
+	MQ_SendMessage = Host_SendMessage;
+
+	MQDoc_GetObjectCount = Doc_GetObjectCount;
+	MQDoc_GetObject = Doc_GetObject;
+	MQDoc_GetObjectIndex = Doc_GetObjectIndex;
+	MQDoc_GetMaterialCount = Doc_GetMaterialCount;
+	MQDoc_GetMaterial = Doc_GetMaterial;
+	MQDoc_FindMappingFile = Doc_FindMappingFile;
+	MQDoc_FindMappingFileW = Doc_FindMappingFileW;
+	MQDoc_Triangulate = Doc_Triangulate;
+
+	MQObj_GetName = Obj_GetName;
+	MQObj_GetVertexCount = Obj_GetVertexCount;
+	MQObj_GetVertex = Obj_GetVertex;
+	MQObj_GetVertexArray = Obj_GetVertexArray;
+	MQObj_GetVertexUniqueID = Obj_GetVertexUniqueID;
+	MQObj_GetFaceCount = Obj_GetFaceCount;
+	MQObj_GetFacePointCount = Obj_GetFacePointCount;
+	MQObj_GetFacePointArray = Obj_GetFacePointArray;
+	MQObj_GetFaceCoordinateArray = Obj_GetFaceCoordinateArray;
+	MQObj_GetFaceMaterial = Obj_GetFaceMaterial;
+	MQObj_GetFaceVertexColor = Obj_GetFaceVertexColor;
+	MQObj_GetVisible = Obj_GetVisible;
+	MQObj_GetShading = Obj_GetShading;
+	MQObj_GetSmoothAngle = Obj_GetSmoothAngle;
+	MQObj_GetIntValue = Obj_GetIntValue;
+
+	MQMat_GetName = Mat_GetName;
+	MQMat_GetIntValue = Mat_GetIntValue;
+	MQMat_GetFloatArray = Mat_GetFloatArray;
+	MQMat_GetColor = Mat_GetColor;
+	MQMat_GetAlpha = Mat_GetAlpha;
+	MQMat_GetDiffuse = Mat_GetDiffuse;
+	MQMat_GetPower = Mat_GetPower;
+	MQMat_GetTextureName = Mat_GetTextureName;
+	MQMat_GetValueArray = Mat_GetValueArray;
+}
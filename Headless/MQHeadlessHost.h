@@ -0,0 +1,147 @@
+﻿//---------------------------------------------------------------------------
+//
+//   MQHeadlessHost.h
+//
+//     An in-memory stand-in for Metasequoia.
+//     MQHeadless_Install() points the function table defined in MQInit.cpp
+//    to this host, so that ExportPMXPlugin::ExportFile can run without the
+//    application (e.g. in a benchmark).
+//     The bone and morph plugins are answered from the document too.
+//
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "MQPlugin.h"
+#include "MString.h"
+#include "PMXMorph.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <unordered_map>
+
+class MQHeadlessObject
+{
+public:
+	std::string name;
+	DWORD visible;
+	int shading;
+	float smooth_angle;
+	UINT unique_id;
+
+	std::vector<MQPoint> vertices;
+
+	// The points of face f are stored in [face_begin[f], face_begin[f+1])
+	// of face_points and face_uv.
+	std::vector<int> face_begin;
+	std::vector<int> face_points;
+	std::vector<MQCoordinate> face_uv;
+	std::vector<int> face_material;
+
+	// The weights of vertex v are stored in [weight_begin[v], weight_begin[v+1])
+	// of weight_bone and weight_value. Empty if the object has no weights.
+	std::vector<int> weight_begin;
+	std::vector<UINT> weight_bone;
+	std::vector<float> weight_value;
+
+	MQHeadlessObject();
+
+	int AddVertex(const MQPoint& p);
+	int AddFace(int count, const int* points, const MQCoordinate* uv, int material);
+	// Weights must be added in the order of the vertices.
+	void AddVertexWeights(int vertex, int count, const UINT* bone_ids, const float* weights);
+
+	int GetFaceCount() const { return static_cast<int>(face_material.size()); }
+	int GetFacePointCount(int face) const { return face_begin[face + 1] - face_begin[face]; }
+
+	// Vertex unique IDs are the vertex index plus one.
+	static UINT GetVertexUniqueID(int index) { return static_cast<UINT>(index + 1); }
+};
+
+class MQHeadlessMaterial
+{
+public:
+	std::string name;
+	MQColor color;
+	float alpha;
+	float diffuse;
+	float power;
+	MQColor ambient_color;
+	MQColor specular_color;
+	MQColor emission_color;
+	std::string texture;
+	int shader;
+	std::string shader_name;
+	bool edge; // "Edge" parameter of the PMX shader
+	UINT unique_id;
+
+	MQHeadlessMaterial();
+};
+
+struct MQHeadlessBone
+{
+	UINT id;
+	UINT parent;
+	UINT tip_bone;
+	std::wstring name;
+	std::wstring tip_name;
+	std::wstring ik_name;
+	std::wstring ik_tip_name;
+	MQPoint root;
+	MQPoint tip;
+	int ikchain; // -1 if not an IK bone
+	UINT ik_parent;
+	bool ik_parent_isik;
+	bool dummy;
+	bool end_point;
+	bool movable;
+	MQAngle angle_min;
+	MQAngle angle_max;
+	UINT link;
+	float link_rotate;
+	std::vector<UINT> children;
+
+	MQHeadlessBone();
+};
+
+// Morph plugin setup of a base object (object indices in the document)
+struct MQHeadlessMorph
+{
+	int base;
+	std::vector<std::pair<int, MorphType>> targets;
+};
+
+class MQHeadlessDocument
+{
+public:
+	std::vector<std::unique_ptr<MQHeadlessObject>> objects;
+	std::vector<std::unique_ptr<MQHeadlessMaterial>> materials;
+	std::vector<MQHeadlessBone> bones;
+	std::vector<MQHeadlessMorph> morphs;
+	int undo_state;
+	// Base folder of relative texture names
+	MString texture_dir;
+
+	MQHeadlessDocument();
+
+	MQDocument GetDocument() { return reinterpret_cast<MQDocument>(this); }
+	static MQHeadlessDocument* FromDocument(MQDocument doc) { return reinterpret_cast<MQHeadlessDocument*>(doc); }
+
+	MQHeadlessObject* AddObject(const char* name);
+	MQHeadlessMaterial* AddMaterial(const char* name);
+	// The parent must be added before its children. Returns the bone ID.
+	UINT AddBone(const MQHeadlessBone& bone);
+
+	int GetObjectIndex(const MQHeadlessObject* obj) const;
+	MQHeadlessBone* FindBone(UINT id);
+	MQHeadlessObject* FindObject(UINT unique_id);
+
+private:
+	std::unordered_map<UINT, int> m_bone_index;
+};
+
+// Point the function table of MQInit.cpp to the headless host.
+// Functions the exporter does not use are left as they are.
+void MQHeadless_Install();
@@ -0,0 +1,343 @@
+﻿//---------------------------------------------------------------------------
+//
+//   MQOBatch.cpp
+//
+//     Convert .mqo files to PMX on the headless host.
+//
+//     Usage: MQOBatch [options] FILE|DIR...
+//       --jobs N       number of concurrent conversions (default: cores)
+//       --out DIR      output folder (default: next to each .mqo)
+//       --report FILE  write the per-file report as TSV
+//
+//     Each file is converted in a child process ("--single IN OUT"), since
+//    ExportFile keeps its state in the plugin object and the host function
+//    table is global. The worker threads only hand out the files and wait
+//    for the children.
+//
+//     Returns 0 if all files were converted.
+//
+//---------------------------------------------------------------------------
+
+#include "MQOReader.h"
+#include "MQBasePlugin.h"
+#include "MFileUtil.h"
+#include "ParallelHelper.h"
+#include <stdio.h>
+#include <wchar.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+MQBasePlugin* GetPluginClass();
+
+typedef std::chrono::steady_clock BatchClock;
+
+static double elapsedMs(BatchClock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(BatchClock::now() - start).count();
+}
+
+static __int64 getFileSize(const wchar_t* filename)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	if (!GetFileAttributesExW(filename, GetFileExInfoStandard, &attr))
+		return -1;
+	return (static_cast<__int64>(attr.nFileSizeHigh) << 32) | attr.nFileSizeLow;
+}
+
+//---------------------------------------------------------------------------
+//  Child process
+//---------------------------------------------------------------------------
+
+// Convert one file and print "ok LOAD_MS EXPORT_MS" or "error MESSAGE".
+static int convertSingle(const wchar_t* input, const wchar_t* output)
+{
+	MQHeadless_Install();
+	MQExportPlugin* exporter = static_cast<MQExportPlugin*>(GetPluginClass());
+
+	MQHeadlessDocument hdoc;
+	MString error;
+	BatchClock::time_point start = BatchClock::now();
+	if (!LoadMQO(input, hdoc, error))
+	{
+		printf("error %s\n", error.toUtf8String().c_str());
+		return 1;
+	}
+	double load_ms = elapsedMs(start);
+
+	start = BatchClock::now();
+	BOOL ret = exporter->ExportFile(0, MString(output).toAnsiString().c_str(), hdoc.GetDocument());
+	double export_ms = elapsedMs(start);
+	if (!ret)
+	{
+		printf("error ExportFile failed\n");
+		return 1;
+	}
+	printf("ok %.3f %.3f\n", load_ms, export_ms);
+	return 0;
+}
+
+//---------------------------------------------------------------------------
+//  Scheduler
+//---------------------------------------------------------------------------
+
+struct BatchJob
+{
+	MString input;
+	MString output;
+	__int64 input_size;
+
+	// Result
+	bool done;
+	bool ok;
+	std::string message;
+	double load_ms;
+	double export_ms;
+	double total_ms; // including the process start
+	__int64 output_size;
+	int worker;
+
+	BatchJob() : input_size(0), done(false), ok(false), load_ms(0), export_ms(0), total_ms(0), output_size(-1), worker(-1) {}
+};
+
+// Work-stealing queues of job indices.
+// A worker takes jobs from the back of its own queue and steals from the
+// front of the others, so the large files dealt first are stolen first.
+class BatchQueues
+{
+public:
+	explicit BatchQueues(int worker_num) : m_queues(worker_num), m_locks(worker_num) {}
+
+	void Push(int worker, int job) { m_queues[worker].push_back(job); }
+
+	bool Pop(int worker, int& job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_locks[worker]);
+			if (!m_queues[worker].empty())
+			{
+				job = m_queues[worker].back();
+				m_queues[worker].pop_back();
+				return true;
+			}
+		}
+		int num = static_cast<int>(m_queues.size());
+		for (int i = 1; i < num; i++)
+		{
+			int victim = (worker + i) % num;
+			std::lock_guard<std::mutex> lock(m_locks[victim]);
+			if (!m_queues[victim].empty())
+			{
+				job = m_queues[victim].front();
+				m_queues[victim].pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	std::vector<std::deque<int>> m_queues;
+	std::vector<std::mutex> m_locks;
+};
+
+static void runChild(const MString& exe, BatchJob& job)
+{
+	BatchClock::time_point start = BatchClock::now();
+
+	SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, TRUE };
+	HANDLE read_pipe, write_pipe;
+	if (!CreatePipe(&read_pipe, &write_pipe, &sa, 0))
+	{
+		job.message = "cannot create a pipe";
+		return;
+	}
+	SetHandleInformation(read_pipe, HANDLE_FLAG_INHERIT, 0);
+
+	STARTUPINFOW si = {};
+	si.cb = sizeof(si);
+	si.dwFlags = STARTF_USESTDHANDLES;
+	si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+	si.hStdOutput = write_pipe;
+	si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+	PROCESS_INFORMATION pi = {};
+
+	MString cmdline = MString::format(L"\"%s\" --single \"%s\" \"%s\"", exe.c_str(), job.input.c_str(), job.output.c_str());
+	BOOL created = CreateProcessW(nullptr, cmdline.c_str(), nullptr, nullptr, TRUE, CREATE_NO_WINDOW, nullptr, nullptr, &si, &pi);
+	CloseHandle(write_pipe);
+	if (!created)
+	{
+		CloseHandle(read_pipe);
+		job.message = "cannot start the converter";
+		return;
+	}
+
+	std::string out;
+	char buf[1024];
+	DWORD read;
+	while (ReadFile(read_pipe, buf, sizeof(buf), &read, nullptr) && read > 0)
+		out.append(buf, read);
+	CloseHandle(read_pipe);
+	WaitForSingleObject(pi.hProcess, INFINITE);
+	DWORD exit_code = 1;
+	GetExitCodeProcess(pi.hProcess, &exit_code);
+	CloseHandle(pi.hProcess);
+	CloseHandle(pi.hThread);
+	job.total_ms = elapsedMs(start);
+
+	// The result is the last line of the output
+	while (!out.empty() && (out.back() == '\n' || out.back() == '\r'))
+		out.pop_back();
+	size_t pos = out.find_last_of('\n');
+	std::string line = (pos != std::string::npos) ? out.substr(pos + 1) : out;
+	if (exit_code == 0 && sscanf_s(line.c_str(), "ok %lf %lf", &job.load_ms, &job.export_ms) == 2)
+	{
+		job.ok = true;
+		job.output_size = getFileSize(job.output.c_str());
+	}
+	else if (line.compare(0, 6, "error ") == 0)
+	{
+		job.message = line.substr(6);
+	}
+	else
+	{
+		job.message = "converter exited with " + std::to_string(exit_code);
+	}
+}
+
+static void collectFiles(const MString& path, std::vector<MString>& files)
+{
+	if (MFileUtil::directoryExists(path))
+	{
+		for (const MString& name : MFileUtil::enumFilesInDirectory(path, L"*.mqo"))
+			files.push_back(MFileUtil::combinePath(path, name));
+	}
+	else
+	{
+		files.push_back(path);
+	}
+}
+
+static void writeReport(FILE* fh, const std::vector<BatchJob>& jobs)
+{
+	fprintf(fh, "file\tstatus\tinput_bytes\toutput_bytes\tload_ms\texport_ms\ttotal_ms\tworker\tmessage\n");
+	for (const BatchJob& job : jobs)
+	{
+		fprintf(fh, "%s\t%s\t%lld\t%lld\t%.3f\t%.3f\t%.3f\t%d\t%s\n",
+			job.input.toUtf8String().c_str(), job.ok ? "ok" : "error",
+			job.input_size, job.output_size, job.load_ms, job.export_ms, job.total_ms, job.worker, job.message.c_str());
+	}
+}
+
+int wmain(int argc, wchar_t** argv)
+{
+	if (argc == 4 && wcscmp(argv[1], L"--single") == 0)
+		return convertSingle(argv[2], argv[3]);
+
+	int job_num = GetParallelWorkerCount();
+	MString out_dir;
+	const wchar_t* report = nullptr;
+	std::vector<MString> files;
+	for (int i = 1; i < argc; i++)
+	{
+		if (wcscmp(argv[i], L"--jobs") == 0 && i + 1 < argc) job_num = _wtoi(argv[++i]);
+		else if (wcscmp(argv[i], L"--out") == 0 && i + 1 < argc) out_dir = argv[++i];
+		else if (wcscmp(argv[i], L"--report") == 0 && i + 1 < argc) report = argv[++i];
+		else if (argv[i][0] == L'-' && argv[i][1] == L'-')
+		{
+			fwprintf(stderr, L"Unknown option: %ls\n", argv[i]);
+			return 2;
+		}
+		else collectFiles(argv[i], files);
+	}
+	if (files.empty())
+	{
+		fwprintf(stderr, L"Usage: MQOBatch [--jobs N] [--out DIR] [--report FILE] FILE|DIR...\n");
+		return 2;
+	}
+	if (out_dir.length() > 0 && !MFileUtil::directoryExists(out_dir) && !MFileUtil::createDirectory(out_dir))
+	{
+		fwprintf(stderr, L"Cannot create %ls\n", out_dir.c_str());
+		return 2;
+	}
+
+	std::vector<BatchJob> jobs(files.size());
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		jobs[i].input = files[i];
+		jobs[i].input_size = getFileSize(files[i].c_str());
+		MString pmx = MFileUtil::changeExtension(files[i], L".pmx");
+		jobs[i].output = (out_dir.length() > 0) ? MFileUtil::combinePath(out_dir, MFileUtil::extractFilenameAndExtension(pmx)) : pmx;
+	}
+
+	// Deal the files from the largest, so that the small ones fill the gaps
+	// at the end.
+	std::vector<int> order(jobs.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = static_cast<int>(i);
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return jobs[a].input_size > jobs[b].input_size; });
+
+	job_num = std::max(1, std::min(job_num, static_cast<int>(jobs.size())));
+	BatchQueues queues(job_num);
+	for (size_t i = 0; i < order.size(); i++)
+		queues.Push(static_cast<int>(i) % job_num, order[i]);
+
+	wchar_t exe[MAX_PATH];
+	GetModuleFileNameW(nullptr, exe, MAX_PATH);
+	MString exe_path(exe);
+
+	std::mutex print_lock;
+	BatchClock::time_point start = BatchClock::now();
+	auto worker = [&](int w)
+	{
+		int index;
+		while (queues.Pop(w, index))
+		{
+			BatchJob& job = jobs[index];
+			job.worker = w;
+			runChild(exe_path, job);
+			job.done = true;
+
+			std::lock_guard<std::mutex> lock(print_lock);
+			if (job.ok)
+				wprintf(L"%ls: load %.1f ms, export %.1f ms, total %.1f ms\n", job.input.c_str(), job.load_ms, job.export_ms, job.total_ms);
+			else
+				wprintf(L"%ls: %hs\n", job.input.c_str(), job.message.c_str());
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int w = 1; w < job_num; w++)
+		threads.emplace_back(worker, w);
+	worker(0);
+	for (auto& th : threads)
+		th.join();
+	double wall_ms = elapsedMs(start);
+
+	int failed = 0;
+	double sum_ms = 0;
+	for (const BatchJob& job : jobs)
+	{
+		if (!job.ok)
+			failed++;
+		sum_ms += job.total_ms;
+	}
+	wprintf(L"%d files, %d failed, %d jobs, %.1f ms (%.1f ms sequential)\n",
+		static_cast<int>(jobs.size()), failed, job_num, wall_ms, sum_ms);
+
+	if (report != nullptr)
+	{
+		FILE* fh;
+		if (_wfopen_s(&fh, report, L"w") != 0)
+		{
+			fwprintf(stderr, L"Cannot open %ls\n", report);
+			return 2;
+		}
+		writeReport(fh, jobs);
+		fclose(fh);
+	}
+	return (failed == 0) ? 0 : 1;
+}
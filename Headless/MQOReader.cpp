@@ -0,0 +1,1061 @@
+﻿//---------------------------------------------------------------------------
+//
+//   MQOReader.cpp
+//
+//     .mqo/.mqx loader for the headless host.
+//     The .mqo is memory-mapped and scanned in place. Large vertex and face
+//    chunks are split at line boundaries and parsed on all cores straight
+//    into the arrays of MQHeadlessObject.
+//
+//---------------------------------------------------------------------------
+
+#include "MQOReader.h"
+#include "MFileUtil.h"
+#include "PMXReader.h"
+#include "ParallelHelper.h"
+#include "tinyxml2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define MQO_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+namespace {
+
+bool readFile(const MString& filename, std::vector<char>& data)
+{
+	FILE* fh;
+	if (_wfopen_s(&fh, filename.c_str(), L"rb") != 0)
+		return false;
+	_fseeki64(fh, 0, SEEK_END);
+	__int64 size = _ftelli64(fh);
+	_fseeki64(fh, 0, SEEK_SET);
+	data.resize(static_cast<size_t>(size) + 1);
+	size_t read = fread(data.data(), 1, static_cast<size_t>(size), fh);
+	fclose(fh);
+	data[read] = '\0';
+	data.resize(read + 1);
+	return read == static_cast<size_t>(size);
+}
+
+//---------------------------------------------------------------------------
+//  Scanner
+//    The mapped file is not null-terminated, so nothing reads beyond 'end'.
+//---------------------------------------------------------------------------
+
+inline bool isSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+inline bool isDigit(char c)
+{
+	return static_cast<unsigned char>(c - '0') < 10;
+}
+
+inline const char* skipSpaces(const char* p, const char* end)
+{
+	while (p < end && isSpace(*p))
+		p++;
+	return p;
+}
+
+#ifdef MQO_SSE2
+inline int firstBit(unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return static_cast<int>(index);
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+// First 'c' in [p, end), or end
+const char* findByte(const char* p, const char* end, char c)
+{
+#ifdef MQO_SSE2
+	const __m128i pattern = _mm_set1_epi8(c);
+	for (; end - p >= 16; p += 16)
+	{
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), pattern));
+		if (mask != 0)
+			return p + firstBit(mask);
+	}
+#endif
+	for (; p < end; p++)
+	{
+		if (*p == c)
+			return p;
+	}
+	return end;
+}
+
+// Number of 'c' in [p, end)
+size_t countByte(const char* p, const char* end, char c)
+{
+	size_t count = 0;
+#ifdef MQO_SSE2
+	const __m128i pattern = _mm_set1_epi8(c);
+	while (end - p >= 16)
+	{
+		// The byte counters wrap after 255 blocks
+		const char* block_end = p + std::min<size_t>((end - p) / 16, 255) * 16;
+		__m128i acc = _mm_setzero_si128();
+		for (; p < block_end; p += 16)
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), pattern));
+		__m128i sum = _mm_sad_epu8(acc, _mm_setzero_si128());
+		count += static_cast<size_t>(_mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4));
+	}
+#endif
+	for (; p < end; p++)
+		count += (*p == c);
+	return count;
+}
+
+const double pow10_table[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+	1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Parse a decimal number at p.
+// Returns the position after the number, or p if there is no number.
+// Numbers the format writes ("-12.3456") are converted from an integer
+// mantissa and a power of ten, which is exact below 2^53 and 1e22.
+// Others fall back to strtod.
+const char* parseFloat(const char* p, const char* end, float& value)
+{
+	const char* start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = (*p == '-');
+		p++;
+	}
+
+	unsigned long long mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool any = false;
+	for (; p < end && isDigit(*p); p++)
+	{
+		any = true;
+		mantissa = mantissa * 10 + (*p - '0');
+		if (mantissa != 0)
+			digits++;
+		if (digits > 18)
+			break;
+	}
+	if (p < end && *p == '.' && digits <= 18)
+	{
+		for (p++; p < end && isDigit(*p); p++)
+		{
+			any = true;
+			mantissa = mantissa * 10 + (*p - '0');
+			exponent--;
+			if (mantissa != 0)
+				digits++;
+			if (digits > 18)
+				break;
+		}
+	}
+	if (!any)
+		return start;
+
+	bool exact = digits <= 18 && !(p < end && isDigit(*p)) && mantissa <= (1ULL << 53);
+	if (exact && p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char* q = p + 1;
+		bool exp_negative = false;
+		if (q < end && (*q == '-' || *q == '+'))
+		{
+			exp_negative = (*q == '-');
+			q++;
+		}
+		if (q < end && isDigit(*q))
+		{
+			int e = 0;
+			for (; q < end && isDigit(*q) && e < 1000; q++)
+				e = e * 10 + (*q - '0');
+			exact = !(q < end && isDigit(*q));
+			exponent += exp_negative ? -e : e;
+			p = q;
+		}
+	}
+	if (exact && exponent >= -22 && exponent <= 22)
+	{
+		double d = static_cast<double>(mantissa);
+		d = (exponent < 0) ? d / pow10_table[-exponent] : d * pow10_table[exponent];
+		value = static_cast<float>(negative ? -d : d);
+		return p;
+	}
+
+	// Slow path on a null-terminated copy of the token
+	const char* token_end = start;
+	while (token_end < end && (isDigit(*token_end) || *token_end == '.' || *token_end == '-' || *token_end == '+' || *token_end == 'e' || *token_end == 'E'))
+		token_end++;
+	std::string token(start, token_end);
+	char* next;
+	double d = strtod(token.c_str(), &next);
+	if (next == token.c_str())
+		return start;
+	value = static_cast<float>(d);
+	return start + (next - token.c_str());
+}
+
+// Parse a decimal integer at p.
+// Returns the position after the number, or p if there is no number.
+const char* parseInt(const char* p, const char* end, long long& value)
+{
+	const char* start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = (*p == '-');
+		p++;
+	}
+	if (p >= end || !isDigit(*p))
+		return start;
+	long long v = 0;
+	for (; p < end && isDigit(*p); p++)
+	{
+		if (v < 100000000000000000LL)
+			v = v * 10 + (*p - '0');
+	}
+	value = negative ? -v : v;
+	return p;
+}
+
+inline const char* parseInt(const char* p, const char* end, int& value)
+{
+	long long v = 0;
+	const char* next = parseInt(p, end, v);
+	value = static_cast<int>(std::max<long long>(std::min<long long>(v, INT_MAX), INT_MIN));
+	return next;
+}
+
+// Lines of a chunk handed to a worker
+struct MQOPiece
+{
+	const char* begin;
+	const char* end;
+	size_t first;       // index of the first item
+	size_t count;       // number of items
+	size_t point_first; // index of the first face point
+	size_t point_count; // number of face points
+	const char* error_pos;
+	const char* error;
+
+	MQOPiece() : begin(nullptr), end(nullptr), first(0), count(0), point_first(0), point_count(0), error_pos(nullptr), error(nullptr) {}
+
+	bool Fail(const char* pos, const char* message)
+	{
+		error_pos = pos;
+		error = message;
+		return false;
+	}
+};
+
+// Split [begin, end) into pieces at line boundaries.
+// Chunks below about 1MB per worker are not worth the threads.
+void splitLines(const char* begin, const char* end, std::vector<MQOPiece>& pieces)
+{
+	const size_t min_piece_size = 1 << 20;
+	size_t size = end - begin;
+	size_t num = std::min<size_t>(GetParallelWorkerCount() * 4, std::max<size_t>(size / min_piece_size, 1));
+
+	pieces.clear();
+	const char* p = begin;
+	for (size_t i = 1; i <= num && p < end; i++)
+	{
+		const char* split = (i == num) ? end : begin + size * i / num;
+		if (split < p)
+			continue;
+		split = std::min(findByte(split, end, '\n') + 1, end);
+		if (i == num)
+			split = end;
+		MQOPiece piece;
+		piece.begin = p;
+		piece.end = split;
+		pieces.push_back(piece);
+		p = split;
+	}
+}
+
+// Next line in the piece without the leading spaces.
+// Returns false at the end of the piece.
+inline bool nextPieceLine(const char*& p, const char* end, const char*& line, const char*& line_end)
+{
+	while (p < end)
+	{
+		const char* eol = findByte(p, end, '\n');
+		line = skipSpaces(p, eol);
+		line_end = eol;
+		p = (eol < end) ? eol + 1 : end;
+		if (line < line_end)
+			return true;
+	}
+	return false;
+}
+
+// Line-based parser of the text format.
+// Every statement of the format fits in one line, and chunks end with a
+// line of '}'.
+class MQOParser
+{
+public:
+	MQOParser(const char* data, const char* end, MQHeadlessDocument& doc)
+		: m_next(data), m_end(end), m_line_no(0), m_doc(doc) {}
+
+	bool Parse();
+
+	const std::string& GetError() const { return m_error; }
+	const std::string& GetIncludeXml() const { return m_include_xml; }
+	// Vertex unique IDs of each object (empty: index + 1)
+	const std::vector<std::vector<UINT>>& GetVertexUIDs() const { return m_vertex_uid; }
+
+private:
+	const char* m_next;
+	const char* m_end;
+	const char* m_line;     // current line without the leading spaces
+	const char* m_line_end; // without the trailing spaces
+	int m_line_no;
+	MQHeadlessDocument& m_doc;
+	std::string m_error;
+	std::string m_include_xml;
+	std::vector<std::vector<UINT>> m_vertex_uid;
+	std::vector<MQOPiece> m_pieces;
+
+	bool nextLine();
+	bool lineStartsWith(const char* word) const;
+	bool lineEndsWithBrace() const { return m_line_end > m_line && m_line_end[-1] == '{'; }
+	bool isChunkEnd() const { return m_line_end - m_line == 1 && m_line[0] == '}'; }
+	bool fail(const char* message);
+
+	bool skipChunk();
+	bool readChunkBody(const char*& body, const char*& body_end);
+	bool failInPieces(const char* body, int body_line);
+	bool parseMaterials();
+	bool parseObject();
+	bool parseVertices(MQHeadlessObject* obj);
+	bool parseFaces(MQHeadlessObject* obj);
+	bool parseVertexAttr(std::vector<UINT>& uid);
+
+	static bool readQuoted(const char*& p, const char* end, std::string& str);
+	static const char* findArgs(const char* begin, const char* end, const char* key, const char*& args_end);
+	static int readFloats(const char* p, const char* end, float* values, int max_num);
+	static bool parseFaceLine(MQOPiece& piece, const char* line, const char* line_end, int count, int vert_num, int mat_num,
+		int* points, MQCoordinate* uv, int& material);
+};
+
+bool MQOParser::nextLine()
+{
+	while (m_next < m_end)
+	{
+		const char* begin = m_next;
+		const char* eol = findByte(begin, m_end, '\n');
+		m_next = (eol < m_end) ? eol + 1 : m_end;
+		m_line_no++;
+
+		begin = skipSpaces(begin, eol);
+		const char* e = eol;
+		while (e > begin && isSpace(e[-1]))
+			e--;
+		if (begin == e)
+			continue;
+		m_line = begin;
+		m_line_end = e;
+		return true;
+	}
+	return false;
+}
+
+bool MQOParser::lineStartsWith(const char* word) const
+{
+	size_t len = strlen(word);
+	if (static_cast<size_t>(m_line_end - m_line) < len || memcmp(m_line, word, len) != 0)
+		return false;
+	return m_line + len == m_line_end || isSpace(m_line[len]) || m_line[len] == '{';
+}
+
+bool MQOParser::fail(const char* message)
+{
+	char buf[64];
+	sprintf_s(buf, "line %d: ", m_line_no);
+	m_error = std::string(buf) + message;
+	return false;
+}
+
+bool MQOParser::skipChunk()
+{
+	int depth = 1;
+	while (depth > 0)
+	{
+		if (!nextLine())
+			return fail("unexpected end of file");
+		if (isChunkEnd())
+			depth--;
+		else if (lineEndsWithBrace())
+			depth++;
+	}
+	return true;
+}
+
+// Lines of a chunk without nested chunks, up to the line of '}'.
+// The line of '}' is read as the current line.
+bool MQOParser::readChunkBody(const char*& body, const char*& body_end)
+{
+	body = m_next;
+	const char* close = findByte(m_next, m_end, '}');
+	if (close == m_end)
+		return fail("unexpected end of file");
+	body_end = close;
+	while (body_end > body && body_end[-1] != '\n')
+		body_end--;
+	m_line_no += static_cast<int>(countByte(body, body_end, '\n'));
+	m_next = body_end;
+	if (!nextLine() || !isChunkEnd())
+		return fail("unexpected '}'");
+	return true;
+}
+
+bool MQOParser::failInPieces(const char* body, int body_line)
+{
+	for (const MQOPiece& piece : m_pieces)
+	{
+		if (piece.error != nullptr)
+		{
+			m_line_no = body_line + static_cast<int>(countByte(body, piece.error_pos, '\n'));
+			return fail(piece.error);
+		}
+	}
+	return true;
+}
+
+bool MQOParser::readQuoted(const char*& p, const char* end, std::string& str)
+{
+	p = skipSpaces(p, end);
+	if (p >= end || *p != '"')
+		return false;
+	const char* q = findByte(p + 1, end, '"');
+	if (q == end)
+		return false;
+	str.assign(p + 1, q);
+	p = q + 1;
+	return true;
+}
+
+// Find "key(" in [begin, end) and return the position after '('.
+const char* MQOParser::findArgs(const char* begin, const char* end, const char* key, const char*& args_end)
+{
+	size_t len = strlen(key);
+	for (const char* p = begin; p + len < end; p++)
+	{
+		if (*p == '"')
+		{
+			// Skip quoted names and file names
+			const char* q = findByte(p + 1, end, '"');
+			if (q == end)
+				return nullptr;
+			p = q;
+			continue;
+		}
+		if (memcmp(p, key, len) == 0 && p[len] == '(' && (p == begin || isSpace(p[-1])))
+		{
+			const char* args = p + len + 1;
+			const char* close = args;
+			bool quoted = false;
+			while (close < end && (quoted || *close != ')'))
+			{
+				if (*close == '"')
+					quoted = !quoted;
+				close++;
+			}
+			args_end = close;
+			return args;
+		}
+	}
+	return nullptr;
+}
+
+int MQOParser::readFloats(const char* p, const char* end, float* values, int max_num)
+{
+	int num = 0;
+	while (num < max_num)
+	{
+		p = skipSpaces(p, end);
+		const char* next = parseFloat(p, end, values[num]);
+		if (next == p)
+			break;
+		num++;
+		p = next;
+	}
+	return num;
+}
+
+bool MQOParser::Parse()
+{
+	if (!nextLine() || !lineStartsWith("Metasequoia"))
+		return fail("not a Metasequoia document");
+	if (!nextLine() || !lineStartsWith("Format"))
+		return fail("no format line");
+	if (std::string(m_line, m_line_end).find("Text") == std::string::npos)
+		return fail("only the text format is supported");
+
+	while (nextLine())
+	{
+		if (lineStartsWith("Eof"))
+			return true;
+		if (lineStartsWith("Material"))
+		{
+			if (!parseMaterials())
+				return false;
+		}
+		else if (lineStartsWith("Object"))
+		{
+			if (!parseObject())
+				return false;
+		}
+		else if (lineStartsWith("IncludeXml"))
+		{
+			const char* p = m_line + 10;
+			readQuoted(p, m_line_end, m_include_xml);
+		}
+		else if (lineEndsWithBrace())
+		{
+			if (!skipChunk())
+				return false;
+		}
+	}
+	return true;
+}
+
+bool MQOParser::parseMaterials()
+{
+	if (!lineEndsWithBrace())
+		return fail("Material without '{'");
+	while (nextLine() && !isChunkEnd())
+	{
+		const char* p = m_line;
+		std::string name;
+		if (!readQuoted(p, m_line_end, name))
+			return fail("material without a name");
+		MQHeadlessMaterial* mat = m_doc.AddMaterial(name.c_str());
+
+		const char* e;
+		const char* args;
+		float v[4];
+		if ((args = findArgs(p, m_line_end, "shader", e)) != nullptr && readFloats(args, e, v, 1) == 1)
+			mat->shader = static_cast<int>(v[0]);
+		if ((args = findArgs(p, m_line_end, "col", e)) != nullptr && readFloats(args, e, v, 4) == 4)
+		{
+			mat->color = MQColor(v[0], v[1], v[2]);
+			mat->alpha = v[3];
+		}
+		if ((args = findArgs(p, m_line_end, "dif", e)) != nullptr && readFloats(args, e, v, 1) == 1)
+			mat->diffuse = v[0];
+		if ((args = findArgs(p, m_line_end, "power", e)) != nullptr && readFloats(args, e, v, 1) == 1)
+			mat->power = v[0];
+
+		// Scalar factors of the material color, or colors of their own (Ver 1.1)
+		struct { const char* scalar; const char* color; MQColor* dst; } colors[] = {
+			{ "amb", "amb_col", &mat->ambient_color },
+			{ "emi", "emi_col", &mat->emission_color },
+			{ "spc", "spc_col", &mat->specular_color },
+		};
+		for (auto& c : colors)
+		{
+			if ((args = findArgs(p, m_line_end, c.color, e)) != nullptr && readFloats(args, e, v, 3) == 3)
+				*c.dst = MQColor(v[0], v[1], v[2]);
+			else if ((args = findArgs(p, m_line_end, c.scalar, e)) != nullptr && readFloats(args, e, v, 1) == 1)
+				*c.dst = MQColor(mat->color.r * v[0], mat->color.g * v[0], mat->color.b * v[0]);
+		}
+		if ((args = findArgs(p, m_line_end, "tex", e)) != nullptr)
+			readQuoted(args, e, mat->texture);
+	}
+	return isChunkEnd() ? true : fail("unexpected end of file in Material");
+}
+
+bool MQOParser::parseObject()
+{
+	const char* p = m_line + 6;
+	std::string name;
+	if (!readQuoted(p, m_line_end, name) || !lineEndsWithBrace())
+		return fail("Object without a name");
+	MQHeadlessObject* obj = m_doc.AddObject(name.c_str());
+	m_vertex_uid.resize(m_doc.objects.size());
+	std::vector<UINT>& uid = m_vertex_uid.back();
+
+	while (nextLine() && !isChunkEnd())
+	{
+		float v[1];
+		if (lineStartsWith("vertex"))
+		{
+			if (!parseVertices(obj))
+				return false;
+		}
+		else if (lineStartsWith("BVertex"))
+		{
+			return fail("binary vertices (BVertex) are not supported");
+		}
+		else if (lineStartsWith("face"))
+		{
+			if (!parseFaces(obj))
+				return false;
+		}
+		else if (lineStartsWith("vertexattr"))
+		{
+			if (!parseVertexAttr(uid))
+				return false;
+		}
+		else if (lineStartsWith("visible"))
+		{
+			if (readFloats(m_line + 7, m_line_end, v, 1) == 1)
+				obj->visible = (v[0] != 0) ? 0xFFFFFFFF : 0;
+		}
+		else if (lineStartsWith("shading"))
+		{
+			if (readFloats(m_line + 7, m_line_end, v, 1) == 1)
+				obj->shading = static_cast<int>(v[0]);
+		}
+		else if (lineStartsWith("facet"))
+		{
+			if (readFloats(m_line + 5, m_line_end, v, 1) == 1)
+				obj->smooth_angle = v[0];
+		}
+		else if (lineEndsWithBrace())
+		{
+			if (!skipChunk())
+				return false;
+		}
+	}
+	return isChunkEnd() ? true : fail("unexpected end of file in Object");
+}
+
+bool MQOParser::parseVertices(MQHeadlessObject* obj)
+{
+	if (!lineEndsWithBrace())
+		return fail("vertex without '{'");
+	int body_line = m_line_no + 1;
+	const char* body;
+	const char* body_end;
+	if (!readChunkBody(body, body_end))
+		return false;
+	splitLines(body, body_end, m_pieces);
+
+	// Count the lines of each piece to place its vertices
+	ParallelFor(static_cast<int>(m_pieces.size()), [&](int i)
+	{
+		MQOPiece& piece = m_pieces[i];
+		const char* p = piece.begin;
+		const char* line;
+		const char* line_end;
+		while (nextPieceLine(p, piece.end, line, line_end))
+			piece.count++;
+	});
+	size_t first = obj->vertices.size();
+	for (MQOPiece& piece : m_pieces)
+	{
+		piece.first = first;
+		first += piece.count;
+	}
+	obj->vertices.resize(first);
+
+	MQPoint* vertices = obj->vertices.data();
+	ParallelFor(static_cast<int>(m_pieces.size()), [&](int i)
+	{
+		MQOPiece& piece = m_pieces[i];
+		const char* p = piece.begin;
+		const char* line;
+		const char* line_end;
+		for (size_t v = piece.first; nextPieceLine(p, piece.end, line, line_end); v++)
+		{
+			float xyz[3];
+			if (readFloats(line, line_end, xyz, 3) != 3)
+			{
+				piece.Fail(line, "broken vertex");
+				return;
+			}
+			vertices[v] = MQPoint(xyz[0], xyz[1], xyz[2]);
+		}
+	});
+	return failInPieces(body, body_line);
+}
+
+// Parse "V(...) M(m) UV(...)" after the point count of a face line.
+// Other arguments (COL, CRS, UID) are skipped.
+bool MQOParser::parseFaceLine(MQOPiece& piece, const char* p, const char* end, int count, int vert_num, int mat_num,
+	int* points, MQCoordinate* uv, int& material)
+{
+	bool has_points = false;
+	material = -1;
+	for (p = skipSpaces(p, end); p < end; p = skipSpaces(p, end))
+	{
+		const char* name = p;
+		while (p < end && *p != '(' && !isSpace(*p))
+			p++;
+		if (p >= end || *p != '(')
+			return piece.Fail(name, "broken face");
+		size_t len = p - name;
+		const char* args = p + 1;
+		const char* args_end = findByte(args, end, ')');
+		if (args_end == end)
+			return piece.Fail(name, "broken face");
+		p = args_end + 1;
+
+		if (len == 1 && name[0] == 'V')
+		{
+			const char* q = args;
+			for (int i = 0; i < count; i++)
+			{
+				q = skipSpaces(q, args_end);
+				const char* next = parseInt(q, args_end, points[i]);
+				if (next == q)
+					return piece.Fail(name, "face without V()");
+				if (points[i] < 0 || points[i] >= vert_num)
+					return piece.Fail(name, "face refers to a vertex out of range");
+				q = next;
+			}
+			has_points = true;
+		}
+		else if (len == 1 && name[0] == 'M')
+		{
+			parseInt(skipSpaces(args, args_end), args_end, material);
+			if (material < -1 || material >= mat_num)
+				return piece.Fail(name, "face refers to a material out of range");
+		}
+		else if (len == 2 && name[0] == 'U' && name[1] == 'V')
+		{
+			float values[2];
+			const char* q = args;
+			for (int i = 0; i < count; i++)
+			{
+				q = skipSpaces(q, args_end);
+				const char* next = parseFloat(q, args_end, values[0]);
+				next = skipSpaces(next, args_end);
+				const char* next2 = parseFloat(next, args_end, values[1]);
+				if (next == q || next2 == next)
+					break;
+				uv[i] = MQCoordinate(values[0], values[1]);
+				q = next2;
+			}
+		}
+	}
+	return has_points ? true : piece.Fail(end, "face without V()");
+}
+
+bool MQOParser::parseFaces(MQHeadlessObject* obj)
+{
+	if (!lineEndsWithBrace())
+		return fail("face without '{'");
+	int body_line = m_line_no + 1;
+	const char* body;
+	const char* body_end;
+	if (!readChunkBody(body, body_end))
+		return false;
+	splitLines(body, body_end, m_pieces);
+
+	// Count the faces and their points of each piece.
+	// Faces without points are skipped.
+	ParallelFor(static_cast<int>(m_pieces.size()), [&](int i)
+	{
+		MQOPiece& piece = m_pieces[i];
+		const char* p = piece.begin;
+		const char* line;
+		const char* line_end;
+		while (nextPieceLine(p, piece.end, line, line_end))
+		{
+			int count;
+			if (parseInt(line, line_end, count) == line)
+			{
+				piece.Fail(line, "broken face");
+				return;
+			}
+			if (count > 0)
+			{
+				piece.count++;
+				piece.point_count += count;
+			}
+		}
+	});
+	if (!failInPieces(body, body_line))
+		return false;
+
+	size_t first = obj->face_material.size();
+	size_t point_first = obj->face_points.size();
+	for (MQOPiece& piece : m_pieces)
+	{
+		piece.first = first;
+		piece.point_first = point_first;
+		first += piece.count;
+		point_first += piece.point_count;
+	}
+	obj->face_begin.resize(first + 1);
+	obj->face_material.resize(first);
+	obj->face_points.resize(point_first);
+	obj->face_uv.resize(point_first, MQCoordinate(0, 0));
+
+	int vert_num = static_cast<int>(obj->vertices.size());
+	int mat_num = static_cast<int>(m_doc.materials.size());
+	ParallelFor(static_cast<int>(m_pieces.size()), [&](int i)
+	{
+		MQOPiece& piece = m_pieces[i];
+		const char* p = piece.begin;
+		const char* line;
+		const char* line_end;
+		size_t f = piece.first;
+		size_t point = piece.point_first;
+		while (nextPieceLine(p, piece.end, line, line_end))
+		{
+			int count;
+			const char* args = parseInt(line, line_end, count);
+			if (count <= 0)
+				continue;
+			if (!parseFaceLine(piece, args, line_end, count, vert_num, mat_num, &obj->face_points[point], &obj->face_uv[point], obj->face_material[f]))
+				return;
+			point += count;
+			obj->face_begin[++f] = static_cast<int>(point);
+		}
+	});
+	return failInPieces(body, body_line);
+}
+
+bool MQOParser::parseVertexAttr(std::vector<UINT>& uid)
+{
+	while (nextLine() && !isChunkEnd())
+	{
+		if (lineStartsWith("uid") && lineEndsWithBrace())
+		{
+			while (nextLine() && !isChunkEnd())
+			{
+				long long value = 0;
+				parseInt(m_line, m_line_end, value);
+				uid.push_back(static_cast<UINT>(value));
+			}
+		}
+		else if (lineEndsWithBrace())
+		{
+			if (!skipChunk())
+				return false;
+		}
+	}
+	return isChunkEnd() ? true : fail("unexpected end of file in vertexattr");
+}
+
+//---------------------------------------------------------------------------
+//  .mqx
+//---------------------------------------------------------------------------
+
+MQPoint getPoint(const tinyxml2::XMLElement* elem, const char* x, const char* y, const char* z)
+{
+	return MQPoint(elem->FloatAttribute(x), elem->FloatAttribute(y), elem->FloatAttribute(z));
+}
+
+std::wstring toWide(const char* utf8)
+{
+	return (utf8 != nullptr) ? std::wstring(MString::fromUtf8String(utf8).c_str()) : std::wstring();
+}
+
+const tinyxml2::XMLElement* findPlugin(const tinyxml2::XMLElement* root, const char* name)
+{
+	for (const tinyxml2::XMLElement* elem = root->FirstChildElement(); elem != nullptr; elem = elem->NextSiblingElement())
+	{
+		if (strncmp(elem->Name(), "Plugin.", 7) == 0 && strstr(elem->Name(), name) != nullptr)
+			return elem;
+	}
+	return nullptr;
+}
+
+void loadBones(const tinyxml2::XMLElement* plugin, MQHeadlessDocument& doc, const std::vector<std::vector<UINT>>& vertex_uid)
+{
+	const tinyxml2::XMLElement* set = plugin->FirstChildElement("BoneSet");
+	if (set == nullptr)
+		return;
+
+	// Weights per object and vertex: (vertex index, bone, weight)
+	struct Weight
+	{
+		int vertex;
+		UINT bone;
+		float weight;
+		bool operator<(const Weight& w) const { return vertex < w.vertex; }
+	};
+	std::vector<std::vector<Weight>> weights(doc.objects.size());
+	std::vector<std::unordered_map<UINT, int>> uid_index(doc.objects.size());
+	for (size_t oi = 0; oi < vertex_uid.size(); oi++)
+	{
+		for (size_t vi = 0; vi < vertex_uid[oi].size(); vi++)
+			uid_index[oi][vertex_uid[oi][vi]] = static_cast<int>(vi);
+	}
+
+	// Bones must be added after their parents
+	std::vector<MQHeadlessBone> bones;
+	for (const tinyxml2::XMLElement* elem = set->FirstChildElement("Bone"); elem != nullptr; elem = elem->NextSiblingElement("Bone"))
+	{
+		MQHeadlessBone bone;
+		bone.id = elem->UnsignedAttribute("id");
+		if (bone.id == 0)
+			continue;
+		bone.name = toWide(elem->Attribute("name"));
+		bone.root = getPoint(elem, "rtX", "rtY", "rtZ");
+		bone.tip = getPoint(elem, "tpX", "tpY", "tpZ");
+		bone.dummy = elem->IntAttribute("isDummy") != 0;
+		const tinyxml2::XMLElement* parent = elem->FirstChildElement("P");
+		if (parent != nullptr)
+			bone.parent = parent->UnsignedAttribute("id");
+		bones.push_back(bone);
+
+		for (const tinyxml2::XMLElement* w = elem->FirstChildElement("W"); w != nullptr; w = w->NextSiblingElement("W"))
+		{
+			int oi = w->IntAttribute("oi") - 1;
+			UINT vuid = w->UnsignedAttribute("vi");
+			if (oi < 0 || oi >= static_cast<int>(doc.objects.size()))
+				continue;
+			int vi;
+			if (uid_index[oi].empty())
+			{
+				vi = static_cast<int>(vuid) - 1;
+			}
+			else
+			{
+				auto it = uid_index[oi].find(vuid);
+				vi = (it != uid_index[oi].end()) ? it->second : -1;
+			}
+			if (vi < 0 || vi >= static_cast<int>(doc.objects[oi]->vertices.size()))
+				continue;
+			Weight weight = { vi, bone.id, w->FloatAttribute("w") };
+			weights[oi].push_back(weight);
+		}
+	}
+
+	std::map<UINT, size_t> remaining;
+	for (size_t i = 0; i < bones.size(); i++)
+		remaining[bones[i].id] = i;
+	while (!remaining.empty())
+	{
+		bool added = false;
+		for (auto it = remaining.begin(); it != remaining.end();)
+		{
+			const MQHeadlessBone& bone = bones[it->second];
+			if (bone.parent == 0 || doc.FindBone(bone.parent) != nullptr || remaining.find(bone.parent) == remaining.end())
+			{
+				MQHeadlessBone copy = bone;
+				if (copy.parent != 0 && doc.FindBone(copy.parent) == nullptr)
+					copy.parent = 0; // parent not in the file
+				doc.AddBone(copy);
+				it = remaining.erase(it);
+				added = true;
+			}
+			else
+			{
+				++it;
+			}
+		}
+		if (!added)
+			break; // parent loop
+	}
+
+	for (size_t oi = 0; oi < weights.size(); oi++)
+	{
+		std::vector<Weight>& list = weights[oi];
+		if (list.empty())
+			continue;
+		std::stable_sort(list.begin(), list.end());
+		std::vector<UINT> ids;
+		std::vector<float> values;
+		size_t i = 0;
+		for (int vi = 0; vi < static_cast<int>(doc.objects[oi]->vertices.size()); vi++)
+		{
+			ids.clear();
+			values.clear();
+			for (; i < list.size() && list[i].vertex == vi; i++)
+			{
+				ids.push_back(list[i].bone);
+				values.push_back(list[i].weight);
+			}
+			doc.objects[oi]->AddVertexWeights(vi, static_cast<int>(ids.size()), ids.data(), values.data());
+		}
+	}
+}
+
+void loadMorphs(const tinyxml2::XMLElement* plugin, MQHeadlessDocument& doc)
+{
+	const tinyxml2::XMLElement* set = plugin->FirstChildElement("MorphSet");
+	if (set == nullptr)
+		return;
+
+	// The names in the .mqo are in the code page of the system, and those in
+	// the .mqx are UTF-8, so both are compared as wide strings
+	std::map<std::wstring, int> object_index;
+	for (size_t i = 0; i < doc.objects.size(); i++)
+		object_index[MString::fromAnsiString(doc.objects[i]->name.c_str()).c_str()] = static_cast<int>(i);
+
+	for (const tinyxml2::XMLElement* list = set->FirstChildElement("TargetList"); list != nullptr; list = list->NextSiblingElement("TargetList"))
+	{
+		const char* base = list->Attribute("base");
+		auto base_it = (base != nullptr) ? object_index.find(MString::fromUtf8String(base).c_str()) : object_index.end();
+		if (base_it == object_index.end())
+			continue;
+		MQHeadlessMorph morph;
+		morph.base = base_it->second;
+		for (const tinyxml2::XMLElement* t = list->FirstChildElement("Target"); t != nullptr; t = t->NextSiblingElement("Target"))
+		{
+			const char* name = t->Attribute("name");
+			auto it = (name != nullptr) ? object_index.find(MString::fromUtf8String(name).c_str()) : object_index.end();
+			if (it != object_index.end())
+				morph.targets.push_back(std::make_pair(it->second, static_cast<MorphType>(std::min(std::max(t->IntAttribute("param"), 0), static_cast<int>(MORPH_OTHER)))));
+		}
+		if (!morph.targets.empty())
+			doc.morphs.push_back(morph);
+	}
+}
+
+} // namespace
+
+bool LoadMQO(const MString& filename, MQHeadlessDocument& doc, MString& error)
+{
+	PMXFileMapping mapping;
+	if (!mapping.Open(filename))
+	{
+		error = MString::format(L"Cannot read %s", filename.c_str());
+		return false;
+	}
+
+	const char* data = reinterpret_cast<const char*>(mapping.GetData());
+	MQOParser parser(data, data + mapping.GetSize(), doc);
+	if (!parser.Parse())
+	{
+		error = MString::format(L"%s: %s", filename.c_str(), MString::fromAnsiString(parser.GetError().c_str()).c_str());
+		return false;
+	}
+	doc.texture_dir = MFileUtil::extractDirectory(filename);
+
+	if (!parser.GetIncludeXml().empty())
+	{
+		// The object and target names in the .mqx are UTF-8
+		MString mqx = MFileUtil::combinePath(doc.texture_dir, MString::fromAnsiString(parser.GetIncludeXml().c_str()));
+		std::vector<char> xml;
+		tinyxml2::XMLDocument xdoc;
+		if (readFile(mqx, xml) && xdoc.Parse(xml.data(), xml.size() - 1) == tinyxml2::XML_SUCCESS)
+		{
+			const tinyxml2::XMLElement* root = xdoc.RootElement();
+			const tinyxml2::XMLElement* plugin;
+			if (root != nullptr && (plugin = findPlugin(root, "71F282AB")) != nullptr)
+				loadBones(plugin, doc, parser.GetVertexUIDs());
+			if (root != nullptr && (plugin = findPlugin(root, "C452C6DB")) != nullptr)
+				loadMorphs(plugin, doc);
+		}
+	}
+	return true;
+}
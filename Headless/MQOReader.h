@@ -0,0 +1,18 @@
+﻿#pragma once
+
+#include "MQHeadlessHost.h"
+
+// Load a Metasequoia text document (.mqo) into a headless document.
+//
+// Read from the .mqo:
+//   Material: name, shader, col, dif, amb, emi, spc, power, tex,
+//             amb_col, emi_col, spc_col
+//   Object:   name, visible, shading, facet, vertex, face (V, M, UV),
+//             vertexattr/uid
+// Bones with their weights and the morph setup are read from the .mqx file
+// referred by IncludeXml, if any:
+//   BoneSet/Bone: id, name, rt*, tp*, isDummy, P, W (oi: object index from 1,
+//                 vi: vertex unique ID)
+//   MorphSet/TargetList: base, Target name
+// Other chunks are skipped. The binary vertex chunk (BVertex) is not supported.
+bool LoadMQO(const MString& filename, MQHeadlessDocument& doc, MString& error);
@@ -0,0 +1,229 @@
+﻿//---------------------------------------------------------------------------
+//
+//   MQSceneGenerator.cpp
+//
+//     Synthetic scenes for the export benchmark.
+//
+//---------------------------------------------------------------------------
+
+#include "MQSceneGenerator.h"
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <string>
+
+MQSceneParam::MQSceneParam()
+{
+	SetPreset("small");
+}
+
+bool MQSceneParam::SetPreset(const char* name)
+{
+	if (strcmp(name, "small") == 0)
+	{
+		object_count = 2;
+		grid_size = 64;
+		uv_island = 16;
+		material_count = 8;
+		texture_count = 4;
+		bone_count = 50;
+		chain_length = 5;
+		ik_count = 2;
+		ik_chain_length = 2;
+		weight_min = 1;
+		weight_max = 4;
+		morph_count = 10;
+		morph_grid_size = 32;
+	}
+	else if (strcmp(name, "medium") == 0)
+	{
+		object_count = 4;
+		grid_size = 256;
+		uv_island = 32;
+		material_count = 50;
+		texture_count = 20;
+		bone_count = 300;
+		chain_length = 6;
+		ik_count = 8;
+		ik_chain_length = 3;
+		weight_min = 2;
+		weight_max = 8;
+		morph_count = 100;
+		morph_grid_size = 64;
+	}
+	else if (strcmp(name, "large") == 0)
+	{
+		// 8 x 360 x 360 = 1,036,800 vertices before the UV seams are split
+		object_count = 8;
+		grid_size = 360;
+		uv_island = 40;
+		material_count = 200;
+		texture_count = 100;
+		bone_count = 1000;
+		chain_length = 8;
+		ik_count = 20;
+		ik_chain_length = 3;
+		weight_min = 4;
+		weight_max = 16;
+		morph_count = 300;
+		morph_grid_size = 100;
+	}
+	else
+	{
+		return false;
+	}
+	seed = 1;
+	return true;
+}
+
+static void generateMaterials(const MQSceneParam& param, MQHeadlessDocument& doc)
+{
+	for (int i = 0; i < param.material_count; i++)
+	{
+		std::string name = "mat" + std::to_string(i);
+		MQHeadlessMaterial* mat = doc.AddMaterial(name.c_str());
+		mat->color = MQColor((i % 7) / 6.0f, (i % 5) / 4.0f, (i % 3) / 2.0f);
+		if (i < param.texture_count)
+			mat->texture = "tex" + std::to_string(i) + ".bmp";
+	}
+}
+
+static void generateBones(const MQSceneParam& param, MQHeadlessDocument& doc, std::mt19937& rng)
+{
+	int chain_length = std::max(param.chain_length, 1);
+	std::vector<UINT> ids;
+	ids.reserve(param.bone_count);
+
+	int chain = 0;
+	while (static_cast<int>(ids.size()) < param.bone_count)
+	{
+		// Each chain starts from a random bone of the previous chains
+		UINT parent = ids.empty() ? 0 : ids[std::uniform_int_distribution<size_t>(0, ids.size() - 1)(rng)];
+		MQPoint root = (parent != 0) ? doc.FindBone(parent)->tip : MQPoint(0, 0, 0);
+		MQPoint dir(static_cast<float>(chain % 3) - 1.0f, 1.0f, static_cast<float>(chain % 5) * 0.25f - 0.5f);
+
+		int length = std::min(chain_length, param.bone_count - static_cast<int>(ids.size()));
+		for (int n = 0; n < length; n++)
+		{
+			MQHeadlessBone bone;
+			bone.parent = parent;
+			bone.name = L"bone" + std::to_wstring(ids.size());
+			bone.tip_name = bone.name + L"_tip";
+			bone.root = root;
+			bone.tip = root + dir;
+			bone.movable = (parent == 0);
+			if (n == length - 1 && chain < param.ik_count && length > param.ik_chain_length)
+			{
+				bone.ikchain = param.ik_chain_length;
+				bone.ik_name = L"IK" + std::to_wstring(chain);
+				bone.ik_tip_name = bone.ik_name + L"_tip";
+			}
+			parent = doc.AddBone(bone);
+			ids.push_back(parent);
+			root = bone.tip;
+		}
+		chain++;
+	}
+}
+
+// Weights of a vertex on bones near the bone at 'center'
+static void addWeights(const MQSceneParam& param, MQHeadlessObject* obj, int vi, int center, std::mt19937& rng)
+{
+	UINT ids[64];
+	float weights[64];
+	int num = std::uniform_int_distribution<int>(param.weight_min, param.weight_max)(rng);
+	num = std::min(std::min(num, 64), param.bone_count);
+	float total = 0;
+	for (int i = 0; i < num; i++)
+	{
+		ids[i] = static_cast<UINT>((center + i) % param.bone_count) + 1;
+		weights[i] = std::uniform_real_distribution<float>(0.05f, 1.0f)(rng);
+		total += weights[i];
+	}
+	for (int i = 0; i < num; i++)
+		weights[i] /= total;
+	obj->AddVertexWeights(vi, num, ids, weights);
+}
+
+static void generateGrid(const MQSceneParam& param, MQHeadlessObject* obj, int grid_size, float offset, std::mt19937& rng, bool weights)
+{
+	int n = grid_size;
+	for (int y = 0; y < n; y++)
+	{
+		for (int x = 0; x < n; x++)
+		{
+			int vi = obj->AddVertex(MQPoint(static_cast<float>(x), static_cast<float>(y), offset));
+			if (weights && param.bone_count > 0)
+				addWeights(param, obj, vi, (y * param.bone_count) / n, rng);
+		}
+	}
+
+	int island = std::max(param.uv_island, 1);
+	float island_size = static_cast<float>(island);
+	int material_count = std::max(param.material_count, 1);
+	for (int y = 0; y < n - 1; y++)
+	{
+		for (int x = 0; x < n - 1; x++)
+		{
+			int points[4] = { y * n + x, (y + 1) * n + x, (y + 1) * n + x + 1, y * n + x + 1 };
+			// UV is local to the island, so the island borders become seams
+			float u0 = (x % island) / island_size;
+			float v0 = (y % island) / island_size;
+			float u1 = u0 + 1.0f / island_size;
+			float v1 = v0 + 1.0f / island_size;
+			MQCoordinate uv[4] = { MQCoordinate(u0, v0), MQCoordinate(u0, v1), MQCoordinate(u1, v1), MQCoordinate(u1, v0) };
+			// Materials are assigned in horizontal bands
+			int material = (param.material_count > 0) ? (y * material_count) / (n - 1) : -1;
+			obj->AddFace(4, points, uv, material);
+		}
+	}
+}
+
+static void generateMorphs(const MQSceneParam& param, MQHeadlessDocument& doc, std::mt19937& rng)
+{
+	int n = param.morph_grid_size;
+	MQHeadlessObject* base = doc.AddObject("morph_base");
+	generateGrid(param, base, n, -10.0f, rng, true);
+
+	MQHeadlessMorph morph;
+	morph.base = doc.GetObjectIndex(base);
+	for (int t = 0; t < param.morph_count; t++)
+	{
+		std::string name = "morph" + std::to_string(t);
+		MQHeadlessObject* target = doc.AddObject(name.c_str());
+		target->visible = 0;
+		target->vertices = base->vertices;
+		target->face_begin = base->face_begin;
+		target->face_points = base->face_points;
+		target->face_uv = base->face_uv;
+		target->face_material = base->face_material;
+
+		// Move a square patch of the grid
+		int patch = std::max(n / 8, 1);
+		int px = std::uniform_int_distribution<int>(0, n - patch)(rng);
+		int py = std::uniform_int_distribution<int>(0, n - patch)(rng);
+		for (int y = py; y < py + patch; y++)
+		{
+			for (int x = px; x < px + patch; x++)
+				target->vertices[y * n + x].z += 0.5f;
+		}
+		morph.targets.push_back(std::make_pair(doc.GetObjectIndex(target), static_cast<MorphType>(MORPH_BROW + t % 4)));
+	}
+	doc.morphs.push_back(morph);
+}
+
+void GenerateScene(const MQSceneParam& param, MQHeadlessDocument& doc)
+{
+	std::mt19937 rng(param.seed);
+
+	generateMaterials(param, doc);
+	generateBones(param, doc, rng);
+	for (int i = 0; i < param.object_count; i++)
+	{
+		std::string name = "mesh" + std::to_string(i);
+		MQHeadlessObject* obj = doc.AddObject(name.c_str());
+		generateGrid(param, obj, param.grid_size, static_cast<float>(i), rng, true);
+	}
+	if (param.morph_count > 0)
+		generateMorphs(param, doc, rng);
+}
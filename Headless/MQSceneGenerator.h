@@ -0,0 +1,41 @@
+﻿#pragma once
+
+#include "MQHeadlessHost.h"
+
+// Parameters of a synthetic scene for the export benchmark
+struct MQSceneParam
+{
+	// Meshes. Each object is a grid of grid_size x grid_size vertices.
+	int object_count;
+	int grid_size;
+	// Quads per side of a UV island. Vertices on island borders have a
+	// different UV on each side and are split by the exporter.
+	int uv_island;
+	int material_count;
+	int texture_count; // the first materials refer to a texture
+
+	// Bones. Bones are added in chains of chain_length; the IK bone is put
+	// on the end of the first ik_count chains.
+	int bone_count;
+	int chain_length;
+	int ik_count;
+	int ik_chain_length;
+	int weight_min; // weights per vertex
+	int weight_max;
+
+	// Morphs. Targets move a patch of a separate base object.
+	int morph_count;
+	int morph_grid_size;
+
+	unsigned int seed;
+
+	MQSceneParam();
+
+	// "small", "medium" or "large". Returns false for an unknown name.
+	bool SetPreset(const char* name);
+
+	int GetVertexCount() const { return object_count * grid_size * grid_size + (morph_count > 0 ? morph_grid_size * morph_grid_size : 0); }
+};
+
+// Fill an empty document with the scene
+void GenerateScene(const MQSceneParam& param, MQHeadlessDocument& doc);
@@ -0,0 +1,114 @@
+﻿//---------------------------------------------------------------------------
+//
+//   PMXTests.cpp
+//
+//     Run the tests of the exporter code on the headless host.
+//
+//     Usage: PMXTests [NAME...]
+//       NAME   run only the tests whose name contains NAME
+//
+//     Returns the number of failed tests.
+//
+//---------------------------------------------------------------------------
+
+#include "PMXTests.h"
+#include "MQHeadlessHost.h"
+#include <MFileUtil.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <string>
+#include <vector>
+
+static PMXTestCase* s_first = nullptr;
+static PMXTestCase* s_last = nullptr;
+static int s_failed_checks = 0;
+static MString s_temp_root;
+static int s_temp_count = 0;
+
+PMXTestCase::PMXTestCase(const char* name, PMXTestFunc func) : name(name), func(func), next(nullptr)
+{
+	// Keep the order of registration
+	if (s_last != nullptr)
+		s_last->next = this;
+	else
+		s_first = this;
+	s_last = this;
+}
+
+void PMXTestFail(const char* file, int line, const char* expr)
+{
+	printf("  %s(%d): %s\n", file, line, expr);
+	s_failed_checks++;
+}
+
+MString PMXTestTempDir()
+{
+	MString dir = MFileUtil::combinePath(s_temp_root, MString::format(L"%d", ++s_temp_count));
+	CreateDirectoryW(dir.c_str(), nullptr);
+	return dir;
+}
+
+static void removeTree(const MString& dir)
+{
+	WIN32_FIND_DATAW data;
+	HANDLE find = FindFirstFileW(MFileUtil::combinePath(dir, L"*").c_str(), &data);
+	if (find != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			if (wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0)
+				continue;
+			MString path = MFileUtil::combinePath(dir, data.cFileName);
+			if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				removeTree(path);
+			else
+				DeleteFileW(path.c_str());
+		} while (FindNextFileW(find, &data));
+		FindClose(find);
+	}
+	RemoveDirectoryW(dir.c_str());
+}
+
+static bool isSelected(const char* name, int argc, wchar_t** argv)
+{
+	if (argc <= 1)
+		return true;
+	MString wname = MString::fromAnsiString(name);
+	for (int i = 1; i < argc; i++)
+	{
+		if (wcsstr(wname.c_str(), argv[i]) != nullptr)
+			return true;
+	}
+	return false;
+}
+
+int wmain(int argc, wchar_t** argv)
+{
+	MQHeadless_Install();
+
+	wchar_t temp[MAX_PATH];
+	GetTempPathW(MAX_PATH, temp);
+	s_temp_root = MFileUtil::combinePath(temp, MString::format(L"PMXTests_%u", GetCurrentProcessId()));
+	CreateDirectoryW(s_temp_root.c_str(), nullptr);
+
+	int run = 0;
+	int failed = 0;
+	for (PMXTestCase* test = s_first; test != nullptr; test = test->next)
+	{
+		if (!isSelected(test->name, argc, argv))
+			continue;
+
+		int before = s_failed_checks;
+		test->func();
+		bool ok = (s_failed_checks == before);
+		printf("%s %s\n", ok ? "[  OK  ]" : "[FAILED]", test->name);
+		run++;
+		if (!ok)
+			failed++;
+	}
+	printf("%d test(s), %d failed\n", run, failed);
+
+	removeTree(s_temp_root);
+	return failed;
+}
@@ -0,0 +1,40 @@
+﻿//---------------------------------------------------------------------------
+//
+//   PMXTests.h
+//
+//     Minimal test runner for the exporter code that runs without
+//    Metasequoia. Tests register themselves with PMX_TEST and are run by
+//    PMXTests.exe.
+//
+//---------------------------------------------------------------------------
+
+#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "MString.h"
+
+typedef void (*PMXTestFunc)();
+
+struct PMXTestCase
+{
+	const char* name;
+	PMXTestFunc func;
+	PMXTestCase* next;
+
+	PMXTestCase(const char* name, PMXTestFunc func);
+};
+
+// Report a failed check. The test goes on to report the other checks.
+void PMXTestFail(const char* file, int line, const char* expr);
+
+// Empty folder for the files of a test, removed when the run ends
+MString PMXTestTempDir();
+
+#define PMX_TEST(name) \
+	static void name(); \
+	static PMXTestCase name##_case(#name, name); \
+	static void name()
+
+#define PMX_CHECK(expr) \
+	do { if (!(expr)) PMXTestFail(__FILE__, __LINE__, #expr); } while (0)
@@ -0,0 +1,275 @@
+﻿#include "PMXVerifier.h"
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+// Errors of one check; only the first ones are listed
+class ErrorList
+{
+public:
+	ErrorList(PMXVerifyResult& result, const char* check, int max_errors)
+		: m_result(result), m_check(check), m_max(max_errors), m_count(0) {}
+
+	~ErrorList()
+	{
+		if (m_count > m_max)
+		{
+			char buf[256];
+			sprintf_s(buf, "%s: %d more errors", m_check, m_count - m_max);
+			m_result.errors.push_back(buf);
+		}
+	}
+
+	void Add(const char* format, ...)
+	{
+		m_result.error_count++;
+		if (m_count++ >= m_max)
+			return;
+		char buf[256];
+		va_list args;
+		va_start(args, format);
+		vsnprintf(buf, sizeof(buf), format, args);
+		va_end(args);
+		m_result.errors.push_back(std::string(m_check) + ": " + buf);
+	}
+
+private:
+	PMXVerifyResult& m_result;
+	const char* m_check;
+	int m_max;
+	int m_count;
+};
+
+inline bool inRange(int index, int count)
+{
+	return index >= 0 && index < count;
+}
+
+// -1 means none
+inline bool inRangeOrNone(int index, int count)
+{
+	return index == -1 || inRange(index, count);
+}
+
+inline bool isFinite3(const float* v)
+{
+	float f[3];
+	memcpy(f, v, sizeof(f));
+	return isfinite(f[0]) && isfinite(f[1]) && isfinite(f[2]);
+}
+
+void verifyCounts(const PMXReader& reader, const PMXVerifyExpect& expect, PMXVerifyResult& result, int max_errors)
+{
+	ErrorList errors(result, "count", max_errors);
+	struct { const char* name; int expected; int actual; } counts[] = {
+		{ "vertices", expect.vertex_count, reader.GetVertexCount() },
+		{ "face indices", expect.index_count, reader.GetIndexCount() },
+		{ "materials", expect.material_count, reader.GetMaterialCount() },
+		{ "bones", expect.bone_count, reader.GetBoneCount() },
+		{ "morphs", expect.morph_count, reader.GetMorphCount() },
+	};
+	for (auto& c : counts)
+	{
+		if (c.expected >= 0 && c.expected != c.actual)
+			errors.Add("%s %d, expected %d", c.name, c.actual, c.expected);
+	}
+}
+
+void verifyVertices(const PMXReader& reader, PMXVerifyResult& result, int max_errors)
+{
+	ErrorList errors(result, "vertex", max_errors);
+	int bone_num = reader.GetBoneCount();
+	int num = reader.GetVertexCount();
+	PMXVertexView v;
+	for (int i = 0; i < num; i++)
+	{
+		reader.GetVertex(i, v);
+		if (!isFinite3(v.position) || !isFinite3(v.normal))
+			errors.Add("%d has a non-finite position or normal", i);
+
+		for (int b = 0; b < v.bone_count; b++)
+		{
+			// Unused slots of BDEF4 may be -1 with a weight of 0
+			if (!inRange(v.bone[b], bone_num) && !(v.bone[b] == -1 && v.weight[b] == 0.0f))
+				errors.Add("%d refers to bone %d of %d", i, v.bone[b], bone_num);
+		}
+		switch (v.weight_type)
+		{
+		case PMX_WEIGHT_BDEF2:
+		case PMX_WEIGHT_SDEF:
+			if (!(v.weight[0] >= 0.0f && v.weight[0] <= 1.0f))
+				errors.Add("%d has a weight %g out of [0,1]", i, v.weight[0]);
+			break;
+		case PMX_WEIGHT_BDEF4:
+		case PMX_WEIGHT_QDEF:
+			{
+				float sum = 0.0f;
+				bool in_range = true;
+				for (int b = 0; b < 4; b++)
+				{
+					sum += v.weight[b];
+					in_range &= (v.weight[b] >= 0.0f && v.weight[b] <= 1.0f);
+				}
+				if (!in_range || fabsf(sum - 1.0f) > 1e-3f)
+					errors.Add("%d has weights %g %g %g %g (sum %g)", i, v.weight[0], v.weight[1], v.weight[2], v.weight[3], sum);
+			}
+			break;
+		}
+	}
+}
+
+void verifyFaces(const PMXReader& reader, PMXVerifyResult& result, int max_errors)
+{
+	ErrorList errors(result, "face", max_errors);
+	int index_num = reader.GetIndexCount();
+	if (index_num % 3 != 0)
+		errors.Add("%d indices are not a multiple of 3", index_num);
+
+	unsigned int vert_num = static_cast<unsigned int>(reader.GetVertexCount());
+	for (int i = 0; i < index_num; i++)
+	{
+		unsigned int vi = static_cast<unsigned int>(reader.GetIndex(i));
+		if (vi >= vert_num)
+			errors.Add("index %d refers to vertex %u of %u", i, vi, vert_num);
+	}
+}
+
+void verifyMaterials(const PMXReader& reader, PMXVerifyResult& result, int max_errors)
+{
+	ErrorList errors(result, "material", max_errors);
+	int tex_num = reader.GetTextureCount();
+	long long index_sum = 0;
+	int num = reader.GetMaterialCount();
+	PMXMaterialView m;
+	for (int i = 0; i < num; i++)
+	{
+		reader.GetMaterial(i, m);
+		if (m.index_count < 0 || m.index_count % 3 != 0)
+			errors.Add("%d has %d face indices", i, m.index_count);
+		index_sum += m.index_count;
+		if (!inRangeOrNone(m.texture, tex_num))
+			errors.Add("%d refers to texture %d of %d", i, m.texture, tex_num);
+		if (!inRangeOrNone(m.sphere, tex_num))
+			errors.Add("%d refers to sphere %d of %d", i, m.sphere, tex_num);
+		if (m.shared_toon ? (m.toon < 0 || m.toon > 9) : !inRangeOrNone(m.toon, tex_num))
+			errors.Add("%d refers to toon %d", i, m.toon);
+	}
+	if (index_sum != reader.GetIndexCount())
+		errors.Add("face indices of the materials sum to %lld, the file has %d", index_sum, reader.GetIndexCount());
+}
+
+void verifyBones(const PMXReader& reader, PMXVerifyResult& result, int max_errors)
+{
+	ErrorList errors(result, "bone", max_errors);
+	int num = reader.GetBoneCount();
+	PMXBoneView b;
+	for (int i = 0; i < num; i++)
+	{
+		reader.GetBone(i, b);
+		if (!inRangeOrNone(b.parent, num) || b.parent == i)
+			errors.Add("%d has parent %d", i, b.parent);
+		if ((b.flags & PMX_BONE_TAIL_INDEX) && !inRangeOrNone(b.tail_bone, num))
+			errors.Add("%d has tail bone %d", i, b.tail_bone);
+		if ((b.flags & (PMX_BONE_INHERIT_ROTATION | PMX_BONE_INHERIT_TRANSLATION)) && !inRangeOrNone(b.inherit_bone, num))
+			errors.Add("%d inherits bone %d", i, b.inherit_bone);
+		if (b.flags & PMX_BONE_IK)
+		{
+			if (!inRange(b.ik_target, num))
+				errors.Add("%d has IK target %d", i, b.ik_target);
+			for (const PMXBoneIKLink& link : b.ik_links)
+			{
+				if (!inRange(link.bone, num))
+					errors.Add("%d has IK link %d", i, link.bone);
+			}
+		}
+	}
+}
+
+void verifyMorphs(const PMXReader& reader, PMXVerifyResult& result, int max_errors)
+{
+	ErrorList errors(result, "morph", max_errors);
+	const PMXHeaderInfo& h = reader.GetHeader();
+	int num = reader.GetMorphCount();
+	PMXMorphView m, sub;
+	for (int i = 0; i < num; i++)
+	{
+		reader.GetMorph(i, m);
+		if (m.panel > 4)
+			errors.Add("%d has panel %d", i, m.panel);
+
+		int count;
+		switch (m.kind)
+		{
+		case PMX_MORPH_GROUP:
+		case PMX_MORPH_FLIP:
+			count = num;
+			break;
+		case PMX_MORPH_BONE:
+			count = reader.GetBoneCount();
+			break;
+		case PMX_MORPH_MATERIAL:
+			count = reader.GetMaterialCount();
+			break;
+		case PMX_MORPH_IMPULSE:
+			count = reader.GetRigidBodyCount();
+			break;
+		default:
+			count = reader.GetVertexCount();
+			break;
+		}
+		for (int o = 0; o < m.offset_count; o++)
+		{
+			int index = m.GetOffsetIndex(o, h);
+			// A material morph with -1 applies to all materials
+			bool ok = (m.kind == PMX_MORPH_MATERIAL) ? inRangeOrNone(index, count) : inRange(index, count);
+			if (!ok || ((m.kind == PMX_MORPH_GROUP || m.kind == PMX_MORPH_FLIP) && index == i))
+				errors.Add("%d offset %d refers to %d of %d", i, o, index, count);
+			else if (m.kind == PMX_MORPH_GROUP)
+			{
+				// Readers do not apply a group morph inside a group morph
+				reader.GetMorph(index, sub);
+				if (sub.kind == PMX_MORPH_GROUP)
+					errors.Add("%d offset %d refers to group morph %d", i, o, index);
+			}
+		}
+	}
+}
+
+void verifyDisplayFrames(const PMXReader& reader, PMXVerifyResult& result, int max_errors)
+{
+	ErrorList errors(result, "display frame", max_errors);
+	const PMXHeaderInfo& h = reader.GetHeader();
+	int num = reader.GetDisplayFrameCount();
+	PMXDisplayFrameView f;
+	for (int i = 0; i < num; i++)
+	{
+		reader.GetDisplayFrame(i, f);
+		const BYTE* p = f.elements;
+		for (int e = 0; e < f.element_count; e++)
+		{
+			bool morph = (*p++ != 0);
+			int size = morph ? h.morph_index_size : h.bone_index_size;
+			int index = ReadPMXIndex(p, size, false);
+			p += size;
+			int count = morph ? reader.GetMorphCount() : reader.GetBoneCount();
+			if (!inRange(index, count))
+				errors.Add("%d element %d refers to %s %d of %d", i, e, morph ? "morph" : "bone", index, count);
+		}
+	}
+}
+
+} // namespace
+
+void VerifyPMX(const PMXReader& reader, const PMXVerifyExpect& expect, PMXVerifyResult& result, int max_errors)
+{
+	verifyCounts(reader, expect, result, max_errors);
+	verifyVertices(reader, result, max_errors);
+	verifyFaces(reader, result, max_errors);
+	verifyMaterials(reader, result, max_errors);
+	verifyBones(reader, result, max_errors);
+	verifyMorphs(reader, result, max_errors);
+	verifyDisplayFrames(reader, result, max_errors);
+}
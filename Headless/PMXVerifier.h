@@ -0,0 +1,32 @@
+﻿#pragma once
+
+#include "PMXReader.h"
+#include <string>
+#include <vector>
+
+// Counts the file is expected to have. -1 skips the check.
+struct PMXVerifyExpect
+{
+	int vertex_count;
+	int index_count;
+	int material_count;
+	int bone_count;
+	int morph_count;
+
+	PMXVerifyExpect() : vertex_count(-1), index_count(-1), material_count(-1), bone_count(-1), morph_count(-1) {}
+};
+
+struct PMXVerifyResult
+{
+	std::vector<std::string> errors; // at most max_errors per check
+	int error_count;                 // including the ones not listed
+
+	PMXVerifyResult() : error_count(0) {}
+	bool IsValid() const { return error_count == 0; }
+};
+
+// Check the references and weights of a parsed PMX file:
+//   face indices, material face counts, texture/bone/morph indices,
+//   group morphs referring to other group morphs,
+//   BDEF2/SDEF weights in [0,1] and BDEF4/QDEF weights summing to 1.
+void VerifyPMX(const PMXReader& reader, const PMXVerifyExpect& expect, PMXVerifyResult& result, int max_errors = 10);
@@ -0,0 +1,81 @@
+﻿//---------------------------------------------------------------------------
+//
+//   PMXVerify.cpp
+//
+//     Parse and verify PMX files.
+//
+//     Usage: PMXVerify [--quiet] FILE...
+//       --quiet   print only the files with errors
+//
+//     Returns 0 if all files are valid.
+//
+//---------------------------------------------------------------------------
+
+#include "PMXVerifier.h"
+#include <stdio.h>
+#include <wchar.h>
+#include <chrono>
+
+typedef std::chrono::steady_clock VerifyClock;
+
+static double elapsedMs(VerifyClock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(VerifyClock::now() - start).count();
+}
+
+static bool verifyFile(const wchar_t* filename, bool quiet)
+{
+	PMXReader reader;
+	VerifyClock::time_point start = VerifyClock::now();
+	bool parsed = reader.Open(filename);
+	double parse_ms = elapsedMs(start);
+	if (!parsed)
+	{
+		wprintf(L"%ls: %ls\n", filename, reader.GetError().c_str());
+		return false;
+	}
+
+	PMXVerifyResult result;
+	start = VerifyClock::now();
+	VerifyPMX(reader, PMXVerifyExpect(), result);
+	double verify_ms = elapsedMs(start);
+
+	if (!quiet || !result.IsValid())
+	{
+		const PMXHeaderInfo& h = reader.GetHeader();
+		wprintf(L"%ls: PMX %.1f %ls, %zu bytes\n", filename, h.version, h.encoding ? L"UTF-8" : L"UTF-16", reader.GetFileSize());
+		wprintf(L"  vertices %d, faces %d, textures %d, materials %d, bones %d, morphs %d, frames %d, rigid bodies %d, joints %d\n",
+			reader.GetVertexCount(), reader.GetIndexCount() / 3, reader.GetTextureCount(), reader.GetMaterialCount(),
+			reader.GetBoneCount(), reader.GetMorphCount(), reader.GetDisplayFrameCount(), reader.GetRigidBodyCount(), reader.GetJointCount());
+		wprintf(L"  parse %.2f ms, verify %.2f ms\n", parse_ms, verify_ms);
+		for (const std::string& error : result.errors)
+			wprintf(L"  %hs\n", error.c_str());
+		if (!result.IsValid())
+			wprintf(L"  %d errors\n", result.error_count);
+	}
+	return result.IsValid();
+}
+
+int wmain(int argc, wchar_t** argv)
+{
+	bool quiet = false;
+	int file_num = 0;
+	int failed = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (wcscmp(argv[i], L"--quiet") == 0)
+		{
+			quiet = true;
+			continue;
+		}
+		file_num++;
+		if (!verifyFile(argv[i], quiet))
+			failed++;
+	}
+	if (file_num == 0)
+	{
+		fwprintf(stderr, L"Usage: PMXVerify [--quiet] FILE...\n");
+		return 2;
+	}
+	return (failed == 0) ? 0 : 1;
+}
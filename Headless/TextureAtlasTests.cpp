@@ -0,0 +1,357 @@
+﻿//---------------------------------------------------------------------------
+//
+//   TextureAtlasTests.cpp
+//
+//     Tests of the image loaders, SavePNG and the texture atlas.
+//
+//---------------------------------------------------------------------------
+
+#include "PMXTests.h"
+#include "MQHeadlessHost.h"
+#include "MQExportObject.h"
+#include "PMXTextureAtlas.h"
+#include <MFileUtil.h>
+#include <stdio.h>
+
+// Compressed with filters of all types, RGBA (x * 40, y * 50, (x + y) * 20, 255 - x * 10), 6x5
+static const BYTE s_png_rgba[] = {
+	0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A, 0x00, 0x00, 0x00, 0x0D, 0x49, 0x48, 0x44, 0x52,
+	0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x05, 0x08, 0x06, 0x00, 0x00, 0x00, 0x66, 0x58, 0x9D,
+	0xE6, 0x00, 0x00, 0x00, 0x20, 0x49, 0x44, 0x41, 0x54, 0x78, 0xDA, 0x63, 0x60, 0x60, 0x60, 0xF8,
+	0xAF, 0xC1, 0x20, 0xF2, 0x35, 0x80, 0x41, 0xE3, 0x75, 0x05, 0x83, 0xCD, 0xC3, 0x05, 0x0C, 0x01,
+	0xD7, 0x4F, 0x30, 0xA4, 0x9C, 0x65, 0x64, 0x30, 0x12, 0x79, 0x6E, 0x27, 0xCD, 0x00, 0x00, 0x00,
+	0x20, 0x49, 0x44, 0x41, 0x54, 0x01, 0x49, 0x7C, 0x43, 0xC7, 0x4C, 0x40, 0x09, 0x06, 0x6C, 0x98,
+	0x99, 0x21, 0x45, 0xA3, 0x41, 0x44, 0x52, 0xE4, 0x37, 0x3A, 0x66, 0x01, 0xAB, 0x60, 0xC0, 0xC4,
+	0x00, 0xC3, 0x92, 0x19, 0xB8, 0x93, 0xCA, 0xA5, 0x1F, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4E,
+	0x44, 0xAE, 0x42, 0x60, 0x82,
+};
+
+// 4bit palette with transparency, 7x3
+static const BYTE s_png_palette[] = {
+	0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A, 0x00, 0x00, 0x00, 0x0D, 0x49, 0x48, 0x44, 0x52,
+	0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, 0x03, 0x04, 0x03, 0x00, 0x00, 0x00, 0xAD, 0xED, 0x08,
+	0xF6, 0x00, 0x00, 0x00, 0x30, 0x50, 0x4C, 0x54, 0x45, 0x00, 0xFF, 0x00, 0x10, 0xEF, 0x08, 0x20,
+	0xDF, 0x10, 0x30, 0xCF, 0x18, 0x40, 0xBF, 0x20, 0x50, 0xAF, 0x28, 0x60, 0x9F, 0x30, 0x70, 0x8F,
+	0x38, 0x80, 0x7F, 0x40, 0x90, 0x6F, 0x48, 0xA0, 0x5F, 0x50, 0xB0, 0x4F, 0x58, 0xC0, 0x3F, 0x60,
+	0xD0, 0x2F, 0x68, 0xE0, 0x1F, 0x70, 0xF0, 0x0F, 0x78, 0xF4, 0x88, 0xA7, 0x31, 0x00, 0x00, 0x00,
+	0x08, 0x74, 0x52, 0x4E, 0x53, 0x00, 0x20, 0x40, 0x60, 0x80, 0xA0, 0xC0, 0xE0, 0xB1, 0xE1, 0xC8,
+	0x71, 0x00, 0x00, 0x00, 0x0B, 0x49, 0x44, 0x41, 0x54, 0x78, 0xDA, 0x63, 0x60, 0x54, 0x76, 0x4D,
+	0x60, 0x14, 0x52, 0x52, 0x52, 0x9D, 0xC3, 0x8F, 0x00, 0x00, 0x00, 0x0C, 0x49, 0x44, 0x41, 0x54,
+	0x92, 0x62, 0x12, 0x14, 0x14, 0x14, 0x00, 0x00, 0x0D, 0x39, 0x01, 0x80, 0x56, 0x84, 0xA4, 0x72,
+	0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4E, 0x44, 0xAE, 0x42, 0x60, 0x82,
+};
+
+static bool writeFile(const MString& path, const BYTE* data, size_t size)
+{
+	FILE* fh;
+	if (_wfopen_s(&fh, path.c_str(), L"wb") != 0)
+		return false;
+	fwrite(data, 1, size, fh);
+	return fclose(fh) == 0;
+}
+
+// 24bit bottom-up BMP
+static bool writeBMP(const MString& path, const PMXImage& image)
+{
+	int pitch = (image.width * 3 + 3) & ~3;
+	std::vector<BYTE> data(54 + pitch * image.height, 0);
+	DWORD values[][2] = {{2, static_cast<DWORD>(data.size())}, {10, 54}, {14, 40}, {18, static_cast<DWORD>(image.width)}, {22, static_cast<DWORD>(image.height)}};
+	data[0] = 'B';
+	data[1] = 'M';
+	for (auto& v : values)
+		memcpy(&data[v[0]], &v[1], 4);
+	data[26] = 1;  // planes
+	data[28] = 24; // bits
+	for (int y = 0; y < image.height; y++)
+	{
+		BYTE* d = &data[54 + (image.height - 1 - y) * pitch];
+		const BYTE* s = &image.pixels[y * image.width * 4];
+		for (int x = 0; x < image.width; x++, d += 3, s += 4)
+			memcpy(d, s, 3);
+	}
+	return writeFile(path, data.data(), data.size());
+}
+
+static PMXImage makeImage(int width, int height, int seed)
+{
+	PMXImage image;
+	image.width = width;
+	image.height = height;
+	image.pixels.resize(width * height * 4);
+	for (size_t i = 0; i < image.pixels.size(); i++)
+		image.pixels[i] = static_cast<BYTE>(i * 7 + seed * 31 + i / 13);
+	return image;
+}
+
+static const BYTE* getPixel(const PMXImage& image, int x, int y)
+{
+	return &image.pixels[(y * image.width + x) * 4];
+}
+
+PMX_TEST(SavePNGRoundTrip)
+{
+	MString dir = PMXTestTempDir();
+	PMXImage image = makeImage(37, 23, 1);
+	MString path = MFileUtil::combinePath(dir, L"round.png");
+	PMX_CHECK(SavePNG(path, image));
+
+	PMXImage loaded;
+	PMX_CHECK(PNGImageLoader().Load(path, loaded));
+	PMX_CHECK(loaded.width == image.width && loaded.height == image.height);
+	PMX_CHECK(loaded.pixels == image.pixels);
+}
+
+PMX_TEST(SavePNGCompresses)
+{
+	// A flat atlas with a gradient strip, as 1024 x 1024 RGBA (4 MB unpacked)
+	MString dir = PMXTestTempDir();
+	PMXImage image;
+	image.width = 1024;
+	image.height = 1024;
+	image.pixels.assign(image.width * image.height * 4, 255);
+	for (int y = 0; y < 64; y++)
+	{
+		for (int x = 0; x < image.width; x++)
+		{
+			BYTE* p = &image.pixels[(y * image.width + x) * 4];
+			p[0] = static_cast<BYTE>(x);
+			p[1] = static_cast<BYTE>(y * 4);
+			p[2] = static_cast<BYTE>(x + y);
+		}
+	}
+	MString path = MFileUtil::combinePath(dir, L"flat.png");
+	PMX_CHECK(SavePNG(path, image));
+
+	FILE* fh;
+	PMX_CHECK(_wfopen_s(&fh, path.c_str(), L"rb") == 0);
+	fseek(fh, 0, SEEK_END);
+	long size = ftell(fh);
+	fclose(fh);
+	PMX_CHECK(size > 0 && size < 64 * 1024);
+
+	PMXImage loaded;
+	PMX_CHECK(PNGImageLoader().Load(path, loaded));
+	PMX_CHECK(loaded.pixels == image.pixels);
+}
+
+PMX_TEST(PNGLoaderCompressed)
+{
+	MString dir = PMXTestTempDir();
+	MString path = MFileUtil::combinePath(dir, L"rgba.png");
+	PMX_CHECK(writeFile(path, s_png_rgba, sizeof(s_png_rgba)));
+	PMXImage image;
+	PMX_CHECK(PNGImageLoader().Load(path, image));
+	PMX_CHECK(image.width == 6 && image.height == 5);
+	bool same = true;
+	for (int y = 0; y < image.height && same; y++)
+	{
+		for (int x = 0; x < image.width && same; x++)
+		{
+			const BYTE* p = getPixel(image, x, y);
+			same = (p[2] == x * 40 && p[1] == y * 50 && p[0] == (x + y) * 20 && p[3] == 255 - x * 10);
+		}
+	}
+	PMX_CHECK(same);
+}
+
+PMX_TEST(PNGLoaderPalette)
+{
+	// 4bit palette: index (x + y) % 16, color (i * 16, 255 - i * 16, i * 8), alpha i * 32 for i < 8
+	MString dir = PMXTestTempDir();
+	MString path = MFileUtil::combinePath(dir, L"palette.png");
+	PMX_CHECK(writeFile(path, s_png_palette, sizeof(s_png_palette)));
+	PMXImage image;
+	PMX_CHECK(PNGImageLoader().Load(path, image));
+	PMX_CHECK(image.width == 7 && image.height == 3);
+	bool same = true;
+	for (int y = 0; y < image.height && same; y++)
+	{
+		for (int x = 0; x < image.width && same; x++)
+		{
+			int i = (x + y) % 16;
+			const BYTE* p = getPixel(image, x, y);
+			same = (p[2] == i * 16 && p[1] == 255 - i * 16 && p[0] == i * 8 && p[3] == (i < 8 ? i * 32 : 255));
+		}
+	}
+	PMX_CHECK(same);
+}
+
+PMX_TEST(PNGLoaderRejectsBrokenFile)
+{
+	MString dir = PMXTestTempDir();
+	MString path = MFileUtil::combinePath(dir, L"broken.png");
+	PMX_CHECK(writeFile(path, s_png_rgba, sizeof(s_png_rgba) - 40));
+	PMXImage image;
+	PMX_CHECK(!PNGImageLoader().Load(path, image));
+}
+
+PMX_TEST(BMPLoader)
+{
+	MString dir = PMXTestTempDir();
+	PMXImage image = makeImage(5, 3, 2);
+	for (size_t i = 3; i < image.pixels.size(); i += 4)
+		image.pixels[i] = 255;
+	MString path = MFileUtil::combinePath(dir, L"image.bmp");
+	PMX_CHECK(writeBMP(path, image));
+
+	PMXImage loaded;
+	PMX_CHECK(BMPImageLoader().Load(path, loaded));
+	PMX_CHECK(loaded.width == 5 && loaded.height == 3);
+	PMX_CHECK(loaded.pixels == image.pixels);
+}
+
+PMX_TEST(PackTextureAtlasPlacements)
+{
+	std::vector<PMXImage> images;
+	images.push_back(makeImage(30, 20, 1));
+	images.push_back(makeImage(50, 50, 2));
+	images.push_back(makeImage(200, 10, 3)); // wider than the atlas
+	images.push_back(makeImage(12, 60, 4));
+	images.push_back(makeImage(64, 30, 5));
+	std::vector<const PMXImage*> candidates;
+	for (const PMXImage& image : images)
+		candidates.push_back(&image);
+	candidates.push_back(nullptr);
+
+	PMXAtlasParam param;
+	param.atlas_size = 128;
+	param.padding = 1;
+	std::vector<PMXAtlasPlacement> placements;
+	std::vector<PMXImage> atlases;
+	PMX_CHECK(PackTextureAtlas(candidates, param, placements, atlases) == 4);
+	PMX_CHECK(placements.size() == candidates.size());
+	PMX_CHECK(placements[2].atlas < 0 && placements[5].atlas < 0);
+
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		const PMXAtlasPlacement& p = placements[i];
+		if (p.atlas < 0)
+			continue;
+		const PMXImage& atlas = atlases[p.atlas];
+		const PMXImage& image = images[i];
+		PMX_CHECK(p.x >= param.padding && p.y >= param.padding);
+		PMX_CHECK(p.x + image.width + param.padding <= atlas.width && p.y + image.height + param.padding <= atlas.height);
+
+		// The image and its padding are copied
+		PMX_CHECK(memcmp(getPixel(atlas, p.x, p.y), getPixel(image, 0, 0), 4) == 0);
+		PMX_CHECK(memcmp(getPixel(atlas, p.x + image.width - 1, p.y + image.height - 1), getPixel(image, image.width - 1, image.height - 1), 4) == 0);
+		PMX_CHECK(memcmp(getPixel(atlas, p.x - 1, p.y - 1), getPixel(image, 0, 0), 4) == 0);
+
+		for (size_t j = i + 1; j < images.size(); j++)
+		{
+			const PMXAtlasPlacement& q = placements[j];
+			if (q.atlas != p.atlas)
+				continue;
+			bool apart = p.x + image.width + param.padding <= q.x - param.padding || q.x + images[j].width + param.padding <= p.x - param.padding ||
+				p.y + image.height + param.padding <= q.y - param.padding || q.y + images[j].height + param.padding <= p.y - param.padding;
+			PMX_CHECK(apart);
+		}
+	}
+}
+
+// A document with one quad per texture
+struct AtlasScene
+{
+	MQHeadlessDocument hdoc;
+	MQExportObject* eobj;
+	std::vector<MQExportObject*> expobjs;
+	std::vector<std::vector<int>> orgvert_vert;
+	std::vector<MQCoordinate> vert_coord;
+	std::vector<PMXMaterialParam> materials;
+	PMXTextureTable textures;
+
+	AtlasScene(const MString& dir, int texture_num, int texture_size)
+	{
+		hdoc.texture_dir = dir;
+		MQHeadlessObject* obj = hdoc.AddObject("obj");
+		for (int t = 0; t < texture_num; t++)
+		{
+			MString name = MString::format(L"tex%d.bmp", t);
+			writeBMP(MFileUtil::combinePath(dir, name), makeImage(texture_size, texture_size, t));
+			MQHeadlessMaterial* mat = hdoc.AddMaterial(MString::format(L"mat%d", t).toAnsiString().c_str());
+			mat->texture = name.toAnsiString().c_str();
+
+			int points[4];
+			points[0] = obj->AddVertex(MQPoint(static_cast<float>(t), 0, 0));
+			points[1] = obj->AddVertex(MQPoint(static_cast<float>(t), 1, 0));
+			points[2] = obj->AddVertex(MQPoint(t + 1.0f, 1, 0));
+			points[3] = obj->AddVertex(MQPoint(t + 1.0f, 0, 0));
+			MQCoordinate uv[4] = {MQCoordinate(0, 1), MQCoordinate(0, 0), MQCoordinate(1, 0), MQCoordinate(1, 1)};
+			obj->AddFace(4, points, uv, t);
+		}
+
+		MQDocument doc = hdoc.GetDocument();
+		MQExportObject::MSeparateParam separate;
+		eobj = new MQExportObject(doc->GetObject(0), separate);
+		expobjs.push_back(eobj);
+		orgvert_vert.resize(1);
+		for (int vi = 0; vi < eobj->GetVertexCount(); vi++)
+		{
+			orgvert_vert[0].push_back(vi);
+			vert_coord.push_back(eobj->GetVertexCoordinate(vi));
+		}
+		std::vector<int> material_used(texture_num + 1, 2);
+		material_used[texture_num] = 0;
+		SnapshotMaterials(doc, material_used, materials, textures);
+	}
+	~AtlasScene()
+	{
+		delete eobj;
+	}
+
+	int Apply(const MString& output_base, const PMXAtlasParam& param, std::vector<MString>& atlas_files)
+	{
+		BMPImageLoader loader;
+		MQDocument doc = hdoc.GetDocument();
+		return ApplyTextureAtlas(doc, expobjs, orgvert_vert, static_cast<int>(hdoc.materials.size()), loader, param, output_base, materials, textures, vert_coord, atlas_files);
+	}
+};
+
+PMX_TEST(ApplyTextureAtlasPacksTextures)
+{
+	MString dir = PMXTestTempDir();
+	AtlasScene scene(dir, 3, 16);
+	PMX_CHECK(scene.textures.GetCount() == 3);
+
+	PMXAtlasParam param;
+	param.atlas_size = 64;
+	MString base = MFileUtil::combinePath(dir, L"model");
+	std::vector<MString> atlas_files;
+	PMX_CHECK(scene.Apply(base, param, atlas_files) == 3);
+	PMX_CHECK(atlas_files.size() == 1);
+	PMX_CHECK(scene.textures.GetCount() == 1);
+	for (const PMXMaterialParam& mat : scene.materials)
+		PMX_CHECK(mat.texture == 0);
+	for (const MQCoordinate& uv : scene.vert_coord)
+		PMX_CHECK(uv.u >= 0 && uv.u <= 1 && uv.v >= 0 && uv.v <= 1);
+
+	PMXImage atlas;
+	PMX_CHECK(!atlas_files.empty() && PNGImageLoader().Load(atlas_files[0], atlas));
+	PMX_CHECK(atlas.width == param.atlas_size);
+}
+
+PMX_TEST(ApplyTextureAtlasRemovesPartialOutput)
+{
+	// Each texture fills an atlas by itself, and the second atlas cannot be
+	// saved because a folder has its name.
+	MString dir = PMXTestTempDir();
+	AtlasScene scene(dir, 2, 40);
+	PMXAtlasParam param;
+	param.atlas_size = 64;
+	MString base = MFileUtil::combinePath(dir, L"model");
+	MString blocker = base + L"_atlas1.png";
+	PMX_CHECK(CreateDirectoryW(blocker.c_str(), nullptr) != FALSE);
+
+	std::vector<MString> atlas_files;
+	PMX_CHECK(scene.Apply(base, param, atlas_files) == 0);
+	PMX_CHECK(atlas_files.empty());
+	PMX_CHECK(!MFileUtil::fileExists(base + L"_atlas0.png"));
+	PMX_CHECK(scene.textures.GetCount() == 2);
+	PMX_CHECK(scene.materials[0].texture == 0 && scene.materials[1].texture == 1);
+
+	RemoveDirectoryW(blocker.c_str());
+	PMX_CHECK(scene.Apply(base, param, atlas_files) == 2);
+	PMX_CHECK(atlas_files.size() == 2);
+	for (const MString& file : atlas_files)
+		PMX_CHECK(MFileUtil::fileExists(file));
+}